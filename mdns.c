@@ -1,6 +1,13 @@
 
 #ifdef _WIN32
 #define _CRT_SECURE_NO_WARNINGS 1
+#elif !defined(_GNU_SOURCE)
+// Enables recvmmsg for the batched receive functions
+#define _GNU_SOURCE 1
+#endif
+#if defined(__linux__) && !defined(MDNS_IO_URING)
+// Enables the optional io_uring transport if supported by the kernel headers
+#define MDNS_IO_URING 1
 #endif
 
 #include <stdio.h>
@@ -14,6 +21,8 @@
 #else
 #include <netdb.h>
 #include <ifaddrs.h>
+#include <net/if.h>
+#include <pthread.h>
 #endif
 
 // Alias some things to simulate recieving data to fuzz library
@@ -31,7 +40,6 @@
 static char addrbuffer[64];
 static char entrybuffer[256];
 static char namebuffer[256];
-static char sendbuffer[1024];
 static mdns_record_txt_t txtbuffer[128];
 
 static struct sockaddr_in service_address_ipv4;
@@ -40,12 +48,27 @@ static struct sockaddr_in6 service_address_ipv6;
 static int has_ipv4;
 static int has_ipv6;
 
+// Network interfaces found when enumerating local addresses, joined by the service sockets in
+// single socket mode
+typedef struct {
+	unsigned int index;
+	struct sockaddr_in address_ipv4;
+	int has_ipv4;
+	int has_ipv6;
+} interface_t;
+
+static interface_t interfaces[32];
+static int num_interfaces;
+
 // Data for our service including the mDNS records
 typedef struct {
 	mdns_string_t service;
 	mdns_string_t hostname;
 	mdns_string_t service_instance;
 	mdns_string_t hostname_qualified;
+	mdns_name_t service_compiled;
+	mdns_name_t service_instance_compiled;
+	mdns_name_t hostname_qualified_compiled;
 	struct sockaddr_in address_ipv4;
 	struct sockaddr_in6 address_ipv6;
 	int port;
@@ -54,8 +77,145 @@ typedef struct {
 	mdns_record_t record_a;
 	mdns_record_t record_aaaa;
 	mdns_record_t txt_record[2];
+	mdns_record_t record_dns_sd;
+	mdns_record_store_t record_store;
+	mdns_record_store_entry_t record_store_entry[8];
+	size_t record_store_bucket[16];
+	// Questions for names and types we do not own are dropped before the service callback
+	mdns_name_filter_t name_filter;
+	uint64_t name_filter_bits[8];
 } service_t;
 
+// Records received by the query mode are cached and looked up once all replies are read
+static mdns_cache_entry_t record_cache_entry[128];
+static size_t record_cache_bucket[64];
+static uint64_t record_cache_arena[2048];
+static mdns_cache_t record_cache;
+
+// Buffers, engine and announcement state of a service loop. The service runs one loop, or with
+// worker threads one loop per thread answering a shard of the queries on its own sockets. Loops
+// share the read only service records, everything written while answering is kept per loop
+typedef struct {
+	const service_t* service;
+	int single_socket;
+	size_t shard;
+	mdns_engine_t engine;
+	mdns_engine_socket_t engine_socket[32];
+	mdns_engine_timer_t engine_timer[80];
+	void* buffer;
+	size_t capacity;
+	void* batch_buffer[8];
+	size_t batch_count;
+	char sendbuffer[2048];
+	char namebuffer[256];
+	// Encoded answers are cached and resent as long as the service records do not change
+	mdns_response_cache_entry_t response_cache_entry[64];
+	char response_cache_storage[16 * 1024];
+	mdns_response_cache_t response_cache;
+	uint32_t random;
+	mdns_record_t announce_additional[5];
+	size_t announce_additional_count;
+	int announce_count;
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+} service_loop_t;
+
+static service_loop_t service_loop[8];
+static int num_service_loops;
+
+// Number of shards the multicast queries are divided into, one per running loop. Read by all loops
+// and reduced while they run if a worker thread fails to start
+static long service_shard_count;
+
+static size_t
+get_service_shard_count(void) {
+#ifdef _WIN32
+	return (size_t)InterlockedCompareExchange(&service_shard_count, 0, 0);
+#else
+	return (size_t)__atomic_load_n(&service_shard_count, __ATOMIC_RELAXED);
+#endif
+}
+
+static void
+set_service_shard_count(size_t count) {
+#ifdef _WIN32
+	InterlockedExchange(&service_shard_count, (long)count);
+#else
+	__atomic_store_n(&service_shard_count, (long)count, __ATOMIC_RELAXED);
+#endif
+}
+
+// Per socket and interface state of the service, holding the multicast response pending on the
+// interface. Sockets not joined on each interface have a single state with interface index 0
+typedef struct {
+	const service_t* service;
+	int sock;
+	service_loop_t* loop;
+	mdns_response_scheduler_t scheduler;
+	mdns_record_t scheduler_answer[16];
+	mdns_record_t scheduler_additional[32];
+	char scheduler_arena[4096];
+	// Storage for a query with the TC bit set and its continuation packets, held by the scheduler
+	uint32_t scheduler_hold[1024];
+	// Parsed packets of the query being answered, for the known answer filter
+	const mdns_message_t* message;
+	size_t message_count;
+	mdns_listen_filter_t listen_filter;
+	// Multicast send context for the socket and interface
+	mdns_socket_context_t context;
+#ifdef MDNS_HAVE_IO_URING
+	// io_uring transport of the socket if enabled, shared by the states of the socket
+	mdns_uring_t* uring;
+#endif
+} service_socket_t;
+
+// Destination of the packets of a response split over several packets, the given address or
+// multicast on the interface of the socket state if no address
+typedef struct {
+	service_socket_t* state;
+	int sock;
+	const void* address;
+	size_t address_size;
+} split_target_t;
+
+static service_socket_t service_socket[130];
+static int num_service_sockets;
+
+#ifdef MDNS_HAVE_IO_URING
+// io_uring transports of the service sockets, each with 64 receive and 16 send buffers
+static mdns_uring_t service_uring[32];
+static void* service_uring_buffer[32];
+static int num_service_urings;
+#endif
+
+// State of the discovery and query modes, reading replies on all client sockets until no reply
+// has arrived for the idle timeout, or forever for continuous queries
+typedef struct {
+	void* buffer;
+	size_t capacity;
+	void* user_data;
+	int discovery;
+	unsigned int idle_timeout;
+	uint64_t last_reply;
+	mdns_query_scheduler_t* scheduler;
+	int* sockets;
+	int num_sockets;
+} client_t;
+
+typedef struct {
+	client_t* client;
+	int query_id;
+} client_socket_t;
+
+static client_socket_t client_socket[32];
+
+// Sockets and timers are dispatched by the event loop engine of the library
+static mdns_engine_socket_t engine_socket[32];
+static mdns_engine_timer_t engine_timer[80];
+
 static mdns_string_t
 ipv4_address_to_string(char* buffer, size_t capacity, const struct sockaddr_in* addr,
                        size_t addrlen) {
@@ -107,7 +267,7 @@ ip_address_to_string(char* buffer, size_t capacity, const struct sockaddr* addr,
 	return ipv4_address_to_string(buffer, capacity, (const struct sockaddr_in*)addr, addrlen);
 }
 
-// Callback handling parsing answers to queries sent
+// Callback handling parsing answers to queries sent, caching the records if a cache is given
 static int
 query_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
                uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
@@ -116,7 +276,9 @@ query_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry
 	(void)sizeof(sock);
 	(void)sizeof(query_id);
 	(void)sizeof(name_length);
-	(void)sizeof(user_data);
+	if (user_data)
+		mdns_cache_insert((mdns_cache_t*)user_data, from, addrlen, data, size, name_offset, rtype,
+		                  rclass, ttl, record_offset, record_length, mdns_engine_time());
 	mdns_string_t fromaddrstr = ip_address_to_string(addrbuffer, sizeof(addrbuffer), from, addrlen);
 	const char* entrytype = (entry == MDNS_ENTRYTYPE_ANSWER) ?
                                 "answer" :
@@ -171,6 +333,186 @@ query_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry
 	return 0;
 }
 
+static const char*
+record_type_name(uint16_t rtype) {
+	if (rtype == MDNS_RECORDTYPE_PTR)
+		return "PTR";
+	if (rtype == MDNS_RECORDTYPE_SRV)
+		return "SRV";
+	if (rtype == MDNS_RECORDTYPE_A)
+		return "A";
+	if (rtype == MDNS_RECORDTYPE_AAAA)
+		return "AAAA";
+	if (rtype == MDNS_RECORDTYPE_TXT)
+		return "TXT";
+	if (rtype == MDNS_RECORDTYPE_ANY)
+		return "ANY";
+	return 0;
+}
+
+static mdns_record_type_t
+parse_record_type(const char* name) {
+	if (strcmp(name, "PTR") == 0)
+		return MDNS_RECORDTYPE_PTR;
+	if (strcmp(name, "SRV") == 0)
+		return MDNS_RECORDTYPE_SRV;
+	if (strcmp(name, "A") == 0)
+		return MDNS_RECORDTYPE_A;
+	if (strcmp(name, "AAAA") == 0)
+		return MDNS_RECORDTYPE_AAAA;
+	if (strcmp(name, "TXT") == 0)
+		return MDNS_RECORDTYPE_TXT;
+	if (strcmp(name, "ANY") == 0)
+		return MDNS_RECORDTYPE_ANY;
+	return MDNS_RECORDTYPE_IGNORE;
+}
+
+// Send a packet to the given address, queued on the io_uring transport of the socket if enabled
+static int
+send_packet(service_socket_t* state, int sock, const void* address, size_t address_size,
+            const void* buffer, size_t size) {
+#ifdef MDNS_HAVE_IO_URING
+	if (state && state->uring)
+		return mdns_uring_send(state->uring, address, address_size, buffer, size);
+#endif
+	(void)sizeof(state);
+	return mdns_unicast_send(sock, address, address_size, buffer, size);
+}
+
+// Send one packet of a split response, queued on the io_uring transport of the socket if enabled
+static int
+send_split_packet(const void* buffer, size_t size, void* user_data) {
+	split_target_t* target = (split_target_t*)user_data;
+	if (target->address)
+		return send_packet(target->state, target->sock, target->address, target->address_size,
+		                   buffer, size);
+#ifdef MDNS_HAVE_IO_URING
+	if (target->state->uring)
+		return mdns_uring_send_multicast(target->state->uring, buffer, size,
+		                                 target->state->scheduler.interface_index);
+#endif
+	return mdns_multicast_send_context(&target->state->context, buffer, size);
+}
+
+// Send the aggregated multicast response pending on a service socket, split over several packets
+// if needed, and queued on the io_uring transport of the socket if enabled
+static int
+send_scheduler(service_socket_t* state, void* buffer, size_t capacity) {
+	split_target_t target = {state, state->sock, 0, 0};
+	int ret = mdns_response_scheduler_split(&state->scheduler, buffer, capacity, 0,
+	                                        send_split_packet, &target);
+	if (ret < 0)
+		return -1;
+#ifdef MDNS_HAVE_IO_URING
+	if (state->uring)
+		return mdns_uring_submit(state->uring);
+#endif
+	return 0;
+}
+
+// Build a unicast answer, store it in the response cache if requested and send it. An answer not
+// fitting in one packet is split over several packets, and not cached
+static int
+send_answer_unicast(service_socket_t* state, int sock, const struct sockaddr* from,
+                    size_t addrlen, const void* data, size_t size, size_t name_offset,
+                    uint16_t query_id, uint16_t rtype, mdns_string_t name, int cache,
+                    mdns_record_t answer, mdns_record_t* additional, size_t additional_count) {
+	service_loop_t* loop = state->loop;
+	size_t packet_size = mdns_query_answer_unicast_build(
+	    loop->sendbuffer, MDNS_PACKET_SIZE_MAX, query_id, (mdns_record_type_t)rtype, name.str,
+	    name.length, answer, 0, 0, additional, additional_count);
+	if (!packet_size) {
+		split_target_t target = {state, sock, from, addrlen};
+		int ret = mdns_query_answer_unicast_split(
+		    loop->sendbuffer, sizeof(loop->sendbuffer), 0, query_id, (mdns_record_type_t)rtype,
+		    name.str, name.length, &answer, 1, 0, 0, additional, additional_count,
+		    send_split_packet, &target);
+		return (ret < 0) ? -1 : 0;
+	}
+	if (cache)
+		mdns_response_cache_store(&loop->response_cache, data, size, name_offset, rtype, 1,
+		                          from->sa_family, loop->sendbuffer, packet_size);
+	return send_packet(state, sock, from, addrlen, loop->sendbuffer, packet_size);
+}
+
+static void
+send_scheduled_answers(mdns_engine_t* engine, uint64_t now, void* user_data);
+
+// Set the timer of a service socket to when the pending response or the held query is due, the
+// deadline moves as answers are aggregated
+static void
+update_scheduler_timer(service_socket_t* state) {
+	mdns_engine_t* engine = &state->loop->engine;
+	mdns_engine_remove_timer(engine, send_scheduled_answers, state);
+	uint64_t now = mdns_engine_time();
+	int timeout = mdns_response_scheduler_timeout(&state->scheduler, now);
+	if (timeout >= 0)
+		mdns_engine_add_timer(engine, now + (uint64_t)timeout, send_scheduled_answers, state);
+}
+
+// Timer answering the query held on a service socket once its continuation packets had time to
+// arrive, and sending the aggregated multicast response pending on the socket when due
+static void
+send_scheduled_answers(mdns_engine_t* engine, uint64_t now, void* user_data) {
+	(void)sizeof(engine);
+	service_socket_t* state = (service_socket_t*)user_data;
+	mdns_response_scheduler_t* scheduler = &state->scheduler;
+	mdns_message_t message[MDNS_RESPONSE_HOLD_PACKETS];
+	mdns_message_record_t message_record[MDNS_MAX_MESSAGE_RECORDS];
+	size_t message_count =
+	    mdns_response_scheduler_release(scheduler, now, message, MDNS_RESPONSE_HOLD_PACKETS,
+	                                    message_record, MDNS_MAX_MESSAGE_RECORDS);
+	if (message_count) {
+		// The answers are filtered with the known answers of all packets of the query
+		state->message = message;
+		state->message_count = message_count;
+		mdns_listen_message(state->sock, (const struct sockaddr*)&scheduler->hold_from,
+		                    scheduler->hold_addrlen, message, mdns_listen_filter_callback,
+		                    &state->listen_filter);
+		state->message_count = 0;
+	}
+	if (scheduler->answer_count && !mdns_response_scheduler_timeout(scheduler, now))
+		send_scheduler(state, state->loop->sendbuffer, sizeof(state->loop->sendbuffer));
+	update_scheduler_timer(state);
+}
+
+// Get a random number from the generator of a loop, as rand is not thread safe
+static unsigned int
+loop_random(service_loop_t* loop) {
+	uint32_t value = loop->random;
+	value ^= value << 13;
+	value ^= value >> 17;
+	value ^= value << 5;
+	loop->random = value;
+	return value;
+}
+
+// Add multicast answers to the response pending on the socket. Answers to questions for shared
+// PTR records are delayed to aggregate answers from other questions and queries
+static int
+schedule_answer_multicast(service_socket_t* state, mdns_record_t* answer, size_t answer_count,
+                          mdns_record_t* additional, size_t additional_count) {
+	service_loop_t* loop = state->loop;
+	unsigned int delay = 0;
+	unsigned int delay_range = MDNS_RESPONSE_DELAY_MAX - MDNS_RESPONSE_DELAY_MIN + 1;
+	for (size_t irec = 0; irec < answer_count; ++irec) {
+		if (answer[irec].type == MDNS_RECORDTYPE_PTR)
+			delay = MDNS_RESPONSE_DELAY_MIN + (loop_random(loop) % delay_range);
+	}
+	uint64_t now = mdns_engine_time();
+	mdns_response_scheduler_t* scheduler = &state->scheduler;
+	int ret = mdns_response_scheduler_add(scheduler, answer, answer_count, additional,
+	                                      additional_count, now, delay);
+	if (ret) {
+		// Pending response is full, send it now and start a new one
+		send_scheduler(state, loop->sendbuffer, sizeof(loop->sendbuffer));
+		ret = mdns_response_scheduler_add(scheduler, answer, answer_count, additional,
+		                                  additional_count, now, delay);
+	}
+	update_scheduler_timer(state);
+	return ret;
+}
+
 // Callback handling questions incoming on service sockets
 static int
 service_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
@@ -181,227 +523,119 @@ service_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_ent
 	if (entry != MDNS_ENTRYTYPE_QUESTION)
 		return 0;
 
-	const char dns_sd[] = "_services._dns-sd._udp.local.";
-	const service_t* service = (const service_t*)user_data;
+	service_socket_t* state = (service_socket_t*)user_data;
+	if (!state)
+		return 0;
+	service_loop_t* loop = state->loop;
+	const service_t* service = state->service;
 
-	mdns_string_t fromaddrstr = ip_address_to_string(addrbuffer, sizeof(addrbuffer), from, addrlen);
+	const char* record_name = record_type_name(rtype);
+	if (!record_name || (rtype == MDNS_RECORDTYPE_TXT))
+		return 0;
 
 	size_t offset = name_offset;
-	mdns_string_t name = mdns_string_extract(data, size, &offset, namebuffer, sizeof(namebuffer));
+	mdns_string_t name =
+	    mdns_string_extract(data, size, &offset, loop->namebuffer, sizeof(loop->namebuffer));
+	printf("Query %s %.*s\n", record_name, MDNS_STRING_FORMAT(name));
 
-	const char* record_name = 0;
-	if (rtype == MDNS_RECORDTYPE_PTR)
-		record_name = "PTR";
-	else if (rtype == MDNS_RECORDTYPE_SRV)
-		record_name = "SRV";
-	else if (rtype == MDNS_RECORDTYPE_A)
-		record_name = "A";
-	else if (rtype == MDNS_RECORDTYPE_AAAA)
-		record_name = "AAAA";
-	else if (rtype == MDNS_RECORDTYPE_ANY)
-		record_name = "ANY";
-	else
+	// Unicast answers are cached, multicast answers are aggregated by the response scheduler.
+	// Queries listing known answers get answers filtered for that querier, bypass the cache
+	const struct mdns_header_t* header = (const struct mdns_header_t*)data;
+	uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
+	int cache = unicast && (mdns_ntohs(&header->answer_rrs) == 0);
+
+	const mdns_response_cache_entry_t* cached =
+	    cache ? mdns_response_cache_find(&loop->response_cache, data, size, name_offset, rtype,
+	                                     unicast, from->sa_family)
+	          : 0;
+	if (cached) {
+		printf("  --> cached answer (unicast)\n");
+		size_t packet_size = mdns_response_cache_build(&loop->response_cache, cached, query_id,
+		                                               loop->sendbuffer, sizeof(loop->sendbuffer));
+		if (packet_size)
+			send_packet(state, sock, from, addrlen, loop->sendbuffer, packet_size);
 		return 0;
-	printf("Query %s %.*s\n", record_name, MDNS_STRING_FORMAT(name));
+	}
 
-	if ((name.length == (sizeof(dns_sd) - 1)) &&
-	    (strncmp(name.str, dns_sd, sizeof(dns_sd) - 1) == 0)) {
-		if ((rtype == MDNS_RECORDTYPE_PTR) || (rtype == MDNS_RECORDTYPE_ANY)) {
-			// The PTR query was for the DNS-SD domain, send answer with a PTR record for the
-			// service name we advertise, typically on the "<_service-name>._tcp.local." format
-
-			// Answer PTR record reverse mapping "<_service-name>._tcp.local." to
-			// "<hostname>.<_service-name>._tcp.local."
-			mdns_record_t answer = {
-			    .name = name, .type = MDNS_RECORDTYPE_PTR, .data.ptr.name = service->service};
-
-			// Send the answer, unicast or multicast depending on flag in query
-			uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
-			printf("  --> answer %.*s (%s)\n", MDNS_STRING_FORMAT(answer.data.ptr.name),
-			       (unicast ? "unicast" : "multicast"));
-
-			if (unicast) {
-				mdns_query_answer_unicast(sock, from, addrlen, sendbuffer, sizeof(sendbuffer),
-				                          query_id, rtype, name.str, name.length, answer, 0, 0, 0,
-				                          0);
-			} else {
-				mdns_query_answer_multicast(sock, sendbuffer, sizeof(sendbuffer), answer, 0, 0, 0,
-				                            0);
-			}
-		}
-	} else if ((name.length == service->service.length) &&
-	           (strncmp(name.str, service->service.str, name.length) == 0)) {
-		if ((rtype == MDNS_RECORDTYPE_PTR) || (rtype == MDNS_RECORDTYPE_ANY)) {
-			// The PTR query was for our service (usually "<_service-name._tcp.local"), answer a PTR
-			// record reverse mapping the queried service name to our service instance name
-			// (typically on the "<hostname>.<_service-name>._tcp.local." format), and add
-			// additional records containing the SRV record mapping the service instance name to our
-			// qualified hostname (typically "<hostname>.local.") and port, as well as any IPv4/IPv6
-			// address for the hostname as A/AAAA records, and two test TXT records
-
-			// Answer PTR record reverse mapping "<_service-name>._tcp.local." to
-			// "<hostname>.<_service-name>._tcp.local."
-			mdns_record_t answer = service->record_ptr;
-
-			mdns_record_t additional[5] = {0};
-			size_t additional_count = 0;
-
-			// SRV record mapping "<hostname>.<_service-name>._tcp.local." to
-			// "<hostname>.local." with port. Set weight & priority to 0.
-			additional[additional_count++] = service->record_srv;
-
-			// A/AAAA records mapping "<hostname>.local." to IPv4/IPv6 addresses
-			if (service->address_ipv4.sin_family == AF_INET)
-				additional[additional_count++] = service->record_a;
-			if (service->address_ipv6.sin6_family == AF_INET6)
-				additional[additional_count++] = service->record_aaaa;
-
-			// Add two test TXT records for our service instance name, will be coalesced into
-			// one record with both key-value pair strings by the library
-			additional[additional_count++] = service->txt_record[0];
-			additional[additional_count++] = service->txt_record[1];
-
-			// Send the answer, unicast or multicast depending on flag in query
-			uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
-			printf("  --> answer %.*s (%s)\n",
-			       MDNS_STRING_FORMAT(service->record_ptr.data.ptr.name),
-			       (unicast ? "unicast" : "multicast"));
-
-			if (unicast) {
-				mdns_query_answer_unicast(sock, from, addrlen, sendbuffer, sizeof(sendbuffer),
-				                          query_id, rtype, name.str, name.length, answer, 0, 0,
-				                          additional, additional_count);
-			} else {
-				mdns_query_answer_multicast(sock, sendbuffer, sizeof(sendbuffer), answer, 0, 0,
-				                            additional, additional_count);
-			}
-		}
-	} else if ((name.length == service->service_instance.length) &&
-	           (strncmp(name.str, service->service_instance.str, name.length) == 0)) {
-		if ((rtype == MDNS_RECORDTYPE_SRV) || (rtype == MDNS_RECORDTYPE_ANY)) {
-			// The SRV query was for our service instance (usually
-			// "<hostname>.<_service-name._tcp.local"), answer a SRV record mapping the service
-			// instance name to our qualified hostname (typically "<hostname>.local.") and port, as
-			// well as any IPv4/IPv6 address for the hostname as A/AAAA records, and two test TXT
-			// records
-
-			// Answer PTR record reverse mapping "<_service-name>._tcp.local." to
-			// "<hostname>.<_service-name>._tcp.local."
-			mdns_record_t answer = service->record_srv;
-
-			mdns_record_t additional[5] = {0};
-			size_t additional_count = 0;
-
-			// A/AAAA records mapping "<hostname>.local." to IPv4/IPv6 addresses
-			if (service->address_ipv4.sin_family == AF_INET)
-				additional[additional_count++] = service->record_a;
-			if (service->address_ipv6.sin6_family == AF_INET6)
-				additional[additional_count++] = service->record_aaaa;
-
-			// Add two test TXT records for our service instance name, will be coalesced into
-			// one record with both key-value pair strings by the library
-			additional[additional_count++] = service->txt_record[0];
-			additional[additional_count++] = service->txt_record[1];
-
-			// Send the answer, unicast or multicast depending on flag in query
-			uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
-			printf("  --> answer %.*s port %d (%s)\n",
-			       MDNS_STRING_FORMAT(service->record_srv.data.srv.name), service->port,
-			       (unicast ? "unicast" : "multicast"));
-
-			if (unicast) {
-				mdns_query_answer_unicast(sock, from, addrlen, sendbuffer, sizeof(sendbuffer),
-				                          query_id, rtype, name.str, name.length, answer, 0, 0,
-				                          additional, additional_count);
-			} else {
-				mdns_query_answer_multicast(sock, sendbuffer, sizeof(sendbuffer), answer, 0, 0,
-				                            additional, additional_count);
-			}
-		}
-	} else if ((name.length == service->hostname_qualified.length) &&
-	           (strncmp(name.str, service->hostname_qualified.str, name.length) == 0)) {
-		if (((rtype == MDNS_RECORDTYPE_A) || (rtype == MDNS_RECORDTYPE_ANY)) &&
-		    (service->address_ipv4.sin_family == AF_INET)) {
-			// The A query was for our qualified hostname (typically "<hostname>.local.") and we
-			// have an IPv4 address, answer with an A record mappiing the hostname to an IPv4
-			// address, as well as any IPv6 address for the hostname, and two test TXT records
-
-			// Answer A records mapping "<hostname>.local." to IPv4 address
-			mdns_record_t answer = service->record_a;
-
-			mdns_record_t additional[5] = {0};
-			size_t additional_count = 0;
-
-			// AAAA record mapping "<hostname>.local." to IPv6 addresses
-			if (service->address_ipv6.sin6_family == AF_INET6)
-				additional[additional_count++] = service->record_aaaa;
-
-			// Add two test TXT records for our service instance name, will be coalesced into
-			// one record with both key-value pair strings by the library
-			additional[additional_count++] = service->txt_record[0];
-			additional[additional_count++] = service->txt_record[1];
-
-			// Send the answer, unicast or multicast depending on flag in query
-			uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
-			mdns_string_t addrstr = ip_address_to_string(
-			    addrbuffer, sizeof(addrbuffer), (struct sockaddr*)&service->record_a.data.a.addr,
-			    sizeof(service->record_a.data.a.addr));
-			printf("  --> answer %.*s IPv4 %.*s (%s)\n", MDNS_STRING_FORMAT(service->record_a.name),
-			       MDNS_STRING_FORMAT(addrstr), (unicast ? "unicast" : "multicast"));
-
-			if (unicast) {
-				mdns_query_answer_unicast(sock, from, addrlen, sendbuffer, sizeof(sendbuffer),
-				                          query_id, rtype, name.str, name.length, answer, 0, 0,
-				                          additional, additional_count);
-			} else {
-				mdns_query_answer_multicast(sock, sendbuffer, sizeof(sendbuffer), answer, 0, 0,
-				                            additional, additional_count);
-			}
-		} else if (((rtype == MDNS_RECORDTYPE_AAAA) || (rtype == MDNS_RECORDTYPE_ANY)) &&
-		           (service->address_ipv6.sin6_family == AF_INET6)) {
-			// The AAAA query was for our qualified hostname (typically "<hostname>.local.") and we
-			// have an IPv6 address, answer with an AAAA record mappiing the hostname to an IPv6
-			// address, as well as any IPv4 address for the hostname, and two test TXT records
-
-			// Answer AAAA records mapping "<hostname>.local." to IPv6 address
-			mdns_record_t answer = service->record_aaaa;
-
-			mdns_record_t additional[5] = {0};
-			size_t additional_count = 0;
-
-			// A record mapping "<hostname>.local." to IPv4 addresses
-			if (service->address_ipv4.sin_family == AF_INET)
-				additional[additional_count++] = service->record_a;
-
-			// Add two test TXT records for our service instance name, will be coalesced into
-			// one record with both key-value pair strings by the library
-			additional[additional_count++] = service->txt_record[0];
-			additional[additional_count++] = service->txt_record[1];
-
-			// Send the answer, unicast or multicast depending on flag in query
-			uint16_t unicast = (rclass & MDNS_UNICAST_RESPONSE);
-			mdns_string_t addrstr =
-			    ip_address_to_string(addrbuffer, sizeof(addrbuffer),
-			                         (struct sockaddr*)&service->record_aaaa.data.aaaa.addr,
-			                         sizeof(service->record_aaaa.data.aaaa.addr));
-			printf("  --> answer %.*s IPv6 %.*s (%s)\n",
-			       MDNS_STRING_FORMAT(service->record_aaaa.name), MDNS_STRING_FORMAT(addrstr),
-			       (unicast ? "unicast" : "multicast"));
-
-			if (unicast) {
-				mdns_query_answer_unicast(sock, from, addrlen, sendbuffer, sizeof(sendbuffer),
-				                          query_id, rtype, name.str, name.length, answer, 0, 0,
-				                          additional, additional_count);
-			} else {
-				mdns_query_answer_multicast(sock, sendbuffer, sizeof(sendbuffer), answer, 0, 0,
-				                            additional, additional_count);
-			}
-		}
+	if (!service)
+		return 0;
+
+	// Look up the records for the question name directly from the query, without comparing
+	// strings against every name we advertise
+	mdns_record_t answer[8];
+	size_t answer_count = mdns_record_store_find(&service->record_store, data, size, name_offset,
+	                                             rtype, answer,
+	                                             sizeof(answer) / sizeof(answer[0]));
+	if (!answer_count)
+		return 0;
+
+	// Skip answers the querier already knows, listed in the query or for a held query in its
+	// continuation packets. The answer functions use a TTL of 10 seconds for unicast and 60
+	// seconds for multicast answers
+	uint32_t answer_ttl = unicast ? 10 : 60;
+	if (!state->message_count)
+		answer_count = mdns_known_answer_filter(data, size, answer, answer_count, answer_ttl);
+	for (size_t imsg = 0; imsg < state->message_count; ++imsg)
+		answer_count = mdns_known_answer_filter_message(state->message + imsg, answer,
+		                                                answer_count, answer_ttl);
+	if (!answer_count) {
+		printf("  --> answers already known\n");
+		return 0;
+	}
+
+	for (size_t irec = 0; irec < answer_count; ++irec)
+		printf("  --> answer %s %.*s (%s)\n", record_type_name(answer[irec].type),
+		       MDNS_STRING_FORMAT(answer[irec].name), (unicast ? "unicast" : "multicast"));
+
+	// Select the records recommended for the answers, like the SRV, A, AAAA and TXT records for
+	// our service instance when answering a PTR question
+	mdns_record_t additional[16];
+	size_t additional_count = 0;
+	if (!unicast) {
+		additional_count = mdns_record_store_additional(&service->record_store, answer,
+		                                                answer_count, additional,
+		                                                sizeof(additional) / sizeof(additional[0]));
+		return schedule_answer_multicast(state, answer, answer_count, additional, additional_count);
 	}
+
+	// The unicast answer function takes one answer record, send any other answers to an ANY
+	// question in the additional section
+	for (size_t irec = 1; irec < answer_count; ++irec)
+		additional[additional_count++] = answer[irec];
+	additional_count += mdns_record_store_additional(
+	    &service->record_store, answer, answer_count, additional + additional_count,
+	    (sizeof(additional) / sizeof(additional[0])) - additional_count);
+
+	send_answer_unicast(state, sock, from, addrlen, data, size, name_offset, query_id, rtype, name,
+	                    cache, answer[0], additional, additional_count);
 	return 0;
 }
 
-// Open sockets for sending one-shot multicast queries from an ephemeral port
+// Remember the interface of a local address
+static void
+add_interface(unsigned int index, const struct sockaddr* saddr) {
+	if (!index)
+		return;
+	int iif = 0;
+	while ((iif < num_interfaces) && (interfaces[iif].index != index))
+		++iif;
+	if (iif == num_interfaces) {
+		if (num_interfaces >= (int)(sizeof(interfaces) / sizeof(interfaces[0])))
+			return;
+		memset(&interfaces[iif], 0, sizeof(interface_t));
+		interfaces[iif].index = index;
+		++num_interfaces;
+	}
+	if ((saddr->sa_family == AF_INET) && !interfaces[iif].has_ipv4) {
+		interfaces[iif].address_ipv4 = *(const struct sockaddr_in*)saddr;
+		interfaces[iif].has_ipv4 = 1;
+	} else if (saddr->sa_family == AF_INET6) {
+		interfaces[iif].has_ipv6 = 1;
+	}
+}
+
+// Open sockets for sending multicast queries on each interface, from an ephemeral port for one-shot
+// queries, or from the mDNS port to receive the multicast responses to continuous queries
 static int
 open_client_sockets(int* sockets, int max_sockets, int port) {
 	// When sending, each socket can only send to one network interface
@@ -456,6 +690,7 @@ open_client_sockets(int* sockets, int max_sockets, int port) {
 						log_addr = 1;
 					}
 					has_ipv4 = 1;
+					add_interface(adapter->IfIndex, (struct sockaddr*)saddr);
 					if (num_sockets < max_sockets) {
 						saddr->sin_port = htons((unsigned short)port);
 						int sock = mdns_socket_open_ipv4(saddr);
@@ -489,6 +724,7 @@ open_client_sockets(int* sockets, int max_sockets, int port) {
 						log_addr = 1;
 					}
 					has_ipv6 = 1;
+					add_interface(adapter->Ipv6IfIndex, (struct sockaddr*)saddr);
 					if (num_sockets < max_sockets) {
 						saddr->sin6_port = htons((unsigned short)port);
 						int sock = mdns_socket_open_ipv6(saddr);
@@ -536,6 +772,7 @@ open_client_sockets(int* sockets, int max_sockets, int port) {
 					log_addr = 1;
 				}
 				has_ipv4 = 1;
+				add_interface(if_nametoindex(ifa->ifa_name), (struct sockaddr*)saddr);
 				if (num_sockets < max_sockets) {
 					saddr->sin_port = htons(port);
 					int sock = mdns_socket_open_ipv4(saddr);
@@ -568,6 +805,7 @@ open_client_sockets(int* sockets, int max_sockets, int port) {
 					log_addr = 1;
 				}
 				has_ipv6 = 1;
+				add_interface(if_nametoindex(ifa->ifa_name), (struct sockaddr*)saddr);
 				if (num_sockets < max_sockets) {
 					saddr->sin6_port = htons(port);
 					int sock = mdns_socket_open_ipv6(saddr);
@@ -595,9 +833,12 @@ open_client_sockets(int* sockets, int max_sockets, int port) {
 	return num_sockets;
 }
 
-// Open sockets to listen to incoming mDNS queries on port 5353
+// Open sockets to listen to incoming mDNS queries on port 5353. In single socket mode the socket
+// for each address family joins the multicast group on every interface, otherwise only on the
+// default interface. With more than one shard a group of sockets sharing the port is opened for
+// each address family, one socket per shard
 static int
-open_service_sockets(int* sockets, int max_sockets) {
+open_service_sockets(int* sockets, int max_sockets, int single_socket, int shards) {
 	// When recieving, each socket can recieve data from all network interfaces
 	// Thus we only need to open one socket for each address family
 	int num_sockets = 0;
@@ -606,7 +847,7 @@ open_service_sockets(int* sockets, int max_sockets) {
 	// but not open the actual sockets
 	open_client_sockets(0, 0, 0);
 
-	if (num_sockets < max_sockets) {
+	if (num_sockets + shards <= max_sockets) {
 		struct sockaddr_in sock_addr;
 		memset(&sock_addr, 0, sizeof(struct sockaddr_in));
 		sock_addr.sin_family = AF_INET;
@@ -619,12 +860,23 @@ open_service_sockets(int* sockets, int max_sockets) {
 #ifdef __APPLE__
 		sock_addr.sin_len = sizeof(struct sockaddr_in);
 #endif
-		int sock = mdns_socket_open_ipv4(&sock_addr);
-		if (sock >= 0)
-			sockets[num_sockets++] = sock;
+		if (!mdns_socket_open_ipv4_shards(sockets + num_sockets, (size_t)shards, &sock_addr)) {
+			for (int ishard = 0; ishard < shards; ++ishard) {
+				int sock = sockets[num_sockets++];
+				// The service only answers questions in queries, let the kernel discard other
+				// datagrams where supported. Known answer continuation packets of queries pass
+				mdns_socket_filter(sock, MDNS_SOCKET_FILTER_QUERY | MDNS_SOCKET_FILTER_QUESTIONS,
+				                   0, 0);
+				// Joining the default interface again fails, it is already joined on setup
+				for (int iif = 0; single_socket && (iif < num_interfaces); ++iif) {
+					if (interfaces[iif].has_ipv4)
+						mdns_socket_join_ipv4(sock, &interfaces[iif].address_ipv4);
+				}
+			}
+		}
 	}
 
-	if (num_sockets < max_sockets) {
+	if (num_sockets + shards <= max_sockets) {
 		struct sockaddr_in6 sock_addr;
 		memset(&sock_addr, 0, sizeof(struct sockaddr_in6));
 		sock_addr.sin6_family = AF_INET6;
@@ -633,14 +885,118 @@ open_service_sockets(int* sockets, int max_sockets) {
 #ifdef __APPLE__
 		sock_addr.sin6_len = sizeof(struct sockaddr_in6);
 #endif
-		int sock = mdns_socket_open_ipv6(&sock_addr);
-		if (sock >= 0)
-			sockets[num_sockets++] = sock;
+		if (!mdns_socket_open_ipv6_shards(sockets + num_sockets, (size_t)shards, &sock_addr)) {
+			for (int ishard = 0; ishard < shards; ++ishard) {
+				int sock = sockets[num_sockets++];
+				mdns_socket_filter(sock, MDNS_SOCKET_FILTER_QUERY | MDNS_SOCKET_FILTER_QUESTIONS,
+				                   0, 0);
+				for (int iif = 0; single_socket && (iif < num_interfaces); ++iif) {
+					if (interfaces[iif].has_ipv6)
+						mdns_socket_join_ipv6(sock, interfaces[iif].index);
+				}
+			}
+		}
 	}
 
 	return num_sockets;
 }
 
+// Timer stopping the client when no reply has arrived for the idle timeout
+static void
+client_idle(mdns_engine_t* engine, uint64_t now, void* user_data) {
+	(void)sizeof(now);
+	(void)sizeof(user_data);
+	mdns_engine_stop(engine);
+}
+
+// Timer sending the continuous questions due on all client sockets, with the records cached from
+// replies as known answers, and scheduling the next query
+static void
+client_query(mdns_engine_t* engine, uint64_t now, void* user_data) {
+	client_t* client = (client_t*)user_data;
+	mdns_cache_t* cache = (mdns_cache_t*)client->user_data;
+	mdns_query_t query[16];
+	uint16_t rclass[16];
+	size_t count;
+	while ((count = mdns_query_scheduler_due(client->scheduler, cache, now, query, rclass,
+	                                         sizeof(query) / sizeof(query[0]))) > 0) {
+		printf("Sending continuous query:");
+		for (size_t iquery = 0; iquery < count; ++iquery)
+			printf(" %s %s%s", record_type_name(query[iquery].type), query[iquery].name,
+			       (rclass[iquery] & MDNS_UNICAST_RESPONSE) ? " (QU)" : "");
+		printf("\n");
+		for (int isock = 0; isock < client->num_sockets; ++isock)
+			mdns_query_scheduler_send_due(client->sockets[isock], query, rclass, count,
+			                              client->buffer, client->capacity, cache, now);
+	}
+	int timeout = mdns_query_scheduler_timeout(client->scheduler, cache, now);
+	mdns_engine_remove_timer(engine, client_query, client);
+	if (timeout >= 0)
+		mdns_engine_add_timer(engine, now + (unsigned int)timeout, client_query, client);
+}
+
+// Read replies on a client socket and restart the idle timeout
+static void
+client_readable(mdns_engine_t* engine, int sock, void* user_data) {
+	client_socket_t* socket_state = (client_socket_t*)user_data;
+	client_t* client = socket_state->client;
+	size_t records;
+	if (client->discovery)
+		records = mdns_discovery_recv(sock, client->buffer, client->capacity, query_callback,
+		                              client->user_data);
+	else
+		records = mdns_query_recv(sock, client->buffer, client->capacity, query_callback,
+		                          client->user_data, socket_state->query_id);
+
+	uint64_t now = mdns_engine_time();
+	if (records)
+		client->last_reply = now;
+	if (client->idle_timeout) {
+		mdns_engine_remove_timer(engine, client_idle, client);
+		mdns_engine_add_timer(engine, now + client->idle_timeout, client_idle, client);
+	}
+	// Records cached from the reply can move the next refresh query forward
+	if (records && client->scheduler)
+		client_query(engine, now, client);
+}
+
+// Add the client sockets to an engine and read replies until the idle timeout
+static int
+run_client(client_t* client, int* sockets, int* query_id, int num_sockets) {
+	mdns_engine_t engine;
+	if (mdns_engine_initialize(&engine, engine_socket,
+	                           sizeof(engine_socket) / sizeof(engine_socket[0]), engine_timer,
+	                           sizeof(engine_timer) / sizeof(engine_timer[0]))) {
+		printf("Failed to initialize event loop\n");
+		for (int isock = 0; isock < num_sockets; ++isock)
+			mdns_socket_close(sockets[isock]);
+		return -1;
+	}
+
+	for (int isock = 0; isock < num_sockets; ++isock) {
+		client_socket[isock].client = client;
+		client_socket[isock].query_id = query_id ? query_id[isock] : 0;
+		if (mdns_engine_add_socket(&engine, sockets[isock], client_readable,
+		                           &client_socket[isock]))
+			mdns_socket_close(sockets[isock]);
+	}
+	client->last_reply = mdns_engine_time();
+	if (client->idle_timeout)
+		mdns_engine_add_timer(&engine, client->last_reply + client->idle_timeout, client_idle,
+		                      client);
+	if (client->scheduler) {
+		client->sockets = sockets;
+		client->num_sockets = num_sockets;
+		client_query(&engine, client->last_reply, client);
+	}
+
+	int ret = mdns_engine_run(&engine);
+
+	mdns_engine_finalize(&engine);
+	printf("Closed socket%s\n", num_sockets ? "s" : "");
+	return ret;
+}
+
 // Send a DNS-SD query
 static int
 send_dns_sd(void) {
@@ -658,55 +1014,30 @@ send_dns_sd(void) {
 			printf("Failed to send DNS-DS discovery: %s\n", strerror(errno));
 	}
 
-	size_t capacity = 2048;
-	void* buffer = malloc(capacity);
-	void* user_data = 0;
-	size_t records;
+	// Read replies for 5 seconds, or as long as we get replies
+	client_t client = {0};
+	client.capacity = 2048;
+	client.buffer = malloc(client.capacity);
+	client.discovery = 1;
+	client.idle_timeout = 5000;
 
-	// This is a simple implementation that loops for 5 seconds or as long as we get replies
-	int res;
 	printf("Reading DNS-SD replies\n");
-	do {
-		struct timeval timeout;
-		timeout.tv_sec = 5;
-		timeout.tv_usec = 0;
+	run_client(&client, sockets, 0, num_sockets);
 
-		int nfds = 0;
-		fd_set readfs;
-		FD_ZERO(&readfs);
-		for (int isock = 0; isock < num_sockets; ++isock) {
-			if (sockets[isock] >= nfds)
-				nfds = sockets[isock] + 1;
-			FD_SET(sockets[isock], &readfs);
-		}
-
-		records = 0;
-		res = select(nfds, &readfs, 0, 0, &timeout);
-		if (res > 0) {
-			for (int isock = 0; isock < num_sockets; ++isock) {
-				if (FD_ISSET(sockets[isock], &readfs)) {
-					records += mdns_discovery_recv(sockets[isock], buffer, capacity, query_callback,
-					                               user_data);
-				}
-			}
-		}
-	} while (res > 0);
-
-	free(buffer);
-
-	for (int isock = 0; isock < num_sockets; ++isock)
-		mdns_socket_close(sockets[isock]);
-	printf("Closed socket%s\n", num_sockets ? "s" : "");
+	free(client.buffer);
 
 	return 0;
 }
 
-// Send a mDNS query
+// Send a mDNS query with all the given questions in one packet, or query the questions
+// continuously until the program is stopped. Continuous queries ask for multicast responses after
+// the first query, so the sockets are bound to the mDNS port to receive them
 static int
-send_mdns_query(const char* service, int record) {
+send_mdns_query(const mdns_query_t* query, size_t count, int continuous) {
 	int sockets[32];
 	int query_id[32];
-	int num_sockets = open_client_sockets(sockets, sizeof(sockets) / sizeof(sockets[0]), 0);
+	int num_sockets = open_client_sockets(sockets, sizeof(sockets) / sizeof(sockets[0]),
+	                                      continuous ? MDNS_PORT : 0);
 	if (num_sockets <= 0) {
 		printf("Failed to open any client sockets\n");
 		return -1;
@@ -715,77 +1046,322 @@ send_mdns_query(const char* service, int record) {
 
 	size_t capacity = 2048;
 	void* buffer = malloc(capacity);
-	void* user_data = 0;
-	size_t records;
 
-	const char* record_name = "PTR";
-	if (record == MDNS_RECORDTYPE_SRV)
-		record_name = "SRV";
-	else if (record == MDNS_RECORDTYPE_A)
-		record_name = "A";
-	else if (record == MDNS_RECORDTYPE_AAAA)
-		record_name = "AAAA";
-	else
-		record = MDNS_RECORDTYPE_PTR;
-
-	printf("Sending mDNS query: %s %s\n", service, record_name);
-	for (int isock = 0; isock < num_sockets; ++isock) {
-		query_id[isock] =
-		    mdns_query_send(sockets[isock], record, service, strlen(service), buffer, capacity, 0);
-		if (query_id[isock] < 0)
-			printf("Failed to send mDNS query: %s\n", strerror(errno));
+	mdns_cache_initialize(&record_cache, record_cache_entry,
+	                      sizeof(record_cache_entry) / sizeof(record_cache_entry[0]),
+	                      record_cache_bucket,
+	                      sizeof(record_cache_bucket) / sizeof(record_cache_bucket[0]),
+	                      record_cache_arena, sizeof(record_cache_arena));
+	void* user_data = &record_cache;
+
+	// Read replies for 10 seconds, or as long as we get replies
+	client_t client = {0};
+	client.buffer = buffer;
+	client.capacity = capacity;
+	client.user_data = user_data;
+	client.idle_timeout = 10000;
+
+	mdns_query_scheduler_t scheduler;
+	mdns_query_scheduler_entry_t scheduler_entry[16];
+	if (continuous) {
+		// Queries are sent by the scheduler when the engine runs, replies are read until stopped
+		mdns_query_scheduler_initialize(&scheduler, scheduler_entry,
+		                                sizeof(scheduler_entry) / sizeof(scheduler_entry[0]));
+		uint64_t now = mdns_engine_time();
+		srand((unsigned int)now);
+		unsigned int delay_range = MDNS_QUERY_DELAY_MAX - MDNS_QUERY_DELAY_MIN + 1;
+		for (size_t iquery = 0; iquery < count; ++iquery)
+			mdns_query_scheduler_add(&scheduler, query[iquery].type, query[iquery].name,
+			                         query[iquery].length, now,
+			                         MDNS_QUERY_DELAY_MIN + ((unsigned int)rand() % delay_range));
+		client.scheduler = &scheduler;
+		client.idle_timeout = 0;
+		for (int isock = 0; isock < num_sockets; ++isock)
+			query_id[isock] = 0;
+	} else {
+		printf("Sending mDNS query:");
+		for (size_t iquery = 0; iquery < count; ++iquery)
+			printf(" %s %s", record_type_name(query[iquery].type), query[iquery].name);
+		printf("\n");
+		for (int isock = 0; isock < num_sockets; ++isock) {
+			query_id[isock] =
+			    mdns_multiquery_send(sockets[isock], query, count, buffer, capacity, 0);
+			if (query_id[isock] < 0)
+				printf("Failed to send mDNS query: %s\n", strerror(errno));
+		}
 	}
 
-	// This is a simple implementation that loops for 5 seconds or as long as we get replies
-	int res;
 	printf("Reading mDNS query replies\n");
-	do {
-		struct timeval timeout;
-		timeout.tv_sec = 10;
-		timeout.tv_usec = 0;
-
-		int nfds = 0;
-		fd_set readfs;
-		FD_ZERO(&readfs);
-		for (int isock = 0; isock < num_sockets; ++isock) {
-			if (sockets[isock] >= nfds)
-				nfds = sockets[isock] + 1;
-			FD_SET(sockets[isock], &readfs);
-		}
+	run_client(&client, sockets, query_id, num_sockets);
 
-		records = 0;
-		res = select(nfds, &readfs, 0, 0, &timeout);
-		if (res > 0) {
-			for (int isock = 0; isock < num_sockets; ++isock) {
-				if (FD_ISSET(sockets[isock], &readfs)) {
-					records += mdns_query_recv(sockets[isock], buffer, capacity, query_callback,
-					                           user_data, query_id[isock]);
-				}
-				FD_SET(sockets[isock], &readfs);
-			}
-		}
-	} while (res > 0);
+	// Resolve the queried name again from the records cached from all replies. The engine waits
+	// for further replies longer than the TTL of unicast answers, so look up the records as they
+	// were cached when the last reply was received
+	for (size_t iquery = 0; iquery < count; ++iquery) {
+		if (iquery && !strcmp(query[iquery].name, query[iquery - 1].name))
+			continue;
+		printf("Cached records for %s\n", query[iquery].name);
+		mdns_cache_query(&record_cache, query[iquery].name, query[iquery].length,
+		                 MDNS_RECORDTYPE_ANY, client.last_reply, query_callback, 0);
+	}
 
 	free(buffer);
 
-	for (int isock = 0; isock < num_sockets; ++isock)
-		mdns_socket_close(sockets[isock]);
-	printf("Closed socket%s\n", num_sockets ? "s" : "");
-
 	return 0;
 }
 
-// Provide a mDNS service, answering incoming DNS-SD and mDNS queries
+// Add the state for a service socket on the given interface
+static void
+add_service_socket(const service_t* service, service_loop_t* loop, int sock,
+                   unsigned int interface_index) {
+	if (num_service_sockets >= (int)(sizeof(service_socket) / sizeof(service_socket[0])))
+		return;
+	service_socket_t* state = &service_socket[num_service_sockets++];
+	state->service = service;
+	state->sock = sock;
+	state->loop = loop;
+	mdns_response_scheduler_initialize(
+	    &state->scheduler, state->scheduler_answer,
+	    sizeof(state->scheduler_answer) / sizeof(mdns_record_t), state->scheduler_additional,
+	    sizeof(state->scheduler_additional) / sizeof(mdns_record_t), state->scheduler_arena,
+	    sizeof(state->scheduler_arena));
+	mdns_response_scheduler_initialize_hold(&state->scheduler, state->scheduler_hold,
+	                                        sizeof(state->scheduler_hold));
+	state->scheduler.interface_index = interface_index;
+	state->listen_filter.filter = &service->name_filter;
+	state->listen_filter.callback = service_callback;
+	state->listen_filter.user_data = state;
+	mdns_socket_context_initialize(&state->context, sock, interface_index);
+}
+
+// Find the state for a service socket and the interface a query arrived on, falling back to the
+// state for the default interface of the socket
+static service_socket_t*
+find_service_socket(int sock, unsigned int interface_index) {
+	service_socket_t* fallback = 0;
+	for (int isock = 0; isock < num_service_sockets; ++isock) {
+		if (service_socket[isock].sock != sock)
+			continue;
+		if (service_socket[isock].scheduler.interface_index == interface_index)
+			return &service_socket[isock];
+		if (!service_socket[isock].scheduler.interface_index)
+			fallback = &service_socket[isock];
+	}
+	return fallback;
+}
+
+// Get the listen filter passing the owned questions to the service callback with the state for a
+// service socket and interface, see find_service_socket
+static mdns_listen_filter_t*
+find_listen_filter(int sock, unsigned int interface_index) {
+	service_socket_t* state = find_service_socket(sock, interface_index);
+	return state ? &state->listen_filter : 0;
+}
+
+// Parse a datagram received on a service socket once for its questions and its known answers. A
+// query with the TC bit set is held with its continuation packets until all known answers arrived
+static size_t
+service_datagram(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer,
+                 size_t size, mdns_record_callback_fn callback, void* user_data, int query_id) {
+	(void)sizeof(query_id);
+	mdns_listen_filter_t* listen_filter = (mdns_listen_filter_t*)user_data;
+	if (!listen_filter)
+		return 0;
+	service_socket_t* state = (service_socket_t*)listen_filter->user_data;
+	unsigned int delay_range = MDNS_RESPONSE_HOLD_MAX - MDNS_RESPONSE_HOLD_MIN + 1;
+	unsigned int delay = MDNS_RESPONSE_HOLD_MIN + (loop_random(state->loop) % delay_range);
+	if (mdns_response_scheduler_hold(&state->scheduler, from, addrlen, buffer, size,
+	                                 mdns_engine_time(), delay)) {
+		update_scheduler_timer(state);
+		return 0;
+	}
+
+	mdns_message_t message;
+	mdns_message_record_t message_record[MDNS_MAX_MESSAGE_RECORDS];
+	if (mdns_message_parse(buffer, size, &message, message_record, MDNS_MAX_MESSAGE_RECORDS) < 0)
+		return 0;
+	state->message = &message;
+	state->message_count = 1;
+	size_t parsed = mdns_listen_message(sock, from, addrlen, &message, callback, user_data);
+	state->message_count = 0;
+	return parsed;
+}
+
+// Read incoming queries on a service socket. Multicast answers are scheduled on the state for the
+// socket, or in single socket mode for the interface the query arrived on. With worker threads
+// each loop skips the multicast queries assigned to the shards of the other loops
+static void
+service_readable(mdns_engine_t* engine, int sock, void* user_data) {
+	(void)sizeof(engine);
+	service_loop_t* loop = (service_loop_t*)user_data;
+	if (!loop->single_socket) {
+		mdns_recv_batch(sock, loop->batch_buffer, loop->batch_count, loop->capacity,
+		                service_datagram, mdns_listen_filter_callback, find_listen_filter(sock, 0),
+		                0);
+		return;
+	}
+	for (size_t ibuf = 0; ibuf < loop->batch_count; ++ibuf) {
+		struct sockaddr_storage from;
+		size_t addrlen = sizeof(from);
+		mdns_pktinfo_t info;
+		size_t size = mdns_socket_recv(sock, loop->buffer, loop->capacity, (struct sockaddr*)&from,
+		                               &addrlen, &info);
+		if (!size)
+			break;
+		if (!mdns_socket_shard_accept((struct sockaddr*)&from, addrlen, &info, loop->shard,
+		                              get_service_shard_count()))
+			continue;
+		service_datagram(sock, (struct sockaddr*)&from, addrlen, loop->buffer, size,
+		                 mdns_listen_filter_callback,
+		                 find_listen_filter(sock, info.interface_index), 0);
+	}
+}
+
+#ifdef MDNS_HAVE_IO_URING
+// Parse a datagram received on the io_uring transport of a service socket with the state for the
+// interface it arrived on
+static size_t
+service_uring_datagram(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer,
+                       size_t size, mdns_record_callback_fn callback, void* user_data,
+                       int query_id) {
+	mdns_uring_t* uring = (mdns_uring_t*)user_data;
+	return service_datagram(sock, from, addrlen, buffer, size, callback,
+	                        find_listen_filter(sock, uring->recv_info.interface_index), query_id);
+}
+
+// Parse the queries received on the io_uring transport of a service socket. Answers queued by the
+// callback are submitted together once all received datagrams are parsed
+static void
+service_uring_readable(mdns_engine_t* engine, int fd, void* user_data) {
+	(void)sizeof(engine);
+	(void)sizeof(fd);
+	mdns_uring_t* uring = (mdns_uring_t*)user_data;
+	mdns_uring_recv(uring, service_uring_datagram, mdns_listen_filter_callback, uring, 0);
+}
+
+// Setup an io_uring transport for a service socket and let the engine wait on the ring instead of
+// the socket. Returns 0 if success, or <0 if the socket should be read directly
 static int
-service_mdns(const char* hostname, const char* service_name, int service_port) {
-	int sockets[32];
-	int num_sockets = open_service_sockets(sockets, sizeof(sockets) / sizeof(sockets[0]));
-	if (num_sockets <= 0) {
-		printf("Failed to open any client sockets\n");
+add_service_uring(service_loop_t* loop, int sock) {
+	if (num_service_urings >= (int)(sizeof(service_uring) / sizeof(service_uring[0])))
+		return -1;
+	size_t buffer_size = 2048;
+	void* buffer = malloc(buffer_size * (64 + 16));
+	if (!buffer)
+		return -1;
+	mdns_uring_t* uring = &service_uring[num_service_urings];
+	void* send_buffer = MDNS_POINTER_OFFSET(buffer, buffer_size * 64);
+	if (mdns_uring_initialize(uring, sock, buffer, 64, send_buffer, 16, buffer_size)) {
+		free(buffer);
 		return -1;
 	}
-	printf("Opened %d socket%s for mDNS service\n", num_sockets, num_sockets ? "s" : "");
+	if (mdns_engine_add_socket(&loop->engine, uring->fd, service_uring_readable, uring)) {
+		mdns_uring_finalize(uring);
+		free(buffer);
+		return -1;
+	}
+	service_uring_buffer[num_service_urings++] = buffer;
+	for (int isock = 0; isock < num_service_sockets; ++isock) {
+		if (service_socket[isock].sock == sock)
+			service_socket[isock].uring = uring;
+	}
+	return 0;
+}
+#endif
+
+// Timer sending the service announcement on all sockets of the loop, or in single socket mode on
+// each interface. RFC 6762 section 8.3 requires at least two announcements one second apart. The
+// announcement is built once, and the interfaces of a single socket are sent in one system call
+static void
+service_announce(mdns_engine_t* engine, uint64_t now, void* user_data) {
+	service_loop_t* loop = (service_loop_t*)user_data;
+	const service_t* service = loop->service;
+	mdns_socket_context_t contexts[sizeof(service_socket) / sizeof(service_socket[0])];
+	size_t count = 0;
+	for (int isock = 0; isock < num_service_sockets; ++isock) {
+		if (service_socket[isock].loop != loop)
+			continue;
+		if (!loop->single_socket || service_socket[isock].context.interface_index)
+			contexts[count++] = service_socket[isock].context;
+	}
+	mdns_announce_multicast_contexts(contexts, count, loop->buffer, loop->capacity,
+	                                 service->record_ptr, 0, 0, loop->announce_additional,
+	                                 loop->announce_additional_count);
+	if (++loop->announce_count < 2)
+		mdns_engine_add_timer(engine, now + 1000, service_announce, loop);
+}
+
+// Run the engine of a service loop on a worker thread
+#ifdef _WIN32
+static DWORD WINAPI
+service_thread(LPVOID arg) {
+	mdns_engine_run(&((service_loop_t*)arg)->engine);
+	return 0;
+}
+#else
+static void*
+service_thread(void* arg) {
+	mdns_engine_run(&((service_loop_t*)arg)->engine);
+	return 0;
+}
+#endif
+
+static int
+start_service_thread(service_loop_t* loop) {
+#ifdef _WIN32
+	loop->thread = CreateThread(0, 0, service_thread, loop, 0, 0);
+	return loop->thread ? 0 : -1;
+#else
+	return pthread_create(&loop->thread, 0, service_thread, loop) ? -1 : 0;
+#endif
+}
+
+static void
+join_service_thread(service_loop_t* loop) {
+#ifdef _WIN32
+	WaitForSingleObject(loop->thread, INFINITE);
+	CloseHandle(loop->thread);
+#else
+	pthread_join(loop->thread, 0);
+#endif
+}
+
+// Free the buffers of the given number of service loops and finalize their engines, closing the
+// sockets added to them
+static void
+finalize_service_loops(int count) {
+	for (int iloop = 0; iloop < count; ++iloop) {
+		service_loop_t* loop = &service_loop[iloop];
+		for (size_t ibuf = 0; ibuf < loop->batch_count; ++ibuf)
+			free(loop->batch_buffer[ibuf]);
+		free(loop->buffer);
+		mdns_engine_finalize(&loop->engine);
+	}
+}
 
+// Provide a mDNS service, answering incoming DNS-SD and mDNS queries
+static int
+service_mdns(const char* hostname, const char* service_name, int service_port, int single_socket,
+             int io_uring, int threads) {
+	int max_threads = (int)(sizeof(service_loop) / sizeof(service_loop[0]));
+	threads = (threads < 1) ? 1 : ((threads > max_threads) ? max_threads : threads);
+	if (threads > 1) {
+		// Each worker thread reads its own socket for each address family joined on every
+		// interface, and skips the multicast queries of the other shards
+		single_socket = 1;
+		if (io_uring)
+			printf("io_uring transport not used with worker threads\n");
+		io_uring = 0;
+	}
+#ifndef MDNS_HAVE_PKTINFO
+	if (single_socket)
+		printf("Interface of queries not available, answering on default interface\n");
+#endif
+#ifndef MDNS_HAVE_IO_URING
+	if (io_uring)
+		printf("io_uring transport not available, using socket calls\n");
+	io_uring = 0;
+#endif
 	size_t service_name_length = strlen(service_name);
 	if (!service_name_length) {
 		printf("Invalid service name\n");
@@ -799,12 +1375,6 @@ service_mdns(const char* hostname, const char* service_name, int service_port) {
 	service_name_buffer[service_name_length] = 0;
 	service_name = service_name_buffer;
 
-	printf("Service mDNS: %s:%d\n", service_name, service_port);
-	printf("Hostname: %s\n", hostname);
-
-	size_t capacity = 2048;
-	void* buffer = malloc(capacity);
-
 	mdns_string_t service_string = (mdns_string_t){service_name, strlen(service_name)};
 	mdns_string_t hostname_string = (mdns_string_t){hostname, strlen(hostname)};
 
@@ -827,93 +1397,216 @@ service_mdns(const char* hostname, const char* service_name, int service_port) {
 	service.hostname = hostname_string;
 	service.service_instance = service_instance_string;
 	service.hostname_qualified = hostname_qualified_string;
+	service.port = service_port;
+
+	// Compile the names to wire format once, the records below reference the compiled names so
+	// they are not encoded from the strings for every answer sent. Names are checked before any
+	// socket or buffer is set up
+	if (mdns_name_compile(&service.service_compiled, MDNS_STRING_ARGS(service.service)) ||
+	    mdns_name_compile(&service.service_instance_compiled,
+	                      MDNS_STRING_ARGS(service.service_instance)) ||
+	    mdns_name_compile(&service.hostname_qualified_compiled,
+	                      MDNS_STRING_ARGS(service.hostname_qualified))) {
+		printf("Invalid service or host name\n");
+		free(service_name_buffer);
+		return -1;
+	}
+
+	int sockets[32];
+	int num_sockets = open_service_sockets(sockets, sizeof(sockets) / sizeof(sockets[0]),
+	                                       single_socket, threads);
+	if (num_sockets <= 0) {
+		printf("Failed to open any client sockets\n");
+		free(service_name_buffer);
+		return -1;
+	}
+	printf("Opened %d socket%s for mDNS service\n", num_sockets, num_sockets ? "s" : "");
+
+	printf("Service mDNS: %s:%d\n", service_name, service_port);
+	printf("Hostname: %s\n", hostname);
+
+	// Each loop has its own buffers, response cache and engine, so loops can run in parallel
+	num_service_loops = threads;
+	set_service_shard_count((size_t)num_service_loops);
+	for (int iloop = 0; iloop < num_service_loops; ++iloop) {
+		service_loop_t* loop = &service_loop[iloop];
+		loop->single_socket = single_socket;
+		loop->shard = (size_t)iloop;
+		loop->capacity = 2048;
+		loop->buffer = malloc(loop->capacity);
+
+		// Drain up to 8 queued datagrams per socket on each wakeup
+		loop->batch_count = sizeof(loop->batch_buffer) / sizeof(void*);
+		for (size_t ibuf = 0; ibuf < loop->batch_count; ++ibuf)
+			loop->batch_buffer[ibuf] = malloc(loop->capacity);
+
+		mdns_response_cache_initialize(
+		    &loop->response_cache, loop->response_cache_entry,
+		    sizeof(loop->response_cache_entry) / sizeof(loop->response_cache_entry[0]),
+		    loop->response_cache_storage, sizeof(loop->response_cache_storage));
+		loop->random = ((uint32_t)mdns_engine_time() * 2654435761U) ^ (uint32_t)iloop;
+		loop->random |= 1;
+		loop->service = &service;
+
+		if (mdns_engine_initialize(&loop->engine, loop->engine_socket,
+		                           sizeof(loop->engine_socket) / sizeof(loop->engine_socket[0]),
+		                           loop->engine_timer,
+		                           sizeof(loop->engine_timer) / sizeof(loop->engine_timer[0]))) {
+			// No socket is added to an engine yet, and a failed engine can be finalized
+			printf("Failed to initialize event loop\n");
+			for (int isock = 0; isock < num_sockets; ++isock)
+				mdns_socket_close(sockets[isock]);
+			finalize_service_loops(iloop + 1);
+			free(service_name_buffer);
+			return -1;
+		}
+	}
+
+	// Local addresses are known once the sockets are open
 	service.address_ipv4 = service_address_ipv4;
 	service.address_ipv6 = service_address_ipv6;
-	service.port = service_port;
 
 	// Setup our mDNS records
 
 	// PTR record reverse mapping "<_service-name>._tcp.local." to
 	// "<hostname>.<_service-name>._tcp.local."
-	service.record_ptr = (mdns_record_t){.name = service.service,
-	                                     .type = MDNS_RECORDTYPE_PTR,
-	                                     .data.ptr.name = service.service_instance};
+	service.record_ptr =
+	    (mdns_record_t){.name = service.service,
+	                    .name_compiled = &service.service_compiled,
+	                    .type = MDNS_RECORDTYPE_PTR,
+	                    .data.ptr.name = service.service_instance,
+	                    .data.ptr.name_compiled = &service.service_instance_compiled};
 
 	// SRV record mapping "<hostname>.<_service-name>._tcp.local." to
 	// "<hostname>.local." with port. Set weight & priority to 0.
-	service.record_srv = (mdns_record_t){.name = service.service_instance,
-	                                     .type = MDNS_RECORDTYPE_SRV,
-	                                     .data.srv.name = service.hostname_qualified,
-	                                     .data.srv.port = service.port,
-	                                     .data.srv.priority = 0,
-	                                     .data.srv.weight = 0};
+	service.record_srv =
+	    (mdns_record_t){.name = service.service_instance,
+	                    .name_compiled = &service.service_instance_compiled,
+	                    .type = MDNS_RECORDTYPE_SRV,
+	                    .data.srv.name = service.hostname_qualified,
+	                    .data.srv.name_compiled = &service.hostname_qualified_compiled,
+	                    .data.srv.port = service.port,
+	                    .data.srv.priority = 0,
+	                    .data.srv.weight = 0};
 
 	// A/AAAA records mapping "<hostname>.local." to IPv4/IPv6 addresses
 	service.record_a = (mdns_record_t){.name = service.hostname_qualified,
+	                                   .name_compiled = &service.hostname_qualified_compiled,
 	                                   .type = MDNS_RECORDTYPE_A,
 	                                   .data.a.addr = service.address_ipv4};
 
 	service.record_aaaa = (mdns_record_t){.name = service.hostname_qualified,
+	                                      .name_compiled = &service.hostname_qualified_compiled,
 	                                      .type = MDNS_RECORDTYPE_AAAA,
 	                                      .data.aaaa.addr = service.address_ipv6};
 
 	// Add two test TXT records for our service instance name, will be coalesced into
 	// one record with both key-value pair strings by the library
 	service.txt_record[0] = (mdns_record_t){.name = service.service_instance,
+	                                        .name_compiled = &service.service_instance_compiled,
 	                                        .type = MDNS_RECORDTYPE_TXT,
 	                                        .data.txt.key = {MDNS_STRING_CONST("test")},
 	                                        .data.txt.value = {MDNS_STRING_CONST("1")}};
 	service.txt_record[1] = (mdns_record_t){.name = service.service_instance,
+	                                        .name_compiled = &service.service_instance_compiled,
 	                                        .type = MDNS_RECORDTYPE_TXT,
 	                                        .data.txt.key = {MDNS_STRING_CONST("other")},
 	                                        .data.txt.value = {MDNS_STRING_CONST("value")}};
 
-	// Send an announcement on startup of service
-	{
-		mdns_record_t additional[5] = {0};
-		size_t additional_count = 0;
-		additional[additional_count++] = service.record_srv;
-		if (service.address_ipv4.sin_family == AF_INET)
-			additional[additional_count++] = service.record_a;
-		if (service.address_ipv6.sin6_family == AF_INET6)
-			additional[additional_count++] = service.record_aaaa;
-		additional[additional_count++] = service.txt_record[0];
-		additional[additional_count++] = service.txt_record[1];
-
-		for (int isock = 0; isock < num_sockets; ++isock)
-			mdns_announce_multicast(sockets[isock], buffer, capacity, service.record_ptr, 0, 0,
-			                        additional, additional_count);
+	// PTR record reverse mapping the DNS-SD domain "_services._dns-sd._udp.local." to the service
+	// name we advertise, typically on the "<_service-name>._tcp.local." format
+	service.record_dns_sd =
+	    (mdns_record_t){.name = {MDNS_STRING_CONST("_services._dns-sd._udp.local.")},
+	                    .type = MDNS_RECORDTYPE_PTR,
+	                    .data.ptr.name = service.service,
+	                    .data.ptr.name_compiled = &service.service_compiled};
+
+	// Index all records in a record store to resolve questions
+	mdns_record_store_initialize(
+	    &service.record_store, service.record_store_entry,
+	    sizeof(service.record_store_entry) / sizeof(service.record_store_entry[0]),
+	    service.record_store_bucket,
+	    sizeof(service.record_store_bucket) / sizeof(service.record_store_bucket[0]));
+	mdns_record_store_add(&service.record_store, &service.record_dns_sd);
+	mdns_record_store_add(&service.record_store, &service.record_ptr);
+	mdns_record_store_add(&service.record_store, &service.record_srv);
+	if (service.address_ipv4.sin_family == AF_INET)
+		mdns_record_store_add(&service.record_store, &service.record_a);
+	if (service.address_ipv6.sin6_family == AF_INET6)
+		mdns_record_store_add(&service.record_store, &service.record_aaaa);
+	mdns_record_store_add(&service.record_store, &service.txt_record[0]);
+	mdns_record_store_add(&service.record_store, &service.txt_record[1]);
+	mdns_name_filter_initialize(&service.name_filter, service.name_filter_bits,
+	                            sizeof(service.name_filter_bits) / sizeof(uint64_t));
+	mdns_name_filter_add_store(&service.name_filter, &service.record_store);
+
+	// Responses are scheduled per socket, and in single socket mode per interface the socket
+	// joined. The sockets of each address family are handed out to the loops in order, one per
+	// shard
+	for (int isock = 0; isock < num_sockets; ++isock) {
+		service_loop_t* loop = &service_loop[isock % num_service_loops];
+		add_service_socket(&service, loop, sockets[isock], 0);
+		for (int iif = 0; single_socket && (iif < num_interfaces); ++iif)
+			add_service_socket(&service, loop, sockets[isock], interfaces[iif].index);
+#ifdef MDNS_HAVE_IO_URING
+		if (io_uring && !add_service_uring(loop, sockets[isock]))
+			continue;
+		if (io_uring)
+			printf("Failed to setup io_uring transport, using socket calls\n");
+#endif
+		mdns_engine_add_socket(&loop->engine, sockets[isock], service_readable, loop);
 	}
 
-	// This is a crude implementation that checks for incoming queries
-	while (1) {
-		int nfds = 0;
-		fd_set readfs;
-		FD_ZERO(&readfs);
-		for (int isock = 0; isock < num_sockets; ++isock) {
-			if (sockets[isock] >= nfds)
-				nfds = sockets[isock] + 1;
-			FD_SET(sockets[isock], &readfs);
-		}
-
-		if (select(nfds, &readfs, 0, 0, 0) >= 0) {
-			for (int isock = 0; isock < num_sockets; ++isock) {
-				if (FD_ISSET(sockets[isock], &readfs)) {
-					mdns_socket_listen(sockets[isock], buffer, capacity, service_callback,
-					                   &service);
-				}
-				FD_SET(sockets[isock], &readfs);
-			}
-		} else {
+	// Announce on startup of service from the first loop, which has a socket for each address
+	// family, and repeat the announcement once after one second
+	service_loop_t* announce_loop = &service_loop[0];
+	announce_loop->announce_additional_count = 0;
+	announce_loop->announce_additional[announce_loop->announce_additional_count++] =
+	    service.record_srv;
+	if (service.address_ipv4.sin_family == AF_INET)
+		announce_loop->announce_additional[announce_loop->announce_additional_count++] =
+		    service.record_a;
+	if (service.address_ipv6.sin6_family == AF_INET6)
+		announce_loop->announce_additional[announce_loop->announce_additional_count++] =
+		    service.record_aaaa;
+	announce_loop->announce_additional[announce_loop->announce_additional_count++] =
+	    service.txt_record[0];
+	announce_loop->announce_additional[announce_loop->announce_additional_count++] =
+	    service.txt_record[1];
+	service_announce(&announce_loop->engine, mdns_engine_time(), announce_loop);
+
+	// Dispatch incoming queries and the timers for delayed responses until an error occurs, the
+	// first loop runs on this thread and the other loops on worker threads
+	if (num_service_loops > 1)
+		printf("Answering queries on %d threads\n", num_service_loops);
+	for (int iloop = 1; iloop < num_service_loops; ++iloop) {
+		if (start_service_thread(&service_loop[iloop])) {
+			// Divide the queries among the running loops only, and close the sockets of the
+			// loops not started so unicast queries are delivered to the sockets still read
+			printf("Failed to start worker thread, answering queries on %d threads\n", iloop);
+			set_service_shard_count((size_t)iloop);
+			for (int istop = iloop; istop < num_service_loops; ++istop)
+				mdns_engine_finalize(&service_loop[istop].engine);
+			num_service_loops = iloop;
 			break;
 		}
 	}
-
-	free(buffer);
+	mdns_engine_run(&service_loop[0].engine);
+	for (int iloop = 1; iloop < num_service_loops; ++iloop)
+		join_service_thread(&service_loop[iloop]);
+
+#ifdef MDNS_HAVE_IO_URING
+	// The engine owns the ring file descriptors, the sockets read through a ring are closed here
+	for (int iuring = 0; iuring < num_service_urings; ++iuring) {
+		service_socket_t* state = find_service_socket(service_uring[iuring].sock, 0);
+		mdns_engine_remove_socket(&state->loop->engine, service_uring[iuring].fd);
+		mdns_socket_close(service_uring[iuring].sock);
+		mdns_uring_finalize(&service_uring[iuring]);
+		free(service_uring_buffer[iuring]);
+	}
+#endif
+	finalize_service_loops(threads);
 	free(service_name_buffer);
-
-	for (int isock = 0; isock < num_sockets; ++isock)
-		mdns_socket_close(sockets[isock]);
 	printf("Closed socket%s\n", num_sockets ? "s" : "");
 
 	return 0;
@@ -985,6 +1678,14 @@ fuzz_mdns(void) {
 		length = size ? (rand() % (size - offset)) : 0;
 		mdns_record_parse_txt(buffer, size, offset, length, (mdns_record_txt_t*)strbuffer,
 		                      MAX_FUZZ_SIZE);
+		mdns_record_parse_txt_count(buffer, size, offset, length);
+
+		// Take the key from the data so it matches some of the records
+		mdns_record_txt_t txt_record;
+		size_t key_offset = size ? (rand() % size) : 0;
+		size_t key_length = size ? ((rand() % (size - key_offset)) % 16) : 0;
+		mdns_record_parse_txt_find(buffer, size, offset, length, (const char*)buffer + key_offset,
+		                           key_length, &txt_record);
 
 		if (ipass && !(ipass % 10000))
 			printf("Completed fuzzing pass %d\n", ipass);
@@ -1001,8 +1702,13 @@ main(int argc, const char* const* argv) {
 	int mode = 0;
 	const char* service = "_test-mdns._tcp.local.";
 	const char* hostname = "dummy-host";
-	int query_record = MDNS_RECORDTYPE_PTR;
+	mdns_query_t query[16];
+	size_t query_count = 0;
 	int service_port = 42424;
+	int single_socket = 0;
+	int io_uring = 0;
+	int continuous = 0;
+	int threads = 1;
 
 #ifdef _WIN32
 
@@ -1031,21 +1737,25 @@ main(int argc, const char* const* argv) {
 		if (strcmp(argv[iarg], "--discovery") == 0) {
 			mode = 0;
 		} else if (strcmp(argv[iarg], "--query") == 0) {
+			// Each --query adds a question with an optional record type before the name, and all
+			// questions are sent in one packet
 			mode = 1;
 			++iarg;
-			if (iarg < argc)
-				service = argv[iarg++];
 			if (iarg < argc) {
-				const char* record_name = service;
-				service = argv[iarg++];
-				if (strcmp(record_name, "PTR") == 0)
-					query_record = MDNS_RECORDTYPE_PTR;
-				else if (strcmp(record_name, "SRV") == 0)
-					query_record = MDNS_RECORDTYPE_SRV;
-				else if (strcmp(record_name, "A") == 0)
-					query_record = MDNS_RECORDTYPE_A;
-				else if (strcmp(record_name, "AAAA") == 0)
-					query_record = MDNS_RECORDTYPE_AAAA;
+				mdns_record_type_t record = MDNS_RECORDTYPE_IGNORE;
+				if ((iarg + 1) < argc)
+					record = parse_record_type(argv[iarg]);
+				if (record != MDNS_RECORDTYPE_IGNORE)
+					++iarg;
+				else
+					record = MDNS_RECORDTYPE_PTR;
+				const char* name = argv[iarg];
+				if (query_count < (sizeof(query) / sizeof(query[0]))) {
+					query[query_count].type = record;
+					query[query_count].name = name;
+					query[query_count].length = strlen(name);
+					++query_count;
+				}
 			}
 		} else if (strcmp(argv[iarg], "--service") == 0) {
 			mode = 2;
@@ -1056,6 +1766,16 @@ main(int argc, const char* const* argv) {
 			++iarg;
 			if (iarg < argc)
 				hostname = argv[iarg];
+		} else if (strcmp(argv[iarg], "--continuous") == 0) {
+			continuous = 1;
+		} else if (strcmp(argv[iarg], "--single-socket") == 0) {
+			single_socket = 1;
+		} else if (strcmp(argv[iarg], "--io-uring") == 0) {
+			io_uring = 1;
+		} else if (strcmp(argv[iarg], "--threads") == 0) {
+			++iarg;
+			if (iarg < argc)
+				threads = atoi(argv[iarg]);
 		} else if (strcmp(argv[iarg], "--port") == 0) {
 			++iarg;
 			if (iarg < argc)
@@ -1063,21 +1783,28 @@ main(int argc, const char* const* argv) {
 		}
 	}
 
+	int ret = 0;
 #ifdef MDNS_FUZZING
 	fuzz_mdns();
 #else
-	int ret;
+	if (!query_count) {
+		query[0].type = MDNS_RECORDTYPE_PTR;
+		query[0].name = service;
+		query[0].length = strlen(service);
+		query_count = 1;
+	}
+
 	if (mode == 0)
 		ret = send_dns_sd();
 	else if (mode == 1)
-		ret = send_mdns_query(service, query_record);
+		ret = send_mdns_query(query, query_count, continuous);
 	else if (mode == 2)
-		ret = service_mdns(hostname, service, service_port);
+		ret = service_mdns(hostname, service, service_port, single_socket, io_uring, threads);
 #endif
 
 #ifdef _WIN32
 	WSACleanup();
 #endif
 
-	return 0;
+	return (ret < 0) ? 1 : 0;
 }
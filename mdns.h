@@ -25,10 +25,22 @@
 #include <Ws2tcpip.h>
 #define strncasecmp _strnicmp
 #else
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <linux/filter.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -44,11 +56,161 @@ extern "C" {
 #define MDNS_POINTER_OFFSET_CONST(p, ofs) ((const void*)((const char*)(p) + (ptrdiff_t)(ofs)))
 #define MDNS_POINTER_DIFF(a, b) ((size_t)((const char*)(a) - (const char*)(b)))
 
+// Marks the API functions, which are static, so translation units using only some of them compile
+// without unused function warnings
+#if defined(__GNUC__) || defined(__clang__)
+#define MDNS_MAYBE_UNUSED __attribute__((unused))
+#else
+#define MDNS_MAYBE_UNUSED
+#endif
+
 #define MDNS_PORT 5353
 #define MDNS_UNICAST_RESPONSE 0x8000U
 #define MDNS_CACHE_FLUSH 0x8000U
+#define MDNS_TRUNCATED 0x0200U
 #define MDNS_MAX_SUBSTRINGS 64
 
+// Number of items in the hashed string table used by the answer functions for name compression
+#ifndef MDNS_STRING_TABLE_SIZE
+#define MDNS_STRING_TABLE_SIZE 256
+#endif
+
+// Number of dotted record names a packet builder keeps compiled, so that sizing and adding records
+// sharing a name compiles it once per packet. At least two, the name and the target of a record
+#ifndef MDNS_PACKET_BUILDER_NAME_CACHE
+#define MDNS_PACKET_BUILDER_NAME_CACHE 4
+#endif
+
+// Maximum number of records indexed from a single datagram by the receive functions
+#ifndef MDNS_MAX_MESSAGE_RECORDS
+#define MDNS_MAX_MESSAGE_RECORDS 128
+#endif
+
+// Maximum number of datagrams read by a single system call in the batched receive functions
+#ifndef MDNS_RECV_BATCH_MAX
+#define MDNS_RECV_BATCH_MAX 32
+#endif
+
+// Maximum number of datagrams sent by a single system call when sending on several interfaces
+#ifndef MDNS_SEND_BATCH_MAX
+#define MDNS_SEND_BATCH_MAX 32
+#endif
+
+// Default maximum size of the packets built by the multi-packet functions, the UDP payload fitting
+// a 1500 byte Ethernet MTU with an IPv6 header (RFC 6762 section 17)
+#ifndef MDNS_PACKET_SIZE_MAX
+#define MDNS_PACKET_SIZE_MAX 1452
+#endif
+
+// Maximum number of authority and additional records of a response split by the multi-packet
+// functions
+#ifndef MDNS_SPLIT_EXTRA_MAX
+#define MDNS_SPLIT_EXTRA_MAX 1024
+#endif
+
+// Range of the random delay in milliseconds before sending a multicast response to a question for
+// shared records, allowing answers to be aggregated (RFC 6762 section 6.3)
+#ifndef MDNS_RESPONSE_DELAY_MIN
+#define MDNS_RESPONSE_DELAY_MIN 20
+#endif
+#ifndef MDNS_RESPONSE_DELAY_MAX
+#define MDNS_RESPONSE_DELAY_MAX 120
+#endif
+
+// Range of the random delay in milliseconds before answering a query with the TC bit set, allowing
+// the continuation packets with the rest of its known answers to arrive (RFC 6762 section 7.2)
+#ifndef MDNS_RESPONSE_HOLD_MIN
+#define MDNS_RESPONSE_HOLD_MIN 400
+#endif
+#ifndef MDNS_RESPONSE_HOLD_MAX
+#define MDNS_RESPONSE_HOLD_MAX 500
+#endif
+
+// Maximum number of packets of a query with the TC bit set held by a response scheduler, counting
+// the query and its continuation packets
+#ifndef MDNS_RESPONSE_HOLD_PACKETS
+#define MDNS_RESPONSE_HOLD_PACKETS 8
+#endif
+
+// Range of the random delay in milliseconds before the first query of a continuous question, and
+// the interval between the first two queries, doubled after every query up to one hour (RFC 6762
+// section 5.2)
+#ifndef MDNS_QUERY_DELAY_MIN
+#define MDNS_QUERY_DELAY_MIN 20
+#endif
+#ifndef MDNS_QUERY_DELAY_MAX
+#define MDNS_QUERY_DELAY_MAX 120
+#endif
+#ifndef MDNS_QUERY_INTERVAL_MIN
+#define MDNS_QUERY_INTERVAL_MIN 1000
+#endif
+#ifndef MDNS_QUERY_INTERVAL_MAX
+#define MDNS_QUERY_INTERVAL_MAX 3600000
+#endif
+
+// recvmmsg is only declared by glibc/musl when _GNU_SOURCE is defined before including system
+// headers, otherwise the batched receive functions fall back to a loop of recvfrom calls. The same
+// holds for sendmmsg, used when sending on several interfaces of one socket
+#if defined(__linux__) && defined(_GNU_SOURCE)
+#define MDNS_HAVE_RECVMMSG 1
+#define MDNS_HAVE_SENDMMSG 1
+#endif
+
+// The packet info ancillary data reporting the arrival interface of a datagram, and selecting the
+// outgoing interface of a multicast datagram, is used on Linux. The structures are only declared
+// when _GNU_SOURCE is defined, otherwise the interface is not reported and multicast datagrams are
+// sent on the default interface
+#if defined(__linux__) && defined(_GNU_SOURCE)
+#define MDNS_HAVE_PKTINFO 1
+#endif
+
+// The event loop engine waits on sockets with epoll on Linux, otherwise with poll (WSAPoll on
+// Windows) on an array of at most MDNS_ENGINE_POLL_MAX sockets kept in the engine
+#ifdef __linux__
+#define MDNS_HAVE_EPOLL 1
+#endif
+#ifndef MDNS_ENGINE_POLL_MAX
+#define MDNS_ENGINE_POLL_MAX 64
+#endif
+
+// Sockets can discard uninteresting datagrams in the kernel with a classic BPF program attached
+// with SO_ATTACH_FILTER on Linux, other systems deliver all datagrams
+#ifdef __linux__
+#define MDNS_HAVE_SOCKET_FILTER 1
+#endif
+
+// TXT record strings are scanned 16 bytes at a time with SSE2 or NEON when the compiler targets
+// them, otherwise one byte at a time
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define MDNS_HAVE_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define MDNS_HAVE_NEON 1
+#endif
+
+// Maximum number of socket events handled by a single wait in the event loop engine
+#ifndef MDNS_ENGINE_EVENTS_MAX
+#define MDNS_ENGINE_EVENTS_MAX 32
+#endif
+
+// The io_uring transport is only compiled when MDNS_IO_URING is defined before including the
+// header on Linux, and the kernel headers support multishot receive (Linux 6.0 or later). It uses
+// the io_uring system calls directly and does not need liburing
+#if defined(MDNS_IO_URING) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef IORING_RECV_MULTISHOT
+#define MDNS_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+// Maximum number of sends in flight on an io_uring transport
+#ifndef MDNS_URING_SEND_MAX
+#define MDNS_URING_SEND_MAX 32
+#endif
+
 enum mdns_record_type {
 	MDNS_RECORDTYPE_IGNORE = 0,
 	// Address
@@ -74,6 +236,18 @@ enum mdns_entry_type {
 
 enum mdns_class { MDNS_CLASS_IN = 1 };
 
+enum mdns_socket_filter_flags {
+	// Accept queries, datagrams with the QR bit clear
+	MDNS_SOCKET_FILTER_QUERY = 1,
+	// Accept responses, datagrams with the QR bit set
+	MDNS_SOCKET_FILTER_RESPONSE = 2,
+	// Discard datagrams without questions, except queries continuing known answers in packets
+	// without questions (RFC 6762 section 7.2)
+	MDNS_SOCKET_FILTER_QUESTIONS = 4,
+	// Discard datagrams without answers
+	MDNS_SOCKET_FILTER_ANSWERS = 8
+};
+
 typedef enum mdns_record_type mdns_record_type_t;
 typedef enum mdns_entry_type mdns_entry_type_t;
 typedef enum mdns_class mdns_class_t;
@@ -84,16 +258,55 @@ typedef int (*mdns_record_callback_fn)(int sock, const struct sockaddr* from, si
                                        size_t name_offset, size_t name_length, size_t record_offset,
                                        size_t record_length, void* user_data);
 
+typedef size_t (*mdns_datagram_parse_fn)(int sock, const struct sockaddr* from, size_t addrlen,
+                                         const void* buffer, size_t size,
+                                         mdns_record_callback_fn callback, void* user_data,
+                                         int query_id);
+
+typedef int (*mdns_packet_send_fn)(const void* buffer, size_t size, void* user_data);
+
 typedef struct mdns_string_t mdns_string_t;
 typedef struct mdns_string_pair_t mdns_string_pair_t;
 typedef struct mdns_string_table_item_t mdns_string_table_item_t;
 typedef struct mdns_string_table_t mdns_string_table_t;
+typedef struct mdns_name_t mdns_name_t;
+typedef struct mdns_packet_builder_t mdns_packet_builder_t;
+typedef struct mdns_label_iterator_t mdns_label_iterator_t;
 typedef struct mdns_record_t mdns_record_t;
+typedef struct mdns_query_t mdns_query_t;
 typedef struct mdns_record_srv_t mdns_record_srv_t;
 typedef struct mdns_record_ptr_t mdns_record_ptr_t;
 typedef struct mdns_record_a_t mdns_record_a_t;
 typedef struct mdns_record_aaaa_t mdns_record_aaaa_t;
 typedef struct mdns_record_txt_t mdns_record_txt_t;
+typedef struct mdns_message_t mdns_message_t;
+typedef struct mdns_response_cache_t mdns_response_cache_t;
+typedef struct mdns_response_cache_entry_t mdns_response_cache_entry_t;
+typedef struct mdns_record_store_t mdns_record_store_t;
+typedef struct mdns_record_store_entry_t mdns_record_store_entry_t;
+typedef struct mdns_name_filter_t mdns_name_filter_t;
+typedef struct mdns_listen_filter_t mdns_listen_filter_t;
+typedef struct mdns_response_scheduler_t mdns_response_scheduler_t;
+typedef struct mdns_cache_t mdns_cache_t;
+typedef struct mdns_cache_entry_t mdns_cache_entry_t;
+typedef struct mdns_query_scheduler_t mdns_query_scheduler_t;
+typedef struct mdns_query_scheduler_entry_t mdns_query_scheduler_entry_t;
+typedef struct mdns_message_record_t mdns_message_record_t;
+typedef struct mdns_pktinfo_t mdns_pktinfo_t;
+typedef struct mdns_socket_context_t mdns_socket_context_t;
+typedef struct mdns_packet_target_t mdns_packet_target_t;
+typedef struct mdns_answer_split_t mdns_answer_split_t;
+typedef struct mdns_engine_t mdns_engine_t;
+typedef struct mdns_engine_socket_t mdns_engine_socket_t;
+typedef struct mdns_engine_timer_t mdns_engine_timer_t;
+#ifdef MDNS_HAVE_IO_URING
+typedef struct mdns_uring_t mdns_uring_t;
+typedef struct mdns_uring_send_t mdns_uring_send_t;
+#endif
+
+typedef void (*mdns_engine_socket_fn)(mdns_engine_t* engine, int sock, void* user_data);
+
+typedef void (*mdns_engine_timer_fn)(mdns_engine_t* engine, uint64_t now, void* user_data);
 
 #ifdef _WIN32
 typedef int mdns_size_t;
@@ -114,10 +327,59 @@ struct mdns_string_pair_t {
 	int ref;
 };
 
+struct mdns_string_table_item_t {
+	uint32_t hash;
+	uint32_t offset;
+};
+
 struct mdns_string_table_t {
 	size_t offset[16];
 	size_t count;
 	size_t next;
+	// Optional hash table of name suffixes, see mdns_string_table_initialize
+	mdns_string_table_item_t* item;
+	size_t capacity;
+};
+
+struct mdns_name_t {
+	// Uncompressed wire format, including the terminating zero length label
+	uint8_t data[256];
+	size_t length;
+	size_t label_count;
+	// Offset of the length byte of each label in data
+	uint8_t label_offset[MDNS_MAX_SUBSTRINGS];
+	// Hash of each name suffix starting at the corresponding label, used for compression
+	uint32_t suffix_hash[MDNS_MAX_SUBSTRINGS];
+	// Case insensitive hash of the full name
+	uint64_t hash;
+};
+
+struct mdns_packet_builder_t {
+	void* buffer;
+	size_t capacity;
+	// Size of the packet built so far
+	size_t size;
+	// Number of records added to each section, indexed by mdns_entry_type_t
+	uint16_t count[4];
+	// Section records are added to, sections must be added in order
+	mdns_entry_type_t section;
+	// Names written to the packet, for compression
+	mdns_string_table_t string_table;
+	mdns_string_table_item_t string_table_item[MDNS_STRING_TABLE_SIZE];
+	// Dotted record names compiled for sizing and adding records, unused entries have zero length
+	mdns_name_t name_cache[MDNS_PACKET_BUILDER_NAME_CACHE];
+	size_t name_cache_next;
+};
+
+struct mdns_label_iterator_t {
+	const void* buffer;
+	size_t size;
+	// Offset of the next label or name reference, MDNS_INVALID_POS when the name is finished
+	size_t offset;
+	// Offset of the first byte after the name in the buffer, MDNS_INVALID_POS until it is known
+	size_t end;
+	// Number of labels read, limited to MDNS_MAX_SUBSTRINGS
+	size_t count;
 };
 
 struct mdns_record_srv_t {
@@ -125,10 +387,14 @@ struct mdns_record_srv_t {
 	uint16_t weight;
 	uint16_t port;
 	mdns_string_t name;
+	// Optional compiled name, used instead of name when building packets
+	const mdns_name_t* name_compiled;
 };
 
 struct mdns_record_ptr_t {
 	mdns_string_t name;
+	// Optional compiled name, used instead of name when building packets
+	const mdns_name_t* name_compiled;
 };
 
 struct mdns_record_a_t {
@@ -154,7 +420,291 @@ struct mdns_record_t {
 		mdns_record_aaaa_t aaaa;
 		mdns_record_txt_t txt;
 	} data;
+	// Optional compiled name, used instead of name when building packets
+	const mdns_name_t* name_compiled;
+};
+
+struct mdns_query_t {
+	mdns_record_type_t type;
+	const char* name;
+	size_t length;
+};
+
+struct mdns_message_record_t {
+	size_t name_offset;
+	size_t name_length;
+	uint16_t rtype;
+	uint16_t rclass;
+	uint32_t ttl;
+	// Record data, zero for questions
+	size_t data_offset;
+	size_t data_length;
+};
+
+struct mdns_message_t {
+	const void* buffer;
+	size_t size;
+	uint16_t query_id;
+	uint16_t flags;
+	// Record counts as given in the header, indexed by mdns_entry_type_t
+	uint16_t declared[4];
+	// Number of records successfully indexed, indexed by mdns_entry_type_t
+	size_t count[4];
+	// Index of the first record of each section in the records array
+	size_t first[4];
+	mdns_message_record_t* records;
+	// Offset of first byte after the last indexed record
+	size_t end;
+};
+
+struct mdns_response_cache_entry_t {
+	uint64_t hash;
+	uint16_t rtype;
+	uint16_t unicast;
+	int family;
+	// Uncompressed question name followed by the encoded packet in the cache storage
+	size_t offset;
+	size_t name_length;
+	size_t size;
+};
+
+struct mdns_response_cache_t {
+	mdns_response_cache_entry_t* entry;
+	size_t capacity;
+	size_t count;
+	void* storage;
+	size_t storage_capacity;
+	size_t storage_used;
+};
+
+struct mdns_record_store_entry_t {
+	mdns_record_t record;
+	uint64_t hash;
+	// Index of the next entry in the same bucket
+	size_t next;
+};
+
+struct mdns_record_store_t {
+	mdns_record_store_entry_t* entry;
+	size_t capacity;
+	size_t count;
+	size_t* bucket;
+	size_t bucket_count;
+};
+
+struct mdns_name_filter_t {
+	// Bloom filter of the owned name and record type pairs, in caller supplied storage
+	uint64_t* bits;
+	size_t count;
+};
+
+struct mdns_listen_filter_t {
+	const mdns_name_filter_t* filter;
+	// Callback receiving the questions passing the filter
+	mdns_record_callback_fn callback;
+	void* user_data;
+};
+
+struct mdns_response_scheduler_t {
+	mdns_record_t* answer;
+	size_t answer_capacity;
+	size_t answer_count;
+	mdns_record_t* additional;
+	size_t additional_capacity;
+	size_t additional_count;
+	// Copies of the names and TXT strings of the pending records, in caller supplied storage
+	char* arena;
+	size_t arena_capacity;
+	size_t arena_size;
+	// Time in milliseconds when the first pending answer was added and when the answers are due
+	uint64_t start;
+	uint64_t deadline;
+	// Index of the interface to send the response on, 0 for the default interface of the socket
+	unsigned int interface_index;
+	// Query with the TC bit set and its continuation packets, held until the hold deadline in
+	// caller supplied storage, and the address of the querier
+	void* hold_buffer;
+	size_t hold_capacity;
+	size_t hold_size;
+	size_t hold_offset[MDNS_RESPONSE_HOLD_PACKETS];
+	size_t hold_length[MDNS_RESPONSE_HOLD_PACKETS];
+	size_t hold_count;
+	uint64_t hold_deadline;
+	struct sockaddr_storage hold_from;
+	size_t hold_addrlen;
+};
+
+struct mdns_pktinfo_t {
+	// Index of the interface the datagram arrived on, 0 if not known
+	unsigned int interface_index;
+	// Destination address of the datagram, family AF_UNSPEC if not known
+	struct sockaddr_storage destination;
+};
+
+struct mdns_socket_context_t {
+	int sock;
+	// Address family of the socket, AF_INET or AF_INET6
+	int family;
+	// Interface to send multicast datagrams on, 0 for the default interface of the socket
+	unsigned int interface_index;
+	// Multicast group address for the address family of the socket
+	struct sockaddr_storage group;
+	size_t group_length;
+};
+
+// Destination of the packets sent by the multi-packet socket functions, multicast on the given
+// interface if no address
+struct mdns_packet_target_t {
+	int sock;
+	const void* address;
+	size_t address_size;
+	unsigned int interface_index;
+};
+
+// Header fields, question and records of a response split over several packets
+struct mdns_answer_split_t {
+	uint16_t query_id;
+	mdns_record_type_t record_type;
+	const char* name;
+	size_t name_length;
+	uint16_t rclass;
+	uint32_t ttl;
+	mdns_record_t* answers;
+	size_t answer_count;
+	mdns_record_t* authority;
+	size_t authority_count;
+	mdns_record_t* additional;
+	size_t additional_count;
+};
+
+struct mdns_cache_entry_t {
+	uint64_t hash;
+	uint16_t rtype;
+	uint16_t rclass;
+	uint32_t ttl;
+	// Time in milliseconds when the record was last received and when it expires
+	uint64_t received;
+	uint64_t expire;
+	// Number of refresh queries sent for the record since it was last received
+	unsigned int refresh;
+	// Source address, uncompressed name and record data with uncompressed names in the arena
+	size_t from_offset;
+	size_t from_length;
+	size_t name_offset;
+	size_t name_length;
+	size_t data_offset;
+	size_t data_length;
+	// Index of the next entry in the same bucket
+	size_t next;
+};
+
+struct mdns_cache_t {
+	mdns_cache_entry_t* entry;
+	size_t capacity;
+	size_t count;
+	size_t* bucket;
+	size_t bucket_count;
+	void* arena;
+	size_t arena_capacity;
+	size_t arena_used;
+};
+
+struct mdns_query_scheduler_entry_t {
+	mdns_query_t query;
+	// Case insensitive hash of the name, to look up cached answers
+	uint64_t hash;
+	// Time in milliseconds when the next query is due, and the interval to the query after it
+	uint64_t deadline;
+	uint32_t interval;
+	// Question class of the next query, asking for a unicast response in the first query only
+	uint16_t rclass;
+};
+
+struct mdns_query_scheduler_t {
+	mdns_query_scheduler_entry_t* entry;
+	size_t capacity;
+	size_t count;
+};
+
+struct mdns_engine_socket_t {
+	int sock;
+	mdns_engine_socket_fn callback;
+	void* user_data;
+};
+
+struct mdns_engine_timer_t {
+	uint64_t deadline;
+	mdns_engine_timer_fn callback;
+	void* user_data;
+};
+
+struct mdns_engine_t {
+	mdns_engine_socket_t* socket;
+	size_t socket_capacity;
+	size_t socket_count;
+	// Binary min-heap of timers ordered by deadline
+	mdns_engine_timer_t* timer;
+	size_t timer_capacity;
+	size_t timer_count;
+	int running;
+#ifdef MDNS_HAVE_EPOLL
+	int epoll;
+#else
+	struct pollfd poll[MDNS_ENGINE_POLL_MAX];
+#endif
+};
+
+#ifdef MDNS_HAVE_IO_URING
+struct mdns_uring_send_t {
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_storage address;
+#ifdef MDNS_HAVE_PKTINFO
+	// Packet info ancillary data, as 64 bit words to align the cmsghdr
+	uint64_t control[(CMSG_SPACE(sizeof(struct in6_pktinfo)) + 7) / 8];
+#endif
+	int busy;
+};
+
+struct mdns_uring_t {
+	// Ring file descriptor, readable when completions are available
+	int fd;
+	int sock;
+	// Submission and completion rings mapped from the kernel
+	void* ring;
+	size_t ring_size;
+	struct io_uring_sqe* sqe;
+	size_t sqe_size;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_pending;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	struct io_uring_cqe* cqe;
+	unsigned int cq_mask;
+	// Ring of provided receive buffers, filled by the multishot receive
+	struct io_uring_buf_ring* buf_ring;
+	size_t buf_ring_size;
+	unsigned short buf_tail;
+	void* recv_buffers;
+	size_t recv_count;
+	struct msghdr recv_msg;
+	int recv_armed;
+	// Packet info of the datagram being parsed, valid in the parse function and callbacks
+	mdns_pktinfo_t recv_info;
+	// Send slots, each owning one of the send buffers until the send completes
+	void* send_buffers;
+	size_t send_count;
+	size_t buffer_size;
+	mdns_uring_send_t send[MDNS_URING_SEND_MAX];
+	// Multicast group address for the address family of the socket
+	struct sockaddr_storage group;
+	size_t group_length;
 };
+#endif
 
 struct mdns_header_t {
 	uint16_t query_id;
@@ -172,7 +722,7 @@ struct mdns_header_t {
 //! send one-shot discovery requests and queries pass a null pointer or set 0 as port to assign a
 //! random user level ephemeral port. To run discovery service listening for incoming discoveries
 //! and queries, you must set MDNS_PORT as port.
-static int
+static MDNS_MAYBE_UNUSED int
 mdns_socket_open_ipv4(const struct sockaddr_in* saddr);
 
 //! Setup an already opened IPv4 socket for mDNS/DNS-SD. To bind the socket to a specific interface,
@@ -180,7 +730,7 @@ mdns_socket_open_ipv4(const struct sockaddr_in* saddr);
 //! To send one-shot discovery requests and queries pass a null pointer or set 0 as port to assign a
 //! random user level ephemeral port. To run discovery service listening for incoming discoveries
 //! and queries, you must set MDNS_PORT as port.
-static int
+static MDNS_MAYBE_UNUSED int
 mdns_socket_setup_ipv4(int sock, const struct sockaddr_in* saddr);
 
 //! Open and setup a IPv6 socket for mDNS/DNS-SD. To bind the socket to a specific interface, pass
@@ -188,7 +738,7 @@ mdns_socket_setup_ipv4(int sock, const struct sockaddr_in* saddr);
 //! send one-shot discovery requests and queries pass a null pointer or set 0 as port to assign a
 //! random user level ephemeral port. To run discovery service listening for incoming discoveries
 //! and queries, you must set MDNS_PORT as port.
-static int
+static MDNS_MAYBE_UNUSED int
 mdns_socket_open_ipv6(const struct sockaddr_in6* saddr);
 
 //! Setup an already opened IPv6 socket for mDNS/DNS-SD. To bind the socket to a specific interface,
@@ -196,58 +746,233 @@ mdns_socket_open_ipv6(const struct sockaddr_in6* saddr);
 //! To send one-shot discovery requests and queries pass a null pointer or set 0 as port to assign a
 //! random user level ephemeral port. To run discovery service listening for incoming discoveries
 //! and queries, you must set MDNS_PORT as port.
-static int
+static MDNS_MAYBE_UNUSED int
 mdns_socket_setup_ipv6(int sock, const struct sockaddr_in6* saddr);
 
 //! Close a socket opened with mdns_socket_open_ipv4 and mdns_socket_open_ipv6.
-static void
+static MDNS_MAYBE_UNUSED void
 mdns_socket_close(int sock);
 
+//! Open a group of IPv4 sockets sharing the same address and port with SO_REUSEPORT, one for each
+//! worker thread handling a shard of the incoming queries. The address is passed to
+//! mdns_socket_open_ipv4 for each socket. Returns 0 if all sockets were opened, or <0 if error,
+//! in which case no socket is left open.
+static MDNS_MAYBE_UNUSED int
+mdns_socket_open_ipv4_shards(int* sockets, size_t count, const struct sockaddr_in* saddr);
+
+//! Open a group of IPv6 sockets sharing the same address and port with SO_REUSEPORT, one for each
+//! worker thread handling a shard of the incoming queries. The address is passed to
+//! mdns_socket_open_ipv6 for each socket. Returns 0 if all sockets were opened, or <0 if error,
+//! in which case no socket is left open.
+static MDNS_MAYBE_UNUSED int
+mdns_socket_open_ipv6_shards(int* sockets, size_t count, const struct sockaddr_in6* saddr);
+
+//! Check if a datagram received on the socket of the given shard in a group of sockets opened with
+//! mdns_socket_open_ipv4_shards or mdns_socket_open_ipv6_shards should be handled by the shard.
+//! Multicast datagrams are delivered to every socket in the group, and are assigned to one shard by
+//! a hash of the source address and port. Unicast datagrams are delivered to one socket only and
+//! are always accepted. Pass the packet info from mdns_socket_recv, or a null pointer if not
+//! available, in which case all datagrams are treated as multicast. Returns non-zero if accepted.
+static MDNS_MAYBE_UNUSED int
+mdns_socket_shard_accept(const struct sockaddr* from, size_t addrlen, const mdns_pktinfo_t* info,
+                         size_t shard, size_t shard_count);
+
+//! Attach a classic BPF program to the socket, discarding uninteresting datagrams in the kernel
+//! before they are copied to user space. Flags is a combination of mdns_socket_filter_flags, if
+//! neither MDNS_SOCKET_FILTER_QUERY nor MDNS_SOCKET_FILTER_RESPONSE is given both are accepted. If
+//! a label is given, only datagrams where the first label of the first question matches it case
+//! insensitively are accepted, for example "_airplay" or the instance name of a service. In known
+//! answer continuation packets without questions, the label of the first known answer is matched
+//! instead, which has the name of the question it answers. Any previously attached filter is
+//! replaced. Requires MDNS_HAVE_SOCKET_FILTER, returns 0 on success, or <0 if error or
+//! unsupported.
+static MDNS_MAYBE_UNUSED int
+mdns_socket_filter(int sock, unsigned int flags, const char* label, size_t length);
+
+//! Remove a filter attached with mdns_socket_filter. Returns 0 on success, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_socket_filter_detach(int sock);
+
+//! Join the mDNS multicast group on the interface with the given address, on an IPv4 socket set up
+//! for INADDR_ANY. Call once for each interface to serve all interfaces with one socket, and use
+//! mdns_socket_recv to get the interface each datagram arrived on. Returns 0 on success, or <0 if
+//! error (joining the interface the socket already joined on setup fails).
+static MDNS_MAYBE_UNUSED int
+mdns_socket_join_ipv4(int sock, const struct sockaddr_in* saddr);
+
+//! Join the mDNS multicast group on the interface with the given index, on an IPv6 socket set up
+//! for in6addr_any. See mdns_socket_join_ipv4. Returns 0 on success, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_socket_join_ipv6(int sock, unsigned int interface_index);
+
+//! Receive one datagram on the socket, storing the sender address in from and its length in
+//! addrlen (which must be set to the capacity of from). The arrival interface and destination
+//! address are stored in info when reported by the system (requires MDNS_HAVE_PKTINFO and a socket
+//! joined with mdns_socket_join_ipv4/mdns_socket_join_ipv6). Parse the datagram with one of the
+//! parse functions. Returns the size of the datagram, or 0 if no datagram was read.
+static MDNS_MAYBE_UNUSED size_t
+mdns_socket_recv(int sock, void* buffer, size_t capacity, struct sockaddr* from, size_t* addrlen,
+                 mdns_pktinfo_t* info);
+
+//! Send a multicast datagram on the interface with the given index, as reported by
+//! mdns_socket_recv. An interface index of 0, or a system without MDNS_HAVE_PKTINFO, sends on the
+//! default interface of the socket. Returns 0 on success, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_multicast_send_interface(int sock, const void* buffer, size_t size,
+                              unsigned int interface_index);
+
+//! Initialize a send context for a socket opened with one of the mdns open or setup socket
+//! functions and the interface to send multicast datagrams on, or 0 for the default interface. The
+//! address family and multicast group address are looked up once, instead of on every send.
+//! Returns 0 on success, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_socket_context_initialize(mdns_socket_context_t* context, int sock,
+                               unsigned int interface_index);
+
+//! Send a multicast datagram on the socket and interface of a send context. Returns 0 on success,
+//! or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_multicast_send_context(const mdns_socket_context_t* context, const void* buffer,
+                            size_t size);
+
+//! Send the same multicast datagram on the sockets and interfaces of several send contexts.
+//! Consecutive contexts on the same socket, like the interfaces joined by a single socket, are sent
+//! with one sendmmsg call on Linux (requires MDNS_HAVE_SENDMMSG). Returns the number of contexts
+//! the datagram was sent on.
+static MDNS_MAYBE_UNUSED size_t
+mdns_multicast_send_contexts(const mdns_socket_context_t* contexts, size_t count,
+                             const void* buffer, size_t size);
+
 //! Listen for incoming multicast DNS-SD and mDNS query requests. The socket should have been opened
 //! on port MDNS_PORT using one of the mdns open or setup socket functions. Buffer must be 32 bit
 //! aligned. Parsing is stopped when callback function returns non-zero. Returns the number of
 //! queries parsed.
-static size_t
+static MDNS_MAYBE_UNUSED size_t
 mdns_socket_listen(int sock, void* buffer, size_t capacity, mdns_record_callback_fn callback,
                    void* user_data);
 
+//! Listen for incoming multicast DNS-SD and mDNS query requests, reading up to buffer_count
+//! datagrams in one call. Each buffer must be 32 bit aligned and hold capacity bytes. On Linux the
+//! datagrams are read with recvmmsg (requires _GNU_SOURCE), otherwise with repeated recvfrom calls
+//! until no more data is pending. A non-zero return from the callback stops parsing of the current
+//! datagram only. Returns the total number of queries parsed in all datagrams.
+static MDNS_MAYBE_UNUSED size_t
+mdns_socket_listen_batch(int sock, void** buffers, size_t buffer_count, size_t capacity,
+                         mdns_record_callback_fn callback, void* user_data);
+
+//! Parse a datagram already received on a socket opened on port MDNS_PORT, as done by
+//! mdns_socket_listen. Use this when the data is read by a custom transport. Returns the number of
+//! queries parsed.
+static MDNS_MAYBE_UNUSED size_t
+mdns_listen_parse(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer,
+                  size_t size, mdns_record_callback_fn callback, void* user_data);
+
+//! Parse the questions of a query already parsed with mdns_message_parse, as done by
+//! mdns_listen_parse. Use this to parse a datagram once for both its questions and its known
+//! answers, see mdns_known_answer_filter_message. Returns the number of queries parsed.
+static MDNS_MAYBE_UNUSED size_t
+mdns_listen_message(int sock, const struct sockaddr* from, size_t addrlen,
+                    const mdns_message_t* message, mdns_record_callback_fn callback,
+                    void* user_data);
+
+//! Receive up to buffer_count datagrams like mdns_socket_listen_batch, and pass each datagram to
+//! the given parse function with the callback, user data and query ID. Use this to handle whole
+//! datagrams, for example to hold queries with the TC bit set, see mdns_response_scheduler_hold.
+//! Returns the total number of records parsed.
+static MDNS_MAYBE_UNUSED size_t
+mdns_recv_batch(int sock, void** buffers, size_t buffer_count, size_t capacity,
+                mdns_datagram_parse_fn parse, mdns_record_callback_fn callback, void* user_data,
+                int query_id);
+
 //! Send a multicast DNS-SD reqeuest on the given socket to discover available services. Returns 0
 //! on success, or <0 if error.
-static int
+static MDNS_MAYBE_UNUSED int
 mdns_discovery_send(int sock);
 
 //! Recieve unicast responses to a DNS-SD sent with mdns_discovery_send. Any data will be piped to
 //! the given callback for parsing. Buffer must be 32 bit aligned. Parsing is stopped when callback
 //! function returns non-zero. Returns the number of responses parsed.
-static size_t
+static MDNS_MAYBE_UNUSED size_t
 mdns_discovery_recv(int sock, void* buffer, size_t capacity, mdns_record_callback_fn callback,
                     void* user_data);
 
+//! Recieve unicast responses to a DNS-SD sent with mdns_discovery_send, reading up to buffer_count
+//! datagrams in one call. See mdns_socket_listen_batch for details on the buffers. Returns the
+//! total number of responses parsed in all datagrams.
+static MDNS_MAYBE_UNUSED size_t
+mdns_discovery_recv_batch(int sock, void** buffers, size_t buffer_count, size_t capacity,
+                          mdns_record_callback_fn callback, void* user_data);
+
+//! Parse a datagram already received as a response to a DNS-SD sent with mdns_discovery_send, as
+//! done by mdns_discovery_recv. Returns the number of responses parsed.
+static MDNS_MAYBE_UNUSED size_t
+mdns_discovery_parse(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer,
+                     size_t size, mdns_record_callback_fn callback, void* user_data);
+
 //! Send a multicast mDNS query on the given socket for the given service name. The supplied buffer
 //! will be used to build the query packet and must be 32 bit aligned. The query ID can be set to
 //! non-zero to filter responses, however the RFC states that the query ID SHOULD be set to 0 for
 //! multicast queries. The query will request a unicast response if the socket is bound to an
 //! ephemeral port, or a multicast response if the socket is bound to mDNS port 5353. Returns the
 //! used query ID, or <0 if error.
-static int
+static MDNS_MAYBE_UNUSED int
 mdns_query_send(int sock, mdns_record_type_t type, const char* name, size_t length, void* buffer,
                 size_t capacity, uint16_t query_id);
 
+//! Send a multicast mDNS query like mdns_query_send, listing the records in the cache matching the
+//! question as known answers so responders do not send them again (RFC 6762 section 7.1). Records
+//! with less than half of their TTL remaining are not listed. When the known answers do not fit in
+//! one packet of at most MDNS_PACKET_SIZE_MAX bytes, they continue in packets without questions and
+//! all packets but the last have the TC bit set (RFC 6762 section 7.2). Returns the used query ID,
+//! or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_query_send_known_answers(int sock, mdns_record_type_t type, const char* name, size_t length,
+                              void* buffer, size_t capacity, uint16_t query_id,
+                              const mdns_cache_t* cache, uint64_t now);
+
+//! Send a multicast mDNS query with all the given questions in one packet, like mdns_query_send
+//! for each question, for example the SRV, TXT, A and AAAA records to resolve a service instance.
+//! Names shared between questions are compressed. Returns the used query ID, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_multiquery_send(int sock, const mdns_query_t* query, size_t count, void* buffer,
+                     size_t capacity, uint16_t query_id);
+
+//! Send a multicast mDNS query with all the given questions in one packet, listing the records in
+//! the cache matching any of the questions as known answers like mdns_query_send_known_answers. The
+//! cache can be null to send no known answers. Returns the used query ID, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_multiquery_send_known_answers(int sock, const mdns_query_t* query, size_t count,
+                                   void* buffer, size_t capacity, uint16_t query_id,
+                                   const mdns_cache_t* cache, uint64_t now);
+
 //! Receive unicast responses to a mDNS query sent with mdns_discovery_recv, optionally filtering
 //! out any responses not matching the given query ID. Set the query ID to 0 to parse all responses,
 //! even if it is not matching the query ID set in a specific query. Any data will be piped to the
 //! given callback for parsing. Buffer must be 32 bit aligned. Parsing is stopped when callback
 //! function returns non-zero. Returns the number of responses parsed.
-static size_t
+static MDNS_MAYBE_UNUSED size_t
 mdns_query_recv(int sock, void* buffer, size_t capacity, mdns_record_callback_fn callback,
                 void* user_data, int query_id);
 
+//! Receive unicast responses to a mDNS query, reading up to buffer_count datagrams in one call.
+//! See mdns_socket_listen_batch for details on the buffers and mdns_query_recv for the query ID
+//! filtering. Returns the total number of responses parsed in all datagrams.
+static MDNS_MAYBE_UNUSED size_t
+mdns_query_recv_batch(int sock, void** buffers, size_t buffer_count, size_t capacity,
+                      mdns_record_callback_fn callback, void* user_data, int query_id);
+
+//! Parse a datagram already received as a response to a mDNS query, as done by mdns_query_recv.
+//! Returns the number of responses parsed.
+static MDNS_MAYBE_UNUSED size_t
+mdns_query_parse(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer,
+                 size_t size, mdns_record_callback_fn callback, void* user_data, int query_id);
+
 //! Send a variable unicast mDNS query answer to any question with variable number of records to the
 //! given address. Use the top bit of the query class field (MDNS_UNICAST_RESPONSE) in the query
 //! recieved to determine if the answer should be sent unicast (bit set) or multicast (bit not set).
 //! Buffer must be 32 bit aligned. The record type and name should match the data from the query
 //! recieved. Returns 0 if success, or <0 if error.
-static int
+static MDNS_MAYBE_UNUSED int
 mdns_query_answer_unicast(int sock, const void* address, size_t address_size, void* buffer,
                           size_t capacity, uint16_t query_id, mdns_record_type_t record_type,
                           const char* name, size_t name_length, mdns_record_t answer,
@@ -258,7 +983,7 @@ mdns_query_answer_unicast(int sock, const void* address, size_t address_size, vo
 //! the top bit of the query class field (MDNS_UNICAST_RESPONSE) in the query recieved to determine
 //! if the answer should be sent unicast (bit set) or multicast (bit not set). Buffer must be 32 bit
 //! aligned. Returns 0 if success, or <0 if error.
-static int
+static MDNS_MAYBE_UNUSED int
 mdns_query_answer_multicast(int sock, void* buffer, size_t capacity, mdns_record_t answer,
                             mdns_record_t* authority, size_t authority_count,
                             mdns_record_t* additional, size_t additional_count);
@@ -266,39 +991,735 @@ mdns_query_answer_multicast(int sock, void* buffer, size_t capacity, mdns_record
 //! Send a variable multicast mDNS announcement (as an unsolicited answer) with variable number of
 //! records.Buffer must be 32 bit aligned. Returns 0 if success, or <0 if error. Use this on service
 //! startup to announce your instance to the local network.
-static int
+static MDNS_MAYBE_UNUSED int
 mdns_announce_multicast(int sock, void* buffer, size_t capacity, mdns_record_t answer,
                         mdns_record_t* authority, size_t authority_count, mdns_record_t* additional,
                         size_t additional_count);
 
+//! Build a unicast mDNS query answer in the same way as mdns_query_answer_unicast, without sending
+//! it. Returns the size of the packet, or 0 if error.
+static MDNS_MAYBE_UNUSED size_t
+mdns_query_answer_unicast_build(void* buffer, size_t capacity, uint16_t query_id,
+                                mdns_record_type_t record_type, const char* name,
+                                size_t name_length, mdns_record_t answer,
+                                mdns_record_t* authority, size_t authority_count,
+                                mdns_record_t* additional, size_t additional_count);
+
+//! Build a multicast mDNS query answer in the same way as mdns_query_answer_multicast, without
+//! sending it. Returns the size of the packet, or 0 if error.
+static MDNS_MAYBE_UNUSED size_t
+mdns_query_answer_multicast_build(void* buffer, size_t capacity, mdns_record_t answer,
+                                  mdns_record_t* authority, size_t authority_count,
+                                  mdns_record_t* additional, size_t additional_count);
+
+//! Build a multicast mDNS announcement in the same way as mdns_announce_multicast, without sending
+//! it. Returns the size of the packet, or 0 if error.
+static MDNS_MAYBE_UNUSED size_t
+mdns_announce_multicast_build(void* buffer, size_t capacity, mdns_record_t answer,
+                              mdns_record_t* authority, size_t authority_count,
+                              mdns_record_t* additional, size_t additional_count);
+
+//! Build a multicast mDNS query answer once and send it on the sockets and interfaces of several
+//! send contexts, see mdns_multicast_send_contexts. Returns the number of contexts the answer was
+//! sent on.
+static MDNS_MAYBE_UNUSED size_t
+mdns_query_answer_multicast_contexts(const mdns_socket_context_t* contexts, size_t count,
+                                     void* buffer, size_t capacity, mdns_record_t answer,
+                                     mdns_record_t* authority, size_t authority_count,
+                                     mdns_record_t* additional, size_t additional_count);
+
+//! Build a multicast mDNS announcement once and send it on the sockets and interfaces of several
+//! send contexts, see mdns_multicast_send_contexts. Use this to announce on all interfaces after
+//! start or a network change. Returns the number of contexts the announcement was sent on.
+static MDNS_MAYBE_UNUSED size_t
+mdns_announce_multicast_contexts(const mdns_socket_context_t* contexts, size_t count,
+                                 void* buffer, size_t capacity, mdns_record_t answer,
+                                 mdns_record_t* authority, size_t authority_count,
+                                 mdns_record_t* additional, size_t additional_count);
+
+// Packet builder functions
+
+//! Begin building a packet in the supplied buffer with the given query ID and header flags, like
+//! 0x8400 for a response. Questions and records are added section by section in order, and the
+//! builder tracks the record count of each section. The builder refers to itself for name
+//! compression and must not be copied once begun. Returns 0 on success, or <0 if the buffer is too
+//! small for the header.
+static MDNS_MAYBE_UNUSED int
+mdns_packet_builder_begin(mdns_packet_builder_t* builder, void* buffer, size_t capacity,
+                          uint16_t query_id, uint16_t flags);
+
+//! Add a question to the packet, before any record is added. Returns 0 on success, or <0 if the
+//! question does not fit, in which case the packet is unchanged.
+static MDNS_MAYBE_UNUSED int
+mdns_packet_builder_add_question(mdns_packet_builder_t* builder, mdns_record_type_t type,
+                                 const char* name, size_t length, uint16_t rclass);
+
+//! Get the exact size in bytes the record would take if added next to the packet, with its names
+//! compressed against the names already in the packet. Dotted names are compiled once per packet
+//! and shared with adding the record, but the compression lookups are done again when adding, so
+//! sizing costs about half as much as adding. Use it to decide where to break a packet, not ahead
+//! of every record; adding a record that does not fit fails and leaves the packet unchanged.
+//! Returns 0 if a name of the record is invalid.
+static MDNS_MAYBE_UNUSED size_t
+mdns_packet_builder_record_size(const mdns_packet_builder_t* builder,
+                                const mdns_record_t* record);
+
+//! Get the number of bytes left in the buffer of the packet
+static MDNS_MAYBE_UNUSED size_t
+mdns_packet_builder_remain(const mdns_packet_builder_t* builder);
+
+//! Add a record to the given section of the packet, MDNS_ENTRYTYPE_ANSWER, MDNS_ENTRYTYPE_AUTHORITY
+//! or MDNS_ENTRYTYPE_ADDITIONAL, which must not come before the section of records already added.
+//! Returns 0 on success, or <0 if the record does not fit, in which case the packet is unchanged.
+static MDNS_MAYBE_UNUSED int
+mdns_packet_builder_add_record(mdns_packet_builder_t* builder, mdns_entry_type_t section,
+                               const mdns_record_t* record, uint16_t rclass, uint32_t ttl);
+
+//! Add records to the given section of the packet like mdns_packet_builder_add_record, coalescing
+//! TXT records with the same name into one record like the answer functions. Returns 0 on success,
+//! or <0 if the records do not fit, in which case the packet is unchanged.
+static MDNS_MAYBE_UNUSED int
+mdns_packet_builder_add_records(mdns_packet_builder_t* builder, mdns_entry_type_t section,
+                                const mdns_record_t* records, size_t record_count, uint16_t rclass,
+                                uint32_t ttl);
+
+//! Finish the packet by writing the section counts to the header. More records can be added
+//! afterwards, as long as the packet is finished again. Returns the size of the packet.
+static MDNS_MAYBE_UNUSED size_t
+mdns_packet_builder_finish(mdns_packet_builder_t* builder);
+
+// Multi-packet functions
+
+//! Build a multicast mDNS answer with the given record class, split over as many packets of at most
+//! max_size bytes as needed, or MDNS_PACKET_SIZE_MAX if zero, and pass each packet built in the
+//! buffer to the send callback. Answers are split in order. Each packet carries the authority and
+//! additional records related to its answers, like the SRV and TXT records of a PTR answer and the
+//! address records of a SRV record, as far as they fit. Unrelated records are only added to the
+//! first packet. The TC bit is not set, as required for responses. At most MDNS_SPLIT_EXTRA_MAX
+//! authority and additional records are supported. Returns the number of packets sent, or <0 if
+//! an answer does not fit in a packet, there are too many authority and additional records, or the
+//! callback returns non-zero.
+static MDNS_MAYBE_UNUSED int
+mdns_answer_multicast_split(void* buffer, size_t capacity, size_t max_size, uint16_t rclass,
+                            mdns_record_t* answers, size_t answer_count, mdns_record_t* authority,
+                            size_t authority_count, mdns_record_t* additional,
+                            size_t additional_count, mdns_packet_send_fn send, void* user_data);
+
+//! Build a unicast mDNS query answer like mdns_query_answer_unicast_build, split over packets like
+//! mdns_answer_multicast_split. Each packet repeats the question. Returns the number of packets
+//! sent, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_query_answer_unicast_split(void* buffer, size_t capacity, size_t max_size, uint16_t query_id,
+                                mdns_record_type_t record_type, const char* name,
+                                size_t name_length, mdns_record_t* answers, size_t answer_count,
+                                mdns_record_t* authority, size_t authority_count,
+                                mdns_record_t* additional, size_t additional_count,
+                                mdns_packet_send_fn send, void* user_data);
+
+//! Send a unicast mDNS query answer with any number of answers to the given address, split over
+//! packets of at most MDNS_PACKET_SIZE_MAX bytes, see mdns_query_answer_unicast_split. Returns the
+//! number of packets sent, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_query_answer_unicast_packets(int sock, const void* address, size_t address_size,
+                                  void* buffer, size_t capacity, uint16_t query_id,
+                                  mdns_record_type_t record_type, const char* name,
+                                  size_t name_length, mdns_record_t* answers, size_t answer_count,
+                                  mdns_record_t* authority, size_t authority_count,
+                                  mdns_record_t* additional, size_t additional_count);
+
+//! Send a multicast mDNS query answer with any number of answers, split over packets of at most
+//! MDNS_PACKET_SIZE_MAX bytes, see mdns_answer_multicast_split. Returns the number of packets sent,
+//! or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_query_answer_multicast_packets(int sock, void* buffer, size_t capacity,
+                                    mdns_record_t* answers, size_t answer_count,
+                                    mdns_record_t* authority, size_t authority_count,
+                                    mdns_record_t* additional, size_t additional_count);
+
+//! Send a multicast mDNS announcement with any number of answers, split over packets of at most
+//! MDNS_PACKET_SIZE_MAX bytes, see mdns_answer_multicast_split. Returns the number of packets sent,
+//! or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_announce_multicast_packets(int sock, void* buffer, size_t capacity, mdns_record_t* answers,
+                                size_t answer_count, mdns_record_t* authority,
+                                size_t authority_count, mdns_record_t* additional,
+                                size_t additional_count);
+
+// Response cache functions
+
+//! Initialize a cache of fully encoded response packets, using the supplied array of entries as a
+//! hash table and the supplied storage for the packet data. Responses are keyed on the question
+//! name, record type, unicast or multicast response and address family of the querier. The cache
+//! is cleared when full, and must be cleared with mdns_response_cache_clear whenever the records
+//! answered change.
+static MDNS_MAYBE_UNUSED void
+mdns_response_cache_initialize(mdns_response_cache_t* cache, mdns_response_cache_entry_t* entries,
+                               size_t capacity, void* storage, size_t storage_capacity);
+
+//! Remove all responses from the cache
+static MDNS_MAYBE_UNUSED void
+mdns_response_cache_clear(mdns_response_cache_t* cache);
+
+//! Find a cached response to the question with the name at the given offset in the buffer.
+//! Returns the cache entry, or null if not found.
+static MDNS_MAYBE_UNUSED const mdns_response_cache_entry_t*
+mdns_response_cache_find(const mdns_response_cache_t* cache, const void* buffer, size_t size,
+                         size_t name_offset, uint16_t rtype, int unicast, int family);
+
+//! Store an encoded response packet to the question with the name at the given offset in the
+//! buffer. Returns 0 if success, or <0 if the response does not fit in the cache.
+static MDNS_MAYBE_UNUSED int
+mdns_response_cache_store(mdns_response_cache_t* cache, const void* buffer, size_t size,
+                          size_t name_offset, uint16_t rtype, int unicast, int family,
+                          const void* packet, size_t packet_size);
+
+//! Get the encoded response packet of a cache entry
+static MDNS_MAYBE_UNUSED const void*
+mdns_response_cache_packet(const mdns_response_cache_t* cache,
+                           const mdns_response_cache_entry_t* entry);
+
+//! Copy a cached response to the supplied buffer with the given query ID patched in, for sending
+//! with a custom transport. Returns the size of the response, or 0 if it does not fit.
+static MDNS_MAYBE_UNUSED size_t
+mdns_response_cache_build(const mdns_response_cache_t* cache,
+                          const mdns_response_cache_entry_t* entry, uint16_t query_id,
+                          void* buffer, size_t capacity);
+
+//! Send a cached response. Unicast responses are copied to the supplied buffer to patch in the
+//! query ID and sent to the given address. Multicast responses are sent directly from the cache.
+//! Returns 0 if success, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_response_cache_send(int sock, const void* address, size_t address_size,
+                         const mdns_response_cache_t* cache,
+                         const mdns_response_cache_entry_t* entry, uint16_t query_id,
+                         void* buffer, size_t capacity);
+
+// Record store functions
+
+//! Initialize a store of records answered by a responder, using the supplied arrays of entries and
+//! buckets. Records are indexed by a case insensitive hash of the record name, so questions can be
+//! resolved directly from the name in a received datagram.
+static MDNS_MAYBE_UNUSED void
+mdns_record_store_initialize(mdns_record_store_t* store, mdns_record_store_entry_t* entries,
+                             size_t capacity, size_t* buckets, size_t bucket_count);
+
+//! Remove all records from the store
+static MDNS_MAYBE_UNUSED void
+mdns_record_store_clear(mdns_record_store_t* store);
+
+//! Add a copy of a record to the store. The name and data strings in the record must stay valid
+//! while the store is used. Returns 0 if success, or <0 if the store is full.
+static MDNS_MAYBE_UNUSED int
+mdns_record_store_add(mdns_record_store_t* store, const mdns_record_t* record);
+
+//! Find the records answering a question with the name at the given offset in the buffer and the
+//! given record type, where MDNS_RECORDTYPE_ANY matches all records with the name. The records are
+//! copied in the order they were added. Returns the number of records stored in the array.
+static MDNS_MAYBE_UNUSED size_t
+mdns_record_store_find(const mdns_record_store_t* store, const void* buffer, size_t size,
+                       size_t name_offset, uint16_t rtype, mdns_record_t* records,
+                       size_t capacity);
+
+//! Select the additional records recommended for the given answers, the SRV and TXT records for the
+//! instance of a PTR record, the A and AAAA records for the target of a SRV record, and the other
+//! address records for the name of an A or AAAA record. Records already in the answers are
+//! skipped. Returns the number of records stored in the array.
+static MDNS_MAYBE_UNUSED size_t
+mdns_record_store_additional(const mdns_record_store_t* store, const mdns_record_t* answers,
+                             size_t answer_count, mdns_record_t* additional, size_t capacity);
+
+// Question filter functions
+
+//! Initialize a bloom filter of the names and record types owned by a responder, using the supplied
+//! array of count 64-bit words. Size the array for about 16 bits per owned name and record type for
+//! a false positive rate of about one percent. A filter without storage passes all questions.
+static MDNS_MAYBE_UNUSED void
+mdns_name_filter_initialize(mdns_name_filter_t* filter, uint64_t* bits, size_t count);
+
+//! Add an owned name and record type to the filter. The name hash is mdns_name_hash_string of the
+//! dotted name, or mdns_name_t::hash of the compiled name. Questions of type MDNS_RECORDTYPE_ANY
+//! for the name also pass the filter.
+static MDNS_MAYBE_UNUSED void
+mdns_name_filter_add(mdns_name_filter_t* filter, uint64_t name_hash, uint16_t rtype);
+
+//! Add the names and record types of all records in a record store to the filter
+static MDNS_MAYBE_UNUSED void
+mdns_name_filter_add_store(mdns_name_filter_t* filter, const mdns_record_store_t* store);
+
+//! Check if a question with the name at the given offset in the buffer and the given record type
+//! may be owned. Returns 0 if the question is certainly not owned, 1 if it may be owned.
+static MDNS_MAYBE_UNUSED int
+mdns_name_filter_match(const mdns_name_filter_t* filter, const void* buffer, size_t size,
+                       size_t name_offset, uint16_t rtype);
+
+//! Record callback dropping the questions not passing the filter of the mdns_listen_filter_t given
+//! as user data, and passing all other questions and records to the callback and user data of the
+//! listen filter. Pass it as callback to the listen functions to drop questions for names and
+//! types that are not owned after hashing the name, without calling the responder callback.
+static MDNS_MAYBE_UNUSED int
+mdns_listen_filter_callback(int sock, const struct sockaddr* from, size_t addrlen,
+                            mdns_entry_type_t entry, uint16_t query_id, uint16_t rtype,
+                            uint16_t rclass, uint32_t ttl, const void* data, size_t size,
+                            size_t name_offset, size_t name_length, size_t record_offset,
+                            size_t record_length, void* user_data);
+
+// Known answer suppression functions
+
+//! Remove the records listed as known answers in a received query from the given array of answer
+//! records (RFC 6762 section 7.1). A record is only removed if the known answer has at least half
+//! of the given TTL remaining, the TTL the answer would be sent with. TXT records with the same
+//! name are sent as one record, and are removed together only if the known answer has exactly
+//! their strings. Returns the number of records remaining, the order of the remaining records is
+//! kept.
+static MDNS_MAYBE_UNUSED size_t
+mdns_known_answer_filter(const void* buffer, size_t size, mdns_record_t* records, size_t count,
+                         uint32_t ttl);
+
+//! Remove the records listed as known answers in a query already parsed with mdns_message_parse,
+//! like mdns_known_answer_filter, without parsing the datagram again for every question. For a
+//! query continued in packets with the TC bit set, call it with each packet. Returns the number of
+//! records remaining.
+static MDNS_MAYBE_UNUSED size_t
+mdns_known_answer_filter_message(const mdns_message_t* message, mdns_record_t* records,
+                                 size_t count, uint32_t ttl);
+
+// Response scheduler functions
+
+//! Initialize a scheduler aggregating multicast answers into one response, using the supplied
+//! arrays to hold the pending answer and additional records, and the supplied arena to hold copies
+//! of their names and TXT strings until the response is sent.
+static MDNS_MAYBE_UNUSED void
+mdns_response_scheduler_initialize(mdns_response_scheduler_t* scheduler, mdns_record_t* answers,
+                                   size_t answer_capacity, mdns_record_t* additional,
+                                   size_t additional_capacity, void* arena, size_t arena_capacity);
+
+//! Add answers and additional records to the pending response, skipping duplicates and additional
+//! records already pending as answers. Records are duplicates if they have the same type and data
+//! and the same name compared case insensitively, whatever strings they point to. The names and TXT
+//! strings of the records added are copied to the arena of the scheduler, so the given records and
+//! strings only need to live for the duration of the call. Compiled names are copied in dotted
+//! form. The response is due at the given time plus the given delay in milliseconds. Answers
+//! joining a pending response can postpone it, up to MDNS_RESPONSE_DELAY_MAX milliseconds after the
+//! first pending answer was added. Use a random delay between MDNS_RESPONSE_DELAY_MIN and
+//! MDNS_RESPONSE_DELAY_MAX for questions answered with shared records, and no delay for unique
+//! records. The time can have any origin as long as it is monotonic and in milliseconds. Returns 0
+//! if success, or <0 if the records or their strings do not fit, in which case nothing is added and
+//! the pending response should be sent first.
+static MDNS_MAYBE_UNUSED int
+mdns_response_scheduler_add(mdns_response_scheduler_t* scheduler, const mdns_record_t* answers,
+                            size_t answer_count, const mdns_record_t* additional,
+                            size_t additional_count, uint64_t now, unsigned int delay);
+
+//! Supply storage for holding queries with the TC bit set, see mdns_response_scheduler_hold. The
+//! storage must be 32 bit aligned and should hold a few packets of MDNS_PACKET_SIZE_MAX bytes.
+//! Without storage no query is held.
+static MDNS_MAYBE_UNUSED void
+mdns_response_scheduler_initialize_hold(mdns_response_scheduler_t* scheduler, void* buffer,
+                                        size_t capacity);
+
+//! Hold a received query with the TC bit set, and the continuation packets without questions from
+//! the same querier, so that its questions are answered once all of its known answers have arrived
+//! (RFC 6762 section 7.2). Call it with every datagram received on a socket answering queries,
+//! before parsing the questions. The query is held until the given time plus the given delay in
+//! milliseconds, use a random delay between MDNS_RESPONSE_HOLD_MIN and MDNS_RESPONSE_HOLD_MAX. One
+//! query is held at a time. A query with the TC bit set arriving while another querier is held is
+//! not held, and continuation packets not fitting in the storage are dropped, at worst sending
+//! answers the querier already knows. Returns 1 if the datagram is held and must not be parsed
+//! now, or 0 if it should be parsed now.
+static MDNS_MAYBE_UNUSED int
+mdns_response_scheduler_hold(mdns_response_scheduler_t* scheduler, const struct sockaddr* from,
+                             size_t addrlen, const void* buffer, size_t size, uint64_t now,
+                             unsigned int delay);
+
+//! Release the held query once it is due, parsing the query and its continuation packets into the
+//! supplied messages, which share the supplied record array. Parse the questions of the first
+//! message with mdns_listen_message from the querier address stored in hold_from and hold_addrlen,
+//! and filter the answers with mdns_known_answer_filter_message for every message. The messages
+//! refer to the storage of the scheduler and are valid until the next call to
+//! mdns_response_scheduler_hold. Returns the number of messages, or 0 if no held query is due.
+static MDNS_MAYBE_UNUSED size_t
+mdns_response_scheduler_release(mdns_response_scheduler_t* scheduler, uint64_t now,
+                                mdns_message_t* messages, size_t message_capacity,
+                                mdns_message_record_t* records, size_t record_capacity);
+
+//! Get the number of milliseconds until the pending response or the held query is due, 0 if due,
+//! or <0 if there is no pending response and no held query
+static MDNS_MAYBE_UNUSED int
+mdns_response_scheduler_timeout(const mdns_response_scheduler_t* scheduler, uint64_t now);
+
+//! Build the pending response as one multicast packet with all answers and additional records in
+//! the supplied buffer, for sending with a custom transport on the interface set in the scheduler,
+//! and clear the pending response. Returns the size of the packet, or 0 if nothing is pending or
+//! the packet does not fit.
+static MDNS_MAYBE_UNUSED size_t
+mdns_response_scheduler_build(mdns_response_scheduler_t* scheduler, void* buffer,
+                              size_t capacity);
+
+//! Build the pending response split over packets of at most max_size bytes, see
+//! mdns_answer_multicast_split, pass each packet to the send callback, and clear the pending
+//! response. Returns the number of packets sent, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_response_scheduler_split(mdns_response_scheduler_t* scheduler, void* buffer, size_t capacity,
+                              size_t max_size, mdns_packet_send_fn send, void* user_data);
+
+//! Send the pending response on the interface set in the scheduler, split over packets of at most
+//! MDNS_PACKET_SIZE_MAX bytes if the answers and additional records do not fit in one, and clear
+//! the pending response. Returns 0 if success, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_response_scheduler_send(int sock, mdns_response_scheduler_t* scheduler, void* buffer,
+                             size_t capacity);
+
+// Record cache functions
+
+//! Initialize a cache of received records, using the supplied arrays of entries and buckets and the
+//! supplied arena for the record data. The arena must be 64 bit aligned. Records are indexed by a
+//! case insensitive hash of the record name, and only A, AAAA, PTR, SRV and TXT records are cached.
+static MDNS_MAYBE_UNUSED void
+mdns_cache_initialize(mdns_cache_t* cache, mdns_cache_entry_t* entries, size_t capacity,
+                      size_t* buckets, size_t bucket_count, void* arena, size_t arena_capacity);
+
+//! Remove all records from the cache
+static MDNS_MAYBE_UNUSED void
+mdns_cache_clear(mdns_cache_t* cache);
+
+//! Insert a received record, taking the same arguments as the record callback. Names in the record
+//! are stored uncompressed so the record data can be parsed with the parse record functions. A
+//! record already cached gets its TTL refreshed, and a record with TTL 0 expires one second later.
+//! A record with the cache flush bit set makes other records with the same name, type and class
+//! received more than one second earlier expire one second later. The time is in milliseconds and
+//! must be monotonic.
+//! Expired records are removed when the cache is full. Returns 0 if success, or <0 if the record
+//! is invalid or the cache is full.
+static MDNS_MAYBE_UNUSED int
+mdns_cache_insert(mdns_cache_t* cache, const struct sockaddr* from, size_t addrlen,
+                  const void* buffer, size_t size, size_t name_offset, uint16_t rtype,
+                  uint16_t rclass, uint32_t ttl, size_t record_offset, size_t record_length,
+                  uint64_t now);
+
+//! Insert all answer, authority and additional records in a parsed message. Returns the number of
+//! records inserted.
+static MDNS_MAYBE_UNUSED size_t
+mdns_cache_insert_message(mdns_cache_t* cache, const struct sockaddr* from, size_t addrlen,
+                          const mdns_message_t* message, uint64_t now);
+
+//! Remove expired records and compact the arena. Returns the number of records removed.
+static MDNS_MAYBE_UNUSED size_t
+mdns_cache_expire(mdns_cache_t* cache, uint64_t now);
+
+//! Look up cached records with the given name and record type, where MDNS_RECORDTYPE_ANY matches
+//! all records with the name. Records are passed to the callback as answers received from the
+//! cached source address, with the remaining TTL and the cache arena as data buffer. The lookup is
+//! stopped when the callback returns non-zero. Returns the number of records passed to the
+//! callback.
+static MDNS_MAYBE_UNUSED size_t
+mdns_cache_query(const mdns_cache_t* cache, const char* name, size_t length, uint16_t rtype,
+                 uint64_t now, mdns_record_callback_fn callback, void* user_data);
+
+// Continuous query functions
+
+//! Initialize a scheduler of continuous questions, queried repeatedly to keep the answers in the
+//! record cache up to date (RFC 6762 section 5.2), using the supplied array of entries
+static MDNS_MAYBE_UNUSED void
+mdns_query_scheduler_initialize(mdns_query_scheduler_t* scheduler,
+                                mdns_query_scheduler_entry_t* entries, size_t capacity);
+
+//! Add a continuous question with the given record type and name. The first query is due at the
+//! given time plus the given delay in milliseconds, use a random delay between MDNS_QUERY_DELAY_MIN
+//! and MDNS_QUERY_DELAY_MAX. The interval to the next query starts at MDNS_QUERY_INTERVAL_MIN and
+//! doubles after every query up to MDNS_QUERY_INTERVAL_MAX. Adding a question already in the
+//! scheduler restarts its queries. The name is not copied and must stay valid until the question is
+//! removed. Returns 0 if success, or <0 if the name is invalid or the scheduler is full.
+static MDNS_MAYBE_UNUSED int
+mdns_query_scheduler_add(mdns_query_scheduler_t* scheduler, mdns_record_type_t type,
+                         const char* name, size_t length, uint64_t now, unsigned int delay);
+
+//! Remove a continuous question. Returns 0 if success, or <0 if the question is not in the
+//! scheduler.
+static MDNS_MAYBE_UNUSED int
+mdns_query_scheduler_remove(mdns_query_scheduler_t* scheduler, mdns_record_type_t type,
+                            const char* name, size_t length);
+
+//! Get the number of milliseconds until a query is due, 0 if due, or <0 if there are no questions.
+//! Besides the interval of each question, a query is due to refresh a record in the cache answering
+//! a question at 80, 85, 90 and 95 percent of its TTL, plus a variation of up to 2 percent. The
+//! cache can be null.
+static MDNS_MAYBE_UNUSED int
+mdns_query_scheduler_timeout(const mdns_query_scheduler_t* scheduler, const mdns_cache_t* cache,
+                             uint64_t now);
+
+//! Collect the questions due for a query, at most capacity, with the question class of each in the
+//! rclass array if not null, and advance their schedule. Questions not collected stay due. The
+//! first query of a question asks for a unicast response, later queries ask for multicast responses
+//! (RFC 6762 section 5.4), which are only received by sockets bound to MDNS_PORT. Send the
+//! questions with mdns_query_scheduler_send_due on every socket bound to MDNS_PORT, for example the
+//! sockets of each interface. Returns the number of questions collected.
+static MDNS_MAYBE_UNUSED size_t
+mdns_query_scheduler_due(mdns_query_scheduler_t* scheduler, mdns_cache_t* cache, uint64_t now,
+                         mdns_query_t* query, uint16_t* rclass, size_t capacity);
+
+//! Send questions collected with mdns_query_scheduler_due on the given socket, which must be bound
+//! to MDNS_PORT to receive the multicast responses. Questions are sent in one packet when they fit,
+//! with the given question classes and the records in the cache answering them as known answers
+//! like mdns_multiquery_send_known_answers. The cache can be null. Returns 0 if success, or <0 if
+//! error.
+static MDNS_MAYBE_UNUSED int
+mdns_query_scheduler_send_due(int sock, const mdns_query_t* query, const uint16_t* rclass,
+                              size_t count, void* buffer, size_t capacity,
+                              const mdns_cache_t* cache, uint64_t now);
+
+//! Send the questions due for a query on the given socket with mdns_query_scheduler_due and
+//! mdns_query_scheduler_send_due. The socket must be bound to MDNS_PORT to receive the multicast
+//! responses. The cache can be null. Returns the number of questions sent, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_query_scheduler_send(int sock, mdns_query_scheduler_t* scheduler, mdns_cache_t* cache,
+                          void* buffer, size_t capacity, uint64_t now);
+
+// Event loop engine functions
+
+//! Initialize an event loop engine dispatching readable sockets and expired timers, using the
+//! supplied arrays of sockets and timers. Sockets are waited on with epoll where available,
+//! otherwise with poll. Returns 0 if success, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_engine_initialize(mdns_engine_t* engine, mdns_engine_socket_t* sockets,
+                       size_t socket_capacity, mdns_engine_timer_t* timers,
+                       size_t timer_capacity);
+
+//! Close all sockets added to the engine and release the system resources of the engine
+static MDNS_MAYBE_UNUSED void
+mdns_engine_finalize(mdns_engine_t* engine);
+
+//! Add a socket to the engine, which takes ownership of the socket. The callback is called when
+//! data is available to read on the socket. Returns 0 if success, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_engine_add_socket(mdns_engine_t* engine, int sock, mdns_engine_socket_fn callback,
+                       void* user_data);
+
+//! Remove a socket from the engine without closing it. Returns 0 if success, or <0 if the socket
+//! was not added.
+static MDNS_MAYBE_UNUSED int
+mdns_engine_remove_socket(mdns_engine_t* engine, int sock);
+
+//! Add a one-shot timer calling the callback once the given time in milliseconds (as returned by
+//! mdns_engine_time) has passed. Use timers for retransmits, announcements and record expiry. A
+//! callback can add the timer again to repeat it. Returns 0 if success, or <0 if full.
+static MDNS_MAYBE_UNUSED int
+mdns_engine_add_timer(mdns_engine_t* engine, uint64_t deadline, mdns_engine_timer_fn callback,
+                      void* user_data);
+
+//! Remove all timers with the given callback and user data. Returns the number of removed timers.
+static MDNS_MAYBE_UNUSED size_t
+mdns_engine_remove_timer(mdns_engine_t* engine, mdns_engine_timer_fn callback, void* user_data);
+
+//! Wait up to the given number of milliseconds for readable sockets or the first timer, and
+//! dispatch the readable sockets and expired timers. Pass a timeout <0 to wait until a socket is
+//! readable or a timer expires. Returns the number of callbacks made, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_engine_run_once(mdns_engine_t* engine, int timeout);
+
+//! Dispatch sockets and timers until mdns_engine_stop is called from a callback, or until no
+//! sockets or timers remain. Returns 0 if stopped, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_engine_run(mdns_engine_t* engine);
+
+//! Stop mdns_engine_run after the current dispatch
+static MDNS_MAYBE_UNUSED void
+mdns_engine_stop(mdns_engine_t* engine);
+
+//! Get the current time of the monotonic clock used by the engine timers, in milliseconds
+static MDNS_MAYBE_UNUSED uint64_t
+mdns_engine_time(void);
+
+#ifdef MDNS_HAVE_IO_URING
+// io_uring transport functions
+
+//! Initialize an io_uring transport on an opened mDNS socket. Datagrams are received with a
+//! multishot receive into the supplied receive buffers, which are provided to the kernel as a
+//! buffer ring, and the number of receive buffers must be a power of two. Packets to send are
+//! copied to the supplied send buffers, at most MDNS_URING_SEND_MAX, and submitted in batches with
+//! one system call. All buffers are buffer_size bytes, which must be at least 1024. The transport
+//! does not take ownership of the socket. Returns 0 if success, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_uring_initialize(mdns_uring_t* uring, int sock, void* recv_buffers, size_t recv_count,
+                      void* send_buffers, size_t send_count, size_t buffer_size);
+
+//! Release the ring and buffer mappings of an io_uring transport
+static MDNS_MAYBE_UNUSED void
+mdns_uring_finalize(mdns_uring_t* uring);
+
+//! Submit queued sends and parse the datagrams received on the transport as incoming queries, like
+//! mdns_socket_listen, without blocking. Wait for the ring file descriptor to be readable, for
+//! example by adding it to an event loop engine. Returns the number of queries parsed.
+static MDNS_MAYBE_UNUSED size_t
+mdns_uring_listen(mdns_uring_t* uring, mdns_record_callback_fn callback, void* user_data);
+
+//! Submit queued sends and pass the datagrams received on the transport to the given parse
+//! function, like mdns_recv_batch, without blocking. The arrival interface and destination address
+//! of the datagram being parsed are in the recv_info field of the transport if the socket has
+//! packet info enabled, see mdns_socket_recv. Returns the total number of records parsed.
+static MDNS_MAYBE_UNUSED size_t
+mdns_uring_recv(mdns_uring_t* uring, mdns_datagram_parse_fn parse,
+                mdns_record_callback_fn callback, void* user_data, int query_id);
+
+//! Submit queued sends and parse the datagrams received on the transport as DNS-SD discovery
+//! responses, like mdns_discovery_recv, without blocking. Returns the number of responses parsed.
+static MDNS_MAYBE_UNUSED size_t
+mdns_uring_discovery_recv(mdns_uring_t* uring, mdns_record_callback_fn callback,
+                          void* user_data);
+
+//! Submit queued sends and parse the datagrams received on the transport as query responses, like
+//! mdns_query_recv, without blocking. Returns the number of responses parsed.
+static MDNS_MAYBE_UNUSED size_t
+mdns_uring_query_recv(mdns_uring_t* uring, mdns_record_callback_fn callback, void* user_data,
+                      int query_id);
+
+//! Queue a packet to send to the given address, copying it to a free send buffer. The packet is
+//! sent directly if all send buffers are in flight. Returns 0 if success, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_uring_send(mdns_uring_t* uring, const void* address, size_t address_size,
+                const void* buffer, size_t size);
+
+//! Queue a packet to send to the mDNS multicast group on the given interface, or the default
+//! interface of the socket if 0. Returns 0 if success, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_uring_send_multicast(mdns_uring_t* uring, const void* buffer, size_t size,
+                          unsigned int interface_index);
+
+//! Submit all queued sends with one system call. Returns 0 if success, or <0 if error.
+static MDNS_MAYBE_UNUSED int
+mdns_uring_submit(mdns_uring_t* uring);
+#endif
+
+// Name compression functions
+
+//! Initialize a string table used for name compression when building packets, using the supplied
+//! array of items as a hash table of every name suffix written to the packet. Lookups are constant
+//! time, and suffixes stay available for compression until the table is three quarters full. A zero
+//! initialized string table without items only remembers the last 16 labels written.
+static MDNS_MAYBE_UNUSED void
+mdns_string_table_initialize(mdns_string_table_t* string_table, mdns_string_table_item_t* items,
+                             size_t capacity);
+
+//! Compile a dotted name string to uncompressed wire format with precomputed label offsets and
+//! hashes. Reference the compiled name from records to avoid encoding the name string every time a
+//! record is written to a packet. Returns 0 if success, or <0 if the name is invalid or too long.
+static MDNS_MAYBE_UNUSED int
+mdns_name_compile(mdns_name_t* name, const char* str, size_t length);
+
+// Label iterator functions
+
+//! Initialize an iterator over the labels of the wire format name at the given offset in the
+//! buffer. The iterator follows name compression references and never copies label data.
+static MDNS_MAYBE_UNUSED void
+mdns_label_iterator_initialize(mdns_label_iterator_t* it, const void* buffer, size_t size,
+                               size_t offset);
+
+//! Get the next label of the name, pointing into the buffer. Returns 1 if a label was stored, 0 at
+//! the end of the name, or <0 if the name is malformed. Once the end is reached, the end field of
+//! the iterator is the offset of the first byte following the name.
+static MDNS_MAYBE_UNUSED int
+mdns_label_iterator_next(mdns_label_iterator_t* it, mdns_string_t* label);
+
+//! Hash the remaining labels of the name. For a new iterator this is the same case insensitive hash
+//! as stored in mdns_name_t::hash. Returns 0 if the name is malformed.
+static MDNS_MAYBE_UNUSED uint64_t
+mdns_label_iterator_hash(mdns_label_iterator_t* it);
+
+//! Case insensitive compare of the wire format name at the given offset in the buffer to a dotted
+//! name string, with or without the trailing dot. Returns 1 if equal, 0 if not.
+static MDNS_MAYBE_UNUSED int
+mdns_name_equal(const void* buffer, size_t size, size_t offset, const char* name, size_t length);
+
+//! Case insensitive compare of the wire format name at the given offset in the buffer to a
+//! compiled name. Returns 1 if equal, 0 if not.
+static MDNS_MAYBE_UNUSED int
+mdns_name_equal_compiled(const void* buffer, size_t size, size_t offset, const mdns_name_t* name);
+
+//! Check if the trailing labels of the wire format name at the given offset in the buffer match
+//! the dotted suffix string, for example "_tcp.local." Returns 1 if matching, 0 if not.
+static MDNS_MAYBE_UNUSED int
+mdns_name_has_suffix(const void* buffer, size_t size, size_t offset, const char* suffix,
+                     size_t length);
+
+//! Case insensitive 64-bit hash of the wire format name at the given offset in the buffer,
+//! following name compression references. The hash is the same as mdns_name_hash_string of the
+//! dotted name and as mdns_name_t::hash of the compiled name, use it as the key for dispatching
+//! questions through a hash table and verify a hit with mdns_name_equal. Returns 0 if the name is
+//! malformed.
+static MDNS_MAYBE_UNUSED uint64_t
+mdns_name_hash(const void* buffer, size_t size, size_t offset);
+
+//! Case insensitive 64-bit hash of a dotted name string, with or without the trailing dot
+static MDNS_MAYBE_UNUSED uint64_t
+mdns_name_hash_string(const char* name, size_t length);
+
+// Parse message functions
+
+//! Parse a received datagram once, validating the header and all record names, types and lengths,
+//! and store an index of the records in the supplied array. The message keeps pointers to the
+//! buffer and records array, they must stay valid while the message is used. Returns 0 if all
+//! records were indexed, 1 if the datagram was malformed or the records array was too small (the
+//! records indexed so far are still valid), or <0 if the datagram has no valid header.
+static MDNS_MAYBE_UNUSED int
+mdns_message_parse(const void* buffer, size_t size, mdns_message_t* message,
+                   mdns_message_record_t* records, size_t capacity);
+
+//! Get the number of indexed records in the given section of a parsed message
+static MDNS_MAYBE_UNUSED size_t
+mdns_message_record_count(const mdns_message_t* message, mdns_entry_type_t section);
+
+//! Get an indexed record in the given section of a parsed message, or null if out of range
+static MDNS_MAYBE_UNUSED const mdns_message_record_t*
+mdns_message_record(const mdns_message_t* message, mdns_entry_type_t section, size_t index);
+
+//! Pipe the records in the given section of a parsed message to the callback, in the same way as
+//! the receive functions do. Questions are passed with the name as record data. Parsing is stopped
+//! when callback function returns non-zero, in which case this function returns non-zero. The
+//! number of records passed to the callback is added to parsed.
+static MDNS_MAYBE_UNUSED int
+mdns_message_dispatch(int sock, const struct sockaddr* from, size_t addrlen,
+                      const mdns_message_t* message, mdns_entry_type_t section,
+                      mdns_record_callback_fn callback, void* user_data, size_t* parsed);
+
 // Parse records functions
 
 //! Parse a PTR record, returns the name in the record
-static mdns_string_t
+static MDNS_MAYBE_UNUSED mdns_string_t
 mdns_record_parse_ptr(const void* buffer, size_t size, size_t offset, size_t length,
                       char* strbuffer, size_t capacity);
 
 //! Parse a SRV record, returns the priority, weight, port and name in the record
-static mdns_record_srv_t
+static MDNS_MAYBE_UNUSED mdns_record_srv_t
 mdns_record_parse_srv(const void* buffer, size_t size, size_t offset, size_t length,
                       char* strbuffer, size_t capacity);
 
 //! Parse an A record, returns the IPv4 address in the record
-static struct sockaddr_in*
+static MDNS_MAYBE_UNUSED struct sockaddr_in*
 mdns_record_parse_a(const void* buffer, size_t size, size_t offset, size_t length,
                     struct sockaddr_in* addr);
 
 //! Parse an AAAA record, returns the IPv6 address in the record
-static struct sockaddr_in6*
+static MDNS_MAYBE_UNUSED struct sockaddr_in6*
 mdns_record_parse_aaaa(const void* buffer, size_t size, size_t offset, size_t length,
                        struct sockaddr_in6* addr);
 
 //! Parse a TXT record, returns the number of key=value records parsed and stores the key-value
 //! pairs in the supplied buffer
-static size_t
+static MDNS_MAYBE_UNUSED size_t
 mdns_record_parse_txt(const void* buffer, size_t size, size_t offset, size_t length,
                       mdns_record_txt_t* records, size_t capacity);
 
+//! Count the key=value records in a TXT record, the number of records mdns_record_parse_txt stores
+//! given a large enough buffer. Use to size the buffer exactly before parsing
+static MDNS_MAYBE_UNUSED size_t
+mdns_record_parse_txt_count(const void* buffer, size_t size, size_t offset, size_t length);
+
+//! Find the value of a key in a TXT record without parsing all key-value pairs. Keys are compared
+//! case insensitively. Returns 1 and stores the key-value pair in the supplied record if found, 0
+//! if not found
+static MDNS_MAYBE_UNUSED int
+mdns_record_parse_txt_find(const void* buffer, size_t size, size_t offset, size_t length,
+                           const char* key, size_t key_length, mdns_record_txt_t* record);
+
 // Internal functions
 
 static mdns_string_t
@@ -314,6 +1735,10 @@ static int
 mdns_string_equal(const void* buffer_lhs, size_t size_lhs, size_t* ofs_lhs, const void* buffer_rhs,
                   size_t size_rhs, size_t* ofs_rhs);
 
+static int
+mdns_record_store_name_equal(mdns_string_t lhs, const mdns_name_t* lhs_compiled, mdns_string_t rhs,
+                             const mdns_name_t* rhs_compiled);
+
 static void*
 mdns_string_make(void* buffer, size_t capacity, void* data, const char* name, size_t length,
                  mdns_string_table_t* string_table);
@@ -490,83 +1915,375 @@ mdns_socket_close(int sock) {
 }
 
 static int
-mdns_is_string_ref(uint8_t val) {
-	return (0xC0 == (val & 0xC0));
+mdns_socket_open_ipv4_shards(int* sockets, size_t count, const struct sockaddr_in* saddr) {
+	for (size_t isock = 0; isock < count; ++isock) {
+		sockets[isock] = mdns_socket_open_ipv4(saddr);
+		if (sockets[isock] < 0) {
+			while (isock)
+				mdns_socket_close(sockets[--isock]);
+			return -1;
+		}
+	}
+	return 0;
 }
 
-static mdns_string_pair_t
-mdns_get_next_substring(const void* rawdata, size_t size, size_t offset) {
-	const uint8_t* buffer = (const uint8_t*)rawdata;
-	mdns_string_pair_t pair = {MDNS_INVALID_POS, 0, 0};
-	if (offset >= size)
-		return pair;
-	if (!buffer[offset]) {
-		pair.offset = offset;
-		return pair;
+static int
+mdns_socket_open_ipv6_shards(int* sockets, size_t count, const struct sockaddr_in6* saddr) {
+	for (size_t isock = 0; isock < count; ++isock) {
+		sockets[isock] = mdns_socket_open_ipv6(saddr);
+		if (sockets[isock] < 0) {
+			while (isock)
+				mdns_socket_close(sockets[--isock]);
+			return -1;
+		}
 	}
-	int recursion = 0;
-	while (mdns_is_string_ref(buffer[offset])) {
-		if (size < offset + 2)
-			return pair;
-
-		offset = mdns_ntohs(MDNS_POINTER_OFFSET(buffer, offset)) & 0x3fff;
-		if (offset >= size)
-			return pair;
+	return 0;
+}
 
-		pair.ref = 1;
-		if (++recursion > 16)
-			return pair;
+static int
+mdns_socket_shard_accept(const struct sockaddr* from, size_t addrlen, const mdns_pktinfo_t* info,
+                         size_t shard, size_t shard_count) {
+	if (shard_count < 2)
+		return 1;
+	if (info) {
+		const struct sockaddr* destination = (const struct sockaddr*)&info->destination;
+		if (destination->sa_family == AF_INET) {
+			const struct sockaddr_in* addr = (const struct sockaddr_in*)destination;
+			if ((ntohl(addr->sin_addr.s_addr) >> 28) != 0xE)
+				return 1;
+		} else if (destination->sa_family == AF_INET6) {
+			const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)destination;
+			if (addr6->sin6_addr.s6_addr[0] != 0xFF)
+				return 1;
+		}
 	}
 
-	size_t length = (size_t)buffer[offset++];
-	if (size < offset + length)
-		return pair;
+	// Hash the source address and port, the same source always maps to the same shard so
+	// queries from one querier are answered in order
+	const uint8_t* data = 0;
+	size_t length = 0;
+	uint16_t port = 0;
+	if ((from->sa_family == AF_INET) && (addrlen >= sizeof(struct sockaddr_in))) {
+		const struct sockaddr_in* addr = (const struct sockaddr_in*)from;
+		data = (const uint8_t*)&addr->sin_addr;
+		length = sizeof(addr->sin_addr);
+		port = addr->sin_port;
+	} else if ((from->sa_family == AF_INET6) && (addrlen >= sizeof(struct sockaddr_in6))) {
+		const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)from;
+		data = (const uint8_t*)&addr6->sin6_addr;
+		length = sizeof(addr6->sin6_addr);
+		port = addr6->sin6_port;
+	}
+	uint32_t hash = 2166136261U;
+	for (size_t ibyte = 0; ibyte < length; ++ibyte)
+		hash = (hash ^ data[ibyte]) * 16777619U;
+	hash = (hash ^ (port & 0xFF)) * 16777619U;
+	hash = (hash ^ (port >> 8)) * 16777619U;
+	return (hash % shard_count) == shard;
+}
 
-	pair.offset = offset;
-	pair.length = length;
+#ifdef MDNS_HAVE_SOCKET_FILTER
+// Append an instruction to a classic BPF program, returns the new instruction count
+static size_t
+mdns_socket_filter_op(struct sock_filter* program, size_t count, uint16_t code, uint32_t k) {
+	program[count].code = code;
+	program[count].jt = 0;
+	program[count].jf = 0;
+	program[count].k = k;
+	return count + 1;
+}
 
-	return pair;
+// Append a compare of the accumulator to a classic BPF program. The branch discarding the datagram
+// is marked with the maximum offset, and patched once the program is complete
+static size_t
+mdns_socket_filter_jump(struct sock_filter* program, size_t count, uint32_t k,
+                        int discard_if_equal) {
+	mdns_socket_filter_op(program, count, BPF_JMP | BPF_JEQ | BPF_K, k);
+	if (discard_if_equal)
+		program[count].jt = 0xFF;
+	else
+		program[count].jf = 0xFF;
+	return count + 1;
 }
+#endif
 
 static int
-mdns_string_skip(const void* buffer, size_t size, size_t* offset) {
-	size_t cur = *offset;
-	mdns_string_pair_t substr;
-	unsigned int counter = 0;
-	do {
-		substr = mdns_get_next_substring(buffer, size, cur);
-		if ((substr.offset == MDNS_INVALID_POS) || (counter++ > MDNS_MAX_SUBSTRINGS))
-			return 0;
-		if (substr.ref) {
-			*offset = cur + 2;
-			return 1;
+mdns_socket_filter(int sock, unsigned int flags, const char* label, size_t length) {
+#ifdef MDNS_HAVE_SOCKET_FILTER
+	// UDP socket filters see the datagram from the start of the UDP header
+	const uint32_t header = 8;
+	struct sock_filter program[96];
+	size_t count = 0;
+	if (length > 63)
+		return -1;
+
+	unsigned int qr = flags & (MDNS_SOCKET_FILTER_QUERY | MDNS_SOCKET_FILTER_RESPONSE);
+	if (qr && (qr != (MDNS_SOCKET_FILTER_QUERY | MDNS_SOCKET_FILTER_RESPONSE))) {
+		count = mdns_socket_filter_op(program, count, BPF_LD | BPF_B | BPF_ABS, header + 2);
+		count = mdns_socket_filter_op(program, count, BPF_ALU | BPF_AND | BPF_K, 0x80);
+		count = mdns_socket_filter_jump(program, count,
+		                                (qr == MDNS_SOCKET_FILTER_QUERY) ? 0 : 0x80, 0);
+	}
+	if (flags & MDNS_SOCKET_FILTER_QUESTIONS) {
+		// Datagrams with questions skip the five instructions accepting only queries with known
+		// answers, which continue the known answers of a query in packets without questions
+		count = mdns_socket_filter_op(program, count, BPF_LD | BPF_H | BPF_ABS, header + 4);
+		count = mdns_socket_filter_op(program, count, BPF_JMP | BPF_JEQ | BPF_K, 0);
+		program[count - 1].jf = 5;
+		count = mdns_socket_filter_op(program, count, BPF_LD | BPF_B | BPF_ABS, header + 2);
+		count = mdns_socket_filter_op(program, count, BPF_ALU | BPF_AND | BPF_K, 0x80);
+		count = mdns_socket_filter_jump(program, count, 0, 0);
+		count = mdns_socket_filter_op(program, count, BPF_LD | BPF_H | BPF_ABS, header + 6);
+		count = mdns_socket_filter_jump(program, count, 0, 1);
+	}
+	if (flags & MDNS_SOCKET_FILTER_ANSWERS) {
+		count = mdns_socket_filter_op(program, count, BPF_LD | BPF_H | BPF_ABS, header + 6);
+		count = mdns_socket_filter_jump(program, count, 0, 1);
+	}
+	if (label && length) {
+		// Compare the label up to four bytes at a time in network byte order. The case bit is set
+		// in the loaded bytes where the label has a letter, which maps only the same letter in
+		// either case to the lower case letter
+		uint32_t offset = header + 12;
+		count = mdns_socket_filter_op(program, count, BPF_LD | BPF_B | BPF_ABS, offset++);
+		count = mdns_socket_filter_jump(program, count, (uint32_t)length, 0);
+		for (size_t ichar = 0; ichar < length;) {
+			size_t chunk = ((length - ichar) >= 4) ? 4 : (((length - ichar) >= 2) ? 2 : 1);
+			uint32_t value = 0;
+			uint32_t mask = 0;
+			for (size_t ibyte = 0; ibyte < chunk; ++ibyte) {
+				uint8_t c = (uint8_t)label[ichar + ibyte];
+				int letter = ((c >= 'A') && (c <= 'Z')) || ((c >= 'a') && (c <= 'z'));
+				value = (value << 8) | (letter ? (c | 0x20U) : c);
+				mask = (mask << 8) | (letter ? 0x20U : 0);
+			}
+			uint16_t load = (chunk == 4) ? BPF_W : ((chunk == 2) ? BPF_H : BPF_B);
+			count = mdns_socket_filter_op(program, count, (uint16_t)(BPF_LD | load | BPF_ABS),
+			                              offset);
+			if (mask)
+				count = mdns_socket_filter_op(program, count, BPF_ALU | BPF_OR | BPF_K, mask);
+			count = mdns_socket_filter_jump(program, count, value, 0);
+			offset += (uint32_t)chunk;
+			ichar += chunk;
 		}
-		cur = substr.offset + substr.length;
-	} while (substr.length);
+	}
+	// Accept the whole datagram, or discard it
+	count = mdns_socket_filter_op(program, count, BPF_RET | BPF_K, 0x40000);
+	count = mdns_socket_filter_op(program, count, BPF_RET | BPF_K, 0);
+
+	size_t discard = count - 1;
+	for (size_t iop = 0; iop < discard; ++iop) {
+		if (program[iop].jt == 0xFF)
+			program[iop].jt = (uint8_t)(discard - (iop + 1));
+		if (program[iop].jf == 0xFF)
+			program[iop].jf = (uint8_t)(discard - (iop + 1));
+	}
 
-	*offset = cur + 1;
-	return 1;
+	struct sock_fprog fprog;
+	fprog.len = (unsigned short)count;
+	fprog.filter = program;
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)))
+		return -1;
+	return 0;
+#else
+	(void)sizeof(sock);
+	(void)sizeof(flags);
+	(void)sizeof(label);
+	(void)sizeof(length);
+	return -1;
+#endif
 }
 
 static int
-mdns_string_equal(const void* buffer_lhs, size_t size_lhs, size_t* ofs_lhs, const void* buffer_rhs,
-                  size_t size_rhs, size_t* ofs_rhs) {
-	size_t lhs_cur = *ofs_lhs;
-	size_t rhs_cur = *ofs_rhs;
-	size_t lhs_end = MDNS_INVALID_POS;
-	size_t rhs_end = MDNS_INVALID_POS;
-	mdns_string_pair_t lhs_substr;
-	mdns_string_pair_t rhs_substr;
-	unsigned int counter = 0;
-	do {
-		lhs_substr = mdns_get_next_substring(buffer_lhs, size_lhs, lhs_cur);
-		rhs_substr = mdns_get_next_substring(buffer_rhs, size_rhs, rhs_cur);
-		if ((lhs_substr.offset == MDNS_INVALID_POS) || (rhs_substr.offset == MDNS_INVALID_POS) ||
-		    (counter++ > MDNS_MAX_SUBSTRINGS))
-			return 0;
-		if (lhs_substr.length != rhs_substr.length)
-			return 0;
-		if (strncasecmp((const char*)MDNS_POINTER_OFFSET_CONST(buffer_rhs, rhs_substr.offset),
+mdns_socket_filter_detach(int sock) {
+#ifdef MDNS_HAVE_SOCKET_FILTER
+	int value = 0;
+	if (setsockopt(sock, SOL_SOCKET, SO_DETACH_FILTER, &value, sizeof(value)))
+		return -1;
+	return 0;
+#else
+	(void)sizeof(sock);
+	return -1;
+#endif
+}
+
+static int
+mdns_socket_join_ipv4(int sock, const struct sockaddr_in* saddr) {
+#ifdef MDNS_HAVE_PKTINFO
+	int enable = 1;
+	setsockopt(sock, IPPROTO_IP, IP_PKTINFO, (const char*)&enable, sizeof(enable));
+#endif
+
+	struct ip_mreq req;
+	memset(&req, 0, sizeof(req));
+	req.imr_multiaddr.s_addr = htonl((((uint32_t)224U) << 24U) | ((uint32_t)251U));
+	req.imr_interface = saddr->sin_addr;
+	if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&req, sizeof(req)))
+		return -1;
+	return 0;
+}
+
+static int
+mdns_socket_join_ipv6(int sock, unsigned int interface_index) {
+#ifdef MDNS_HAVE_PKTINFO
+	int enable = 1;
+	setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, (const char*)&enable, sizeof(enable));
+#endif
+
+	struct ipv6_mreq req;
+	memset(&req, 0, sizeof(req));
+	req.ipv6mr_multiaddr.s6_addr[0] = 0xFF;
+	req.ipv6mr_multiaddr.s6_addr[1] = 0x02;
+	req.ipv6mr_multiaddr.s6_addr[15] = 0xFB;
+	req.ipv6mr_interface = interface_index;
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, (char*)&req, sizeof(req)))
+		return -1;
+	return 0;
+}
+
+#ifdef MDNS_HAVE_PKTINFO
+// Space for the IPv4 and IPv6 packet info ancillary data of a received datagram
+#define MDNS_PKTINFO_CONTROL_SIZE \
+	(CMSG_SPACE(sizeof(struct in_pktinfo)) + CMSG_SPACE(sizeof(struct in6_pktinfo)))
+
+// Get the arrival interface and destination address from the ancillary data of a received message
+static void
+mdns_pktinfo_parse(struct msghdr* msg, mdns_pktinfo_t* info) {
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if ((cmsg->cmsg_level == IPPROTO_IP) && (cmsg->cmsg_type == IP_PKTINFO)) {
+			struct in_pktinfo pktinfo;
+			memcpy(&pktinfo, CMSG_DATA(cmsg), sizeof(pktinfo));
+			struct sockaddr_in* destination = (struct sockaddr_in*)&info->destination;
+			destination->sin_family = AF_INET;
+			destination->sin_addr = pktinfo.ipi_addr;
+			info->interface_index = (unsigned int)pktinfo.ipi_ifindex;
+		} else if ((cmsg->cmsg_level == IPPROTO_IPV6) && (cmsg->cmsg_type == IPV6_PKTINFO)) {
+			struct in6_pktinfo pktinfo;
+			memcpy(&pktinfo, CMSG_DATA(cmsg), sizeof(pktinfo));
+			struct sockaddr_in6* destination = (struct sockaddr_in6*)&info->destination;
+			destination->sin6_family = AF_INET6;
+			destination->sin6_addr = pktinfo.ipi6_addr;
+			destination->sin6_scope_id = pktinfo.ipi6_ifindex;
+			info->interface_index = pktinfo.ipi6_ifindex;
+		}
+	}
+}
+#endif
+
+static size_t
+mdns_socket_recv(int sock, void* buffer, size_t capacity, struct sockaddr* from, size_t* addrlen,
+                 mdns_pktinfo_t* info) {
+	memset(info, 0, sizeof(mdns_pktinfo_t));
+#ifdef MDNS_HAVE_PKTINFO
+	union {
+		struct cmsghdr header;
+		char data[MDNS_PKTINFO_CONTROL_SIZE];
+	} control;
+	struct iovec iov;
+	iov.iov_base = buffer;
+	iov.iov_len = capacity;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = from;
+	msg.msg_namelen = (socklen_t)*addrlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data;
+	msg.msg_controllen = sizeof(control.data);
+
+	mdns_ssize_t ret = recvmsg(sock, &msg, 0);
+	if (ret <= 0)
+		return 0;
+	*addrlen = msg.msg_namelen;
+	mdns_pktinfo_parse(&msg, info);
+#else
+	socklen_t fromlen = (socklen_t)*addrlen;
+	mdns_ssize_t ret = recvfrom(sock, (char*)buffer, (mdns_size_t)capacity, 0, from, &fromlen);
+	if (ret <= 0)
+		return 0;
+	*addrlen = (size_t)fromlen;
+#endif
+	return (size_t)ret;
+}
+
+static int
+mdns_is_string_ref(uint8_t val) {
+	return (0xC0 == (val & 0xC0));
+}
+
+static mdns_string_pair_t
+mdns_get_next_substring(const void* rawdata, size_t size, size_t offset) {
+	const uint8_t* buffer = (const uint8_t*)rawdata;
+	mdns_string_pair_t pair = {MDNS_INVALID_POS, 0, 0};
+	if (offset >= size)
+		return pair;
+	if (!buffer[offset]) {
+		pair.offset = offset;
+		return pair;
+	}
+	int recursion = 0;
+	while (mdns_is_string_ref(buffer[offset])) {
+		if (size < offset + 2)
+			return pair;
+
+		offset = mdns_ntohs(MDNS_POINTER_OFFSET(buffer, offset)) & 0x3fff;
+		if (offset >= size)
+			return pair;
+
+		pair.ref = 1;
+		if (++recursion > 16)
+			return pair;
+	}
+
+	size_t length = (size_t)buffer[offset++];
+	if (size < offset + length)
+		return pair;
+
+	pair.offset = offset;
+	pair.length = length;
+
+	return pair;
+}
+
+static int
+mdns_string_skip(const void* buffer, size_t size, size_t* offset) {
+	size_t cur = *offset;
+	mdns_string_pair_t substr;
+	unsigned int counter = 0;
+	do {
+		substr = mdns_get_next_substring(buffer, size, cur);
+		if ((substr.offset == MDNS_INVALID_POS) || (counter++ > MDNS_MAX_SUBSTRINGS))
+			return 0;
+		if (substr.ref) {
+			*offset = cur + 2;
+			return 1;
+		}
+		cur = substr.offset + substr.length;
+	} while (substr.length);
+
+	*offset = cur + 1;
+	return 1;
+}
+
+static int
+mdns_string_equal(const void* buffer_lhs, size_t size_lhs, size_t* ofs_lhs, const void* buffer_rhs,
+                  size_t size_rhs, size_t* ofs_rhs) {
+	size_t lhs_cur = *ofs_lhs;
+	size_t rhs_cur = *ofs_rhs;
+	size_t lhs_end = MDNS_INVALID_POS;
+	size_t rhs_end = MDNS_INVALID_POS;
+	mdns_string_pair_t lhs_substr;
+	mdns_string_pair_t rhs_substr;
+	unsigned int counter = 0;
+	do {
+		lhs_substr = mdns_get_next_substring(buffer_lhs, size_lhs, lhs_cur);
+		rhs_substr = mdns_get_next_substring(buffer_rhs, size_rhs, rhs_cur);
+		if ((lhs_substr.offset == MDNS_INVALID_POS) || (rhs_substr.offset == MDNS_INVALID_POS) ||
+		    (counter++ > MDNS_MAX_SUBSTRINGS))
+			return 0;
+		if (lhs_substr.length != rhs_substr.length)
+			return 0;
+		if (strncasecmp((const char*)MDNS_POINTER_OFFSET_CONST(buffer_rhs, rhs_substr.offset),
 		                (const char*)MDNS_POINTER_OFFSET_CONST(buffer_lhs, lhs_substr.offset),
 		                rhs_substr.length))
 			return 0;
@@ -589,6 +2306,157 @@ mdns_string_equal(const void* buffer_lhs, size_t size_lhs, size_t* ofs_lhs, cons
 	return 1;
 }
 
+static uint64_t
+mdns_string_hash_fold_label(uint64_t hash, const void* label, size_t length) {
+	// Case insensitive FNV-1a over the label length byte and the label bytes
+	const uint8_t* data = (const uint8_t*)label;
+	hash = (hash ^ (uint64_t)length) * 1099511628211ULL;
+	for (size_t ichar = 0; ichar < length; ++ichar) {
+		uint8_t c = data[ichar];
+		if ((c >= 'A') && (c <= 'Z'))
+			c |= 0x20;
+		hash = (hash ^ c) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static void
+mdns_label_iterator_initialize(mdns_label_iterator_t* it, const void* buffer, size_t size,
+                               size_t offset) {
+	it->buffer = buffer;
+	it->size = size;
+	it->offset = offset;
+	it->end = MDNS_INVALID_POS;
+	it->count = 0;
+}
+
+static int
+mdns_label_iterator_next(mdns_label_iterator_t* it, mdns_string_t* label) {
+	if (it->offset == MDNS_INVALID_POS)
+		return (it->end != MDNS_INVALID_POS) ? 0 : -1;
+	mdns_string_pair_t substr = mdns_get_next_substring(it->buffer, it->size, it->offset);
+	if ((substr.offset == MDNS_INVALID_POS) || (it->count++ > MDNS_MAX_SUBSTRINGS)) {
+		it->offset = MDNS_INVALID_POS;
+		it->end = MDNS_INVALID_POS;
+		return -1;
+	}
+	if (substr.ref && (it->end == MDNS_INVALID_POS))
+		it->end = it->offset + 2;
+	if (!substr.length) {
+		if (it->end == MDNS_INVALID_POS)
+			it->end = substr.offset + 1;
+		it->offset = MDNS_INVALID_POS;
+		return 0;
+	}
+	label->str = (const char*)MDNS_POINTER_OFFSET_CONST(it->buffer, substr.offset);
+	label->length = substr.length;
+	it->offset = substr.offset + substr.length;
+	return 1;
+}
+
+static uint64_t
+mdns_label_iterator_hash(mdns_label_iterator_t* it) {
+	uint64_t hash = 14695981039346656037ULL;
+	mdns_string_t label;
+	int res;
+	while ((res = mdns_label_iterator_next(it, &label)) > 0)
+		hash = mdns_string_hash_fold_label(hash, label.str, label.length);
+	return res ? 0 : hash;
+}
+
+static uint64_t
+mdns_name_hash(const void* buffer, size_t size, size_t offset) {
+	mdns_label_iterator_t it;
+	mdns_label_iterator_initialize(&it, buffer, size, offset);
+	return mdns_label_iterator_hash(&it);
+}
+
+static uint64_t
+mdns_name_hash_string(const char* name, size_t length) {
+	if (length && (name[length - 1] == '.'))
+		--length;
+	uint64_t hash = 14695981039346656037ULL;
+	size_t last_pos = 0;
+	while (last_pos < length) {
+		size_t pos = mdns_string_find(name, length, '.', last_pos);
+		if (pos == MDNS_INVALID_POS)
+			pos = length;
+		hash = mdns_string_hash_fold_label(hash, name + last_pos, pos - last_pos);
+		last_pos = pos + 1;
+	}
+	return hash;
+}
+
+// Case insensitive compare of the remaining labels of the iterator to a dotted name string
+static int
+mdns_label_iterator_equal(mdns_label_iterator_t* it, const char* name, size_t length) {
+	if (length && (name[length - 1] == '.'))
+		--length;
+	size_t last_pos = 0;
+	mdns_string_t label;
+	int res;
+	while ((res = mdns_label_iterator_next(it, &label)) > 0) {
+		if (last_pos >= length)
+			return 0;
+		size_t pos = mdns_string_find(name, length, '.', last_pos);
+		if (pos == MDNS_INVALID_POS)
+			pos = length;
+		if (((pos - last_pos) != label.length) ||
+		    strncasecmp(label.str, name + last_pos, label.length))
+			return 0;
+		last_pos = pos + 1;
+	}
+	return !res && (last_pos >= length);
+}
+
+static int
+mdns_name_equal(const void* buffer, size_t size, size_t offset, const char* name, size_t length) {
+	mdns_label_iterator_t it;
+	mdns_label_iterator_initialize(&it, buffer, size, offset);
+	return mdns_label_iterator_equal(&it, name, length);
+}
+
+static int
+mdns_name_equal_compiled(const void* buffer, size_t size, size_t offset, const mdns_name_t* name) {
+	mdns_label_iterator_t it;
+	mdns_label_iterator_initialize(&it, buffer, size, offset);
+	mdns_string_t label;
+	for (size_t ilabel = 0; ilabel < name->label_count; ++ilabel) {
+		const uint8_t* data = name->data + name->label_offset[ilabel];
+		if ((mdns_label_iterator_next(&it, &label) <= 0) || (label.length != *data) ||
+		    strncasecmp(label.str, (const char*)data + 1, label.length))
+			return 0;
+	}
+	return !mdns_label_iterator_next(&it, &label);
+}
+
+static int
+mdns_name_has_suffix(const void* buffer, size_t size, size_t offset, const char* suffix,
+                     size_t length) {
+	if (length && (suffix[length - 1] == '.'))
+		--length;
+	size_t suffix_labels = 0;
+	for (size_t last_pos = 0; last_pos < length; ++suffix_labels) {
+		size_t pos = mdns_string_find(suffix, length, '.', last_pos);
+		last_pos = (pos == MDNS_INVALID_POS) ? length : pos + 1;
+	}
+
+	mdns_label_iterator_t it;
+	mdns_label_iterator_initialize(&it, buffer, size, offset);
+	mdns_string_t label;
+	size_t name_labels = 0;
+	int res;
+	while ((res = mdns_label_iterator_next(&it, &label)) > 0)
+		++name_labels;
+	if (res || (name_labels < suffix_labels))
+		return 0;
+
+	mdns_label_iterator_initialize(&it, buffer, size, offset);
+	for (size_t ilabel = suffix_labels; ilabel < name_labels; ++ilabel)
+		mdns_label_iterator_next(&it, &label);
+	return mdns_label_iterator_equal(&it, suffix, length);
+}
+
 static mdns_string_t
 mdns_string_extract(const void* buffer, size_t size, size_t* offset, char* str, size_t capacity) {
 	size_t cur = *offset;
@@ -627,6 +2495,86 @@ mdns_string_extract(const void* buffer, size_t size, size_t* offset, char* str,
 	return result;
 }
 
+static void
+mdns_string_table_initialize(mdns_string_table_t* string_table, mdns_string_table_item_t* items,
+                             size_t capacity) {
+	memset(string_table, 0, sizeof(mdns_string_table_t));
+	if (items && capacity) {
+		memset(items, 0, sizeof(mdns_string_table_item_t) * capacity);
+		string_table->item = items;
+		string_table->capacity = capacity;
+	}
+}
+
+static uint32_t
+mdns_string_hash_label(uint32_t hash, const void* label, size_t length) {
+	// FNV-1a over the label length byte and the label bytes
+	const uint8_t* data = (const uint8_t*)label;
+	hash = (hash ^ (uint32_t)length) * 16777619U;
+	for (size_t ichar = 0; ichar < length; ++ichar)
+		hash = (hash ^ data[ichar]) * 16777619U;
+	return hash;
+}
+
+// Check if the name at the given offset in the buffer is exactly the given dotted string
+static int
+mdns_string_table_match(const void* buffer, size_t capacity, size_t offset, const char* str,
+                        size_t length) {
+	size_t pos = 0;
+	unsigned int counter = 0;
+	while (1) {
+		mdns_string_pair_t sub_string = mdns_get_next_substring(buffer, capacity, offset);
+		if ((sub_string.offset == MDNS_INVALID_POS) || (counter++ > MDNS_MAX_SUBSTRINGS))
+			return 0;
+		if (pos >= length)
+			return !sub_string.length;
+		size_t dot_pos = mdns_string_find(str, length, '.', pos);
+		if (dot_pos == MDNS_INVALID_POS)
+			dot_pos = length;
+		size_t current_length = dot_pos - pos;
+		if (!sub_string.length || (sub_string.length != current_length))
+			return 0;
+		if (memcmp(str + pos, MDNS_POINTER_OFFSET_CONST(buffer, sub_string.offset),
+		           sub_string.length))
+			return 0;
+		pos = dot_pos + 1;
+		offset = sub_string.offset + sub_string.length;
+	}
+}
+
+static size_t
+mdns_string_table_find_hashed(mdns_string_table_t* string_table, const void* buffer,
+                              size_t capacity, uint32_t hash, const char* str, size_t length) {
+	size_t slot = hash % string_table->capacity;
+	for (size_t iprobe = 0; iprobe < string_table->capacity; ++iprobe) {
+		mdns_string_table_item_t* item = string_table->item + slot;
+		if (!item->offset)
+			break;
+		if ((item->hash == hash) &&
+		    mdns_string_table_match(buffer, capacity, item->offset, str, length))
+			return item->offset;
+		if (++slot >= string_table->capacity)
+			slot = 0;
+	}
+	return MDNS_INVALID_POS;
+}
+
+static void
+mdns_string_table_add_hashed(mdns_string_table_t* string_table, uint32_t hash, size_t offset) {
+	// Keep the load factor low to keep probe sequences short, and only store offsets that can be
+	// encoded in a 14 bit name reference (offset is never zero, it is always after the header)
+	if (((string_table->count + 1) * 4 > string_table->capacity * 3) || (offset > 0x3FFF))
+		return;
+	size_t slot = hash % string_table->capacity;
+	while (string_table->item[slot].offset) {
+		if (++slot >= string_table->capacity)
+			slot = 0;
+	}
+	string_table->item[slot].hash = hash;
+	string_table->item[slot].offset = (uint32_t)offset;
+	++string_table->count;
+}
+
 static size_t
 mdns_string_table_find(mdns_string_table_t* string_table, const void* buffer, size_t capacity,
                        const char* str, size_t first_length, size_t total_length) {
@@ -685,6 +2633,22 @@ mdns_string_table_add(mdns_string_table_t* string_table, size_t offset) {
 		string_table->next = 0;
 }
 
+// Drop the names added to the string table at or after the given offset, when the data written
+// from that offset is discarded. Hashed items are kept to not break probe sequences, but can no
+// longer match
+static void
+mdns_string_table_truncate(mdns_string_table_t* string_table, size_t offset) {
+	size_t table_capacity = sizeof(string_table->offset) / sizeof(string_table->offset[0]);
+	for (size_t istr = 0; istr < table_capacity; ++istr) {
+		if (string_table->offset[istr] >= offset)
+			string_table->offset[istr] = MDNS_INVALID_POS;
+	}
+	for (size_t iitem = 0; iitem < string_table->capacity; ++iitem) {
+		if (string_table->item[iitem].offset >= offset)
+			string_table->item[iitem].offset = 0xFFFFFFFFU;
+	}
+}
+
 static size_t
 mdns_string_find(const char* str, size_t length, char c, size_t offset) {
 	const void* found;
@@ -703,76 +2667,338 @@ mdns_string_make_ref(void* data, size_t capacity, size_t ref_offset) {
 	return mdns_htons(data, 0xC000 | (uint16_t)ref_offset);
 }
 
-static void*
-mdns_string_make(void* buffer, size_t capacity, void* data, const char* name, size_t length,
-                 mdns_string_table_t* string_table) {
-	size_t last_pos = 0;
-	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
-	if (name[length - 1] == '.')
+// Compile a dotted name to wire format with the suffix hashes used for compression, without the
+// case insensitive hash of the full name and without clearing unused parts of the name
+static int
+mdns_name_compile_wire(mdns_name_t* name, const char* str, size_t length) {
+	name->label_count = 0;
+	if (length && (str[length - 1] == '.'))
 		--length;
+
+	size_t last_pos = 0;
+	size_t offset = 0;
 	while (last_pos < length) {
-		size_t pos = mdns_string_find(name, length, '.', last_pos);
-		size_t sub_length = ((pos != MDNS_INVALID_POS) ? pos : length) - last_pos;
-		size_t total_length = length - last_pos;
+		size_t pos = mdns_string_find(str, length, '.', last_pos);
+		if (pos == MDNS_INVALID_POS)
+			pos = length;
+		size_t sub_length = pos - last_pos;
+		// Labels must be 1-63 bytes and the full name at most 255 bytes
+		if (!sub_length || (sub_length > 63) || (name->label_count >= MDNS_MAX_SUBSTRINGS) ||
+		    ((offset + sub_length + 2) > 255))
+			return -1;
+		name->label_offset[name->label_count++] = (uint8_t)offset;
+		name->data[offset] = (uint8_t)sub_length;
+		memcpy(name->data + offset + 1, str + last_pos, sub_length);
+		offset += sub_length + 1;
+		last_pos = pos + 1;
+	}
+	name->data[offset++] = 0;
+	name->length = offset;
+
+	uint32_t suffix_hash = 2166136261U;
+	for (size_t ilabel = name->label_count; ilabel-- > 0;) {
+		const uint8_t* label = name->data + name->label_offset[ilabel];
+		suffix_hash = mdns_string_hash_label(suffix_hash, label + 1, *label);
+		name->suffix_hash[ilabel] = suffix_hash;
+	}
+	return 0;
+}
 
-		size_t ref_offset =
-		    mdns_string_table_find(string_table, buffer, capacity,
-		                           (char*)MDNS_POINTER_OFFSET(name, last_pos), sub_length,
-		                           total_length);
-		if (ref_offset != MDNS_INVALID_POS)
-			return mdns_string_make_ref(data, remain, ref_offset);
+static int
+mdns_name_compile(mdns_name_t* name, const char* str, size_t length) {
+	memset(name, 0, sizeof(mdns_name_t));
+	if (mdns_name_compile_wire(name, str, length))
+		return -1;
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t ilabel = 0; ilabel < name->label_count; ++ilabel) {
+		const uint8_t* label = name->data + name->label_offset[ilabel];
+		hash = mdns_string_hash_fold_label(hash, label + 1, *label);
+	}
+	name->hash = hash;
+	return 0;
+}
 
-		if (remain <= (sub_length + 1))
+// Check if the name at the given offset in the buffer is exactly the given uncompressed wire name
+static int
+mdns_string_table_match_wire(const void* buffer, size_t capacity, size_t offset,
+                             const uint8_t* wire) {
+	unsigned int counter = 0;
+	while (1) {
+		mdns_string_pair_t sub_string = mdns_get_next_substring(buffer, capacity, offset);
+		if ((sub_string.offset == MDNS_INVALID_POS) || (counter++ > MDNS_MAX_SUBSTRINGS))
 			return 0;
-
-		*(unsigned char*)data = (unsigned char)sub_length;
-		memcpy(MDNS_POINTER_OFFSET(data, 1), name + last_pos, sub_length);
-		mdns_string_table_add(string_table, MDNS_POINTER_DIFF(data, buffer));
-
-		data = MDNS_POINTER_OFFSET(data, sub_length + 1);
-		last_pos = ((pos != MDNS_INVALID_POS) ? pos + 1 : length);
-		remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+		if (sub_string.length != *wire)
+			return 0;
+		if (!sub_string.length)
+			return 1;
+		if (memcmp(wire + 1, MDNS_POINTER_OFFSET_CONST(buffer, sub_string.offset),
+		           sub_string.length))
+			return 0;
+		wire += sub_string.length + 1;
+		offset = sub_string.offset + sub_string.length;
 	}
-
-	if (!remain)
-		return 0;
-
-	*(unsigned char*)data = 0;
-	return MDNS_POINTER_OFFSET(data, 1);
 }
 
 static size_t
-mdns_records_parse(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer,
-                   size_t size, size_t* offset, mdns_entry_type_t type, uint16_t query_id,
-                   size_t records, mdns_record_callback_fn callback, void* user_data) {
-	size_t parsed = 0;
-	for (size_t i = 0; i < records; ++i) {
-		size_t name_offset = *offset;
-		mdns_string_skip(buffer, size, offset);
-		if (((*offset) + 10) > size)
-			return parsed;
-		size_t name_length = (*offset) - name_offset;
-		const uint16_t* data = (const uint16_t*)MDNS_POINTER_OFFSET(buffer, *offset);
-
-		uint16_t rtype = mdns_ntohs(data++);
-		uint16_t rclass = mdns_ntohs(data++);
-		uint32_t ttl = mdns_ntohl(data);
-		data += 2;
-		uint16_t length = mdns_ntohs(data++);
-
-		*offset += 10;
-
-		if (length <= (size - (*offset))) {
-			++parsed;
-			if (callback &&
-			    callback(sock, from, addrlen, type, query_id, rtype, rclass, ttl, buffer, size,
-			             name_offset, name_length, *offset, length, user_data))
+mdns_string_table_find_name(mdns_string_table_t* string_table, const void* buffer,
+                            size_t capacity, const mdns_name_t* name, size_t label) {
+	const uint8_t* wire = name->data + name->label_offset[label];
+	if (string_table->item) {
+		uint32_t hash = name->suffix_hash[label];
+		size_t slot = hash % string_table->capacity;
+		for (size_t iprobe = 0; iprobe < string_table->capacity; ++iprobe) {
+			mdns_string_table_item_t* item = string_table->item + slot;
+			if (!item->offset)
 				break;
+			if ((item->hash == hash) &&
+			    mdns_string_table_match_wire(buffer, capacity, item->offset, wire))
+				return item->offset;
+			if (++slot >= string_table->capacity)
+				slot = 0;
+		}
+	} else {
+		for (size_t istr = 0; istr < string_table->count; ++istr) {
+			if ((string_table->offset[istr] < capacity) &&
+			    mdns_string_table_match_wire(buffer, capacity, string_table->offset[istr], wire))
+				return string_table->offset[istr];
 		}
-
-		*offset += length;
 	}
-	return parsed;
+	return MDNS_INVALID_POS;
+}
+
+static void*
+mdns_string_make_name(void* buffer, size_t capacity, void* data, const mdns_name_t* name,
+                      mdns_string_table_t* string_table) {
+	// Name that failed to compile
+	if (!name->length)
+		return 0;
+	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+	size_t ref_offset = MDNS_INVALID_POS;
+	size_t label_count = name->label_count;
+	if (string_table) {
+		for (size_t ilabel = 0; ilabel < name->label_count; ++ilabel) {
+			ref_offset = mdns_string_table_find_name(string_table, buffer, capacity, name, ilabel);
+			if (ref_offset != MDNS_INVALID_POS) {
+				label_count = ilabel;
+				break;
+			}
+		}
+	}
+
+	// Copy all labels up to the first suffix found in the table (or the full name including the
+	// terminating zero length label) in one go
+	size_t copy_length = (ref_offset != MDNS_INVALID_POS) ?
+	                         (label_count ? name->label_offset[label_count] : 0) :
+	                         name->length;
+	if (remain < copy_length + ((ref_offset != MDNS_INVALID_POS) ? 2 : 0))
+		return 0;
+	memcpy(data, name->data, copy_length);
+
+	if (string_table) {
+		size_t base_offset = MDNS_POINTER_DIFF(data, buffer);
+		for (size_t ilabel = 0; ilabel < label_count; ++ilabel) {
+			size_t offset = base_offset + name->label_offset[ilabel];
+			if (string_table->item)
+				mdns_string_table_add_hashed(string_table, name->suffix_hash[ilabel], offset);
+			else
+				mdns_string_table_add(string_table, offset);
+		}
+	}
+
+	data = MDNS_POINTER_OFFSET(data, copy_length);
+	if (ref_offset != MDNS_INVALID_POS)
+		return mdns_string_make_ref(data, 2, ref_offset);
+	return data;
+}
+
+static void*
+mdns_string_make_hashed(void* buffer, size_t capacity, void* data, const char* name,
+                        size_t length, mdns_string_table_t* string_table) {
+	size_t label_start[MDNS_MAX_SUBSTRINGS];
+	size_t label_length[MDNS_MAX_SUBSTRINGS];
+	uint32_t suffix_hash[MDNS_MAX_SUBSTRINGS];
+	size_t label_count = 0;
+
+	if (name[length - 1] == '.')
+		--length;
+	size_t last_pos = 0;
+	while (last_pos < length) {
+		// Names with too many labels are not valid anyway, write them without compression
+		if (label_count >= MDNS_MAX_SUBSTRINGS)
+			return mdns_string_make(buffer, capacity, data, name, length, 0);
+		size_t pos = mdns_string_find(name, length, '.', last_pos);
+		if (pos == MDNS_INVALID_POS)
+			pos = length;
+		label_start[label_count] = last_pos;
+		label_length[label_count++] = pos - last_pos;
+		last_pos = pos + 1;
+	}
+
+	// Hash every suffix of the name, starting from the root, so that the hash of a suffix does not
+	// depend on the labels preceding it
+	uint32_t hash = 2166136261U;
+	for (size_t ilabel = label_count; ilabel-- > 0;) {
+		hash = mdns_string_hash_label(hash, name + label_start[ilabel], label_length[ilabel]);
+		suffix_hash[ilabel] = hash;
+	}
+
+	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+	for (size_t ilabel = 0; ilabel < label_count; ++ilabel) {
+		size_t ref_offset = mdns_string_table_find_hashed(
+		    string_table, buffer, capacity, suffix_hash[ilabel], name + label_start[ilabel],
+		    length - label_start[ilabel]);
+		if (ref_offset != MDNS_INVALID_POS)
+			return mdns_string_make_ref(data, remain, ref_offset);
+
+		size_t sub_length = label_length[ilabel];
+		if (remain <= (sub_length + 1))
+			return 0;
+
+		*(unsigned char*)data = (unsigned char)sub_length;
+		memcpy(MDNS_POINTER_OFFSET(data, 1), name + label_start[ilabel], sub_length);
+		mdns_string_table_add_hashed(string_table, suffix_hash[ilabel],
+		                             MDNS_POINTER_DIFF(data, buffer));
+
+		data = MDNS_POINTER_OFFSET(data, sub_length + 1);
+		remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+	}
+
+	if (!remain)
+		return 0;
+
+	*(unsigned char*)data = 0;
+	return MDNS_POINTER_OFFSET(data, 1);
+}
+
+static void*
+mdns_string_make(void* buffer, size_t capacity, void* data, const char* name, size_t length,
+                 mdns_string_table_t* string_table) {
+	if (string_table && string_table->item)
+		return mdns_string_make_hashed(buffer, capacity, data, name, length, string_table);
+
+	size_t last_pos = 0;
+	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+	if (name[length - 1] == '.')
+		--length;
+	while (last_pos < length) {
+		size_t pos = mdns_string_find(name, length, '.', last_pos);
+		size_t sub_length = ((pos != MDNS_INVALID_POS) ? pos : length) - last_pos;
+		size_t total_length = length - last_pos;
+
+		size_t ref_offset =
+		    mdns_string_table_find(string_table, buffer, capacity,
+		                           (char*)MDNS_POINTER_OFFSET(name, last_pos), sub_length,
+		                           total_length);
+		if (ref_offset != MDNS_INVALID_POS)
+			return mdns_string_make_ref(data, remain, ref_offset);
+
+		if (remain <= (sub_length + 1))
+			return 0;
+
+		*(unsigned char*)data = (unsigned char)sub_length;
+		memcpy(MDNS_POINTER_OFFSET(data, 1), name + last_pos, sub_length);
+		mdns_string_table_add(string_table, MDNS_POINTER_DIFF(data, buffer));
+
+		data = MDNS_POINTER_OFFSET(data, sub_length + 1);
+		last_pos = ((pos != MDNS_INVALID_POS) ? pos + 1 : length);
+		remain = capacity - MDNS_POINTER_DIFF(data, buffer);
+	}
+
+	if (!remain)
+		return 0;
+
+	*(unsigned char*)data = 0;
+	return MDNS_POINTER_OFFSET(data, 1);
+}
+
+static int
+mdns_message_parse(const void* buffer, size_t size, mdns_message_t* message,
+                   mdns_message_record_t* records, size_t capacity) {
+	memset(message, 0, sizeof(mdns_message_t));
+	message->buffer = buffer;
+	message->size = size;
+	message->records = records;
+	if (size < sizeof(struct mdns_header_t))
+		return -1;
+
+	const uint16_t* data = (const uint16_t*)buffer;
+	message->query_id = mdns_ntohs(data++);
+	message->flags = mdns_ntohs(data++);
+	for (int isection = 0; isection < 4; ++isection)
+		message->declared[isection] = mdns_ntohs(data++);
+
+	size_t offset = sizeof(struct mdns_header_t);
+	size_t total = 0;
+	for (int isection = 0; isection < 4; ++isection) {
+		message->first[isection] = total;
+		for (size_t irec = 0; irec < message->declared[isection]; ++irec) {
+			message->end = offset;
+			if (total >= capacity)
+				return 1;
+			mdns_message_record_t* record = records + total;
+			record->name_offset = offset;
+			if (!mdns_string_skip(buffer, size, &offset))
+				return 1;
+			record->name_length = offset - record->name_offset;
+			size_t header_size = (isection == MDNS_ENTRYTYPE_QUESTION) ? 4 : 10;
+			if ((offset + header_size) > size)
+				return 1;
+			const void* rdata = MDNS_POINTER_OFFSET_CONST(buffer, offset);
+			record->rtype = mdns_ntohs(rdata);
+			record->rclass = mdns_ntohs(MDNS_POINTER_OFFSET_CONST(rdata, 2));
+			record->ttl = 0;
+			record->data_offset = 0;
+			record->data_length = 0;
+			offset += header_size;
+			if (isection != MDNS_ENTRYTYPE_QUESTION) {
+				record->ttl = mdns_ntohl(MDNS_POINTER_OFFSET_CONST(rdata, 4));
+				record->data_length = mdns_ntohs(MDNS_POINTER_OFFSET_CONST(rdata, 8));
+				record->data_offset = offset;
+				if (record->data_length > (size - offset))
+					return 1;
+				offset += record->data_length;
+			}
+			++message->count[isection];
+			++total;
+		}
+	}
+	message->end = offset;
+	return 0;
+}
+
+static size_t
+mdns_message_record_count(const mdns_message_t* message, mdns_entry_type_t section) {
+	return message->count[section];
+}
+
+static const mdns_message_record_t*
+mdns_message_record(const mdns_message_t* message, mdns_entry_type_t section, size_t index) {
+	if (index >= message->count[section])
+		return 0;
+	return message->records + message->first[section] + index;
+}
+
+static int
+mdns_message_dispatch(int sock, const struct sockaddr* from, size_t addrlen,
+                      const mdns_message_t* message, mdns_entry_type_t section,
+                      mdns_record_callback_fn callback, void* user_data, size_t* parsed) {
+	const mdns_message_record_t* record = message->records + message->first[section];
+	for (size_t irec = 0; irec < message->count[section]; ++irec, ++record) {
+		++(*parsed);
+		size_t record_offset = record->data_offset;
+		size_t record_length = record->data_length;
+		if (section == MDNS_ENTRYTYPE_QUESTION) {
+			record_offset = record->name_offset;
+			record_length = record->name_length;
+		}
+		if (callback &&
+		    callback(sock, from, addrlen, section, message->query_id, record->rtype,
+		             record->rclass, record->ttl, message->buffer, message->size,
+		             record->name_offset, record->name_length, record_offset, record_length,
+		             user_data))
+			return 1;
+	}
+	return 0;
 }
 
 static int
@@ -784,44 +3010,208 @@ mdns_unicast_send(int sock, const void* address, size_t address_size, const void
 	return 0;
 }
 
-static int
-mdns_multicast_send(int sock, const void* buffer, size_t size) {
-	struct sockaddr_storage addr_storage;
-	struct sockaddr_in addr;
-	struct sockaddr_in6 addr6;
-	struct sockaddr* saddr = (struct sockaddr*)&addr_storage;
+// Get the mDNS multicast group address for the address family of the socket. Returns the length
+// of the address, or 0 if error
+static socklen_t
+mdns_multicast_address(int sock, struct sockaddr_storage* addr_storage) {
+	struct sockaddr* saddr = (struct sockaddr*)addr_storage;
 	socklen_t saddrlen = sizeof(struct sockaddr_storage);
 	if (getsockname(sock, saddr, &saddrlen))
-		return -1;
+		return 0;
 	if (saddr->sa_family == AF_INET6) {
-		memset(&addr6, 0, sizeof(addr6));
-		addr6.sin6_family = AF_INET6;
+		struct sockaddr_in6* addr6 = (struct sockaddr_in6*)addr_storage;
+		memset(addr6, 0, sizeof(struct sockaddr_in6));
+		addr6->sin6_family = AF_INET6;
 #ifdef __APPLE__
-		addr6.sin6_len = sizeof(addr6);
-#endif
-		addr6.sin6_addr.s6_addr[0] = 0xFF;
-		addr6.sin6_addr.s6_addr[1] = 0x02;
-		addr6.sin6_addr.s6_addr[15] = 0xFB;
-		addr6.sin6_port = htons((unsigned short)MDNS_PORT);
-		saddr = (struct sockaddr*)&addr6;
-		saddrlen = sizeof(addr6);
-	} else {
-		memset(&addr, 0, sizeof(addr));
-		addr.sin_family = AF_INET;
+		addr6->sin6_len = sizeof(struct sockaddr_in6);
+#endif
+		addr6->sin6_addr.s6_addr[0] = 0xFF;
+		addr6->sin6_addr.s6_addr[1] = 0x02;
+		addr6->sin6_addr.s6_addr[15] = 0xFB;
+		addr6->sin6_port = htons((unsigned short)MDNS_PORT);
+		return sizeof(struct sockaddr_in6);
+	}
+	struct sockaddr_in* addr = (struct sockaddr_in*)addr_storage;
+	memset(addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family = AF_INET;
 #ifdef __APPLE__
-		addr.sin_len = sizeof(addr);
+	addr->sin_len = sizeof(struct sockaddr_in);
 #endif
-		addr.sin_addr.s_addr = htonl((((uint32_t)224U) << 24U) | ((uint32_t)251U));
-		addr.sin_port = htons((unsigned short)MDNS_PORT);
-		saddr = (struct sockaddr*)&addr;
-		saddrlen = sizeof(addr);
+	addr->sin_addr.s_addr = htonl((((uint32_t)224U) << 24U) | ((uint32_t)251U));
+	addr->sin_port = htons((unsigned short)MDNS_PORT);
+	return sizeof(struct sockaddr_in);
+}
+
+static int
+mdns_multicast_send(int sock, const void* buffer, size_t size) {
+	struct sockaddr_storage addr_storage;
+	socklen_t saddrlen = mdns_multicast_address(sock, &addr_storage);
+	if (!saddrlen)
+		return -1;
+
+	if (sendto(sock, (const char*)buffer, (mdns_size_t)size, 0, (struct sockaddr*)&addr_storage,
+	           saddrlen) < 0)
+		return -1;
+	return 0;
+}
+
+#ifdef MDNS_HAVE_PKTINFO
+// Add packet info ancillary data selecting the outgoing interface to a message, leaving the source
+// address to the system. The control buffer must hold CMSG_SPACE(sizeof(struct in6_pktinfo))
+// bytes and be aligned for a cmsghdr
+static void
+mdns_multicast_control(struct msghdr* msg, void* control, int family,
+                       unsigned int interface_index) {
+	struct cmsghdr* cmsg = (struct cmsghdr*)control;
+	memset(control, 0, CMSG_SPACE(sizeof(struct in6_pktinfo)));
+	msg->msg_control = control;
+	if (family == AF_INET6) {
+		struct in6_pktinfo pktinfo;
+		memset(&pktinfo, 0, sizeof(pktinfo));
+		pktinfo.ipi6_ifindex = interface_index;
+		cmsg->cmsg_level = IPPROTO_IPV6;
+		cmsg->cmsg_type = IPV6_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(pktinfo));
+		memcpy(CMSG_DATA(cmsg), &pktinfo, sizeof(pktinfo));
+		msg->msg_controllen = CMSG_SPACE(sizeof(pktinfo));
+	} else {
+		struct in_pktinfo pktinfo;
+		memset(&pktinfo, 0, sizeof(pktinfo));
+		pktinfo.ipi_ifindex = (int)interface_index;
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_PKTINFO;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(pktinfo));
+		memcpy(CMSG_DATA(cmsg), &pktinfo, sizeof(pktinfo));
+		msg->msg_controllen = CMSG_SPACE(sizeof(pktinfo));
 	}
+}
+#endif
+
+static int
+mdns_multicast_send_interface(int sock, const void* buffer, size_t size,
+                              unsigned int interface_index) {
+#ifdef MDNS_HAVE_PKTINFO
+	if (!interface_index)
+		return mdns_multicast_send(sock, buffer, size);
+
+	struct sockaddr_storage addr_storage;
+	socklen_t saddrlen = mdns_multicast_address(sock, &addr_storage);
+	if (!saddrlen)
+		return -1;
+
+	union {
+		struct cmsghdr header;
+		char data[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+	} control;
+	struct iovec iov;
+	iov.iov_base = (void*)(uintptr_t)buffer;
+	iov.iov_len = size;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr_storage;
+	msg.msg_namelen = saddrlen;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	mdns_multicast_control(&msg, control.data, addr_storage.ss_family, interface_index);
+
+	if (sendmsg(sock, &msg, 0) < 0)
+		return -1;
+	return 0;
+#else
+	(void)sizeof(interface_index);
+	return mdns_multicast_send(sock, buffer, size);
+#endif
+}
 
-	if (sendto(sock, (const char*)buffer, (mdns_size_t)size, 0, saddr, saddrlen) < 0)
+static int
+mdns_socket_context_initialize(mdns_socket_context_t* context, int sock,
+                               unsigned int interface_index) {
+	memset(context, 0, sizeof(mdns_socket_context_t));
+	context->sock = sock;
+	context->interface_index = interface_index;
+	context->group_length = mdns_multicast_address(sock, &context->group);
+	if (!context->group_length)
 		return -1;
+	context->family = context->group.ss_family;
 	return 0;
 }
 
+static int
+mdns_multicast_send_context(const mdns_socket_context_t* context, const void* buffer,
+                            size_t size) {
+#ifdef MDNS_HAVE_PKTINFO
+	if (context->interface_index) {
+		uint64_t control[(CMSG_SPACE(sizeof(struct in6_pktinfo)) + 7) / 8];
+		struct iovec iov;
+		iov.iov_base = (void*)(uintptr_t)buffer;
+		iov.iov_len = size;
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = (void*)(uintptr_t)&context->group;
+		msg.msg_namelen = (socklen_t)context->group_length;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		mdns_multicast_control(&msg, control, context->family, context->interface_index);
+		if (sendmsg(context->sock, &msg, 0) < 0)
+			return -1;
+		return 0;
+	}
+#endif
+	return mdns_unicast_send(context->sock, &context->group, context->group_length, buffer, size);
+}
+
+static size_t
+mdns_multicast_send_contexts(const mdns_socket_context_t* contexts, size_t count,
+                             const void* buffer, size_t size) {
+	size_t sent = 0;
+#ifdef MDNS_HAVE_SENDMMSG
+	struct mmsghdr msgs[MDNS_SEND_BATCH_MAX];
+	uint64_t control[MDNS_SEND_BATCH_MAX][(CMSG_SPACE(sizeof(struct in6_pktinfo)) + 7) / 8];
+	struct iovec iov;
+	iov.iov_base = (void*)(uintptr_t)buffer;
+	iov.iov_len = size;
+	size_t icontext = 0;
+	while (icontext < count) {
+		// Batch the consecutive contexts on the same socket, all sharing the datagram buffer
+		int sock = contexts[icontext].sock;
+		size_t batch = 0;
+		while (((icontext + batch) < count) && (contexts[icontext + batch].sock == sock) &&
+		       (batch < MDNS_SEND_BATCH_MAX)) {
+			const mdns_socket_context_t* context = contexts + icontext + batch;
+			struct msghdr* msg = &msgs[batch].msg_hdr;
+			memset(&msgs[batch], 0, sizeof(struct mmsghdr));
+			msg->msg_name = (void*)(uintptr_t)&context->group;
+			msg->msg_namelen = (socklen_t)context->group_length;
+			msg->msg_iov = &iov;
+			msg->msg_iovlen = 1;
+			if (context->interface_index)
+				mdns_multicast_control(msg, control[batch], context->family,
+				                       context->interface_index);
+			++batch;
+		}
+		icontext += batch;
+
+		// Skip a datagram failing to send and continue with the rest of the batch
+		size_t done = 0;
+		while (done < batch) {
+			int ret = sendmmsg(sock, msgs + done, (unsigned int)(batch - done), 0);
+			if (ret <= 0) {
+				++done;
+				continue;
+			}
+			sent += (size_t)ret;
+			done += (size_t)ret;
+		}
+	}
+#else
+	for (size_t icontext = 0; icontext < count; ++icontext) {
+		if (!mdns_multicast_send_context(contexts + icontext, buffer, size))
+			++sent;
+	}
+#endif
+	return sent;
+}
+
 static const uint8_t mdns_services_query[] = {
     // Query ID
     0x00, 0x00,
@@ -858,19 +3248,19 @@ mdns_discovery_recv(int sock, void* buffer, size_t capacity, mdns_record_callbac
 	if (ret <= 0)
 		return 0;
 
-	size_t data_size = (size_t)ret;
-	size_t records = 0;
-	const uint16_t* data = (uint16_t*)buffer;
+	return mdns_discovery_parse(sock, saddr, addrlen, buffer, (size_t)ret, callback, user_data);
+}
 
-	uint16_t query_id = mdns_ntohs(data++);
-	uint16_t flags = mdns_ntohs(data++);
-	uint16_t questions = mdns_ntohs(data++);
-	uint16_t answer_rrs = mdns_ntohs(data++);
-	uint16_t authority_rrs = mdns_ntohs(data++);
-	uint16_t additional_rrs = mdns_ntohs(data++);
+static size_t
+mdns_discovery_parse(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer,
+                     size_t size, mdns_record_callback_fn callback, void* user_data) {
+	mdns_message_t message;
+	mdns_message_record_t records[MDNS_MAX_MESSAGE_RECORDS];
+	if (mdns_message_parse(buffer, size, &message, records, MDNS_MAX_MESSAGE_RECORDS) < 0)
+		return 0;
 
 	// According to RFC 6762 the query ID MUST match the sent query ID (which is 0 in our case)
-	if (query_id || (flags != 0x8400))
+	if (message.query_id || (message.flags != 0x8400))
 		return 0;  // Not a reply to our question
 
 	// It seems some implementations do not fill the correct questions field,
@@ -880,72 +3270,45 @@ mdns_discovery_recv(int sock, void* buffer, size_t capacity, mdns_record_callbac
 	    return 0;
 	*/
 
-	int i;
-	for (i = 0; i < questions; ++i) {
-		size_t ofs = MDNS_POINTER_DIFF(data, buffer);
+	if (message.count[MDNS_ENTRYTYPE_QUESTION] != message.declared[MDNS_ENTRYTYPE_QUESTION])
+		return 0;
+	const mdns_message_record_t* record = records;
+	for (size_t irec = 0; irec < message.count[MDNS_ENTRYTYPE_QUESTION]; ++irec, ++record) {
+		size_t ofs = record->name_offset;
 		size_t verify_ofs = 12;
 		// Verify it's our question, _services._dns-sd._udp.local.
-		if (!mdns_string_equal(buffer, data_size, &ofs, mdns_services_query,
+		if (!mdns_string_equal(buffer, size, &ofs, mdns_services_query,
 		                       sizeof(mdns_services_query), &verify_ofs))
 			return 0;
-		data = (const uint16_t*)MDNS_POINTER_OFFSET(buffer, ofs);
-
-		uint16_t rtype = mdns_ntohs(data++);
-		uint16_t rclass = mdns_ntohs(data++);
 
 		// Make sure we get a reply based on our PTR question for class IN
-		if ((rtype != MDNS_RECORDTYPE_PTR) || ((rclass & 0x7FFF) != MDNS_CLASS_IN))
+		if ((record->rtype != MDNS_RECORDTYPE_PTR) ||
+		    ((record->rclass & 0x7FFF) != MDNS_CLASS_IN))
 			return 0;
 	}
 
-	for (i = 0; i < answer_rrs; ++i) {
-		size_t ofs = MDNS_POINTER_DIFF(data, buffer);
+	size_t parsed = 0;
+	for (size_t irec = 0; irec < message.count[MDNS_ENTRYTYPE_ANSWER]; ++irec, ++record) {
+		size_t ofs = record->name_offset;
 		size_t verify_ofs = 12;
 		// Verify it's an answer to our question, _services._dns-sd._udp.local.
-		size_t name_offset = ofs;
-		int is_answer = mdns_string_equal(buffer, data_size, &ofs, mdns_services_query,
-		                                  sizeof(mdns_services_query), &verify_ofs);
-		size_t name_length = ofs - name_offset;
-		if ((ofs + 10) > data_size)
-			return records;
-		data = (const uint16_t*)MDNS_POINTER_OFFSET(buffer, ofs);
-
-		uint16_t rtype = mdns_ntohs(data++);
-		uint16_t rclass = mdns_ntohs(data++);
-		uint32_t ttl = mdns_ntohl(data);
-		data += 2;
-		uint16_t length = mdns_ntohs(data++);
-		if (length > (data_size - ofs))
-			return 0;
-
-		if (is_answer) {
-			++records;
-			ofs = MDNS_POINTER_DIFF(data, buffer);
-			if (callback &&
-			    callback(sock, saddr, addrlen, MDNS_ENTRYTYPE_ANSWER, query_id, rtype, rclass, ttl,
-			             buffer, data_size, name_offset, name_length, ofs, length, user_data))
-				return records;
-		}
-		data = (const uint16_t*)MDNS_POINTER_OFFSET_CONST(data, length);
+		if (!mdns_string_equal(buffer, size, &ofs, mdns_services_query,
+		                       sizeof(mdns_services_query), &verify_ofs))
+			continue;
+		++parsed;
+		if (callback && callback(sock, from, addrlen, MDNS_ENTRYTYPE_ANSWER, message.query_id,
+		                         record->rtype, record->rclass, record->ttl, buffer, size,
+		                         record->name_offset, record->name_length, record->data_offset,
+		                         record->data_length, user_data))
+			return parsed;
 	}
 
-	size_t total_records = records;
-	size_t offset = MDNS_POINTER_DIFF(data, buffer);
-	records =
-	    mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
-	                       MDNS_ENTRYTYPE_AUTHORITY, query_id, authority_rrs, callback, user_data);
-	total_records += records;
-	if (records != authority_rrs)
-		return total_records;
-
-	records = mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
-	                             MDNS_ENTRYTYPE_ADDITIONAL, query_id, additional_rrs, callback,
-	                             user_data);
-	total_records += records;
-	if (records != additional_rrs)
-		return total_records;
-
-	return total_records;
+	if (mdns_message_dispatch(sock, from, addrlen, &message, MDNS_ENTRYTYPE_AUTHORITY, callback,
+	                          user_data, &parsed))
+		return parsed;
+	mdns_message_dispatch(sock, from, addrlen, &message, MDNS_ENTRYTYPE_ADDITIONAL, callback,
+	                      user_data, &parsed);
+	return parsed;
 }
 
 static size_t
@@ -962,63 +3325,56 @@ mdns_socket_listen(int sock, void* buffer, size_t capacity, mdns_record_callback
 	if (ret <= 0)
 		return 0;
 
-	size_t data_size = (size_t)ret;
-	const uint16_t* data = (const uint16_t*)buffer;
+	return mdns_listen_parse(sock, saddr, addrlen, buffer, (size_t)ret, callback, user_data);
+}
 
-	uint16_t query_id = mdns_ntohs(data++);
-	uint16_t flags = mdns_ntohs(data++);
-	uint16_t questions = mdns_ntohs(data++);
-	/*
-	This data is unused at the moment, skip
-	uint16_t answer_rrs = mdns_ntohs(data++);
-	uint16_t authority_rrs = mdns_ntohs(data++);
-	uint16_t additional_rrs = mdns_ntohs(data++);
-	*/
-	data += 3;
+static size_t
+mdns_listen_parse(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer,
+                  size_t size, mdns_record_callback_fn callback, void* user_data) {
+	mdns_message_t message;
+	mdns_message_record_t records[MDNS_MAX_MESSAGE_RECORDS];
+	if (mdns_message_parse(buffer, size, &message, records, MDNS_MAX_MESSAGE_RECORDS) < 0)
+		return 0;
+	return mdns_listen_message(sock, from, addrlen, &message, callback, user_data);
+}
 
+static size_t
+mdns_listen_message(int sock, const struct sockaddr* from, size_t addrlen,
+                    const mdns_message_t* message, mdns_record_callback_fn callback,
+                    void* user_data) {
+	const void* buffer = message->buffer;
+	size_t size = message->size;
 	size_t parsed = 0;
-	for (int iquestion = 0; iquestion < questions; ++iquestion) {
-		size_t question_offset = MDNS_POINTER_DIFF(data, buffer);
-		size_t offset = question_offset;
-		size_t verify_ofs = 12;
-		int dns_sd = 0;
-		if (mdns_string_equal(buffer, data_size, &offset, mdns_services_query,
-		                      sizeof(mdns_services_query), &verify_ofs)) {
-			dns_sd = 1;
-		} else {
-			offset = question_offset;
-			if (!mdns_string_skip(buffer, data_size, &offset))
-				break;
-		}
-		size_t length = offset - question_offset;
-		data = (const uint16_t*)MDNS_POINTER_OFFSET_CONST(buffer, offset);
-
-		uint16_t rtype = mdns_ntohs(data++);
-		uint16_t rclass = mdns_ntohs(data++);
-
+	for (size_t irec = 0; irec < message->count[MDNS_ENTRYTYPE_QUESTION]; ++irec) {
+		const mdns_message_record_t* record =
+		    mdns_message_record(message, MDNS_ENTRYTYPE_QUESTION, irec);
 		// Make sure we get a question of class IN
-		if ((rclass & 0x7FFF) != MDNS_CLASS_IN)
+		if ((record->rclass & 0x7FFF) != MDNS_CLASS_IN)
 			break;
-		if (dns_sd && flags)
-			continue;
+
+		if (message->flags) {
+			size_t offset = record->name_offset;
+			size_t verify_ofs = 12;
+			if (mdns_string_equal(buffer, size, &offset, mdns_services_query,
+			                      sizeof(mdns_services_query), &verify_ofs))
+				continue;
+		}
 
 		++parsed;
-		if (callback && callback(sock, saddr, addrlen, MDNS_ENTRYTYPE_QUESTION, query_id, rtype,
-		                         rclass, 0, buffer, data_size, question_offset, length,
-		                         question_offset, length, user_data))
+		if (callback && callback(sock, from, addrlen, MDNS_ENTRYTYPE_QUESTION, message->query_id,
+		                         record->rtype, record->rclass, 0, buffer, size,
+		                         record->name_offset, record->name_length, record->name_offset,
+		                         record->name_length, user_data))
 			break;
 	}
 
 	return parsed;
 }
 
-static int
-mdns_query_send(int sock, mdns_record_type_t type, const char* name, size_t length, void* buffer,
-                size_t capacity, uint16_t query_id) {
-	if (capacity < (17 + length))
-		return -1;
-
-	// Ask for a unicast response since it's a one-shot query
+// Get the question class of a one-shot query, asking for a unicast response unless the socket is
+// bound to the mDNS port
+static uint16_t
+mdns_query_class(int sock) {
 	uint16_t rclass = MDNS_CLASS_IN | MDNS_UNICAST_RESPONSE;
 
 	struct sockaddr_storage addr_storage;
@@ -1032,35 +3388,159 @@ mdns_query_send(int sock, mdns_record_type_t type, const char* name, size_t leng
 		         (ntohs(((struct sockaddr_in6*)saddr)->sin6_port) == MDNS_PORT))
 			rclass &= ~MDNS_UNICAST_RESPONSE;
 	}
+	return rclass;
+}
 
-	struct mdns_header_t* header = (struct mdns_header_t*)buffer;
-	// Query ID
-	header->query_id = htons(query_id);
-	// Flags
-	header->flags = 0;
-	// Questions
-	header->questions = htons(1);
-	// No answer, authority or additional RRs
-	header->answer_rrs = 0;
-	header->authority_rrs = 0;
-	header->additional_rrs = 0;
-	// Fill in question
-	// Name string
-	void* data = MDNS_POINTER_OFFSET(buffer, sizeof(struct mdns_header_t));
-	data = mdns_string_make(buffer, capacity, data, name, length, 0);
-	if (!data)
+// Build a query packet with the given questions in the buffer, with the given class for each
+// question, or the class of a one-shot query from the socket if null. Returns the size of the
+// packet, or 0 if the questions do not fit
+static size_t
+mdns_query_build(int sock, const mdns_query_t* query, const uint16_t* rclass, size_t count,
+                 void* buffer, size_t capacity, uint16_t query_id) {
+	mdns_packet_builder_t builder;
+	if (!count || mdns_packet_builder_begin(&builder, buffer, capacity, query_id, 0))
+		return 0;
+	uint16_t sock_class = rclass ? 0 : mdns_query_class(sock);
+	for (size_t iquery = 0; iquery < count; ++iquery) {
+		if (mdns_packet_builder_add_question(&builder, query[iquery].type, query[iquery].name,
+		                                     query[iquery].length,
+		                                     rclass ? rclass[iquery] : sock_class))
+			return 0;
+	}
+	return mdns_packet_builder_finish(&builder);
+}
+
+static int
+mdns_query_send(int sock, mdns_record_type_t type, const char* name, size_t length, void* buffer,
+                size_t capacity, uint16_t query_id) {
+	mdns_query_t query;
+	query.type = type;
+	query.name = name;
+	query.length = length;
+	return mdns_multiquery_send(sock, &query, 1, buffer, capacity, query_id);
+}
+
+static int
+mdns_query_send_known_answers(int sock, mdns_record_type_t type, const char* name, size_t length,
+                              void* buffer, size_t capacity, uint16_t query_id,
+                              const mdns_cache_t* cache, uint64_t now) {
+	mdns_query_t query;
+	query.type = type;
+	query.name = name;
+	query.length = length;
+	return mdns_multiquery_send_known_answers(sock, &query, 1, buffer, capacity, query_id, cache,
+	                                          now);
+}
+
+static int
+mdns_multiquery_send(int sock, const mdns_query_t* query, size_t count, void* buffer,
+                     size_t capacity, uint16_t query_id) {
+	size_t size = mdns_query_build(sock, query, 0, count, buffer, capacity, query_id);
+	if (!size)
 		return -1;
-	// Record type
-	data = mdns_htons(data, type);
-	//! Optional unicast response based on local port, class IN
-	data = mdns_htons(data, rclass);
+	if (mdns_multicast_send(sock, buffer, size))
+		return -1;
+	return query_id;
+}
+
+// Send a query with the given questions and question classes, or the class of a one-shot query from
+// the socket if null, listing the cached records answering the questions as known answers
+static int
+mdns_multiquery_send_cached(int sock, const mdns_query_t* query, const uint16_t* rclass,
+                            size_t count, void* buffer, size_t capacity, uint16_t query_id,
+                            const mdns_cache_t* cache, uint64_t now) {
+	size_t limit = (capacity < MDNS_PACKET_SIZE_MAX) ? capacity : MDNS_PACKET_SIZE_MAX;
+	size_t size = mdns_query_build(sock, query, rclass, count, buffer, limit, query_id);
+	if (!size)
+		return -1;
+
+	struct mdns_header_t* header = (struct mdns_header_t*)buffer;
+	void* data = MDNS_POINTER_OFFSET(buffer, size);
+	uint16_t known_count = 0;
+	int continued = 0;
+	size_t question_offset = sizeof(struct mdns_header_t);
+	for (size_t iquery = 0; cache && (iquery < count); ++iquery) {
+		// The known answers of a question have the question name, referenced from the question in
+		// the first packet and from the first known answer in continuation packets
+		size_t name_ref = MDNS_INVALID_POS;
+		if (!continued) {
+			const uint8_t* question = (const uint8_t*)MDNS_POINTER_OFFSET(buffer, question_offset);
+			name_ref = question_offset;
+			if ((question[0] & 0xC0) == 0xC0)
+				name_ref = ((size_t)(question[0] & 0x3F) << 8) | question[1];
+			mdns_string_skip(buffer, size, &question_offset);
+			question_offset += 4;
+		}
+
+		mdns_record_type_t type = query[iquery].type;
+		mdns_string_t name_string = {query[iquery].name, query[iquery].length};
+		uint64_t hash = mdns_name_hash_string(MDNS_STRING_ARGS(name_string));
+		size_t index = MDNS_INVALID_POS;
+		if (cache->count && cache->bucket_count)
+			index = cache->bucket[hash % cache->bucket_count];
+		while (index != MDNS_INVALID_POS) {
+			const mdns_cache_entry_t* entry = cache->entry + index;
+			index = entry->next;
+			if ((entry->expire <= now) || (entry->hash != hash) ||
+			    ((type != MDNS_RECORDTYPE_ANY) && (entry->rtype != type)) ||
+			    !mdns_name_equal(cache->arena, cache->arena_used, entry->name_offset,
+			                     MDNS_STRING_ARGS(name_string)))
+				continue;
+			uint32_t ttl = (uint32_t)((entry->expire - now) / 1000);
+			if ((ttl * 2) < entry->ttl)
+				continue;
+
+			size_t record_size = 10 + entry->data_length;
+			size_t name_size = (name_ref != MDNS_INVALID_POS) ? 2 : entry->name_length;
+			if ((limit - MDNS_POINTER_DIFF(data, buffer)) < (name_size + record_size)) {
+				if ((limit - sizeof(struct mdns_header_t)) < (entry->name_length + record_size))
+					continue;
+				// Send the packet with the TC bit set and continue in a packet without questions
+				header->flags = htons(MDNS_TRUNCATED);
+				header->answer_rrs = htons(known_count);
+				if (mdns_multicast_send(sock, buffer, MDNS_POINTER_DIFF(data, buffer)))
+					return -1;
+				header->questions = 0;
+				known_count = 0;
+				continued = 1;
+				name_ref = MDNS_INVALID_POS;
+				data = MDNS_POINTER_OFFSET(buffer, sizeof(struct mdns_header_t));
+			}
+
+			if (name_ref != MDNS_INVALID_POS) {
+				data = mdns_string_make_ref(data, 2, name_ref);
+			} else {
+				name_ref = MDNS_POINTER_DIFF(data, buffer);
+				memcpy(data, MDNS_POINTER_OFFSET_CONST(cache->arena, entry->name_offset),
+				       entry->name_length);
+				data = MDNS_POINTER_OFFSET(data, entry->name_length);
+			}
+			data = mdns_htons(data, entry->rtype);
+			data = mdns_htons(data, entry->rclass & ~MDNS_CACHE_FLUSH);
+			data = mdns_htonl(data, ttl);
+			data = mdns_htons(data, (uint16_t)entry->data_length);
+			memcpy(data, MDNS_POINTER_OFFSET_CONST(cache->arena, entry->data_offset),
+			       entry->data_length);
+			data = MDNS_POINTER_OFFSET(data, entry->data_length);
+			++known_count;
+		}
+	}
 
-	size_t tosend = MDNS_POINTER_DIFF(data, buffer);
-	if (mdns_multicast_send(sock, buffer, (size_t)tosend))
+	header->flags = 0;
+	header->answer_rrs = htons(known_count);
+	if (mdns_multicast_send(sock, buffer, MDNS_POINTER_DIFF(data, buffer)))
 		return -1;
 	return query_id;
 }
 
+static int
+mdns_multiquery_send_known_answers(int sock, const mdns_query_t* query, size_t count,
+                                   void* buffer, size_t capacity, uint16_t query_id,
+                                   const mdns_cache_t* cache, uint64_t now) {
+	return mdns_multiquery_send_cached(sock, query, 0, count, buffer, capacity, query_id, cache,
+	                                   now);
+}
+
 static size_t
 mdns_query_recv(int sock, void* buffer, size_t capacity, mdns_record_callback_fn callback,
                 void* user_data, int only_query_id) {
@@ -1075,83 +3555,164 @@ mdns_query_recv(int sock, void* buffer, size_t capacity, mdns_record_callback_fn
 	if (ret <= 0)
 		return 0;
 
-	size_t data_size = (size_t)ret;
-	const uint16_t* data = (const uint16_t*)buffer;
-
-	uint16_t query_id = mdns_ntohs(data++);
-	uint16_t flags = mdns_ntohs(data++);
-	uint16_t questions = mdns_ntohs(data++);
-	uint16_t answer_rrs = mdns_ntohs(data++);
-	uint16_t authority_rrs = mdns_ntohs(data++);
-	uint16_t additional_rrs = mdns_ntohs(data++);
-	(void)sizeof(flags);
+	return mdns_query_parse(sock, saddr, addrlen, buffer, (size_t)ret, callback, user_data,
+	                        only_query_id);
+}
 
-	if ((only_query_id > 0) && (query_id != only_query_id))
+static size_t
+mdns_query_parse(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer,
+                 size_t size, mdns_record_callback_fn callback, void* user_data,
+                 int only_query_id) {
+	mdns_message_t message;
+	mdns_message_record_t records[MDNS_MAX_MESSAGE_RECORDS];
+	if (mdns_message_parse(buffer, size, &message, records, MDNS_MAX_MESSAGE_RECORDS) < 0)
+		return 0;
+
+	if ((only_query_id > 0) && (message.query_id != only_query_id))
 		return 0;  // Not a reply to the wanted one-shot query
 
-	if (questions > 1)
+	if ((message.declared[MDNS_ENTRYTYPE_QUESTION] > 1) ||
+	    (message.count[MDNS_ENTRYTYPE_QUESTION] != message.declared[MDNS_ENTRYTYPE_QUESTION]))
 		return 0;
 
-	// Skip questions part
-	int i;
-	for (i = 0; i < questions; ++i) {
-		size_t ofs = MDNS_POINTER_DIFF(data, buffer);
-		if (!mdns_string_skip(buffer, data_size, &ofs))
-			return 0;
-		data = (const uint16_t*)MDNS_POINTER_OFFSET_CONST(buffer, ofs);
-		/* Record type and class not used, skip
-		uint16_t rtype = mdns_ntohs(data++);
-		uint16_t rclass = mdns_ntohs(data++);*/
-		data += 2;
+	size_t parsed = 0;
+	for (int isection = MDNS_ENTRYTYPE_ANSWER; isection <= MDNS_ENTRYTYPE_ADDITIONAL; ++isection) {
+		if (mdns_message_dispatch(sock, from, addrlen, &message, (mdns_entry_type_t)isection,
+		                          callback, user_data, &parsed))
+			break;
+	}
+	return parsed;
+}
+
+static size_t
+mdns_socket_recv_batch(int sock, void** buffers, size_t count, size_t capacity, size_t* sizes,
+                       struct sockaddr_in6* addrs, size_t* addrlens, int wait) {
+	if (count > MDNS_RECV_BATCH_MAX)
+		count = MDNS_RECV_BATCH_MAX;
+	memset(addrs, 0, sizeof(struct sockaddr_in6) * count);
+#ifdef MDNS_HAVE_RECVMMSG
+	struct mmsghdr msgs[MDNS_RECV_BATCH_MAX];
+	struct iovec iov[MDNS_RECV_BATCH_MAX];
+	memset(msgs, 0, sizeof(struct mmsghdr) * count);
+	for (size_t imsg = 0; imsg < count; ++imsg) {
+		iov[imsg].iov_base = buffers[imsg];
+		iov[imsg].iov_len = capacity;
+		msgs[imsg].msg_hdr.msg_name = &addrs[imsg];
+		msgs[imsg].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+		msgs[imsg].msg_hdr.msg_iov = &iov[imsg];
+		msgs[imsg].msg_hdr.msg_iovlen = 1;
+	}
+	// Block (if socket is blocking) until the first datagram arrives, then take what is queued
+	int ret = recvmmsg(sock, msgs, (unsigned int)count, wait ? MSG_WAITFORONE : MSG_DONTWAIT, 0);
+	if (ret <= 0)
+		return 0;
+	for (int imsg = 0; imsg < ret; ++imsg) {
+		sizes[imsg] = msgs[imsg].msg_len;
+		addrlens[imsg] = msgs[imsg].msg_hdr.msg_namelen;
+	}
+	return (size_t)ret;
+#else
+	size_t received = 0;
+	while (received < count) {
+		struct sockaddr* saddr = (struct sockaddr*)&addrs[received];
+		socklen_t addrlen = sizeof(struct sockaddr_in6);
+#ifdef __APPLE__
+		saddr->sa_len = sizeof(struct sockaddr_in6);
+#endif
+		int flags = 0;
+		if (received || !wait) {
+			// Only the first read is allowed to block
+#ifdef _WIN32
+			unsigned long pending = 0;
+			if (ioctlsocket(sock, FIONREAD, &pending) || !pending)
+				break;
+#else
+			flags = MSG_DONTWAIT;
+#endif
+		}
+		mdns_ssize_t ret = recvfrom(sock, (char*)buffers[received], (mdns_size_t)capacity, flags,
+		                            saddr, &addrlen);
+		if (ret <= 0)
+			break;
+		sizes[received] = (size_t)ret;
+		addrlens[received] = (size_t)addrlen;
+		++received;
 	}
+	return received;
+#endif
+}
 
+static size_t
+mdns_recv_batch(int sock, void** buffers, size_t buffer_count, size_t capacity,
+                mdns_datagram_parse_fn parse, mdns_record_callback_fn callback, void* user_data,
+                int query_id) {
+	size_t sizes[MDNS_RECV_BATCH_MAX];
+	size_t addrlens[MDNS_RECV_BATCH_MAX];
+	struct sockaddr_in6 addrs[MDNS_RECV_BATCH_MAX];
 	size_t records = 0;
-	size_t total_records = 0;
-	size_t offset = MDNS_POINTER_DIFF(data, buffer);
-	records = mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
-	                             MDNS_ENTRYTYPE_ANSWER, query_id, answer_rrs, callback, user_data);
-	total_records += records;
-	if (records != answer_rrs)
-		return total_records;
-
-	records =
-	    mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
-	                       MDNS_ENTRYTYPE_AUTHORITY, query_id, authority_rrs, callback, user_data);
-	total_records += records;
-	if (records != authority_rrs)
-		return total_records;
-
-	records = mdns_records_parse(sock, saddr, addrlen, buffer, data_size, &offset,
-	                             MDNS_ENTRYTYPE_ADDITIONAL, query_id, additional_rrs, callback,
-	                             user_data);
-	total_records += records;
-	if (records != additional_rrs)
-		return total_records;
-
-	return total_records;
+	size_t ibuf = 0;
+	while (ibuf < buffer_count) {
+		size_t count = buffer_count - ibuf;
+		if (count > MDNS_RECV_BATCH_MAX)
+			count = MDNS_RECV_BATCH_MAX;
+		size_t received = mdns_socket_recv_batch(sock, buffers + ibuf, count, capacity, sizes,
+		                                         addrs, addrlens, !ibuf);
+		for (size_t imsg = 0; imsg < received; ++imsg)
+			records += parse(sock, (const struct sockaddr*)&addrs[imsg], addrlens[imsg],
+			                 buffers[ibuf + imsg], sizes[imsg], callback, user_data, query_id);
+		ibuf += received;
+		// Socket queue drained
+		if (received < count)
+			break;
+	}
+	return records;
 }
 
-static void*
-mdns_answer_add_question_unicast(void* buffer, size_t capacity, void* data,
-                                 mdns_record_type_t record_type, const char* name,
-                                 size_t name_length, mdns_string_table_t* string_table) {
-	data = mdns_string_make(buffer, capacity, data, name, name_length, string_table);
-	if (!data)
-		return 0;
-	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
-	if (remain < 4)
-		return 0;
+static size_t
+mdns_listen_parse_batch(int sock, const struct sockaddr* from, size_t addrlen, const void* buffer,
+                        size_t size, mdns_record_callback_fn callback, void* user_data,
+                        int query_id) {
+	(void)sizeof(query_id);
+	return mdns_listen_parse(sock, from, addrlen, buffer, size, callback, user_data);
+}
 
-	data = mdns_htons(data, record_type);
-	data = mdns_htons(data, MDNS_UNICAST_RESPONSE | MDNS_CLASS_IN);
+static size_t
+mdns_discovery_parse_batch(int sock, const struct sockaddr* from, size_t addrlen,
+                           const void* buffer, size_t size, mdns_record_callback_fn callback,
+                           void* user_data, int query_id) {
+	(void)sizeof(query_id);
+	return mdns_discovery_parse(sock, from, addrlen, buffer, size, callback, user_data);
+}
 
-	return data;
+static size_t
+mdns_socket_listen_batch(int sock, void** buffers, size_t buffer_count, size_t capacity,
+                         mdns_record_callback_fn callback, void* user_data) {
+	return mdns_recv_batch(sock, buffers, buffer_count, capacity, mdns_listen_parse_batch,
+	                       callback, user_data, 0);
+}
+
+static size_t
+mdns_discovery_recv_batch(int sock, void** buffers, size_t buffer_count, size_t capacity,
+                          mdns_record_callback_fn callback, void* user_data) {
+	return mdns_recv_batch(sock, buffers, buffer_count, capacity, mdns_discovery_parse_batch,
+	                       callback, user_data, 0);
+}
+
+static size_t
+mdns_query_recv_batch(int sock, void** buffers, size_t buffer_count, size_t capacity,
+                      mdns_record_callback_fn callback, void* user_data, int query_id) {
+	return mdns_recv_batch(sock, buffers, buffer_count, capacity, mdns_query_parse, callback,
+	                       user_data, query_id);
 }
 
 static void*
 mdns_answer_add_record_header(void* buffer, size_t capacity, void* data, mdns_record_t record,
                               uint16_t rclass, uint32_t ttl, mdns_string_table_t* string_table) {
-	data = mdns_string_make(buffer, capacity, data, record.name.str, record.name.length, string_table);
+	if (record.name_compiled)
+		data = mdns_string_make_name(buffer, capacity, data, record.name_compiled, string_table);
+	else
+		data = mdns_string_make(buffer, capacity, data, record.name.str, record.name.length,
+		                        string_table);
 	if (!data)
 		return 0;
 	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
@@ -1183,8 +3744,12 @@ mdns_answer_add_record(void* buffer, size_t capacity, void* data, mdns_record_t
 	size_t remain = capacity - MDNS_POINTER_DIFF(data, buffer);
 	switch (record.type) {
 		case MDNS_RECORDTYPE_PTR:
-			data = mdns_string_make(buffer, capacity, data, record.data.ptr.name.str,
-			                        record.data.ptr.name.length, string_table);
+			if (record.data.ptr.name_compiled)
+				data = mdns_string_make_name(buffer, capacity, data, record.data.ptr.name_compiled,
+				                             string_table);
+			else
+				data = mdns_string_make(buffer, capacity, data, record.data.ptr.name.str,
+				                        record.data.ptr.name.length, string_table);
 			break;
 
 		case MDNS_RECORDTYPE_SRV:
@@ -1193,8 +3758,12 @@ mdns_answer_add_record(void* buffer, size_t capacity, void* data, mdns_record_t
 			data = mdns_htons(data, record.data.srv.priority);
 			data = mdns_htons(data, record.data.srv.weight);
 			data = mdns_htons(data, record.data.srv.port);
-			data = mdns_string_make(buffer, capacity, data, record.data.srv.name.str,
-			                        record.data.srv.name.length, string_table);
+			if (record.data.srv.name_compiled)
+				data = mdns_string_make_name(buffer, capacity, data, record.data.srv.name_compiled,
+				                             string_table);
+			else
+				data = mdns_string_make(buffer, capacity, data, record.data.srv.name.str,
+				                        record.data.srv.name.length, string_table);
 			break;
 
 		case MDNS_RECORDTYPE_A:
@@ -1223,22 +3792,43 @@ mdns_answer_add_record(void* buffer, size_t capacity, void* data, mdns_record_t
 	return data;
 }
 
+// Check if a TXT record is coalesced into the record of an earlier TXT record with the same name
+static int
+mdns_answer_txt_record_written(const mdns_record_t* records, size_t index) {
+	for (size_t irec = 0; irec < index; ++irec) {
+		if ((records[irec].type == MDNS_RECORDTYPE_TXT) &&
+		    mdns_record_store_name_equal(records[irec].name, records[irec].name_compiled,
+		                                 records[index].name, records[index].name_compiled))
+			return 1;
+	}
+	return 0;
+}
+
+// Add one record coalescing all TXT records with the same name as the first given record, written
+// from the given compiled name
 static void*
-mdns_answer_add_txt_record(void* buffer, size_t capacity, void* data, mdns_record_t* records,
-                           size_t record_count, uint16_t rclass, uint32_t ttl,
-                           mdns_string_table_t* string_table) {
+mdns_answer_add_txt_record_name(void* buffer, size_t capacity, void* data,
+                                const mdns_record_t* records, size_t record_count, size_t first,
+                                const mdns_name_t* name, uint16_t rclass, uint32_t ttl,
+                                mdns_string_table_t* string_table) {
 	// Pointer to length of record to be filled at end
 	void* record_length = 0;
 	void* record_data = 0;
 
 	size_t remain = 0;
-	for (size_t irec = 0; data && (irec < record_count); ++irec) {
-		if (records[irec].type != MDNS_RECORDTYPE_TXT)
+	for (size_t irec = first; data && (irec < record_count); ++irec) {
+		if ((records[irec].type != MDNS_RECORDTYPE_TXT) ||
+		    !mdns_record_store_name_equal(records[irec].name, records[irec].name_compiled,
+		                                  records[first].name, records[first].name_compiled))
 			continue;
 
 		if (!record_data) {
-			data = mdns_answer_add_record_header(buffer, capacity, data, records[irec], rclass, ttl,
+			mdns_record_t header = records[irec];
+			header.name_compiled = name;
+			data = mdns_answer_add_record_header(buffer, capacity, data, header, rclass, ttl,
 			                                     string_table);
+			if (!data)
+				return 0;
 			record_length = MDNS_POINTER_OFFSET(data, -2);
 			record_data = data;
 		}
@@ -1271,18 +3861,344 @@ mdns_answer_add_txt_record(void* buffer, size_t capacity, void* data, mdns_recor
 	return data;
 }
 
-static uint16_t
-mdns_answer_get_record_count(mdns_record_t* records, size_t record_count) {
-	// TXT records will be coalesced into one record
-	uint16_t total_count = 0;
-	uint16_t txt_record = 0;
-	for (size_t irec = 0; irec < record_count; ++irec) {
-		if (records[irec].type == MDNS_RECORDTYPE_TXT)
-			txt_record = 1;
-		else
-			++total_count;
+static int
+mdns_packet_builder_begin(mdns_packet_builder_t* builder, void* buffer, size_t capacity,
+                          uint16_t query_id, uint16_t flags) {
+	builder->buffer = buffer;
+	builder->capacity = capacity;
+	builder->size = 0;
+	memset(builder->count, 0, sizeof(builder->count));
+	builder->section = MDNS_ENTRYTYPE_QUESTION;
+	mdns_string_table_initialize(&builder->string_table, builder->string_table_item,
+	                             MDNS_STRING_TABLE_SIZE);
+	for (size_t iname = 0; iname < MDNS_PACKET_BUILDER_NAME_CACHE; ++iname)
+		builder->name_cache[iname].length = 0;
+	builder->name_cache_next = 0;
+	if (capacity < sizeof(struct mdns_header_t)) {
+		builder->capacity = 0;
+		return -1;
+	}
+
+	struct mdns_header_t* header = (struct mdns_header_t*)buffer;
+	header->query_id = htons(query_id);
+	header->flags = htons(flags);
+	header->questions = 0;
+	header->answer_rrs = 0;
+	header->authority_rrs = 0;
+	header->additional_rrs = 0;
+	builder->size = sizeof(struct mdns_header_t);
+	return 0;
+}
+
+static int
+mdns_packet_builder_add_question(mdns_packet_builder_t* builder, mdns_record_type_t type,
+                                 const char* name, size_t length, uint16_t rclass) {
+	if ((builder->section != MDNS_ENTRYTYPE_QUESTION) || !builder->capacity)
+		return -1;
+	void* data = MDNS_POINTER_OFFSET(builder->buffer, builder->size);
+	data = mdns_string_make(builder->buffer, builder->capacity, data, name, length,
+	                        &builder->string_table);
+	if (!data || ((builder->capacity - MDNS_POINTER_DIFF(data, builder->buffer)) < 4)) {
+		mdns_string_table_truncate(&builder->string_table, builder->size);
+		return -1;
+	}
+	data = mdns_htons(data, type);
+	data = mdns_htons(data, rclass);
+	builder->size = MDNS_POINTER_DIFF(data, builder->buffer);
+	++builder->count[MDNS_ENTRYTYPE_QUESTION];
+	return 0;
+}
+
+// Check if a compiled name is exactly the given dotted name. Labels are at the same offsets in both
+// forms, shifted by the length byte of the first label
+static int
+mdns_name_match_dotted(const mdns_name_t* name, const char* str, size_t length) {
+	if (length && (str[length - 1] == '.'))
+		--length;
+	if (!name->length || (name->length != (length ? length + 2 : 1)))
+		return 0;
+	for (size_t ilabel = 0; ilabel < name->label_count; ++ilabel) {
+		size_t offset = name->label_offset[ilabel];
+		size_t label_length = name->data[offset];
+		if (((offset + label_length) < length) && (str[offset + label_length] != '.'))
+			return 0;
+		if (memcmp(name->data + offset + 1, str + offset, label_length))
+			return 0;
+	}
+	return 1;
+}
+
+// Get the compiled form of a record name. Dotted names are compiled once per packet into the name
+// cache of the builder, which is not part of the packet and is updated on const builders too.
+// Returns null if the name is invalid
+static const mdns_name_t*
+mdns_packet_builder_name(const mdns_packet_builder_t* builder, mdns_string_t name,
+                         const mdns_name_t* compiled) {
+	if (compiled)
+		return compiled->length ? compiled : 0;
+	if (!name.length)
+		return 0;
+	// The entry returned last is never replaced next, so the name and the target of a record can
+	// be held at the same time
+	mdns_packet_builder_t* cache = (mdns_packet_builder_t*)builder;
+	for (size_t iname = 0; iname < MDNS_PACKET_BUILDER_NAME_CACHE; ++iname) {
+		if (mdns_name_match_dotted(cache->name_cache + iname, name.str, name.length)) {
+			if ((iname == cache->name_cache_next) &&
+			    (++cache->name_cache_next >= MDNS_PACKET_BUILDER_NAME_CACHE))
+				cache->name_cache_next = 0;
+			return cache->name_cache + iname;
+		}
+	}
+	mdns_name_t* storage = cache->name_cache + cache->name_cache_next;
+	if (mdns_name_compile_wire(storage, name.str, name.length)) {
+		storage->length = 0;
+		return 0;
+	}
+	if (++cache->name_cache_next >= MDNS_PACKET_BUILDER_NAME_CACHE)
+		cache->name_cache_next = 0;
+	return storage;
+}
+
+// Get the size of a name written at the given offset, compressed against the names in the string
+// table or against the first pending_count labels of a name written before it in the same record,
+// which are not in the table yet. The number of leading labels written in full, which are added to
+// the table, is stored in written
+static size_t
+mdns_packet_builder_name_size(const mdns_packet_builder_t* builder, const mdns_name_t* name,
+                              const mdns_name_t* pending, size_t pending_count, size_t* written) {
+	mdns_string_table_t* string_table = (mdns_string_table_t*)&builder->string_table;
+	for (size_t ilabel = 0; ilabel < name->label_count; ++ilabel) {
+		int found = (mdns_string_table_find_name(string_table, builder->buffer, builder->capacity,
+		                                         name, ilabel) != MDNS_INVALID_POS);
+		size_t suffix_length = name->length - name->label_offset[ilabel];
+		for (size_t ipending = 0; !found && (ipending < pending_count); ++ipending) {
+			found = (pending->suffix_hash[ipending] == name->suffix_hash[ilabel]) &&
+			        ((pending->length - pending->label_offset[ipending]) == suffix_length) &&
+			        !memcmp(pending->data + pending->label_offset[ipending],
+			                name->data + name->label_offset[ilabel], suffix_length);
+		}
+		if (found) {
+			*written = ilabel;
+			return (size_t)name->label_offset[ilabel] + 2;
+		}
+	}
+	*written = name->label_count;
+	return name->length;
+}
+
+// Get the size of the data of the TXT record at the given index of an array, coalescing the TXT
+// records with the same name
+static size_t
+mdns_packet_builder_txt_size(const mdns_record_t* records, size_t record_count, size_t index) {
+	const mdns_record_t* record = records + index;
+	size_t size = 0;
+	for (size_t irec = index; irec < record_count; ++irec) {
+		if ((records[irec].type == MDNS_RECORDTYPE_TXT) &&
+		    mdns_record_store_name_equal(records[irec].name, records[irec].name_compiled,
+		                                 record->name, record->name_compiled))
+			size += records[irec].data.txt.key.length + records[irec].data.txt.value.length + 2;
+	}
+	return size;
+}
+
+// Get an upper bound of the size of a name, written without compression
+static size_t
+mdns_packet_builder_name_bound(mdns_string_t name, const mdns_name_t* compiled) {
+	if (compiled)
+		return compiled->length;
+	if (name.length && (name.str[name.length - 1] == '.'))
+		return name.length + 1;
+	return name.length + 2;
+}
+
+// Get an upper bound of the size of the record at the given index of an array as added by
+// mdns_packet_builder_add_entry, without the cost of looking up the name compression
+static size_t
+mdns_packet_builder_entry_bound(const mdns_record_t* records, size_t record_count, size_t index) {
+	const mdns_record_t* record = records + index;
+	if ((record->type == MDNS_RECORDTYPE_TXT) && mdns_answer_txt_record_written(records, index))
+		return 0;
+	size_t size = mdns_packet_builder_name_bound(record->name, record->name_compiled) + 10;
+	switch (record->type) {
+		case MDNS_RECORDTYPE_PTR:
+			return size + mdns_packet_builder_name_bound(record->data.ptr.name,
+			                                             record->data.ptr.name_compiled);
+		case MDNS_RECORDTYPE_SRV:
+			return size + 6 +
+			       mdns_packet_builder_name_bound(record->data.srv.name,
+			                                      record->data.srv.name_compiled);
+		case MDNS_RECORDTYPE_A:
+			return size + 4;
+		case MDNS_RECORDTYPE_AAAA:
+			return size + 16;
+		case MDNS_RECORDTYPE_TXT:
+			return size + mdns_packet_builder_txt_size(records, record_count, index);
+		default:
+			return size;
+	}
+}
+
+// Get the exact size of the record at the given index of an array as added by
+// mdns_packet_builder_add_entry, coalescing TXT records with the same name. Returns 0 if a name
+// is invalid
+static size_t
+mdns_packet_builder_entry_size(const mdns_packet_builder_t* builder, const mdns_record_t* records,
+                               size_t record_count, size_t index) {
+	const mdns_record_t* record = records + index;
+	const mdns_name_t* name =
+	    mdns_packet_builder_name(builder, record->name, record->name_compiled);
+	if (!name)
+		return 0;
+	size_t written = 0;
+	size_t size = mdns_packet_builder_name_size(builder, name, 0, 0, &written) + 10;
+
+	// The labels of the record name written in full are added to the string table as long as it
+	// has room and the offset can be referenced, and can then compress the name in the data
+	size_t table_count = builder->string_table.count;
+	size_t table_capacity = builder->string_table.capacity;
+	size_t pending_count = 0;
+	while ((pending_count < written) &&
+	       (((table_count + pending_count + 1) * 4) <= (table_capacity * 3)) &&
+	       ((builder->size + name->label_offset[pending_count]) <= 0x3FFF))
+		++pending_count;
+
+	const mdns_name_t* target = 0;
+	switch (record->type) {
+		case MDNS_RECORDTYPE_PTR:
+			target = mdns_packet_builder_name(builder, record->data.ptr.name,
+			                                  record->data.ptr.name_compiled);
+			if (!target)
+				return 0;
+			size += mdns_packet_builder_name_size(builder, target, name, pending_count, &written);
+			break;
+
+		case MDNS_RECORDTYPE_SRV:
+			target = mdns_packet_builder_name(builder, record->data.srv.name,
+			                                  record->data.srv.name_compiled);
+			if (!target)
+				return 0;
+			size += 6;
+			size += mdns_packet_builder_name_size(builder, target, name, pending_count, &written);
+			break;
+
+		case MDNS_RECORDTYPE_A:
+			size += 4;
+			break;
+
+		case MDNS_RECORDTYPE_AAAA:
+			size += 16;
+			break;
+
+		case MDNS_RECORDTYPE_TXT:
+			size += mdns_packet_builder_txt_size(records, record_count, index);
+			break;
+
+		default:
+			break;
+	}
+	return size;
+}
+
+static size_t
+mdns_packet_builder_record_size(const mdns_packet_builder_t* builder,
+                                const mdns_record_t* record) {
+	return mdns_packet_builder_entry_size(builder, record, 1, 0);
+}
+
+static size_t
+mdns_packet_builder_remain(const mdns_packet_builder_t* builder) {
+	return builder->capacity - builder->size;
+}
+
+// Add the record at the given index of an array, coalescing TXT records with the same name, and
+// skipping TXT records coalesced into an earlier record. The packet is unchanged if the record
+// does not fit
+static int
+mdns_packet_builder_add_entry(mdns_packet_builder_t* builder, mdns_entry_type_t section,
+                              const mdns_record_t* records, size_t record_count, size_t index,
+                              uint16_t rclass, uint32_t ttl) {
+	if ((section < builder->section) || (section == MDNS_ENTRYTYPE_QUESTION) || !builder->capacity)
+		return -1;
+	if ((records[index].type == MDNS_RECORDTYPE_TXT) &&
+	    mdns_answer_txt_record_written(records, index))
+		return 0;
+
+	// Names are written from their compiled form, shared with the size functions
+	mdns_record_t record = records[index];
+	record.name_compiled = mdns_packet_builder_name(builder, record.name, record.name_compiled);
+	if (!record.name_compiled)
+		return -1;
+	if (record.type == MDNS_RECORDTYPE_PTR) {
+		record.data.ptr.name_compiled = mdns_packet_builder_name(builder, record.data.ptr.name,
+		                                                         record.data.ptr.name_compiled);
+		if (!record.data.ptr.name_compiled)
+			return -1;
+	} else if (record.type == MDNS_RECORDTYPE_SRV) {
+		record.data.srv.name_compiled = mdns_packet_builder_name(builder, record.data.srv.name,
+		                                                         record.data.srv.name_compiled);
+		if (!record.data.srv.name_compiled)
+			return -1;
+	}
+
+	void* data = MDNS_POINTER_OFFSET(builder->buffer, builder->size);
+	if (record.type != MDNS_RECORDTYPE_TXT)
+		data = mdns_answer_add_record(builder->buffer, builder->capacity, data, record, rclass, ttl,
+		                              &builder->string_table);
+	else
+		data = mdns_answer_add_txt_record_name(builder->buffer, builder->capacity, data, records,
+		                                       record_count, index, record.name_compiled, rclass,
+		                                       ttl, &builder->string_table);
+	if (!data) {
+		mdns_string_table_truncate(&builder->string_table, builder->size);
+		return -1;
+	}
+	builder->section = section;
+	builder->size = MDNS_POINTER_DIFF(data, builder->buffer);
+	++builder->count[section];
+	return 0;
+}
+
+static int
+mdns_packet_builder_add_record(mdns_packet_builder_t* builder, mdns_entry_type_t section,
+                               const mdns_record_t* record, uint16_t rclass, uint32_t ttl) {
+	return mdns_packet_builder_add_entry(builder, section, record, 1, 0, rclass, ttl);
+}
+
+static int
+mdns_packet_builder_add_records(mdns_packet_builder_t* builder, mdns_entry_type_t section,
+                                const mdns_record_t* records, size_t record_count, uint16_t rclass,
+                                uint32_t ttl) {
+	size_t size = builder->size;
+	uint16_t count = builder->count[section];
+	mdns_entry_type_t previous_section = builder->section;
+	// TXT records are added last, coalesced into one record per name
+	for (int txt = 0; txt < 2; ++txt) {
+		for (size_t irec = 0; irec < record_count; ++irec) {
+			if ((records[irec].type == MDNS_RECORDTYPE_TXT) != (txt != 0))
+				continue;
+			if (mdns_packet_builder_add_entry(builder, section, records, record_count, irec, rclass,
+			                                  ttl)) {
+				mdns_string_table_truncate(&builder->string_table, size);
+				builder->size = size;
+				builder->count[section] = count;
+				builder->section = previous_section;
+				return -1;
+			}
+		}
 	}
-	return total_count + txt_record;
+	return 0;
+}
+
+static size_t
+mdns_packet_builder_finish(mdns_packet_builder_t* builder) {
+	if (builder->size < sizeof(struct mdns_header_t))
+		return 0;
+	struct mdns_header_t* header = (struct mdns_header_t*)builder->buffer;
+	header->questions = htons(builder->count[MDNS_ENTRYTYPE_QUESTION]);
+	header->answer_rrs = htons(builder->count[MDNS_ENTRYTYPE_ANSWER]);
+	header->authority_rrs = htons(builder->count[MDNS_ENTRYTYPE_AUTHORITY]);
+	header->additional_rrs = htons(builder->count[MDNS_ENTRYTYPE_ADDITIONAL]);
+	return builder->size;
 }
 
 static int
@@ -1291,92 +4207,79 @@ mdns_query_answer_unicast(int sock, const void* address, size_t address_size, vo
                           const char* name, size_t name_length, mdns_record_t answer,
                           mdns_record_t* authority, size_t authority_count,
                           mdns_record_t* additional, size_t additional_count) {
-	if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
+	size_t tosend = mdns_query_answer_unicast_build(
+	    buffer, capacity, query_id, record_type, name, name_length, answer, authority,
+	    authority_count, additional, additional_count);
+	if (!tosend)
 		return -1;
+	return mdns_unicast_send(sock, address, address_size, buffer, tosend);
+}
+
+static size_t
+mdns_query_answer_unicast_build(void* buffer, size_t capacity, uint16_t query_id,
+                                mdns_record_type_t record_type, const char* name,
+                                size_t name_length, mdns_record_t answer,
+                                mdns_record_t* authority, size_t authority_count,
+                                mdns_record_t* additional, size_t additional_count) {
+	if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
+		return 0;
 
 	uint16_t rclass = MDNS_CACHE_FLUSH | MDNS_CLASS_IN;
 	uint32_t ttl = 10;
 
-	// Basic answer structure
-	struct mdns_header_t* header = (struct mdns_header_t*)buffer;
-	header->query_id = htons(query_id);
-	header->flags = htons(0x8400);
-	header->questions = htons(1);
-	header->answer_rrs = htons(1);
-	header->authority_rrs = htons(mdns_answer_get_record_count(authority, authority_count));
-	header->additional_rrs = htons(mdns_answer_get_record_count(additional, additional_count));
-
-	mdns_string_table_t string_table = {0};
-	void* data = MDNS_POINTER_OFFSET(buffer, sizeof(struct mdns_header_t));
-
-	// Fill in question
-	data = mdns_answer_add_question_unicast(buffer, capacity, data, record_type, name, name_length,
-	                                        &string_table);
-
-	// Fill in answer
-	data = mdns_answer_add_record(buffer, capacity, data, answer, rclass, ttl, &string_table);
-
-	// Fill in authority records
-	for (size_t irec = 0; data && (irec < authority_count); ++irec)
-		data = mdns_answer_add_record(buffer, capacity, data, authority[irec], rclass, ttl,
-		                              &string_table);
-	data = mdns_answer_add_txt_record(buffer, capacity, data, authority, authority_count, rclass,
-	                                  ttl, &string_table);
-
-	// Fill in additional records
-	for (size_t irec = 0; data && (irec < additional_count); ++irec)
-		data = mdns_answer_add_record(buffer, capacity, data, additional[irec], rclass, ttl,
-		                              &string_table);
-	data = mdns_answer_add_txt_record(buffer, capacity, data, additional, additional_count, rclass,
-	                                  ttl, &string_table);
-	if (!data)
-		return -1;
+	mdns_packet_builder_t builder;
+	mdns_packet_builder_begin(&builder, buffer, capacity, query_id, 0x8400);
+	if (mdns_packet_builder_add_question(&builder, record_type, name, name_length,
+	                                     MDNS_UNICAST_RESPONSE | MDNS_CLASS_IN) ||
+	    mdns_packet_builder_add_record(&builder, MDNS_ENTRYTYPE_ANSWER, &answer, rclass, ttl) ||
+	    mdns_packet_builder_add_records(&builder, MDNS_ENTRYTYPE_AUTHORITY, authority,
+	                                    authority_count, rclass, ttl) ||
+	    mdns_packet_builder_add_records(&builder, MDNS_ENTRYTYPE_ADDITIONAL, additional,
+	                                    additional_count, rclass, ttl))
+		return 0;
+	return mdns_packet_builder_finish(&builder);
+}
 
-	size_t tosend = MDNS_POINTER_DIFF(data, buffer);
-	return mdns_unicast_send(sock, address, address_size, buffer, tosend);
+static size_t
+mdns_answer_multicast_records_build(void* buffer, size_t capacity, uint16_t rclass,
+                                    mdns_record_t* answers, size_t answer_count,
+                                    mdns_record_t* authority, size_t authority_count,
+                                    mdns_record_t* additional, size_t additional_count) {
+	if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
+		return 0;
+
+	uint32_t ttl = 60;
+
+	mdns_packet_builder_t builder;
+	mdns_packet_builder_begin(&builder, buffer, capacity, 0, 0x8400);
+	if (mdns_packet_builder_add_records(&builder, MDNS_ENTRYTYPE_ANSWER, answers, answer_count,
+	                                    rclass, ttl) ||
+	    mdns_packet_builder_add_records(&builder, MDNS_ENTRYTYPE_AUTHORITY, authority,
+	                                    authority_count, rclass, ttl) ||
+	    mdns_packet_builder_add_records(&builder, MDNS_ENTRYTYPE_ADDITIONAL, additional,
+	                                    additional_count, rclass, ttl))
+		return 0;
+	return mdns_packet_builder_finish(&builder);
+}
+
+static size_t
+mdns_answer_multicast_rclass_build(void* buffer, size_t capacity, uint16_t rclass,
+                                   mdns_record_t answer, mdns_record_t* authority,
+                                   size_t authority_count, mdns_record_t* additional,
+                                   size_t additional_count) {
+	return mdns_answer_multicast_records_build(buffer, capacity, rclass, &answer, 1, authority,
+	                                           authority_count, additional, additional_count);
 }
 
 static int
 mdns_answer_multicast_rclass(int sock, void* buffer, size_t capacity, uint16_t rclass,
                              mdns_record_t answer, mdns_record_t* authority, size_t authority_count,
                              mdns_record_t* additional, size_t additional_count) {
-	if (capacity < (sizeof(struct mdns_header_t) + 32 + 4))
-		return -1;
-
-	uint32_t ttl = 60;
-
-	// Basic answer structure
-	struct mdns_header_t* header = (struct mdns_header_t*)buffer;
-	header->query_id = 0;
-	header->flags = htons(0x8400);
-	header->questions = 0;
-	header->answer_rrs = htons(1);
-	header->authority_rrs = htons(mdns_answer_get_record_count(authority, authority_count));
-	header->additional_rrs = htons(mdns_answer_get_record_count(additional, additional_count));
-
-	mdns_string_table_t string_table = {0};
-	void* data = MDNS_POINTER_OFFSET(buffer, sizeof(struct mdns_header_t));
-
-	// Fill in answer
-	data = mdns_answer_add_record(buffer, capacity, data, answer, rclass, ttl, &string_table);
-
-	// Fill in authority records
-	for (size_t irec = 0; data && (irec < authority_count); ++irec)
-		data = mdns_answer_add_record(buffer, capacity, data, authority[irec], rclass, ttl,
-		                              &string_table);
-	data = mdns_answer_add_txt_record(buffer, capacity, data, authority, authority_count, rclass,
-	                                  ttl, &string_table);
-
-	// Fill in additional records
-	for (size_t irec = 0; data && (irec < additional_count); ++irec)
-		data = mdns_answer_add_record(buffer, capacity, data, additional[irec], rclass, ttl,
-		                              &string_table);
-	data = mdns_answer_add_txt_record(buffer, capacity, data, additional, additional_count, rclass,
-	                                  ttl, &string_table);
-	if (!data)
+	size_t tosend =
+	    mdns_answer_multicast_rclass_build(buffer, capacity, rclass, answer, authority,
+	                                       authority_count, additional, additional_count);
+	if (!tosend)
 		return -1;
-
-	size_t tosend = MDNS_POINTER_DIFF(data, buffer);
 	return mdns_multicast_send(sock, buffer, tosend);
 }
 
@@ -1389,6 +4292,15 @@ mdns_query_answer_multicast(int sock, void* buffer, size_t capacity, mdns_record
 	                                    authority_count, additional, additional_count);
 }
 
+static size_t
+mdns_query_answer_multicast_build(void* buffer, size_t capacity, mdns_record_t answer,
+                                  mdns_record_t* authority, size_t authority_count,
+                                  mdns_record_t* additional, size_t additional_count) {
+	uint16_t rclass = MDNS_CLASS_IN;
+	return mdns_answer_multicast_rclass_build(buffer, capacity, rclass, answer, authority,
+	                                          authority_count, additional, additional_count);
+}
+
 static int
 mdns_announce_multicast(int sock, void* buffer, size_t capacity, mdns_record_t answer,
                         mdns_record_t* authority, size_t authority_count, mdns_record_t* additional,
@@ -1398,57 +4310,2387 @@ mdns_announce_multicast(int sock, void* buffer, size_t capacity, mdns_record_t a
 	                                    authority_count, additional, additional_count);
 }
 
-static mdns_string_t
-mdns_record_parse_ptr(const void* buffer, size_t size, size_t offset, size_t length,
-                      char* strbuffer, size_t capacity) {
-	// PTR record is just a string
-	if ((size >= offset + length) && (length >= 2))
-		return mdns_string_extract(buffer, size, &offset, strbuffer, capacity);
-	mdns_string_t empty = {0, 0};
-	return empty;
+static size_t
+mdns_announce_multicast_build(void* buffer, size_t capacity, mdns_record_t answer,
+                              mdns_record_t* authority, size_t authority_count,
+                              mdns_record_t* additional, size_t additional_count) {
+	uint16_t rclass = MDNS_CLASS_IN | MDNS_CACHE_FLUSH;
+	return mdns_answer_multicast_rclass_build(buffer, capacity, rclass, answer, authority,
+	                                          authority_count, additional, additional_count);
 }
 
-static mdns_record_srv_t
-mdns_record_parse_srv(const void* buffer, size_t size, size_t offset, size_t length,
-                      char* strbuffer, size_t capacity) {
-	mdns_record_srv_t srv;
-	memset(&srv, 0, sizeof(mdns_record_srv_t));
-	// Read the service priority, weight, port number and the discovery name
-	// SRV record format (http://www.ietf.org/rfc/rfc2782.txt):
-	// 2 bytes network-order unsigned priority
-	// 2 bytes network-order unsigned weight
-	// 2 bytes network-order unsigned port
-	// string: discovery (domain) name, minimum 2 bytes when compressed
-	if ((size >= offset + length) && (length >= 8)) {
-		const uint16_t* recorddata = (const uint16_t*)MDNS_POINTER_OFFSET_CONST(buffer, offset);
-		srv.priority = mdns_ntohs(recorddata++);
-		srv.weight = mdns_ntohs(recorddata++);
-		srv.port = mdns_ntohs(recorddata++);
-		offset += 6;
-		srv.name = mdns_string_extract(buffer, size, &offset, strbuffer, capacity);
-	}
-	return srv;
+static size_t
+mdns_query_answer_multicast_contexts(const mdns_socket_context_t* contexts, size_t count,
+                                     void* buffer, size_t capacity, mdns_record_t answer,
+                                     mdns_record_t* authority, size_t authority_count,
+                                     mdns_record_t* additional, size_t additional_count) {
+	size_t size = mdns_query_answer_multicast_build(buffer, capacity, answer, authority,
+	                                                authority_count, additional, additional_count);
+	if (!size)
+		return 0;
+	return mdns_multicast_send_contexts(contexts, count, buffer, size);
 }
 
-static struct sockaddr_in*
-mdns_record_parse_a(const void* buffer, size_t size, size_t offset, size_t length,
-                    struct sockaddr_in* addr) {
-	memset(addr, 0, sizeof(struct sockaddr_in));
-	addr->sin_family = AF_INET;
-#ifdef __APPLE__
-	addr->sin_len = sizeof(struct sockaddr_in);
-#endif
-	if ((size >= offset + length) && (length == 4))
-		memcpy(&addr->sin_addr.s_addr, MDNS_POINTER_OFFSET(buffer, offset), 4);
-	return addr;
+static size_t
+mdns_announce_multicast_contexts(const mdns_socket_context_t* contexts, size_t count,
+                                 void* buffer, size_t capacity, mdns_record_t answer,
+                                 mdns_record_t* authority, size_t authority_count,
+                                 mdns_record_t* additional, size_t additional_count) {
+	size_t size = mdns_announce_multicast_build(buffer, capacity, answer, authority,
+	                                            authority_count, additional, additional_count);
+	if (!size)
+		return 0;
+	return mdns_multicast_send_contexts(contexts, count, buffer, size);
 }
 
-static struct sockaddr_in6*
-mdns_record_parse_aaaa(const void* buffer, size_t size, size_t offset, size_t length,
-                       struct sockaddr_in6* addr) {
-	memset(addr, 0, sizeof(struct sockaddr_in6));
-	addr->sin6_family = AF_INET6;
-#ifdef __APPLE__
+// Check if a record is recommended as additional record for another record, like the SRV and TXT
+// records of a PTR record, see mdns_record_store_select_for
+static int
+mdns_answer_record_related(const mdns_record_t* record, const mdns_record_t* extra) {
+	switch (record->type) {
+		case MDNS_RECORDTYPE_PTR:
+			return ((extra->type == MDNS_RECORDTYPE_SRV) || (extra->type == MDNS_RECORDTYPE_TXT)) &&
+			       mdns_record_store_name_equal(record->data.ptr.name,
+			                                    record->data.ptr.name_compiled, extra->name,
+			                                    extra->name_compiled);
+		case MDNS_RECORDTYPE_SRV:
+			return ((extra->type == MDNS_RECORDTYPE_A) || (extra->type == MDNS_RECORDTYPE_AAAA)) &&
+			       mdns_record_store_name_equal(record->data.srv.name,
+			                                    record->data.srv.name_compiled, extra->name,
+			                                    extra->name_compiled);
+		case MDNS_RECORDTYPE_A:
+		case MDNS_RECORDTYPE_AAAA:
+			return ((extra->type == MDNS_RECORDTYPE_A) || (extra->type == MDNS_RECORDTYPE_AAAA)) &&
+			       (extra->type != record->type) &&
+			       mdns_record_store_name_equal(record->name, record->name_compiled, extra->name,
+			                                    extra->name_compiled);
+		default:
+			return 0;
+	}
+}
+
+// Flags of the authority and additional records while splitting a response
+enum mdns_answer_split_flag {
+	// Related to an answer of the response, otherwise only added to the first packet
+	MDNS_ANSWER_SPLIT_RELATED = 1,
+	// Related to the answer being added, directly or through another record
+	MDNS_ANSWER_SPLIT_DIRECT = 2,
+	MDNS_ANSWER_SPLIT_NEW = 4,
+	// Added after the answers of the packet being built
+	MDNS_ANSWER_SPLIT_PACKET = 8,
+	// Size is the exact size with name compression instead of an upper bound
+	MDNS_ANSWER_SPLIT_EXACT = 16
+};
+
+// Get an authority or additional record of a split response, indexed over the authority records
+// followed by the additional records
+static void
+mdns_answer_split_extra(const mdns_answer_split_t* split, size_t index,
+                        const mdns_record_t** records, size_t* record_count, size_t* record_index) {
+	if (index < split->authority_count) {
+		*records = split->authority;
+		*record_count = split->authority_count;
+		*record_index = index;
+	} else {
+		*records = split->additional;
+		*record_count = split->additional_count;
+		*record_index = index - split->authority_count;
+	}
+}
+
+// Mark the authority and additional records related to an answer with the given flag, directly or
+// through another authority or additional record, like the address records of the SRV record of a
+// PTR answer
+static void
+mdns_answer_split_mark(const mdns_answer_split_t* split, const mdns_record_t* answer,
+                       uint8_t* flags, uint8_t flag) {
+	size_t extra_count = split->authority_count + split->additional_count;
+	uint16_t direct[MDNS_SPLIT_EXTRA_MAX];
+	size_t direct_count = 0;
+	const mdns_record_t* records;
+	size_t record_count;
+	size_t irec;
+	for (size_t iextra = 0; iextra < extra_count; ++iextra) {
+		mdns_answer_split_extra(split, iextra, &records, &record_count, &irec);
+		if (mdns_answer_record_related(answer, records + irec)) {
+			flags[iextra] |= MDNS_ANSWER_SPLIT_DIRECT;
+			direct[direct_count++] = (uint16_t)iextra;
+		}
+	}
+	for (size_t iextra = 0; direct_count && (iextra < extra_count); ++iextra) {
+		if (flags[iextra] & MDNS_ANSWER_SPLIT_DIRECT)
+			continue;
+		mdns_answer_split_extra(split, iextra, &records, &record_count, &irec);
+		for (size_t idirect = 0; idirect < direct_count; ++idirect) {
+			const mdns_record_t* via;
+			size_t via_count;
+			size_t ivia;
+			mdns_answer_split_extra(split, direct[idirect], &via, &via_count, &ivia);
+			if (mdns_answer_record_related(via + ivia, records + irec)) {
+				flags[iextra] |= flag;
+				break;
+			}
+		}
+	}
+	for (size_t idirect = 0; idirect < direct_count; ++idirect) {
+		uint8_t* direct_flags = flags + direct[idirect];
+		*direct_flags = (uint8_t)((*direct_flags & ~MDNS_ANSWER_SPLIT_DIRECT) | flag);
+	}
+}
+
+// Get the size of an authority or additional record of a split response in the packet being built,
+// an upper bound without name compression unless the exact size is requested. Exact sizes stay
+// upper bounds as more names are added to the packet
+static size_t
+mdns_answer_split_extra_size(const mdns_packet_builder_t* builder, const mdns_answer_split_t* split,
+                             size_t index, uint8_t* flags, uint16_t* sizes, int exact) {
+	const mdns_record_t* records;
+	size_t record_count;
+	size_t irec;
+	mdns_answer_split_extra(split, index, &records, &record_count, &irec);
+	if ((records[irec].type == MDNS_RECORDTYPE_TXT) &&
+	    mdns_answer_txt_record_written(records, irec))
+		return 0;
+	size_t size = sizes[index];
+	if (exact && !(flags[index] & MDNS_ANSWER_SPLIT_EXACT)) {
+		size = mdns_packet_builder_entry_size(builder, records, record_count, irec);
+		flags[index] |= MDNS_ANSWER_SPLIT_EXACT;
+	} else if (!size) {
+		size = mdns_packet_builder_entry_bound(records, record_count, irec);
+	}
+	// Sizes beyond the largest packet do not need to be exact
+	sizes[index] = (uint16_t)((size < 0xFFFF) ? size : 0xFFFF);
+	return sizes[index];
+}
+
+// Add the authority or additional records marked for the packet, as far as they fit
+static void
+mdns_answer_split_add_extra(mdns_packet_builder_t* builder, mdns_entry_type_t section,
+                            const mdns_answer_split_t* split, const uint8_t* flags, size_t first,
+                            const mdns_record_t* records, size_t record_count) {
+	for (size_t irec = 0; irec < record_count; ++irec) {
+		if (flags[first + irec] & MDNS_ANSWER_SPLIT_PACKET)
+			mdns_packet_builder_add_entry(builder, section, records, record_count, irec,
+			                              split->rclass, split->ttl);
+	}
+}
+
+static int
+mdns_answer_split(void* buffer, size_t capacity, size_t max_size, const mdns_answer_split_t* split,
+                  mdns_packet_send_fn send, void* user_data) {
+	if (!max_size)
+		max_size = MDNS_PACKET_SIZE_MAX;
+	size_t limit = (max_size < capacity) ? max_size : capacity;
+	size_t extra_count = split->authority_count + split->additional_count;
+	if ((limit < (sizeof(struct mdns_header_t) + 32 + 4)) || (extra_count > MDNS_SPLIT_EXTRA_MAX))
+		return -1;
+
+	// Find the records related to any answer once, records not related to an answer are only
+	// added to the first packet
+	uint8_t flags[MDNS_SPLIT_EXTRA_MAX];
+	uint16_t sizes[MDNS_SPLIT_EXTRA_MAX];
+	memset(flags, 0, extra_count);
+	for (size_t ians = 0; ians < split->answer_count; ++ians)
+		mdns_answer_split_mark(split, split->answers + ians, flags, MDNS_ANSWER_SPLIT_RELATED);
+
+	int packets = 0;
+	size_t first = 0;
+	do {
+		mdns_packet_builder_t builder;
+		mdns_packet_builder_begin(&builder, buffer, limit, split->query_id, 0x8400);
+		if (split->name && mdns_packet_builder_add_question(&builder, split->record_type,
+		                                                    split->name, split->name_length,
+		                                                    MDNS_UNICAST_RESPONSE | MDNS_CLASS_IN))
+			return -1;
+
+		// Space taken by the authority and additional records to add after the answers
+		size_t reserved = 0;
+		memset(sizes, 0, sizeof(uint16_t) * extra_count);
+		for (size_t iextra = 0; iextra < extra_count; ++iextra) {
+			flags[iextra] &= MDNS_ANSWER_SPLIT_RELATED;
+			if (!first && !(flags[iextra] & MDNS_ANSWER_SPLIT_RELATED)) {
+				flags[iextra] |= MDNS_ANSWER_SPLIT_PACKET;
+				reserved += mdns_answer_split_extra_size(&builder, split, iextra, flags, sizes, 0);
+			}
+		}
+
+		// Fill the packet with answers in one pass, and close it when an answer and the records
+		// related to it do not fit, keeping the related records with their answers
+		size_t added = 0;
+		while ((first + added) < split->answer_count) {
+			size_t ianswer = first + added;
+			mdns_answer_split_mark(split, split->answers + ianswer, flags, MDNS_ANSWER_SPLIT_NEW);
+			size_t need =
+			    mdns_packet_builder_entry_bound(split->answers, split->answer_count, ianswer);
+			for (size_t iextra = 0; iextra < extra_count; ++iextra) {
+				if ((flags[iextra] & (MDNS_ANSWER_SPLIT_NEW | MDNS_ANSWER_SPLIT_PACKET)) ==
+				    MDNS_ANSWER_SPLIT_NEW)
+					need += mdns_answer_split_extra_size(&builder, split, iextra, flags, sizes, 0);
+			}
+			size_t start = builder.size;
+			uint16_t answers = builder.count[MDNS_ENTRYTYPE_ANSWER];
+			mdns_entry_type_t section = builder.section;
+			int fit = !mdns_packet_builder_add_entry(&builder, MDNS_ENTRYTYPE_ANSWER,
+			                                         split->answers, split->answer_count, ianswer,
+			                                         split->rclass, split->ttl);
+			// The first answer of a packet is kept with its related records as far as they fit.
+			// Close to the end of the packet decide with the exact sizes, measured after the
+			// answer so the names of the related records are compressed against it
+			if (fit && added && ((start + reserved + need) > limit)) {
+				reserved = 0;
+				need = 0;
+				for (size_t iextra = 0; iextra < extra_count; ++iextra) {
+					if (flags[iextra] & MDNS_ANSWER_SPLIT_PACKET)
+						reserved +=
+						    mdns_answer_split_extra_size(&builder, split, iextra, flags, sizes, 1);
+					else if (flags[iextra] & MDNS_ANSWER_SPLIT_NEW)
+						need +=
+						    mdns_answer_split_extra_size(&builder, split, iextra, flags, sizes, 1);
+				}
+				if ((builder.size + reserved + need) > limit) {
+					mdns_string_table_truncate(&builder.string_table, start);
+					builder.size = start;
+					builder.count[MDNS_ENTRYTYPE_ANSWER] = answers;
+					builder.section = section;
+					fit = 0;
+				}
+			}
+			for (size_t iextra = 0; iextra < extra_count; ++iextra) {
+				if (!(flags[iextra] & MDNS_ANSWER_SPLIT_NEW))
+					continue;
+				flags[iextra] &= (uint8_t)~MDNS_ANSWER_SPLIT_NEW;
+				if (fit && !(flags[iextra] & MDNS_ANSWER_SPLIT_PACKET)) {
+					flags[iextra] |= MDNS_ANSWER_SPLIT_PACKET;
+					reserved += sizes[iextra];
+				}
+			}
+			if (!fit)
+				break;
+			++added;
+		}
+		if (!added && (first < split->answer_count))
+			return -1;
+
+		mdns_answer_split_add_extra(&builder, MDNS_ENTRYTYPE_AUTHORITY, split, flags, 0,
+		                            split->authority, split->authority_count);
+		mdns_answer_split_add_extra(&builder, MDNS_ENTRYTYPE_ADDITIONAL, split, flags,
+		                            split->authority_count, split->additional,
+		                            split->additional_count);
+		size_t size = mdns_packet_builder_finish(&builder);
+		if (!size || send(buffer, size, user_data))
+			return -1;
+		++packets;
+		first += added;
+	} while (first < split->answer_count);
+	return packets;
+}
+
+static int
+mdns_answer_multicast_split(void* buffer, size_t capacity, size_t max_size, uint16_t rclass,
+                            mdns_record_t* answers, size_t answer_count, mdns_record_t* authority,
+                            size_t authority_count, mdns_record_t* additional,
+                            size_t additional_count, mdns_packet_send_fn send, void* user_data) {
+	mdns_answer_split_t split;
+	memset(&split, 0, sizeof(split));
+	split.rclass = rclass;
+	split.ttl = 60;
+	split.answers = answers;
+	split.answer_count = answer_count;
+	split.authority = authority;
+	split.authority_count = authority_count;
+	split.additional = additional;
+	split.additional_count = additional_count;
+	return mdns_answer_split(buffer, capacity, max_size, &split, send, user_data);
+}
+
+static int
+mdns_query_answer_unicast_split(void* buffer, size_t capacity, size_t max_size, uint16_t query_id,
+                                mdns_record_type_t record_type, const char* name,
+                                size_t name_length, mdns_record_t* answers, size_t answer_count,
+                                mdns_record_t* authority, size_t authority_count,
+                                mdns_record_t* additional, size_t additional_count,
+                                mdns_packet_send_fn send, void* user_data) {
+	mdns_answer_split_t split;
+	memset(&split, 0, sizeof(split));
+	split.query_id = query_id;
+	split.record_type = record_type;
+	split.name = name;
+	split.name_length = name_length;
+	split.rclass = MDNS_CACHE_FLUSH | MDNS_CLASS_IN;
+	split.ttl = 10;
+	split.answers = answers;
+	split.answer_count = answer_count;
+	split.authority = authority;
+	split.authority_count = authority_count;
+	split.additional = additional;
+	split.additional_count = additional_count;
+	return mdns_answer_split(buffer, capacity, max_size, &split, send, user_data);
+}
+
+// Send a packet built by the multi-packet functions to the target given as user data
+static int
+mdns_packet_send_target(const void* buffer, size_t size, void* user_data) {
+	const mdns_packet_target_t* target = (const mdns_packet_target_t*)user_data;
+	if (target->address)
+		return mdns_unicast_send(target->sock, target->address, target->address_size, buffer,
+		                         size);
+	return mdns_multicast_send_interface(target->sock, buffer, size, target->interface_index);
+}
+
+static int
+mdns_query_answer_unicast_packets(int sock, const void* address, size_t address_size,
+                                  void* buffer, size_t capacity, uint16_t query_id,
+                                  mdns_record_type_t record_type, const char* name,
+                                  size_t name_length, mdns_record_t* answers, size_t answer_count,
+                                  mdns_record_t* authority, size_t authority_count,
+                                  mdns_record_t* additional, size_t additional_count) {
+	mdns_packet_target_t target = {sock, address, address_size, 0};
+	return mdns_query_answer_unicast_split(buffer, capacity, 0, query_id, record_type, name,
+	                                       name_length, answers, answer_count, authority,
+	                                       authority_count, additional, additional_count,
+	                                       mdns_packet_send_target, &target);
+}
+
+static int
+mdns_query_answer_multicast_packets(int sock, void* buffer, size_t capacity,
+                                    mdns_record_t* answers, size_t answer_count,
+                                    mdns_record_t* authority, size_t authority_count,
+                                    mdns_record_t* additional, size_t additional_count) {
+	mdns_packet_target_t target = {sock, 0, 0, 0};
+	return mdns_answer_multicast_split(buffer, capacity, 0, MDNS_CLASS_IN, answers, answer_count,
+	                                   authority, authority_count, additional, additional_count,
+	                                   mdns_packet_send_target, &target);
+}
+
+static int
+mdns_announce_multicast_packets(int sock, void* buffer, size_t capacity, mdns_record_t* answers,
+                                size_t answer_count, mdns_record_t* authority,
+                                size_t authority_count, mdns_record_t* additional,
+                                size_t additional_count) {
+	mdns_packet_target_t target = {sock, 0, 0, 0};
+	return mdns_answer_multicast_split(buffer, capacity, 0, MDNS_CLASS_IN | MDNS_CACHE_FLUSH,
+	                                   answers, answer_count, authority, authority_count,
+	                                   additional, additional_count, mdns_packet_send_target,
+	                                   &target);
+}
+
+// Copy the name at the given offset in the buffer to uncompressed wire format. Returns the length
+// of the copied name, or 0 if the name is invalid or does not fit
+static size_t
+mdns_string_copy_wire(const void* buffer, size_t size, size_t offset, void* dest,
+                      size_t capacity) {
+	uint8_t* data = (uint8_t*)dest;
+	size_t length = 0;
+	mdns_string_pair_t substr;
+	unsigned int counter = 0;
+	do {
+		substr = mdns_get_next_substring(buffer, size, offset);
+		if ((substr.offset == MDNS_INVALID_POS) || (counter++ > MDNS_MAX_SUBSTRINGS) ||
+		    ((length + substr.length + 1) > capacity))
+			return 0;
+		data[length++] = (uint8_t)substr.length;
+		memcpy(data + length, MDNS_POINTER_OFFSET_CONST(buffer, substr.offset), substr.length);
+		length += substr.length;
+		offset = substr.offset + substr.length;
+	} while (substr.length);
+	return length;
+}
+
+static void
+mdns_response_cache_initialize(mdns_response_cache_t* cache, mdns_response_cache_entry_t* entries,
+                               size_t capacity, void* storage, size_t storage_capacity) {
+	memset(cache, 0, sizeof(mdns_response_cache_t));
+	cache->entry = entries;
+	cache->capacity = capacity;
+	cache->storage = storage;
+	cache->storage_capacity = storage_capacity;
+	mdns_response_cache_clear(cache);
+}
+
+static void
+mdns_response_cache_clear(mdns_response_cache_t* cache) {
+	if (cache->entry)
+		memset(cache->entry, 0, sizeof(mdns_response_cache_entry_t) * cache->capacity);
+	cache->count = 0;
+	cache->storage_used = 0;
+}
+
+static size_t
+mdns_response_cache_slot(const mdns_response_cache_t* cache, uint64_t hash, uint16_t rtype,
+                         int unicast, int family) {
+	uint64_t key = hash ^ ((uint64_t)rtype << 17) ^ ((uint64_t)(unicast ? 1 : 0) << 33) ^
+	               ((uint64_t)(unsigned int)family << 41);
+	return (size_t)(key % cache->capacity);
+}
+
+static const mdns_response_cache_entry_t*
+mdns_response_cache_find(const mdns_response_cache_t* cache, const void* buffer, size_t size,
+                         size_t name_offset, uint16_t rtype, int unicast, int family) {
+	if (!cache->count)
+		return 0;
+	uint64_t hash = mdns_name_hash(buffer, size, name_offset);
+	uint16_t is_unicast = unicast ? 1 : 0;
+	size_t slot = mdns_response_cache_slot(cache, hash, rtype, unicast, family);
+	for (size_t iprobe = 0; iprobe < cache->capacity; ++iprobe) {
+		const mdns_response_cache_entry_t* entry = cache->entry + slot;
+		if (!entry->size)
+			break;
+		if ((entry->hash == hash) && (entry->rtype == rtype) && (entry->unicast == is_unicast) &&
+		    (entry->family == family)) {
+			// Verify the name to guard against hash collisions
+			size_t ofs = name_offset;
+			size_t verify_ofs = 0;
+			if (mdns_string_equal(buffer, size, &ofs,
+			                      MDNS_POINTER_OFFSET(cache->storage, entry->offset),
+			                      entry->name_length, &verify_ofs))
+				return entry;
+		}
+		if (++slot >= cache->capacity)
+			slot = 0;
+	}
+	return 0;
+}
+
+static int
+mdns_response_cache_store(mdns_response_cache_t* cache, const void* buffer, size_t size,
+                          size_t name_offset, uint16_t rtype, int unicast, int family,
+                          const void* packet, size_t packet_size) {
+	if (!cache->capacity || !packet_size)
+		return -1;
+
+	// Store the question name uncompressed so it can be verified without the query buffer
+	uint8_t name[256];
+	size_t name_length = mdns_string_copy_wire(buffer, size, name_offset, name, sizeof(name));
+	if (!name_length)
+		return -1;
+
+	size_t total_size = name_length + packet_size;
+	if (total_size > cache->storage_capacity)
+		return -1;
+	if (((cache->count + 1) * 4 > cache->capacity * 3) ||
+	    (total_size > (cache->storage_capacity - cache->storage_used)))
+		mdns_response_cache_clear(cache);
+
+	uint64_t hash = mdns_name_hash(buffer, size, name_offset);
+	size_t slot = mdns_response_cache_slot(cache, hash, rtype, unicast, family);
+	while (cache->entry[slot].size) {
+		if (++slot >= cache->capacity)
+			slot = 0;
+	}
+
+	mdns_response_cache_entry_t* entry = cache->entry + slot;
+	entry->hash = hash;
+	entry->rtype = rtype;
+	entry->unicast = unicast ? 1 : 0;
+	entry->family = family;
+	entry->offset = cache->storage_used;
+	entry->name_length = name_length;
+	entry->size = packet_size;
+	memcpy(MDNS_POINTER_OFFSET(cache->storage, entry->offset), name, name_length);
+	memcpy(MDNS_POINTER_OFFSET(cache->storage, entry->offset + name_length), packet, packet_size);
+	cache->storage_used += total_size;
+	++cache->count;
+	return 0;
+}
+
+static const void*
+mdns_response_cache_packet(const mdns_response_cache_t* cache,
+                           const mdns_response_cache_entry_t* entry) {
+	return MDNS_POINTER_OFFSET_CONST(cache->storage, entry->offset + entry->name_length);
+}
+
+static size_t
+mdns_response_cache_build(const mdns_response_cache_t* cache,
+                          const mdns_response_cache_entry_t* entry, uint16_t query_id,
+                          void* buffer, size_t capacity) {
+	if (capacity < entry->size)
+		return 0;
+	memcpy(buffer, mdns_response_cache_packet(cache, entry), entry->size);
+	mdns_htons(buffer, query_id);
+	return entry->size;
+}
+
+static int
+mdns_response_cache_send(int sock, const void* address, size_t address_size,
+                         const mdns_response_cache_t* cache,
+                         const mdns_response_cache_entry_t* entry, uint16_t query_id,
+                         void* buffer, size_t capacity) {
+	if (!entry->unicast)
+		return mdns_multicast_send(sock, mdns_response_cache_packet(cache, entry), entry->size);
+	size_t tosend = mdns_response_cache_build(cache, entry, query_id, buffer, capacity);
+	if (!tosend)
+		return -1;
+	return mdns_unicast_send(sock, address, address_size, buffer, tosend);
+}
+
+static uint64_t
+mdns_record_store_name_hash(mdns_string_t name, const mdns_name_t* compiled) {
+	if (compiled && compiled->length)
+		return compiled->hash;
+	return mdns_name_hash_string(name.str, name.length);
+}
+
+// Check if the name at the given offset in the buffer is the record name, compiled or dotted
+static int
+mdns_record_name_equal(const void* buffer, size_t size, size_t offset, mdns_string_t name,
+                       const mdns_name_t* compiled) {
+	if (compiled && compiled->length)
+		return mdns_name_equal_compiled(buffer, size, offset, compiled);
+	return mdns_name_equal(buffer, size, offset, name.str, name.length);
+}
+
+
+static int
+mdns_record_store_name_equal(mdns_string_t lhs, const mdns_name_t* lhs_compiled, mdns_string_t rhs,
+                             const mdns_name_t* rhs_compiled) {
+	// Records of one service usually share the same name storage
+	if (lhs_compiled && (lhs_compiled == rhs_compiled))
+		return 1;
+	if (lhs.length && (lhs.str == rhs.str) && (lhs.length == rhs.length))
+		return 1;
+	if (lhs_compiled && lhs_compiled->length) {
+		if (rhs_compiled && rhs_compiled->length) {
+			size_t lhs_ofs = 0;
+			size_t rhs_ofs = 0;
+			return mdns_string_equal(lhs_compiled->data, lhs_compiled->length, &lhs_ofs,
+			                         rhs_compiled->data, rhs_compiled->length, &rhs_ofs);
+		}
+		return mdns_name_equal(lhs_compiled->data, lhs_compiled->length, 0, rhs.str, rhs.length);
+	}
+	if (rhs_compiled && rhs_compiled->length)
+		return mdns_name_equal(rhs_compiled->data, rhs_compiled->length, 0, lhs.str, lhs.length);
+	if (lhs.length && (lhs.str[lhs.length - 1] == '.'))
+		--lhs.length;
+	if (rhs.length && (rhs.str[rhs.length - 1] == '.'))
+		--rhs.length;
+	return (lhs.length == rhs.length) && !strncasecmp(lhs.str, rhs.str, lhs.length);
+}
+
+// Check if two strings have the same bytes
+static int
+mdns_string_bytes_equal(mdns_string_t lhs, mdns_string_t rhs) {
+	return (lhs.length == rhs.length) &&
+	       ((lhs.str == rhs.str) || !lhs.length || !memcmp(lhs.str, rhs.str, lhs.length));
+}
+
+// Check if two records have the same type, name and record data. Names are compared by content and
+// case insensitively, in dotted or compiled form, and TXT keys and values byte by byte, so records
+// pointing to different copies of the same strings are equal
+static int
+mdns_record_equal(const mdns_record_t* lhs, const mdns_record_t* rhs) {
+	if ((lhs->type != rhs->type) || !mdns_record_store_name_equal(lhs->name, lhs->name_compiled,
+	                                                              rhs->name, rhs->name_compiled))
+		return 0;
+	switch (lhs->type) {
+		case MDNS_RECORDTYPE_PTR:
+			return mdns_record_store_name_equal(lhs->data.ptr.name, lhs->data.ptr.name_compiled,
+			                                    rhs->data.ptr.name, rhs->data.ptr.name_compiled);
+		case MDNS_RECORDTYPE_SRV:
+			return (lhs->data.srv.port == rhs->data.srv.port) &&
+			       (lhs->data.srv.priority == rhs->data.srv.priority) &&
+			       (lhs->data.srv.weight == rhs->data.srv.weight) &&
+			       mdns_record_store_name_equal(lhs->data.srv.name, lhs->data.srv.name_compiled,
+			                                    rhs->data.srv.name, rhs->data.srv.name_compiled);
+		case MDNS_RECORDTYPE_A:
+			return !memcmp(&lhs->data.a.addr.sin_addr, &rhs->data.a.addr.sin_addr,
+			               sizeof(lhs->data.a.addr.sin_addr));
+		case MDNS_RECORDTYPE_AAAA:
+			return !memcmp(&lhs->data.aaaa.addr.sin6_addr, &rhs->data.aaaa.addr.sin6_addr,
+			               sizeof(lhs->data.aaaa.addr.sin6_addr));
+		case MDNS_RECORDTYPE_TXT:
+			return mdns_string_bytes_equal(lhs->data.txt.key, rhs->data.txt.key) &&
+			       mdns_string_bytes_equal(lhs->data.txt.value, rhs->data.txt.value);
+		default:
+			return 1;
+	}
+}
+
+static void
+mdns_record_store_initialize(mdns_record_store_t* store, mdns_record_store_entry_t* entries,
+                             size_t capacity, size_t* buckets, size_t bucket_count) {
+	memset(store, 0, sizeof(mdns_record_store_t));
+	store->entry = entries;
+	store->capacity = capacity;
+	store->bucket = buckets;
+	store->bucket_count = bucket_count;
+	mdns_record_store_clear(store);
+}
+
+static void
+mdns_record_store_clear(mdns_record_store_t* store) {
+	for (size_t ibucket = 0; ibucket < store->bucket_count; ++ibucket)
+		store->bucket[ibucket] = MDNS_INVALID_POS;
+	store->count = 0;
+}
+
+static int
+mdns_record_store_add(mdns_record_store_t* store, const mdns_record_t* record) {
+	if ((store->count >= store->capacity) || !store->bucket_count)
+		return -1;
+
+	size_t index = store->count++;
+	mdns_record_store_entry_t* entry = store->entry + index;
+	entry->record = *record;
+	entry->hash = mdns_record_store_name_hash(record->name, record->name_compiled);
+	entry->next = MDNS_INVALID_POS;
+
+	// Append to the end of the bucket chain to keep records in the order they were added
+	size_t* link = store->bucket + (entry->hash % store->bucket_count);
+	while (*link != MDNS_INVALID_POS)
+		link = &store->entry[*link].next;
+	*link = index;
+	return 0;
+}
+
+static size_t
+mdns_record_store_find(const mdns_record_store_t* store, const void* buffer, size_t size,
+                       size_t name_offset, uint16_t rtype, mdns_record_t* records,
+                       size_t capacity) {
+	if (!store->count || !store->bucket_count)
+		return 0;
+	uint64_t hash = mdns_name_hash(buffer, size, name_offset);
+	if (!hash)
+		return 0;
+
+	size_t found = 0;
+	size_t index = store->bucket[hash % store->bucket_count];
+	while ((index != MDNS_INVALID_POS) && (found < capacity)) {
+		const mdns_record_store_entry_t* entry = store->entry + index;
+		index = entry->next;
+		if ((entry->hash != hash) ||
+		    ((rtype != MDNS_RECORDTYPE_ANY) && (entry->record.type != rtype)))
+			continue;
+		if (!mdns_record_name_equal(buffer, size, name_offset, entry->record.name,
+		                            entry->record.name_compiled))
+			continue;
+		records[found++] = entry->record;
+	}
+	return found;
+}
+
+// Add the records of the given type and name which are not already selected
+static size_t
+mdns_record_store_select(const mdns_record_store_t* store, mdns_string_t name,
+                         const mdns_name_t* compiled, mdns_record_type_t type,
+                         const mdns_record_t* answers, size_t answer_count,
+                         mdns_record_t* additional, size_t additional_count, size_t capacity) {
+	uint64_t hash = mdns_record_store_name_hash(name, compiled);
+	size_t index = store->bucket[hash % store->bucket_count];
+	while ((index != MDNS_INVALID_POS) && (additional_count < capacity)) {
+		const mdns_record_store_entry_t* entry = store->entry + index;
+		index = entry->next;
+		if ((entry->hash != hash) || (entry->record.type != type) ||
+		    !mdns_record_store_name_equal(entry->record.name, entry->record.name_compiled, name,
+		                                  compiled))
+			continue;
+		int selected = 0;
+		for (size_t irec = 0; !selected && (irec < answer_count); ++irec)
+			selected = mdns_record_equal(answers + irec, &entry->record);
+		for (size_t irec = 0; !selected && (irec < additional_count); ++irec)
+			selected = mdns_record_equal(additional + irec, &entry->record);
+		if (!selected)
+			additional[additional_count++] = entry->record;
+	}
+	return additional_count;
+}
+
+// Add the additional records recommended for the given record
+static size_t
+mdns_record_store_select_for(const mdns_record_store_t* store, const mdns_record_t* record,
+                             const mdns_record_t* answers, size_t answer_count,
+                             mdns_record_t* additional, size_t additional_count,
+                             size_t capacity) {
+	switch (record->type) {
+		case MDNS_RECORDTYPE_PTR:
+			additional_count = mdns_record_store_select(
+			    store, record->data.ptr.name, record->data.ptr.name_compiled, MDNS_RECORDTYPE_SRV,
+			    answers, answer_count, additional, additional_count, capacity);
+			additional_count = mdns_record_store_select(
+			    store, record->data.ptr.name, record->data.ptr.name_compiled, MDNS_RECORDTYPE_TXT,
+			    answers, answer_count, additional, additional_count, capacity);
+			break;
+		case MDNS_RECORDTYPE_SRV:
+			additional_count = mdns_record_store_select(
+			    store, record->data.srv.name, record->data.srv.name_compiled, MDNS_RECORDTYPE_A,
+			    answers, answer_count, additional, additional_count, capacity);
+			additional_count = mdns_record_store_select(
+			    store, record->data.srv.name, record->data.srv.name_compiled, MDNS_RECORDTYPE_AAAA,
+			    answers, answer_count, additional, additional_count, capacity);
+			break;
+		case MDNS_RECORDTYPE_A:
+			additional_count = mdns_record_store_select(
+			    store, record->name, record->name_compiled, MDNS_RECORDTYPE_AAAA, answers,
+			    answer_count, additional, additional_count, capacity);
+			break;
+		case MDNS_RECORDTYPE_AAAA:
+			additional_count = mdns_record_store_select(
+			    store, record->name, record->name_compiled, MDNS_RECORDTYPE_A, answers,
+			    answer_count, additional, additional_count, capacity);
+			break;
+		default:
+			break;
+	}
+	return additional_count;
+}
+
+static size_t
+mdns_record_store_additional(const mdns_record_store_t* store, const mdns_record_t* answers,
+                             size_t answer_count, mdns_record_t* additional, size_t capacity) {
+	if (!store->count || !store->bucket_count)
+		return 0;
+	size_t additional_count = 0;
+	for (size_t irec = 0; irec < answer_count; ++irec)
+		additional_count = mdns_record_store_select_for(store, answers + irec, answers,
+		                                                answer_count, additional,
+		                                                additional_count, capacity);
+	// Selected records can in turn recommend further records, like the address records for a
+	// SRV record selected for a PTR answer
+	for (size_t irec = 0; irec < additional_count; ++irec)
+		additional_count = mdns_record_store_select_for(store, additional + irec, answers,
+		                                                answer_count, additional,
+		                                                additional_count, capacity);
+	return additional_count;
+}
+
+// Bloom filter key of a name hash and record type, mixed to spread the bits of both over the key
+static uint64_t
+mdns_name_filter_key(uint64_t name_hash, uint16_t rtype) {
+	uint64_t key = name_hash ^ ((uint64_t)rtype * 0x9E3779B97F4A7C15ULL);
+	key ^= key >> 33;
+	key *= 0xFF51AFD7ED558CCDULL;
+	key ^= key >> 33;
+	return key;
+}
+
+// Set or test the three filter bits of a key, derived from the two halves of the key. Returns 1 if
+// all bits were set before
+static int
+mdns_name_filter_bits(const mdns_name_filter_t* filter, uint64_t key, int set) {
+	size_t bit_count = filter->count * 64;
+	size_t bit = (size_t)(key & 0xFFFFFFFFU);
+	size_t step = (size_t)(key >> 32) | 1;
+	int found = 1;
+	for (int ihash = 0; ihash < 3; ++ihash, bit += step) {
+		size_t index = bit % bit_count;
+		uint64_t mask = (uint64_t)1 << (index & 63);
+		if (!(filter->bits[index / 64] & mask)) {
+			if (!set)
+				return 0;
+			found = 0;
+			filter->bits[index / 64] |= mask;
+		}
+	}
+	return found;
+}
+
+static void
+mdns_name_filter_initialize(mdns_name_filter_t* filter, uint64_t* bits, size_t count) {
+	filter->bits = bits;
+	filter->count = bits ? count : 0;
+	if (filter->count)
+		memset(bits, 0, sizeof(uint64_t) * count);
+}
+
+static void
+mdns_name_filter_add(mdns_name_filter_t* filter, uint64_t name_hash, uint16_t rtype) {
+	if (!filter->count)
+		return;
+	mdns_name_filter_bits(filter, mdns_name_filter_key(name_hash, rtype), 1);
+	mdns_name_filter_bits(filter, mdns_name_filter_key(name_hash, MDNS_RECORDTYPE_ANY), 1);
+}
+
+static void
+mdns_name_filter_add_store(mdns_name_filter_t* filter, const mdns_record_store_t* store) {
+	for (size_t ientry = 0; ientry < store->count; ++ientry)
+		mdns_name_filter_add(filter, store->entry[ientry].hash,
+		                     (uint16_t)store->entry[ientry].record.type);
+}
+
+static int
+mdns_name_filter_match(const mdns_name_filter_t* filter, const void* buffer, size_t size,
+                       size_t name_offset, uint16_t rtype) {
+	if (!filter->count)
+		return 1;
+	uint64_t name_hash = mdns_name_hash(buffer, size, name_offset);
+	return mdns_name_filter_bits(filter, mdns_name_filter_key(name_hash, rtype), 0);
+}
+
+static int
+mdns_listen_filter_callback(int sock, const struct sockaddr* from, size_t addrlen,
+                            mdns_entry_type_t entry, uint16_t query_id, uint16_t rtype,
+                            uint16_t rclass, uint32_t ttl, const void* data, size_t size,
+                            size_t name_offset, size_t name_length, size_t record_offset,
+                            size_t record_length, void* user_data) {
+	const mdns_listen_filter_t* listen_filter = (const mdns_listen_filter_t*)user_data;
+	if (!listen_filter || !listen_filter->callback)
+		return 0;
+	if ((entry == MDNS_ENTRYTYPE_QUESTION) && listen_filter->filter &&
+	    !mdns_name_filter_match(listen_filter->filter, data, size, name_offset, rtype))
+		return 0;
+	return listen_filter->callback(sock, from, addrlen, entry, query_id, rtype, rclass, ttl, data,
+	                               size, name_offset, name_length, record_offset, record_length,
+	                               listen_filter->user_data);
+}
+
+// Check if the record data at the given offset in the buffer is the data of the record
+static int
+mdns_record_data_equal(const void* buffer, size_t size, size_t offset, size_t length,
+                       const mdns_record_t* record) {
+	switch (record->type) {
+		case MDNS_RECORDTYPE_PTR:
+			return mdns_record_name_equal(buffer, size, offset, record->data.ptr.name,
+			                              record->data.ptr.name_compiled);
+		case MDNS_RECORDTYPE_SRV:
+			if (length < 6)
+				return 0;
+			return (mdns_ntohs(MDNS_POINTER_OFFSET_CONST(buffer, offset)) ==
+			        record->data.srv.priority) &&
+			       (mdns_ntohs(MDNS_POINTER_OFFSET_CONST(buffer, offset + 2)) ==
+			        record->data.srv.weight) &&
+			       (mdns_ntohs(MDNS_POINTER_OFFSET_CONST(buffer, offset + 4)) ==
+			        record->data.srv.port) &&
+			       mdns_record_name_equal(buffer, size, offset + 6, record->data.srv.name,
+			                              record->data.srv.name_compiled);
+		case MDNS_RECORDTYPE_A:
+			return (length == sizeof(record->data.a.addr.sin_addr)) &&
+			       !memcmp(MDNS_POINTER_OFFSET_CONST(buffer, offset),
+			               &record->data.a.addr.sin_addr, length);
+		case MDNS_RECORDTYPE_AAAA:
+			return (length == sizeof(record->data.aaaa.addr.sin6_addr)) &&
+			       !memcmp(MDNS_POINTER_OFFSET_CONST(buffer, offset),
+			               &record->data.aaaa.addr.sin6_addr, length);
+		default:
+			return 0;
+	}
+}
+
+// Check if TXT record data equals the strings of all TXT records with the name of the first given
+// record, coalesced in order into one record as done by mdns_answer_add_txt_record_name
+static int
+mdns_record_txt_equal(const void* buffer, size_t size, size_t offset, size_t length,
+                      const mdns_record_t* records, size_t count, size_t first) {
+	if ((length > size) || (offset > (size - length)))
+		return 0;
+	const uint8_t* strdata = (const uint8_t*)MDNS_POINTER_OFFSET_CONST(buffer, offset);
+	size_t pos = 0;
+	for (size_t irec = first; irec < count; ++irec) {
+		const mdns_record_t* record = records + irec;
+		if ((record->type != MDNS_RECORDTYPE_TXT) ||
+		    !mdns_record_store_name_equal(record->name, record->name_compiled,
+		                                  records[first].name, records[first].name_compiled))
+			continue;
+		// Strings are written as key=value, also when the value is empty
+		const mdns_string_t* key = &record->data.txt.key;
+		const mdns_string_t* value = &record->data.txt.value;
+		size_t expected = key->length + value->length + 1;
+		if ((pos >= length) || (strdata[pos] != expected) || (expected > (length - pos - 1)))
+			return 0;
+		const char* str = (const char*)(strdata + pos + 1);
+		if (memcmp(str, key->str, key->length) || (str[key->length] != '=') ||
+		    memcmp(str + key->length + 1, value->str, value->length))
+			return 0;
+		pos += expected + 1;
+	}
+	return (pos == length);
+}
+
+static size_t
+mdns_known_answer_filter(const void* buffer, size_t size, mdns_record_t* records, size_t count,
+                         uint32_t ttl) {
+	mdns_message_t message;
+	mdns_message_record_t message_records[MDNS_MAX_MESSAGE_RECORDS];
+	if (mdns_message_parse(buffer, size, &message, message_records, MDNS_MAX_MESSAGE_RECORDS) < 0)
+		return count;
+	return mdns_known_answer_filter_message(&message, records, count, ttl);
+}
+
+static size_t
+mdns_known_answer_filter_message(const mdns_message_t* message, mdns_record_t* records,
+                                 size_t count, uint32_t ttl) {
+	const void* buffer = message->buffer;
+	size_t size = message->size;
+	size_t answer_count = mdns_message_record_count(message, MDNS_ENTRYTYPE_ANSWER);
+	for (size_t ianswer = 0; (ianswer < answer_count) && count; ++ianswer) {
+		const mdns_message_record_t* answer =
+		    mdns_message_record(message, MDNS_ENTRYTYPE_ANSWER, ianswer);
+
+		// Known answers with less than half our TTL remaining must still be answered
+		if (((answer->rclass & 0x7FFF) != MDNS_CLASS_IN) || (((uint64_t)answer->ttl * 2) < ttl))
+			continue;
+
+		for (size_t irec = 0; irec < count;) {
+			const mdns_record_t* record = records + irec;
+			if ((record->type != answer->rtype) ||
+			    !mdns_record_name_equal(buffer, size, answer->name_offset, record->name,
+			                            record->name_compiled)) {
+				++irec;
+				continue;
+			}
+			if (record->type == MDNS_RECORDTYPE_TXT) {
+				// TXT records with the same name are sent as one record, and are only known if
+				// the known answer has all of their strings
+				if (!mdns_record_txt_equal(buffer, size, answer->data_offset, answer->data_length,
+				                           records, count, irec))
+					break;
+				mdns_record_t txt = *record;
+				size_t kept = irec;
+				for (size_t itxt = irec; itxt < count; ++itxt) {
+					if ((records[itxt].type != MDNS_RECORDTYPE_TXT) ||
+					    !mdns_record_store_name_equal(records[itxt].name,
+					                                  records[itxt].name_compiled, txt.name,
+					                                  txt.name_compiled))
+						records[kept++] = records[itxt];
+				}
+				count = kept;
+				break;
+			}
+			if (mdns_record_data_equal(buffer, size, answer->data_offset, answer->data_length,
+			                           record)) {
+				memmove(records + irec, records + irec + 1,
+				        sizeof(mdns_record_t) * (count - irec - 1));
+				--count;
+			} else {
+				++irec;
+			}
+		}
+	}
+	return count;
+}
+
+static void
+mdns_response_scheduler_initialize(mdns_response_scheduler_t* scheduler, mdns_record_t* answers,
+                                   size_t answer_capacity, mdns_record_t* additional,
+                                   size_t additional_capacity, void* arena, size_t arena_capacity) {
+	memset(scheduler, 0, sizeof(mdns_response_scheduler_t));
+	scheduler->answer = answers;
+	scheduler->answer_capacity = answer_capacity;
+	scheduler->additional = additional;
+	scheduler->additional_capacity = additional_capacity;
+	scheduler->arena = (char*)arena;
+	scheduler->arena_capacity = arena_capacity;
+}
+
+// Get the number of bytes needed to copy a name in dotted form, a compiled name without a dotted
+// name takes one byte less than its wire format
+static size_t
+mdns_response_scheduler_name_size(mdns_string_t name, const mdns_name_t* compiled) {
+	if (!name.length && compiled && compiled->length)
+		return compiled->length - 1;
+	return name.length;
+}
+
+// Get the number of bytes needed to copy the names and TXT strings of records to the arena
+static size_t
+mdns_response_scheduler_records_size(const mdns_record_t* records, size_t count) {
+	size_t size = 0;
+	for (size_t irec = 0; irec < count; ++irec) {
+		const mdns_record_t* record = records + irec;
+		size += mdns_response_scheduler_name_size(record->name, record->name_compiled);
+		if (record->type == MDNS_RECORDTYPE_PTR)
+			size += mdns_response_scheduler_name_size(record->data.ptr.name,
+			                                          record->data.ptr.name_compiled);
+		else if (record->type == MDNS_RECORDTYPE_SRV)
+			size += mdns_response_scheduler_name_size(record->data.srv.name,
+			                                          record->data.srv.name_compiled);
+		else if (record->type == MDNS_RECORDTYPE_TXT)
+			size += record->data.txt.key.length + record->data.txt.value.length;
+	}
+	return size;
+}
+
+// Copy a string to the arena, or a compiled name without a dotted name in dotted form. The arena
+// has room, checked by the caller
+static mdns_string_t
+mdns_response_scheduler_copy_string(mdns_response_scheduler_t* scheduler, mdns_string_t str,
+                                    const mdns_name_t* compiled) {
+	char* copy = scheduler->arena + scheduler->arena_size;
+	size_t length = 0;
+	if (!str.length && compiled && compiled->length) {
+		for (size_t ilabel = 0; ilabel < compiled->label_count; ++ilabel) {
+			const uint8_t* label = compiled->data + compiled->label_offset[ilabel];
+			memcpy(copy + length, label + 1, *label);
+			length += *label;
+			copy[length++] = '.';
+		}
+	} else if (str.length) {
+		memcpy(copy, str.str, str.length);
+		length = str.length;
+	}
+	scheduler->arena_size += length;
+	mdns_string_t result = {copy, length};
+	return result;
+}
+
+// Copy a record with its names and TXT strings to the arena of the scheduler
+static mdns_record_t
+mdns_response_scheduler_copy_record(mdns_response_scheduler_t* scheduler,
+                                    const mdns_record_t* record) {
+	mdns_record_t copy = *record;
+	copy.name = mdns_response_scheduler_copy_string(scheduler, record->name, record->name_compiled);
+	copy.name_compiled = 0;
+	if (record->type == MDNS_RECORDTYPE_PTR) {
+		copy.data.ptr.name = mdns_response_scheduler_copy_string(scheduler, record->data.ptr.name,
+		                                                         record->data.ptr.name_compiled);
+		copy.data.ptr.name_compiled = 0;
+	} else if (record->type == MDNS_RECORDTYPE_SRV) {
+		copy.data.srv.name = mdns_response_scheduler_copy_string(scheduler, record->data.srv.name,
+		                                                         record->data.srv.name_compiled);
+		copy.data.srv.name_compiled = 0;
+	} else if (record->type == MDNS_RECORDTYPE_TXT) {
+		copy.data.txt.key = mdns_response_scheduler_copy_string(scheduler, record->data.txt.key, 0);
+		copy.data.txt.value =
+		    mdns_response_scheduler_copy_string(scheduler, record->data.txt.value, 0);
+	}
+	return copy;
+}
+
+static int
+mdns_response_scheduler_add(mdns_response_scheduler_t* scheduler, const mdns_record_t* answers,
+                            size_t answer_count, const mdns_record_t* additional,
+                            size_t additional_count, uint64_t now, unsigned int delay) {
+	if ((answer_count > (scheduler->answer_capacity - scheduler->answer_count)) ||
+	    (additional_count > (scheduler->additional_capacity - scheduler->additional_count)))
+		return -1;
+	if (!answer_count)
+		return 0;
+	// Duplicates are not copied, but are counted here so that nothing is added if the strings do
+	// not fit
+	size_t arena_size = mdns_response_scheduler_records_size(answers, answer_count) +
+	                    mdns_response_scheduler_records_size(additional, additional_count);
+	if (arena_size > (scheduler->arena_capacity - scheduler->arena_size))
+		return -1;
+
+	if (!scheduler->answer_count) {
+		scheduler->start = now;
+		scheduler->deadline = now + delay;
+	} else {
+		// Answers joining a pending response can postpone it, but not beyond the maximum delay
+		uint64_t deadline = now + delay;
+		if (deadline > (scheduler->start + MDNS_RESPONSE_DELAY_MAX))
+			deadline = scheduler->start + MDNS_RESPONSE_DELAY_MAX;
+		if (deadline > scheduler->deadline)
+			scheduler->deadline = deadline;
+	}
+
+	for (size_t irec = 0; irec < answer_count; ++irec) {
+		int pending = 0;
+		for (size_t ians = 0; !pending && (ians < scheduler->answer_count); ++ians)
+			pending = mdns_record_equal(scheduler->answer + ians, answers + irec);
+		if (pending)
+			continue;
+		scheduler->answer[scheduler->answer_count++] =
+		    mdns_response_scheduler_copy_record(scheduler, answers + irec);
+		// A record sent as an answer does not need to be repeated in the additional section
+		for (size_t iadd = 0; iadd < scheduler->additional_count; ++iadd) {
+			if (mdns_record_equal(scheduler->additional + iadd, answers + irec)) {
+				memmove(scheduler->additional + iadd, scheduler->additional + iadd + 1,
+				        sizeof(mdns_record_t) * (scheduler->additional_count - iadd - 1));
+				--scheduler->additional_count;
+				break;
+			}
+		}
+	}
+
+	for (size_t irec = 0; irec < additional_count; ++irec) {
+		int pending = 0;
+		for (size_t ians = 0; !pending && (ians < scheduler->answer_count); ++ians)
+			pending = mdns_record_equal(scheduler->answer + ians, additional + irec);
+		for (size_t iadd = 0; !pending && (iadd < scheduler->additional_count); ++iadd)
+			pending = mdns_record_equal(scheduler->additional + iadd, additional + irec);
+		if (!pending)
+			scheduler->additional[scheduler->additional_count++] =
+			    mdns_response_scheduler_copy_record(scheduler, additional + irec);
+	}
+	return 0;
+}
+
+static void
+mdns_response_scheduler_initialize_hold(mdns_response_scheduler_t* scheduler, void* buffer,
+                                        size_t capacity) {
+	scheduler->hold_buffer = buffer;
+	scheduler->hold_capacity = capacity;
+	scheduler->hold_size = 0;
+	scheduler->hold_count = 0;
+}
+
+// Check if two socket addresses have the same address and port
+static int
+mdns_socket_address_equal(const struct sockaddr* lhs, size_t lhs_len, const struct sockaddr* rhs,
+                          size_t rhs_len) {
+	if (lhs->sa_family != rhs->sa_family)
+		return 0;
+	if ((lhs->sa_family == AF_INET) && (lhs_len >= sizeof(struct sockaddr_in)) &&
+	    (rhs_len >= sizeof(struct sockaddr_in))) {
+		const struct sockaddr_in* lhs_in = (const struct sockaddr_in*)(const void*)lhs;
+		const struct sockaddr_in* rhs_in = (const struct sockaddr_in*)(const void*)rhs;
+		return (lhs_in->sin_port == rhs_in->sin_port) &&
+		       (lhs_in->sin_addr.s_addr == rhs_in->sin_addr.s_addr);
+	}
+	if ((lhs->sa_family == AF_INET6) && (lhs_len >= sizeof(struct sockaddr_in6)) &&
+	    (rhs_len >= sizeof(struct sockaddr_in6))) {
+		const struct sockaddr_in6* lhs_in6 = (const struct sockaddr_in6*)(const void*)lhs;
+		const struct sockaddr_in6* rhs_in6 = (const struct sockaddr_in6*)(const void*)rhs;
+		return (lhs_in6->sin6_port == rhs_in6->sin6_port) &&
+		       (lhs_in6->sin6_scope_id == rhs_in6->sin6_scope_id) &&
+		       !memcmp(&lhs_in6->sin6_addr, &rhs_in6->sin6_addr, sizeof(lhs_in6->sin6_addr));
+	}
+	return 0;
+}
+
+// Copy a packet of the held query to the hold storage, 32 bit aligned. Returns 0 if it does not fit
+static int
+mdns_response_scheduler_hold_packet(mdns_response_scheduler_t* scheduler, const void* buffer,
+                                    size_t size) {
+	size_t offset = (scheduler->hold_size + 3) & ~(size_t)3;
+	if ((scheduler->hold_count >= MDNS_RESPONSE_HOLD_PACKETS) ||
+	    (offset > scheduler->hold_capacity) || (size > (scheduler->hold_capacity - offset)))
+		return 0;
+	memcpy(MDNS_POINTER_OFFSET(scheduler->hold_buffer, offset), buffer, size);
+	scheduler->hold_offset[scheduler->hold_count] = offset;
+	scheduler->hold_length[scheduler->hold_count] = size;
+	++scheduler->hold_count;
+	scheduler->hold_size = offset + size;
+	return 1;
+}
+
+static int
+mdns_response_scheduler_hold(mdns_response_scheduler_t* scheduler, const struct sockaddr* from,
+                             size_t addrlen, const void* buffer, size_t size, uint64_t now,
+                             unsigned int delay) {
+	if (!scheduler->hold_buffer || (size < sizeof(struct mdns_header_t)))
+		return 0;
+	const struct mdns_header_t* header = (const struct mdns_header_t*)buffer;
+	uint16_t flags = mdns_ntohs(&header->flags);
+	if (flags & 0x8000)
+		return 0;
+
+	// A query with questions starts a held query if it has the TC bit set
+	if (mdns_ntohs(&header->questions)) {
+		if (!(flags & MDNS_TRUNCATED) || scheduler->hold_count ||
+		    (addrlen > sizeof(scheduler->hold_from)))
+			return 0;
+		scheduler->hold_size = 0;
+		if (!mdns_response_scheduler_hold_packet(scheduler, buffer, size))
+			return 0;
+		memcpy(&scheduler->hold_from, from, addrlen);
+		scheduler->hold_addrlen = addrlen;
+		scheduler->hold_deadline = now + delay;
+		return 1;
+	}
+
+	// Continuation packets have known answers and no questions
+	if (!scheduler->hold_count || !mdns_ntohs(&header->answer_rrs) ||
+	    !mdns_socket_address_equal(from, addrlen, (const struct sockaddr*)&scheduler->hold_from,
+	                               scheduler->hold_addrlen))
+		return 0;
+	mdns_response_scheduler_hold_packet(scheduler, buffer, size);
+	return 1;
+}
+
+static size_t
+mdns_response_scheduler_release(mdns_response_scheduler_t* scheduler, uint64_t now,
+                                mdns_message_t* messages, size_t message_capacity,
+                                mdns_message_record_t* records, size_t record_capacity) {
+	if (!scheduler->hold_count || (now < scheduler->hold_deadline))
+		return 0;
+	size_t count = 0;
+	size_t used = 0;
+	for (size_t ipacket = 0; (ipacket < scheduler->hold_count) && (count < message_capacity);
+	     ++ipacket) {
+		const void* packet =
+		    MDNS_POINTER_OFFSET_CONST(scheduler->hold_buffer, scheduler->hold_offset[ipacket]);
+		if (mdns_message_parse(packet, scheduler->hold_length[ipacket], messages + count,
+		                       records + used, record_capacity - used) < 0)
+			continue;
+		for (int isection = 0; isection < 4; ++isection)
+			used += messages[count].count[isection];
+		++count;
+	}
+	scheduler->hold_count = 0;
+	return count;
+}
+
+// Get the number of milliseconds until the given deadline, 0 if passed
+static int
+mdns_response_scheduler_remain(uint64_t deadline, uint64_t now) {
+	if (now >= deadline)
+		return 0;
+	uint64_t remain = deadline - now;
+	return (remain > 0x7FFFFFFF) ? 0x7FFFFFFF : (int)remain;
+}
+
+static int
+mdns_response_scheduler_timeout(const mdns_response_scheduler_t* scheduler, uint64_t now) {
+	int timeout = -1;
+	if (scheduler->answer_count)
+		timeout = mdns_response_scheduler_remain(scheduler->deadline, now);
+	if (scheduler->hold_count) {
+		int hold = mdns_response_scheduler_remain(scheduler->hold_deadline, now);
+		if ((timeout < 0) || (hold < timeout))
+			timeout = hold;
+	}
+	return timeout;
+}
+
+static size_t
+mdns_response_scheduler_build(mdns_response_scheduler_t* scheduler, void* buffer,
+                              size_t capacity) {
+	if (!scheduler->answer_count)
+		return 0;
+	size_t size = mdns_answer_multicast_records_build(
+	    buffer, capacity, MDNS_CLASS_IN, scheduler->answer, scheduler->answer_count, 0, 0,
+	    scheduler->additional, scheduler->additional_count);
+	scheduler->answer_count = 0;
+	scheduler->additional_count = 0;
+	scheduler->arena_size = 0;
+	return size;
+}
+
+static int
+mdns_response_scheduler_split(mdns_response_scheduler_t* scheduler, void* buffer, size_t capacity,
+                              size_t max_size, mdns_packet_send_fn send, void* user_data) {
+	if (!scheduler->answer_count)
+		return 0;
+	int ret = mdns_answer_multicast_split(buffer, capacity, max_size, MDNS_CLASS_IN,
+	                                      scheduler->answer, scheduler->answer_count, 0, 0,
+	                                      scheduler->additional, scheduler->additional_count,
+	                                      send, user_data);
+	scheduler->answer_count = 0;
+	scheduler->additional_count = 0;
+	scheduler->arena_size = 0;
+	return ret;
+}
+
+static int
+mdns_response_scheduler_send(int sock, mdns_response_scheduler_t* scheduler, void* buffer,
+                             size_t capacity) {
+	mdns_packet_target_t target = {sock, 0, 0, scheduler->interface_index};
+	int ret = mdns_response_scheduler_split(scheduler, buffer, capacity, 0,
+	                                        mdns_packet_send_target, &target);
+	return (ret < 0) ? -1 : 0;
+}
+
+static void
+mdns_cache_initialize(mdns_cache_t* cache, mdns_cache_entry_t* entries, size_t capacity,
+                      size_t* buckets, size_t bucket_count, void* arena, size_t arena_capacity) {
+	memset(cache, 0, sizeof(mdns_cache_t));
+	cache->entry = entries;
+	cache->capacity = capacity;
+	cache->bucket = buckets;
+	cache->bucket_count = bucket_count;
+	cache->arena = arena;
+	cache->arena_capacity = arena_capacity;
+	mdns_cache_clear(cache);
+}
+
+static void
+mdns_cache_clear(mdns_cache_t* cache) {
+	for (size_t ibucket = 0; ibucket < cache->bucket_count; ++ibucket)
+		cache->bucket[ibucket] = MDNS_INVALID_POS;
+	cache->count = 0;
+	cache->arena_used = 0;
+}
+
+static void
+mdns_cache_link(mdns_cache_t* cache, size_t index) {
+	mdns_cache_entry_t* entry = cache->entry + index;
+	size_t* bucket = cache->bucket + (entry->hash % cache->bucket_count);
+	entry->next = *bucket;
+	*bucket = index;
+}
+
+// Entry data starts 64 bit aligned to keep the source address aligned
+static size_t
+mdns_cache_align(size_t offset) {
+	return (offset + 7) & ~(size_t)7;
+}
+
+static size_t
+mdns_cache_expire(mdns_cache_t* cache, uint64_t now) {
+	// Entries are stored in arena order, so live data can be moved down in place
+	size_t count = 0;
+	size_t arena_used = 0;
+	for (size_t ientry = 0; ientry < cache->count; ++ientry) {
+		mdns_cache_entry_t entry = cache->entry[ientry];
+		if (entry.expire <= now)
+			continue;
+		size_t begin = entry.from_offset;
+		size_t end = entry.data_offset + entry.data_length;
+		size_t dest = mdns_cache_align(arena_used);
+		size_t shift = begin - dest;
+		if (shift) {
+			memmove(MDNS_POINTER_OFFSET(cache->arena, dest),
+			        MDNS_POINTER_OFFSET(cache->arena, begin), end - begin);
+			entry.from_offset -= shift;
+			entry.name_offset -= shift;
+			entry.data_offset -= shift;
+		}
+		arena_used = dest + (end - begin);
+		cache->entry[count++] = entry;
+	}
+	size_t removed = cache->count - count;
+	cache->count = count;
+	cache->arena_used = arena_used;
+
+	for (size_t ibucket = 0; ibucket < cache->bucket_count; ++ibucket)
+		cache->bucket[ibucket] = MDNS_INVALID_POS;
+	for (size_t ientry = 0; ientry < count; ++ientry)
+		mdns_cache_link(cache, ientry);
+	return removed;
+}
+
+// Write the source address, uncompressed name and record data with uncompressed names to the free
+// space at the end of the arena. Returns the size written, or 0 if it does not fit or is invalid
+static size_t
+mdns_cache_stage(mdns_cache_t* cache, mdns_cache_entry_t* entry, const struct sockaddr* from,
+                 size_t addrlen, const void* buffer, size_t size, size_t name_offset,
+                 uint16_t rtype, size_t record_offset, size_t record_length) {
+	size_t offset = mdns_cache_align(cache->arena_used);
+	size_t capacity = cache->arena_capacity;
+	if (!from)
+		addrlen = 0;
+	if ((offset > capacity) || (addrlen > (capacity - offset)) || (record_length > size) ||
+	    (record_offset > (size - record_length)))
+		return 0;
+	entry->from_offset = offset;
+	entry->from_length = addrlen;
+	if (addrlen)
+		memcpy(MDNS_POINTER_OFFSET(cache->arena, offset), from, addrlen);
+	offset += addrlen;
+
+	entry->name_offset = offset;
+	entry->name_length = mdns_string_copy_wire(
+	    buffer, size, name_offset, MDNS_POINTER_OFFSET(cache->arena, offset), capacity - offset);
+	if (!entry->name_length)
+		return 0;
+	offset += entry->name_length;
+
+	entry->data_offset = offset;
+	void* data = MDNS_POINTER_OFFSET(cache->arena, offset);
+	if (rtype == MDNS_RECORDTYPE_PTR) {
+		entry->data_length =
+		    mdns_string_copy_wire(buffer, size, record_offset, data, capacity - offset);
+		if (!entry->data_length)
+			return 0;
+	} else if (rtype == MDNS_RECORDTYPE_SRV) {
+		if ((record_length < 6) || ((capacity - offset) < 6))
+			return 0;
+		memcpy(data, MDNS_POINTER_OFFSET_CONST(buffer, record_offset), 6);
+		entry->data_length = mdns_string_copy_wire(buffer, size, record_offset + 6,
+		                                           MDNS_POINTER_OFFSET(data, 6),
+		                                           capacity - offset - 6);
+		if (!entry->data_length)
+			return 0;
+		entry->data_length += 6;
+	} else {
+		if (record_length > (capacity - offset))
+			return 0;
+		memcpy(data, MDNS_POINTER_OFFSET_CONST(buffer, record_offset), record_length);
+		entry->data_length = record_length;
+	}
+	offset += entry->data_length;
+	return offset - cache->arena_used;
+}
+
+static int
+mdns_cache_insert(mdns_cache_t* cache, const struct sockaddr* from, size_t addrlen,
+                  const void* buffer, size_t size, size_t name_offset, uint16_t rtype,
+                  uint16_t rclass, uint32_t ttl, size_t record_offset, size_t record_length,
+                  uint64_t now) {
+	if ((rtype != MDNS_RECORDTYPE_A) && (rtype != MDNS_RECORDTYPE_AAAA) &&
+	    (rtype != MDNS_RECORDTYPE_PTR) && (rtype != MDNS_RECORDTYPE_SRV) &&
+	    (rtype != MDNS_RECORDTYPE_TXT))
+		return 0;
+	if (!cache->capacity || !cache->bucket_count)
+		return -1;
+	uint64_t hash = mdns_name_hash(buffer, size, name_offset);
+	if (!hash)
+		return -1;
+
+	if (cache->count >= cache->capacity)
+		mdns_cache_expire(cache, now);
+	mdns_cache_entry_t staged;
+	size_t staged_size = (cache->count < cache->capacity) ?
+	                         mdns_cache_stage(cache, &staged, from, addrlen, buffer, size,
+	                                          name_offset, rtype, record_offset, record_length) :
+	                         0;
+	if (!staged_size) {
+		mdns_cache_expire(cache, now);
+		if (cache->count < cache->capacity)
+			staged_size = mdns_cache_stage(cache, &staged, from, addrlen, buffer, size,
+			                               name_offset, rtype, record_offset, record_length);
+	}
+
+	uint16_t cache_flush = (rclass & MDNS_CACHE_FLUSH);
+	rclass &= (uint16_t)~MDNS_CACHE_FLUSH;
+	int found = 0;
+	size_t index = cache->bucket[hash % cache->bucket_count];
+	while (index != MDNS_INVALID_POS) {
+		mdns_cache_entry_t* entry = cache->entry + index;
+		index = entry->next;
+		if ((entry->expire <= now) || (entry->hash != hash) || (entry->rtype != rtype) ||
+		    (entry->rclass != rclass))
+			continue;
+		size_t entry_ofs = entry->name_offset;
+		size_t name_ofs = name_offset;
+		if (!mdns_string_equal(cache->arena, cache->arena_used, &entry_ofs, buffer, size,
+		                       &name_ofs))
+			continue;
+		int same = staged_size && (entry->data_length == staged.data_length) &&
+		           !memcmp(MDNS_POINTER_OFFSET(cache->arena, entry->data_offset),
+		                   MDNS_POINTER_OFFSET(cache->arena, staged.data_offset),
+		                   entry->data_length);
+		if (same) {
+			// Goodbye records are removed after one second (RFC 6762 section 10.1)
+			entry->ttl = ttl;
+			entry->received = now;
+			entry->expire = now + (ttl ? ((uint64_t)ttl * 1000) : 1000);
+			entry->refresh = 0;
+			found = 1;
+		} else if (cache_flush && ((entry->received + 1000) <= now)) {
+			// Records with the cache flush bit replace records with the same name, type and
+			// class received more than one second ago, which expire one second later so records
+			// of the same set arriving in other packets are not lost (RFC 6762 section 10.2)
+			if (entry->expire > (now + 1000))
+				entry->expire = now + 1000;
+		}
+	}
+	if (found || !ttl)
+		return 0;
+	if (!staged_size)
+		return -1;
+
+	staged.hash = hash;
+	staged.rtype = rtype;
+	staged.rclass = rclass;
+	staged.ttl = ttl;
+	staged.received = now;
+	staged.expire = now + ((uint64_t)ttl * 1000);
+	staged.refresh = 0;
+	cache->entry[cache->count] = staged;
+	mdns_cache_link(cache, cache->count++);
+	cache->arena_used += staged_size;
+	return 0;
+}
+
+static size_t
+mdns_cache_insert_message(mdns_cache_t* cache, const struct sockaddr* from, size_t addrlen,
+                          const mdns_message_t* message, uint64_t now) {
+	size_t inserted = 0;
+	for (int section = MDNS_ENTRYTYPE_ANSWER; section <= MDNS_ENTRYTYPE_ADDITIONAL; ++section) {
+		size_t count = mdns_message_record_count(message, (mdns_entry_type_t)section);
+		for (size_t irec = 0; irec < count; ++irec) {
+			const mdns_message_record_t* record =
+			    mdns_message_record(message, (mdns_entry_type_t)section, irec);
+			if (mdns_cache_insert(cache, from, addrlen, message->buffer, message->size,
+			                      record->name_offset, record->rtype, record->rclass, record->ttl,
+			                      record->data_offset, record->data_length, now) == 0)
+				++inserted;
+		}
+	}
+	return inserted;
+}
+
+static size_t
+mdns_cache_query(const mdns_cache_t* cache, const char* name, size_t length, uint16_t rtype,
+                 uint64_t now, mdns_record_callback_fn callback, void* user_data) {
+	if (!cache->count || !cache->bucket_count)
+		return 0;
+	mdns_string_t name_string = {name, length};
+	uint64_t hash = mdns_name_hash_string(MDNS_STRING_ARGS(name_string));
+
+	size_t records = 0;
+	size_t index = cache->bucket[hash % cache->bucket_count];
+	while (index != MDNS_INVALID_POS) {
+		const mdns_cache_entry_t* entry = cache->entry + index;
+		index = entry->next;
+		if ((entry->expire <= now) || (entry->hash != hash) ||
+		    ((rtype != MDNS_RECORDTYPE_ANY) && (entry->rtype != rtype)) ||
+		    !mdns_name_equal(cache->arena, cache->arena_used, entry->name_offset,
+		                     MDNS_STRING_ARGS(name_string)))
+			continue;
+		++records;
+		uint32_t ttl = (uint32_t)((entry->expire - now + 999) / 1000);
+		const struct sockaddr* from = 0;
+		if (entry->from_length)
+			from = (const struct sockaddr*)MDNS_POINTER_OFFSET_CONST(cache->arena,
+			                                                         entry->from_offset);
+		if (callback(0, from, entry->from_length, MDNS_ENTRYTYPE_ANSWER, 0, entry->rtype,
+		             entry->rclass, ttl, cache->arena, cache->arena_used, entry->name_offset,
+		             entry->name_length, entry->data_offset, entry->data_length, user_data))
+			break;
+	}
+	return records;
+}
+
+// Get the time in milliseconds when the next refresh query for a cached record is due, at 80, 85,
+// 90 and 95 percent of the TTL plus a variation of up to 2 percent of the TTL (RFC 6762 section
+// 5.2), or 0 if no refresh query is left before the record expires. The variation is derived from
+// the name hash and the receive time, so hosts caching the same record refresh it at different
+// times
+static uint64_t
+mdns_cache_refresh_deadline(const mdns_cache_entry_t* entry) {
+	if (!entry->ttl || (entry->refresh >= 4))
+		return 0;
+	uint64_t mix = entry->hash ^ (entry->received * 0x9E3779B97F4A7C15ULL);
+	mix ^= mix >> 31;
+	mix *= 0xBF58476D1CE4E5B9ULL;
+	mix ^= mix >> 29;
+	uint64_t variation = (mix >> (16 * entry->refresh)) & 0xFFFF;
+	uint64_t lifetime = (uint64_t)entry->ttl * 1000;
+	uint64_t deadline = entry->received + ((lifetime * (80 + 5 * entry->refresh)) / 100) +
+	                    ((lifetime * variation) / (50 * 65536ULL));
+	return (deadline < entry->expire) ? deadline : 0;
+}
+
+// Check if a cached record answers a continuous question
+static int
+mdns_query_scheduler_match(const mdns_query_scheduler_entry_t* entry, const mdns_cache_t* cache,
+                           const mdns_cache_entry_t* cache_entry, uint64_t now) {
+	return (cache_entry->expire > now) && (cache_entry->hash == entry->hash) &&
+	       ((entry->query.type == MDNS_RECORDTYPE_ANY) ||
+	        (cache_entry->rtype == entry->query.type)) &&
+	       mdns_name_equal(cache->arena, cache->arena_used, cache_entry->name_offset,
+	                       entry->query.name, entry->query.length);
+}
+
+static void
+mdns_query_scheduler_initialize(mdns_query_scheduler_t* scheduler,
+                                mdns_query_scheduler_entry_t* entries, size_t capacity) {
+	memset(scheduler, 0, sizeof(mdns_query_scheduler_t));
+	scheduler->entry = entries;
+	scheduler->capacity = capacity;
+}
+
+// Find the continuous question with the given record type and name
+static size_t
+mdns_query_scheduler_find(const mdns_query_scheduler_t* scheduler, mdns_record_type_t type,
+                          const char* name, size_t length, uint64_t hash) {
+	mdns_string_t name_string = {name, length};
+	for (size_t ientry = 0; ientry < scheduler->count; ++ientry) {
+		const mdns_query_scheduler_entry_t* entry = scheduler->entry + ientry;
+		mdns_string_t entry_name = {entry->query.name, entry->query.length};
+		if ((entry->query.type == type) && (entry->hash == hash) &&
+		    mdns_record_store_name_equal(entry_name, 0, name_string, 0))
+			return ientry;
+	}
+	return MDNS_INVALID_POS;
+}
+
+static int
+mdns_query_scheduler_add(mdns_query_scheduler_t* scheduler, mdns_record_type_t type,
+                         const char* name, size_t length, uint64_t now, unsigned int delay) {
+	uint64_t hash = mdns_name_hash_string(name, length);
+	if (!length || !hash)
+		return -1;
+	size_t index = mdns_query_scheduler_find(scheduler, type, name, length, hash);
+	if (index == MDNS_INVALID_POS) {
+		if (scheduler->count >= scheduler->capacity)
+			return -1;
+		index = scheduler->count++;
+	}
+	mdns_query_scheduler_entry_t* entry = scheduler->entry + index;
+	entry->query.type = type;
+	entry->query.name = name;
+	entry->query.length = length;
+	entry->hash = hash;
+	entry->deadline = now + delay;
+	entry->interval = MDNS_QUERY_INTERVAL_MIN;
+	entry->rclass = MDNS_CLASS_IN | MDNS_UNICAST_RESPONSE;
+	return 0;
+}
+
+static int
+mdns_query_scheduler_remove(mdns_query_scheduler_t* scheduler, mdns_record_type_t type,
+                            const char* name, size_t length) {
+	size_t index = mdns_query_scheduler_find(scheduler, type, name, length,
+	                                         mdns_name_hash_string(name, length));
+	if (index == MDNS_INVALID_POS)
+		return -1;
+	--scheduler->count;
+	memmove(scheduler->entry + index, scheduler->entry + index + 1,
+	        sizeof(mdns_query_scheduler_entry_t) * (scheduler->count - index));
+	return 0;
+}
+
+static int
+mdns_query_scheduler_timeout(const mdns_query_scheduler_t* scheduler, const mdns_cache_t* cache,
+                             uint64_t now) {
+	if (!scheduler->count)
+		return -1;
+	uint64_t deadline = scheduler->entry[0].deadline;
+	for (size_t ientry = 0; ientry < scheduler->count; ++ientry) {
+		const mdns_query_scheduler_entry_t* entry = scheduler->entry + ientry;
+		if (entry->deadline < deadline)
+			deadline = entry->deadline;
+		if (!cache || !cache->count || !cache->bucket_count)
+			continue;
+		size_t index = cache->bucket[entry->hash % cache->bucket_count];
+		while (index != MDNS_INVALID_POS) {
+			const mdns_cache_entry_t* cache_entry = cache->entry + index;
+			index = cache_entry->next;
+			if (!mdns_query_scheduler_match(entry, cache, cache_entry, now))
+				continue;
+			uint64_t refresh = mdns_cache_refresh_deadline(cache_entry);
+			if (refresh && (refresh < deadline))
+				deadline = refresh;
+		}
+	}
+	if (now >= deadline)
+		return 0;
+	uint64_t remain = deadline - now;
+	return (remain > 0x7FFFFFFF) ? 0x7FFFFFFF : (int)remain;
+}
+
+static size_t
+mdns_query_scheduler_due(mdns_query_scheduler_t* scheduler, mdns_cache_t* cache, uint64_t now,
+                         mdns_query_t* query, uint16_t* rclass, size_t capacity) {
+	size_t count = 0;
+	for (size_t ientry = 0; (ientry < scheduler->count) && (count < capacity); ++ientry) {
+		mdns_query_scheduler_entry_t* entry = scheduler->entry + ientry;
+		int due = 0;
+		if (entry->deadline <= now) {
+			// Intervals between queries double up to the maximum interval
+			entry->deadline = now + entry->interval;
+			entry->interval = (entry->interval < (MDNS_QUERY_INTERVAL_MAX / 2)) ?
+			                      (entry->interval * 2) :
+			                      MDNS_QUERY_INTERVAL_MAX;
+			due = 1;
+		}
+		if (cache && cache->count && cache->bucket_count) {
+			size_t index = cache->bucket[entry->hash % cache->bucket_count];
+			while (index != MDNS_INVALID_POS) {
+				mdns_cache_entry_t* cache_entry = cache->entry + index;
+				index = cache_entry->next;
+				if (!mdns_query_scheduler_match(entry, cache, cache_entry, now))
+					continue;
+				// Refresh queries passed without being sent are covered by this one
+				uint64_t refresh = mdns_cache_refresh_deadline(cache_entry);
+				while (refresh && (refresh <= now)) {
+					++cache_entry->refresh;
+					refresh = mdns_cache_refresh_deadline(cache_entry);
+					due = 1;
+				}
+			}
+		}
+		if (!due)
+			continue;
+		if (rclass)
+			rclass[count] = entry->rclass;
+		entry->rclass &= (uint16_t)~MDNS_UNICAST_RESPONSE;
+		query[count++] = entry->query;
+	}
+	return count;
+}
+
+static int
+mdns_query_scheduler_send_due(int sock, const mdns_query_t* query, const uint16_t* rclass,
+                              size_t count, void* buffer, size_t capacity,
+                              const mdns_cache_t* cache, uint64_t now) {
+	if (!rclass)
+		return -1;
+	int ret =
+	    mdns_multiquery_send_cached(sock, query, rclass, count, buffer, capacity, 0, cache, now);
+	return (ret < 0) ? -1 : 0;
+}
+
+static int
+mdns_query_scheduler_send(int sock, mdns_query_scheduler_t* scheduler, mdns_cache_t* cache,
+                          void* buffer, size_t capacity, uint64_t now) {
+	mdns_query_t query[16];
+	uint16_t rclass[16];
+	int sent = 0;
+	while (1) {
+		size_t count = mdns_query_scheduler_due(scheduler, cache, now, query, rclass,
+		                                        sizeof(query) / sizeof(query[0]));
+		if (!count)
+			break;
+		if (mdns_query_scheduler_send_due(sock, query, rclass, count, buffer, capacity, cache,
+		                                  now))
+			return -1;
+		sent += (int)count;
+	}
+	return sent;
+}
+
+static int
+mdns_engine_initialize(mdns_engine_t* engine, mdns_engine_socket_t* sockets,
+                       size_t socket_capacity, mdns_engine_timer_t* timers,
+                       size_t timer_capacity) {
+	memset(engine, 0, sizeof(mdns_engine_t));
+	engine->socket = sockets;
+	engine->socket_capacity = socket_capacity;
+	engine->timer = timers;
+	engine->timer_capacity = timer_capacity;
+#ifdef MDNS_HAVE_EPOLL
+	engine->epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (engine->epoll < 0)
+		return -1;
+#else
+	if (engine->socket_capacity > MDNS_ENGINE_POLL_MAX)
+		engine->socket_capacity = MDNS_ENGINE_POLL_MAX;
+#endif
+	return 0;
+}
+
+static void
+mdns_engine_finalize(mdns_engine_t* engine) {
+	for (size_t isock = 0; isock < engine->socket_count; ++isock)
+		mdns_socket_close(engine->socket[isock].sock);
+	engine->socket_count = 0;
+	engine->timer_count = 0;
+#ifdef MDNS_HAVE_EPOLL
+	if (engine->epoll >= 0)
+		close(engine->epoll);
+	engine->epoll = -1;
+#endif
+}
+
+#ifdef MDNS_HAVE_EPOLL
+// Socket events carry the socket slot in the upper and the socket in the lower 32 bits, to detect
+// events for sockets removed or moved by an earlier callback in the same dispatch
+static int
+mdns_engine_epoll_set(mdns_engine_t* engine, int op, size_t slot) {
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u64 = ((uint64_t)slot << 32) | (uint32_t)engine->socket[slot].sock;
+	return epoll_ctl(engine->epoll, op, engine->socket[slot].sock, &event);
+}
+#endif
+
+static int
+mdns_engine_add_socket(mdns_engine_t* engine, int sock, mdns_engine_socket_fn callback,
+                       void* user_data) {
+	if (engine->socket_count >= engine->socket_capacity)
+		return -1;
+	size_t slot = engine->socket_count;
+	engine->socket[slot].sock = sock;
+	engine->socket[slot].callback = callback;
+	engine->socket[slot].user_data = user_data;
+#ifdef MDNS_HAVE_EPOLL
+	if (mdns_engine_epoll_set(engine, EPOLL_CTL_ADD, slot))
+		return -1;
+#else
+	engine->poll[slot].fd = sock;
+	engine->poll[slot].events = POLLIN;
+	engine->poll[slot].revents = 0;
+#endif
+	++engine->socket_count;
+	return 0;
+}
+
+static int
+mdns_engine_remove_socket(mdns_engine_t* engine, int sock) {
+	size_t slot = 0;
+	while ((slot < engine->socket_count) && (engine->socket[slot].sock != sock))
+		++slot;
+	if (slot == engine->socket_count)
+		return -1;
+
+	// Move the last socket into the free slot
+	size_t last = --engine->socket_count;
+#ifdef MDNS_HAVE_EPOLL
+	epoll_ctl(engine->epoll, EPOLL_CTL_DEL, sock, 0);
+	if (slot != last) {
+		engine->socket[slot] = engine->socket[last];
+		mdns_engine_epoll_set(engine, EPOLL_CTL_MOD, slot);
+	}
+#else
+	if (slot != last) {
+		engine->socket[slot] = engine->socket[last];
+		engine->poll[slot] = engine->poll[last];
+	}
+#endif
+	return 0;
+}
+
+static void
+mdns_engine_timer_sift_up(mdns_engine_t* engine, size_t index) {
+	mdns_engine_timer_t timer = engine->timer[index];
+	while (index) {
+		size_t parent = (index - 1) / 2;
+		if (engine->timer[parent].deadline <= timer.deadline)
+			break;
+		engine->timer[index] = engine->timer[parent];
+		index = parent;
+	}
+	engine->timer[index] = timer;
+}
+
+static void
+mdns_engine_timer_sift_down(mdns_engine_t* engine, size_t index) {
+	mdns_engine_timer_t timer = engine->timer[index];
+	while (1) {
+		size_t child = (index * 2) + 1;
+		if (child >= engine->timer_count)
+			break;
+		if (((child + 1) < engine->timer_count) &&
+		    (engine->timer[child + 1].deadline < engine->timer[child].deadline))
+			++child;
+		if (timer.deadline <= engine->timer[child].deadline)
+			break;
+		engine->timer[index] = engine->timer[child];
+		index = child;
+	}
+	engine->timer[index] = timer;
+}
+
+static void
+mdns_engine_timer_remove_index(mdns_engine_t* engine, size_t index) {
+	size_t last = --engine->timer_count;
+	if (index == last)
+		return;
+	engine->timer[index] = engine->timer[last];
+	if (index && (engine->timer[index].deadline < engine->timer[(index - 1) / 2].deadline))
+		mdns_engine_timer_sift_up(engine, index);
+	else
+		mdns_engine_timer_sift_down(engine, index);
+}
+
+static int
+mdns_engine_add_timer(mdns_engine_t* engine, uint64_t deadline, mdns_engine_timer_fn callback,
+                      void* user_data) {
+	if (engine->timer_count >= engine->timer_capacity)
+		return -1;
+	size_t index = engine->timer_count++;
+	engine->timer[index].deadline = deadline;
+	engine->timer[index].callback = callback;
+	engine->timer[index].user_data = user_data;
+	mdns_engine_timer_sift_up(engine, index);
+	return 0;
+}
+
+static size_t
+mdns_engine_remove_timer(mdns_engine_t* engine, mdns_engine_timer_fn callback, void* user_data) {
+	size_t removed = 0;
+	size_t index = 0;
+	while (index < engine->timer_count) {
+		if ((engine->timer[index].callback == callback) &&
+		    (engine->timer[index].user_data == user_data)) {
+			mdns_engine_timer_remove_index(engine, index);
+			++removed;
+			// The timer moved into this index may be another match, restart the scan to also
+			// cover timers moved up from later indices
+			index = 0;
+			continue;
+		}
+		++index;
+	}
+	return removed;
+}
+
+static int
+mdns_engine_run_once(mdns_engine_t* engine, int timeout) {
+	// Wait no longer than until the first timer expires
+	uint64_t now = mdns_engine_time();
+	if (engine->timer_count) {
+		uint64_t deadline = engine->timer[0].deadline;
+		uint64_t remain = (deadline > now) ? (deadline - now) : 0;
+		if (remain > 0x7FFFFFFF)
+			remain = 0x7FFFFFFF;
+		if ((timeout < 0) || ((int)remain < timeout))
+			timeout = (int)remain;
+	}
+
+	int dispatched = 0;
+#ifdef MDNS_HAVE_EPOLL
+	struct epoll_event events[MDNS_ENGINE_EVENTS_MAX];
+	int ret = epoll_wait(engine->epoll, events, MDNS_ENGINE_EVENTS_MAX, timeout);
+	if ((ret < 0) && (errno != EINTR))
+		return -1;
+	for (int ievent = 0; ievent < ret; ++ievent) {
+		size_t slot = (size_t)(events[ievent].data.u64 >> 32);
+		int sock = (int)(uint32_t)(events[ievent].data.u64 & 0xFFFFFFFFU);
+		if ((slot >= engine->socket_count) || (engine->socket[slot].sock != sock))
+			continue;
+		engine->socket[slot].callback(engine, sock, engine->socket[slot].user_data);
+		++dispatched;
+	}
+#else
+#ifdef _WIN32
+	// WSAPoll fails on an empty array
+	int ret = 0;
+	if (engine->socket_count)
+		ret = WSAPoll(engine->poll, (ULONG)engine->socket_count, timeout);
+	else
+		Sleep((timeout < 0) ? INFINITE : (DWORD)timeout);
+	if (ret < 0)
+		return -1;
+#else
+	int ret = poll(engine->poll, (nfds_t)engine->socket_count, timeout);
+	if ((ret < 0) && (errno != EINTR))
+		return -1;
+#endif
+	// Walk the slots backwards so a socket moved into a slot by a removal has been visited
+	for (size_t slot = engine->socket_count; (ret > 0) && slot; --slot) {
+		if (slot > engine->socket_count)
+			continue;
+		short revents = engine->poll[slot - 1].revents;
+		engine->poll[slot - 1].revents = 0;
+		if (!(revents & (POLLIN | POLLERR | POLLHUP)))
+			continue;
+		engine->socket[slot - 1].callback(engine, engine->socket[slot - 1].sock,
+		                                  engine->socket[slot - 1].user_data);
+		++dispatched;
+	}
+#endif
+
+	// Dispatch expired timers, but not timers added by the callbacks for the current time
+	now = mdns_engine_time();
+	size_t timer_limit = engine->timer_count;
+	while (timer_limit-- && engine->timer_count && (engine->timer[0].deadline <= now)) {
+		mdns_engine_timer_t timer = engine->timer[0];
+		mdns_engine_timer_remove_index(engine, 0);
+		timer.callback(engine, now, timer.user_data);
+		++dispatched;
+	}
+
+	return dispatched;
+}
+
+static int
+mdns_engine_run(mdns_engine_t* engine) {
+	engine->running = 1;
+	while (engine->running && (engine->socket_count || engine->timer_count)) {
+		if (mdns_engine_run_once(engine, -1) < 0)
+			return -1;
+	}
+	engine->running = 0;
+	return 0;
+}
+
+static void
+mdns_engine_stop(mdns_engine_t* engine) {
+	engine->running = 0;
+}
+
+static uint64_t
+mdns_engine_time(void) {
+#ifdef _WIN32
+	return (uint64_t)GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000ULL) + ((uint64_t)ts.tv_nsec / 1000000ULL);
+#endif
+}
+
+#ifdef MDNS_HAVE_IO_URING
+
+// Completion tag of the multishot receive, sends are tagged with the index of the send slot
+#define MDNS_URING_RECV_TAG ((uint64_t)-1)
+
+// Get the next free submission queue entry, cleared, or null if the submission queue is full. The
+// entry is queued for submission by mdns_uring_sqe_commit
+static struct io_uring_sqe*
+mdns_uring_sqe(mdns_uring_t* uring) {
+	unsigned int tail = *uring->sq_tail;
+	unsigned int head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= uring->sq_entries)
+		return 0;
+	struct io_uring_sqe* sqe = uring->sqe + (tail & uring->sq_mask);
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+static void
+mdns_uring_sqe_commit(mdns_uring_t* uring) {
+	unsigned int tail = *uring->sq_tail;
+	uring->sq_array[tail & uring->sq_mask] = tail & uring->sq_mask;
+	__atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++uring->sq_pending;
+}
+
+// Submit the queued entries, without waiting for completions
+static int
+mdns_uring_enter(mdns_uring_t* uring) {
+	while (uring->sq_pending) {
+		long submitted = syscall(__NR_io_uring_enter, uring->fd, uring->sq_pending, 0, 0, 0, 0);
+		if (submitted < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		uring->sq_pending -= (unsigned int)submitted;
+	}
+	return 0;
+}
+
+// Provide a receive buffer to the kernel by adding it to the tail of the buffer ring
+static void
+mdns_uring_buffer_provide(mdns_uring_t* uring, unsigned short buffer_id) {
+	// The first buffer entry overlays the ring tail, so only the buffer fields are written
+	struct io_uring_buf* buf = uring->buf_ring->bufs + (uring->buf_tail & (uring->recv_count - 1));
+	buf->addr = (uint64_t)(uintptr_t)MDNS_POINTER_OFFSET(uring->recv_buffers,
+	                                                     uring->buffer_size * buffer_id);
+	buf->len = (uint32_t)uring->buffer_size;
+	buf->bid = buffer_id;
+	++uring->buf_tail;
+	__atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Queue the multishot receive, picking a receive buffer from the buffer ring for each datagram
+static int
+mdns_uring_recv_arm(mdns_uring_t* uring) {
+	struct io_uring_sqe* sqe = mdns_uring_sqe(uring);
+	if (!sqe) {
+		if (mdns_uring_enter(uring) || !(sqe = mdns_uring_sqe(uring)))
+			return -1;
+	}
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = uring->sock;
+	sqe->addr = (uint64_t)(uintptr_t)&uring->recv_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = MDNS_URING_RECV_TAG;
+	mdns_uring_sqe_commit(uring);
+	uring->recv_armed = 1;
+	return 0;
+}
+
+// Map the submission and completion rings and the submission queue entries of a created ring
+static int
+mdns_uring_map(mdns_uring_t* uring, const struct io_uring_params* params) {
+	if (!(params->features & IORING_FEAT_SINGLE_MMAP))
+		return -1;
+	size_t sq_size = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+	size_t cq_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+	size_t ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+	void* ring = mmap(0, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd,
+	                  IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		return -1;
+	uring->ring = ring;
+	uring->ring_size = ring_size;
+
+	size_t sqe_size = params->sq_entries * sizeof(struct io_uring_sqe);
+	void* sqe = mmap(0, sqe_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd,
+	                 IORING_OFF_SQES);
+	if (sqe == MAP_FAILED)
+		return -1;
+	uring->sqe = (struct io_uring_sqe*)sqe;
+	uring->sqe_size = sqe_size;
+
+	uring->sq_head = (unsigned int*)MDNS_POINTER_OFFSET(ring, params->sq_off.head);
+	uring->sq_tail = (unsigned int*)MDNS_POINTER_OFFSET(ring, params->sq_off.tail);
+	uring->sq_array = (unsigned int*)MDNS_POINTER_OFFSET(ring, params->sq_off.array);
+	uring->sq_mask = *(unsigned int*)MDNS_POINTER_OFFSET(ring, params->sq_off.ring_mask);
+	uring->sq_entries = params->sq_entries;
+	uring->cq_head = (unsigned int*)MDNS_POINTER_OFFSET(ring, params->cq_off.head);
+	uring->cq_tail = (unsigned int*)MDNS_POINTER_OFFSET(ring, params->cq_off.tail);
+	uring->cqe = (struct io_uring_cqe*)MDNS_POINTER_OFFSET(ring, params->cq_off.cqes);
+	uring->cq_mask = *(unsigned int*)MDNS_POINTER_OFFSET(ring, params->cq_off.ring_mask);
+	return 0;
+}
+
+// Register the ring of receive buffers as buffer group 0 and provide all receive buffers
+static int
+mdns_uring_register_buffers(mdns_uring_t* uring) {
+	size_t buf_ring_size = uring->recv_count * sizeof(struct io_uring_buf);
+	void* buf_ring = mmap(0, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+	                      -1, 0);
+	if (buf_ring == MAP_FAILED)
+		return -1;
+	uring->buf_ring = (struct io_uring_buf_ring*)buf_ring;
+	uring->buf_ring_size = buf_ring_size;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+	reg.ring_entries = (uint32_t)uring->recv_count;
+	reg.bgid = 0;
+	if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -1;
+	for (size_t ibuf = 0; ibuf < uring->recv_count; ++ibuf)
+		mdns_uring_buffer_provide(uring, (unsigned short)ibuf);
+	return 0;
+}
+
+static int
+mdns_uring_initialize(mdns_uring_t* uring, int sock, void* recv_buffers, size_t recv_count,
+                      void* send_buffers, size_t send_count, size_t buffer_size) {
+	memset(uring, 0, sizeof(mdns_uring_t));
+	uring->fd = -1;
+	if (!recv_count || (recv_count & (recv_count - 1)) || (recv_count > 32768) ||
+	    (send_count > MDNS_URING_SEND_MAX) || (buffer_size < 1024))
+		return -1;
+	uring->sock = sock;
+	uring->recv_buffers = recv_buffers;
+	uring->recv_count = recv_count;
+	uring->send_buffers = send_buffers;
+	uring->send_count = send_count;
+	uring->buffer_size = buffer_size;
+	uring->group_length = mdns_multicast_address(sock, &uring->group);
+	if (!uring->group_length)
+		return -1;
+
+	// Size the completion queue to hold a completion for every buffer and send in flight
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = (unsigned int)(recv_count + MDNS_URING_SEND_MAX) * 2;
+	long fd = syscall(__NR_io_uring_setup, MDNS_URING_SEND_MAX + 2, &params);
+	if (fd < 0)
+		return -1;
+	uring->fd = (int)fd;
+
+	// Each receive buffer starts with the receive header followed by the source address, the packet
+	// info and the datagram. The address space is sized for IPv6, the ancillary data space is a
+	// multiple of 8 bytes, which keeps the datagram 32 bit aligned
+	uring->recv_msg.msg_namelen = sizeof(struct sockaddr_in6);
+#ifdef MDNS_HAVE_PKTINFO
+	uring->recv_msg.msg_controllen = MDNS_PKTINFO_CONTROL_SIZE;
+#else
+	uring->recv_msg.msg_controllen = 0;
+#endif
+	if (mdns_uring_map(uring, &params) || mdns_uring_register_buffers(uring) ||
+	    mdns_uring_recv_arm(uring) || mdns_uring_enter(uring)) {
+		mdns_uring_finalize(uring);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+mdns_uring_finalize(mdns_uring_t* uring) {
+	// Closing the ring cancels pending operations and unregisters the buffer ring
+	if (uring->fd >= 0)
+		close(uring->fd);
+	if (uring->buf_ring)
+		munmap(uring->buf_ring, uring->buf_ring_size);
+	if (uring->sqe)
+		munmap(uring->sqe, uring->sqe_size);
+	if (uring->ring)
+		munmap(uring->ring, uring->ring_size);
+	uring->fd = -1;
+	uring->buf_ring = 0;
+	uring->sqe = 0;
+	uring->ring = 0;
+}
+
+// Get the packet info of a datagram in a receive buffer. The ancillary data follows the source
+// address and is copied out to align the cmsghdr
+static void
+mdns_uring_recv_info(mdns_uring_t* uring, const void* buffer,
+                     const struct io_uring_recvmsg_out* out) {
+	memset(&uring->recv_info, 0, sizeof(mdns_pktinfo_t));
+#ifdef MDNS_HAVE_PKTINFO
+	union {
+		struct cmsghdr header;
+		char data[MDNS_PKTINFO_CONTROL_SIZE];
+	} control;
+	size_t controllen = out->controllen;
+	if (controllen > sizeof(control.data))
+		controllen = sizeof(control.data);
+	memcpy(control.data,
+	       MDNS_POINTER_OFFSET_CONST(buffer, sizeof(*out) + uring->recv_msg.msg_namelen),
+	       controllen);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = control.data;
+	msg.msg_controllen = controllen;
+	mdns_pktinfo_parse(&msg, &uring->recv_info);
+#else
+	(void)sizeof(buffer);
+	(void)sizeof(out);
+#endif
+}
+
+// Submit queued sends, then reap the completions without blocking, parsing received datagrams with
+// the given parse function and releasing the slots of completed sends
+static size_t
+mdns_uring_recv(mdns_uring_t* uring, mdns_datagram_parse_fn parse,
+                mdns_record_callback_fn callback, void* user_data, int query_id) {
+	mdns_uring_enter(uring);
+
+	size_t records = 0;
+	size_t header_size = sizeof(struct io_uring_recvmsg_out) + uring->recv_msg.msg_namelen +
+	                     uring->recv_msg.msg_controllen;
+	unsigned int head = *uring->cq_head;
+	while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+		const struct io_uring_cqe* cqe = uring->cqe + (head & uring->cq_mask);
+		uint64_t tag = cqe->user_data;
+		int res = cqe->res;
+		unsigned int flags = cqe->flags;
+		// Release the completion before parsing, callbacks can queue sends and submit
+		__atomic_store_n(uring->cq_head, ++head, __ATOMIC_RELEASE);
+
+		if (tag != MDNS_URING_RECV_TAG) {
+			if (tag < MDNS_URING_SEND_MAX)
+				uring->send[tag].busy = 0;
+			continue;
+		}
+		// The multishot receive ends on errors, including running out of receive buffers
+		if (!(flags & IORING_CQE_F_MORE))
+			uring->recv_armed = 0;
+		if (!(flags & IORING_CQE_F_BUFFER))
+			continue;
+
+		unsigned short buffer_id = (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT);
+		void* buffer = MDNS_POINTER_OFFSET(uring->recv_buffers, uring->buffer_size * buffer_id);
+		const struct io_uring_recvmsg_out* out = (const struct io_uring_recvmsg_out*)buffer;
+		if ((res >= (int)header_size) && !(out->flags & MSG_TRUNC) &&
+		    (out->payloadlen <= (size_t)res - header_size)) {
+			const struct sockaddr* from =
+			    (const struct sockaddr*)MDNS_POINTER_OFFSET_CONST(buffer, sizeof(*out));
+			size_t addrlen = out->namelen;
+			if (addrlen > uring->recv_msg.msg_namelen)
+				addrlen = uring->recv_msg.msg_namelen;
+			mdns_uring_recv_info(uring, buffer, out);
+			records += parse(uring->sock, from, addrlen,
+			                 MDNS_POINTER_OFFSET_CONST(buffer, header_size), out->payloadlen,
+			                 callback, user_data, query_id);
+		}
+		mdns_uring_buffer_provide(uring, buffer_id);
+	}
+
+	if (!uring->recv_armed)
+		mdns_uring_recv_arm(uring);
+	mdns_uring_enter(uring);
+	return records;
+}
+
+static size_t
+mdns_uring_listen(mdns_uring_t* uring, mdns_record_callback_fn callback, void* user_data) {
+	return mdns_uring_recv(uring, mdns_listen_parse_batch, callback, user_data, 0);
+}
+
+static size_t
+mdns_uring_discovery_recv(mdns_uring_t* uring, mdns_record_callback_fn callback,
+                          void* user_data) {
+	return mdns_uring_recv(uring, mdns_discovery_parse_batch, callback, user_data, 0);
+}
+
+static size_t
+mdns_uring_query_recv(mdns_uring_t* uring, mdns_record_callback_fn callback, void* user_data,
+                      int query_id) {
+	return mdns_uring_recv(uring, mdns_query_parse, callback, user_data, query_id);
+}
+
+// Queue a send of a packet to the address in a send slot, falling back to a direct send when no
+// slot or submission queue entry is free
+static int
+mdns_uring_send_message(mdns_uring_t* uring, const void* address, size_t address_size,
+                        const void* buffer, size_t size, unsigned int interface_index) {
+	if ((size > uring->buffer_size) || (address_size > sizeof(struct sockaddr_storage)))
+		return -1;
+
+	size_t islot = 0;
+	while ((islot < uring->send_count) && uring->send[islot].busy)
+		++islot;
+	struct io_uring_sqe* sqe = 0;
+	if (islot < uring->send_count) {
+		sqe = mdns_uring_sqe(uring);
+		if (!sqe && !mdns_uring_enter(uring))
+			sqe = mdns_uring_sqe(uring);
+	}
+	if (!sqe) {
+		if (interface_index)
+			return mdns_multicast_send_interface(uring->sock, buffer, size, interface_index);
+		return mdns_unicast_send(uring->sock, address, address_size, buffer, size);
+	}
+
+	mdns_uring_send_t* slot = uring->send + islot;
+	void* data = MDNS_POINTER_OFFSET(uring->send_buffers, uring->buffer_size * islot);
+	memcpy(data, buffer, size);
+	memcpy(&slot->address, address, address_size);
+	slot->iov.iov_base = data;
+	slot->iov.iov_len = size;
+	memset(&slot->msg, 0, sizeof(slot->msg));
+	slot->msg.msg_name = &slot->address;
+	slot->msg.msg_namelen = (socklen_t)address_size;
+	slot->msg.msg_iov = &slot->iov;
+	slot->msg.msg_iovlen = 1;
+#ifdef MDNS_HAVE_PKTINFO
+	if (interface_index)
+		mdns_multicast_control(&slot->msg, slot->control, slot->address.ss_family,
+		                       interface_index);
+#endif
+	slot->busy = 1;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = uring->sock;
+	sqe->addr = (uint64_t)(uintptr_t)&slot->msg;
+	sqe->len = 1;
+	sqe->user_data = islot;
+	mdns_uring_sqe_commit(uring);
+	return 0;
+}
+
+static int
+mdns_uring_send(mdns_uring_t* uring, const void* address, size_t address_size,
+                const void* buffer, size_t size) {
+	return mdns_uring_send_message(uring, address, address_size, buffer, size, 0);
+}
+
+static int
+mdns_uring_send_multicast(mdns_uring_t* uring, const void* buffer, size_t size,
+                          unsigned int interface_index) {
+	return mdns_uring_send_message(uring, &uring->group, uring->group_length, buffer, size,
+	                               interface_index);
+}
+
+static int
+mdns_uring_submit(mdns_uring_t* uring) {
+	return mdns_uring_enter(uring);
+}
+
+#endif
+
+static mdns_string_t
+mdns_record_parse_ptr(const void* buffer, size_t size, size_t offset, size_t length,
+                      char* strbuffer, size_t capacity) {
+	// PTR record is just a string
+	if ((size >= offset + length) && (length >= 2))
+		return mdns_string_extract(buffer, size, &offset, strbuffer, capacity);
+	mdns_string_t empty = {0, 0};
+	return empty;
+}
+
+static mdns_record_srv_t
+mdns_record_parse_srv(const void* buffer, size_t size, size_t offset, size_t length,
+                      char* strbuffer, size_t capacity) {
+	mdns_record_srv_t srv;
+	memset(&srv, 0, sizeof(mdns_record_srv_t));
+	// Read the service priority, weight, port number and the discovery name
+	// SRV record format (http://www.ietf.org/rfc/rfc2782.txt):
+	// 2 bytes network-order unsigned priority
+	// 2 bytes network-order unsigned weight
+	// 2 bytes network-order unsigned port
+	// string: discovery (domain) name, minimum 2 bytes when compressed
+	if ((size >= offset + length) && (length >= 8)) {
+		const uint16_t* recorddata = (const uint16_t*)MDNS_POINTER_OFFSET_CONST(buffer, offset);
+		srv.priority = mdns_ntohs(recorddata++);
+		srv.weight = mdns_ntohs(recorddata++);
+		srv.port = mdns_ntohs(recorddata++);
+		offset += 6;
+		srv.name = mdns_string_extract(buffer, size, &offset, strbuffer, capacity);
+	}
+	return srv;
+}
+
+static struct sockaddr_in*
+mdns_record_parse_a(const void* buffer, size_t size, size_t offset, size_t length,
+                    struct sockaddr_in* addr) {
+	memset(addr, 0, sizeof(struct sockaddr_in));
+	addr->sin_family = AF_INET;
+#ifdef __APPLE__
+	addr->sin_len = sizeof(struct sockaddr_in);
+#endif
+	if ((size >= offset + length) && (length == 4))
+		memcpy(&addr->sin_addr.s_addr, MDNS_POINTER_OFFSET(buffer, offset), 4);
+	return addr;
+}
+
+static struct sockaddr_in6*
+mdns_record_parse_aaaa(const void* buffer, size_t size, size_t offset, size_t length,
+                       struct sockaddr_in6* addr) {
+	memset(addr, 0, sizeof(struct sockaddr_in6));
+	addr->sin6_family = AF_INET6;
+#ifdef __APPLE__
 	addr->sin6_len = sizeof(struct sockaddr_in6);
 #endif
 	if ((size >= offset + length) && (length == 16))
@@ -1456,46 +6698,96 @@ mdns_record_parse_aaaa(const void* buffer, size_t size, size_t offset, size_t le
 	return addr;
 }
 
+// Get the next character string in TXT record data ending at the given offset, and step the offset
+// past it. Returns null at the end of the data, or if the string is truncated
+static const char*
+mdns_record_txt_string(const void* buffer, size_t end, size_t* offset, size_t* length) {
+	if (*offset >= end)
+		return 0;
+	const char* strdata = (const char*)MDNS_POINTER_OFFSET_CONST(buffer, *offset);
+	size_t sublength = *(const unsigned char*)strdata;
+	if (*offset + sublength + 1 > end)
+		return 0;
+	*offset += sublength + 1;
+	*length = sublength;
+	return strdata + 1;
+}
+
+// Find the key-value separator in a TXT record string. DNS-SD TXT record keys MUST be printable
+// US-ASCII [0x20, 0x7E], returns the offset of the first '=' if all preceding characters are valid
+// and the key is not empty, otherwise 0. Strings of 16 bytes or more are scanned a block at a time
+// for the first separator or invalid character, the last block overlapping the previous one
+static size_t
+mdns_record_txt_separator(const char* strdata, size_t length) {
+	size_t block = 0;
+#if defined(MDNS_HAVE_SSE2)
+	if (length >= 16) {
+		// Bytes 0x80 and above are negative in the signed compare and below the valid range
+		const __m128i separator = _mm_set1_epi8('=');
+		const __m128i valid_min = _mm_set1_epi8(0x20);
+		const __m128i valid_max = _mm_set1_epi8(0x7E);
+		for (size_t ichar = 0; ichar < length; ichar += 16) {
+			size_t pos = ((ichar + 16) <= length) ? ichar : (length - 16);
+			__m128i data = _mm_loadu_si128((const __m128i*)(const void*)(strdata + pos));
+			__m128i stop = _mm_or_si128(
+			    _mm_cmpeq_epi8(data, separator),
+			    _mm_or_si128(_mm_cmplt_epi8(data, valid_min), _mm_cmpgt_epi8(data, valid_max)));
+			unsigned int mask = (unsigned int)_mm_movemask_epi8(stop);
+			if (mask) {
+				size_t stop_pos = pos;
+				while (!(mask & 1)) {
+					mask >>= 1;
+					++stop_pos;
+				}
+				return (strdata[stop_pos] == '=') ? stop_pos : 0;
+			}
+		}
+		return 0;
+	}
+#elif defined(MDNS_HAVE_NEON)
+	// Find the first block with a separator or invalid character, then scan it byte by byte
+	const uint8x16_t separator = vdupq_n_u8('=');
+	const uint8x16_t valid_min = vdupq_n_u8(0x20);
+	const uint8x16_t valid_max = vdupq_n_u8(0x7E);
+	for (; (block + 16) <= length; block += 16) {
+		uint8x16_t data = vld1q_u8((const uint8_t*)strdata + block);
+		uint8x16_t stop = vorrq_u8(vceqq_u8(data, separator),
+		                           vorrq_u8(vcltq_u8(data, valid_min), vcgtq_u8(data, valid_max)));
+		uint64x2_t stop_lanes = vreinterpretq_u64_u8(stop);
+		if (vgetq_lane_u64(stop_lanes, 0) | vgetq_lane_u64(stop_lanes, 1))
+			break;
+	}
+#endif
+	for (size_t c = block; c < length; ++c) {
+		if ((strdata[c] < 0x20) || (strdata[c] > 0x7E))
+			return 0;
+		if (strdata[c] == '=')
+			return c;
+	}
+	return 0;
+}
+
 static size_t
 mdns_record_parse_txt(const void* buffer, size_t size, size_t offset, size_t length,
                       mdns_record_txt_t* records, size_t capacity) {
 	size_t parsed = 0;
 	const char* strdata;
+	size_t sublength = 0;
 	size_t end = offset + length;
 
 	if (size < end)
 		end = size;
 
-	while ((offset < end) && (parsed < capacity)) {
-		strdata = (const char*)MDNS_POINTER_OFFSET(buffer, offset);
-		size_t sublength = *(const unsigned char*)strdata;
-
-		++strdata;
-		offset += sublength + 1;
-
-		size_t separator = 0;
-		for (size_t c = 0; c < sublength; ++c) {
-			// DNS-SD TXT record keys MUST be printable US-ASCII, [0x20, 0x7E]
-			if ((strdata[c] < 0x20) || (strdata[c] > 0x7E))
-				break;
-			if (strdata[c] == '=') {
-				separator = c;
-				break;
-			}
-		}
-
+	while ((parsed < capacity) &&
+	       (strdata = mdns_record_txt_string(buffer, end, &offset, &sublength))) {
+		size_t separator = mdns_record_txt_separator(strdata, sublength);
 		if (!separator)
 			continue;
 
-		if (separator < sublength) {
-			records[parsed].key.str = strdata;
-			records[parsed].key.length = separator;
-			records[parsed].value.str = strdata + separator + 1;
-			records[parsed].value.length = sublength - (separator + 1);
-		} else {
-			records[parsed].key.str = strdata;
-			records[parsed].key.length = sublength;
-		}
+		records[parsed].key.str = strdata;
+		records[parsed].key.length = separator;
+		records[parsed].value.str = strdata + separator + 1;
+		records[parsed].value.length = sublength - (separator + 1);
 
 		++parsed;
 	}
@@ -1503,6 +6795,55 @@ mdns_record_parse_txt(const void* buffer, size_t size, size_t offset, size_t len
 	return parsed;
 }
 
+static size_t
+mdns_record_parse_txt_count(const void* buffer, size_t size, size_t offset, size_t length) {
+	size_t count = 0;
+	const char* strdata;
+	size_t sublength = 0;
+	size_t end = offset + length;
+
+	if (size < end)
+		end = size;
+
+	while ((strdata = mdns_record_txt_string(buffer, end, &offset, &sublength))) {
+		if (mdns_record_txt_separator(strdata, sublength))
+			++count;
+	}
+
+	return count;
+}
+
+static int
+mdns_record_parse_txt_find(const void* buffer, size_t size, size_t offset, size_t length,
+                           const char* key, size_t key_length, mdns_record_txt_t* record) {
+	const char* strdata;
+	size_t sublength = 0;
+	size_t end = offset + length;
+
+	if (size < end)
+		end = size;
+	if (!key_length)
+		return 0;
+
+	// Only strings starting with the key and a separator are validated, other strings and values
+	// are never scanned
+	while ((strdata = mdns_record_txt_string(buffer, end, &offset, &sublength))) {
+		if ((sublength <= key_length) || (strdata[key_length] != '=') ||
+		    strncasecmp(strdata, key, key_length))
+			continue;
+		if (mdns_record_txt_separator(strdata, key_length + 1) != key_length)
+			continue;
+
+		record->key.str = strdata;
+		record->key.length = key_length;
+		record->value.str = strdata + key_length + 1;
+		record->value.length = sublength - (key_length + 1);
+		return 1;
+	}
+
+	return 0;
+}
+
 #ifdef _WIN32
 #undef strncasecmp
 #endif
@@ -0,0 +1,720 @@
+#ifdef _WIN32
+#define _CRT_SECURE_NO_WARNINGS 1
+#endif
+
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <time.h>
+#endif
+
+#include "mdns.h"
+
+// Micro-benchmark of the parse and build functions on a corpus of packets, reporting the time per
+// call and the throughput in bytes of packet data processed per second
+
+typedef struct {
+	const char* name;
+	uint8_t data[2048];
+	size_t size;
+} bench_packet_t;
+
+static bench_packet_t corpus[8];
+static size_t corpus_count;
+
+static char strbuffer[256];
+static mdns_record_txt_t txtbuffer[128];
+
+static volatile size_t bench_sink;
+static size_t bench_iterations = 100000;
+
+static uint64_t
+bench_time_ns(void) {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static void
+bench_report(const char* function, const char* packet, size_t iterations, size_t bytes,
+             uint64_t elapsed) {
+	double ns = (double)elapsed / (double)iterations;
+	double mbps = elapsed ? ((double)bytes * (double)iterations * 1000.0 / (double)elapsed) : 0;
+	printf("%-34s %-22s %10.1f ns/op %10.1f MB/s\n", function, packet, ns, mbps);
+}
+
+static int
+bench_callback(int sock, const struct sockaddr* from, size_t addrlen, mdns_entry_type_t entry,
+               uint16_t query_id, uint16_t rtype, uint16_t rclass, uint32_t ttl, const void* data,
+               size_t size, size_t name_offset, size_t name_length, size_t record_offset,
+               size_t record_length, void* user_data) {
+	(void)sizeof(sock);
+	(void)sizeof(from);
+	(void)sizeof(addrlen);
+	(void)sizeof(entry);
+	(void)sizeof(query_id);
+	(void)sizeof(rclass);
+	(void)sizeof(ttl);
+	(void)sizeof(data);
+	(void)sizeof(size);
+	(void)sizeof(name_offset);
+	(void)sizeof(name_length);
+	(void)sizeof(record_offset);
+	*(size_t*)user_data += rtype + record_length;
+	return 0;
+}
+
+// Records of an Apple style AirPlay service announcement
+static mdns_record_t airplay_records[16];
+static size_t airplay_record_count;
+static mdns_name_t airplay_names[3];
+
+static void
+setup_airplay_records(int compiled) {
+	static const char* txt[][2] = {
+	    {"acl", "0"},
+	    {"deviceid", "A4:83:E7:12:34:56"},
+	    {"features", "0x4A7FDFD5,0xBC157FDE"},
+	    {"flags", "0x18644"},
+	    {"gid", "5D3F7A6C-1B2E-4F9A-8C7D-6E5F4A3B2C1D"},
+	    {"igl", "1"},
+	    {"model", "AudioAccessory5,1"},
+	    {"protovers", "1.1"},
+	    {"pi", "2E8F4A6C-3B1D-4E7F-9A8C-5D6E7F8A9B0C"},
+	    {"pk", "d4a1c2f3e4b5a6978877665544332211ffeeddccbbaa99887766554433221100"},
+	    {"srcvers", "670.6.2"},
+	    {"vv", "2"}};
+
+	mdns_string_t type = {MDNS_STRING_CONST("_airplay._tcp.local.")};
+	mdns_string_t instance = {MDNS_STRING_CONST("Living Room._airplay._tcp.local.")};
+	mdns_string_t host = {MDNS_STRING_CONST("Living-Room.local.")};
+	mdns_name_compile(&airplay_names[0], MDNS_STRING_ARGS(type));
+	mdns_name_compile(&airplay_names[1], MDNS_STRING_ARGS(instance));
+	mdns_name_compile(&airplay_names[2], MDNS_STRING_ARGS(host));
+	const mdns_name_t* type_compiled = compiled ? &airplay_names[0] : 0;
+	const mdns_name_t* instance_compiled = compiled ? &airplay_names[1] : 0;
+	const mdns_name_t* host_compiled = compiled ? &airplay_names[2] : 0;
+
+	airplay_record_count = 0;
+	airplay_records[airplay_record_count++] =
+	    (mdns_record_t){.name = type,
+	                    .name_compiled = type_compiled,
+	                    .type = MDNS_RECORDTYPE_PTR,
+	                    .data.ptr.name = instance,
+	                    .data.ptr.name_compiled = instance_compiled};
+	airplay_records[airplay_record_count++] =
+	    (mdns_record_t){.name = instance,
+	                    .name_compiled = instance_compiled,
+	                    .type = MDNS_RECORDTYPE_SRV,
+	                    .data.srv.name = host,
+	                    .data.srv.name_compiled = host_compiled,
+	                    .data.srv.port = 7000};
+
+	struct sockaddr_in addr_ipv4;
+	memset(&addr_ipv4, 0, sizeof(addr_ipv4));
+	addr_ipv4.sin_family = AF_INET;
+	addr_ipv4.sin_addr.s_addr = htonl(0xC0A8010A);
+	airplay_records[airplay_record_count++] = (mdns_record_t){.name = host,
+	                                                          .name_compiled = host_compiled,
+	                                                          .type = MDNS_RECORDTYPE_A,
+	                                                          .data.a.addr = addr_ipv4};
+
+	struct sockaddr_in6 addr_ipv6;
+	memset(&addr_ipv6, 0, sizeof(addr_ipv6));
+	addr_ipv6.sin6_family = AF_INET6;
+	addr_ipv6.sin6_addr.s6_addr[0] = 0xFE;
+	addr_ipv6.sin6_addr.s6_addr[1] = 0x80;
+	addr_ipv6.sin6_addr.s6_addr[15] = 0x0A;
+	airplay_records[airplay_record_count++] = (mdns_record_t){.name = host,
+	                                                          .name_compiled = host_compiled,
+	                                                          .type = MDNS_RECORDTYPE_AAAA,
+	                                                          .data.aaaa.addr = addr_ipv6};
+
+	for (size_t itxt = 0; itxt < sizeof(txt) / sizeof(txt[0]); ++itxt) {
+		mdns_record_t record = {.name = instance,
+		                        .name_compiled = instance_compiled,
+		                        .type = MDNS_RECORDTYPE_TXT};
+		record.data.txt.key = (mdns_string_t){txt[itxt][0], strlen(txt[itxt][0])};
+		record.data.txt.value = (mdns_string_t){txt[itxt][1], strlen(txt[itxt][1])};
+		if (airplay_record_count < (sizeof(airplay_records) / sizeof(airplay_records[0])))
+			airplay_records[airplay_record_count++] = record;
+	}
+}
+
+static bench_packet_t*
+corpus_add(const char* name) {
+	bench_packet_t* packet = corpus + corpus_count++;
+	memset(packet, 0, sizeof(bench_packet_t));
+	packet->name = name;
+	return packet;
+}
+
+static void
+setup_corpus(void) {
+	bench_packet_t* packet;
+
+	// Apple style announcement, PTR answer with SRV, A, AAAA and TXT as additional records
+	setup_airplay_records(0);
+	packet = corpus_add("apple-announce");
+	packet->size = mdns_query_answer_multicast_build(
+	    packet->data, sizeof(packet->data), airplay_records[0], 0, 0, airplay_records + 1,
+	    airplay_record_count - 1);
+
+	// Avahi style response advertising several services of a workstation in one packet
+	{
+		static const char* types[] = {"_workstation._tcp.local.", "_ssh._tcp.local.",
+		                              "_sftp-ssh._tcp.local.",    "_http._tcp.local.",
+		                              "_smb._tcp.local.",         "_device-info._tcp.local."};
+		static char instance[6][128];
+		mdns_record_t answers[6];
+		mdns_record_t additional[16];
+		size_t additional_count = 0;
+		mdns_string_t host = {MDNS_STRING_CONST("fileserver.local.")};
+		for (size_t itype = 0; itype < 6; ++itype) {
+			snprintf(instance[itype], sizeof(instance[itype]), "fileserver.%s", types[itype]);
+			mdns_string_t type_string = {types[itype], strlen(types[itype])};
+			mdns_string_t instance_string = {instance[itype], strlen(instance[itype])};
+			answers[itype] = (mdns_record_t){.name = type_string,
+			                                 .type = MDNS_RECORDTYPE_PTR,
+			                                 .data.ptr.name = instance_string};
+			additional[additional_count++] =
+			    (mdns_record_t){.name = instance_string,
+			                    .type = MDNS_RECORDTYPE_SRV,
+			                    .data.srv.name = host,
+			                    .data.srv.port = (uint16_t)(22 + itype)};
+		}
+		struct sockaddr_in addr_ipv4;
+		memset(&addr_ipv4, 0, sizeof(addr_ipv4));
+		addr_ipv4.sin_family = AF_INET;
+		addr_ipv4.sin_addr.s_addr = htonl(0x0A000005);
+		additional[additional_count++] = (mdns_record_t){
+		    .name = host, .type = MDNS_RECORDTYPE_A, .data.a.addr = addr_ipv4};
+		additional[additional_count++] =
+		    (mdns_record_t){.name = {instance[5], strlen(instance[5])},
+		                    .type = MDNS_RECORDTYPE_TXT,
+		                    .data.txt.key = {MDNS_STRING_CONST("model")},
+		                    .data.txt.value = {MDNS_STRING_CONST("Xserve")}};
+		packet = corpus_add("avahi-services");
+		packet->size = mdns_answer_multicast_records_build(
+		    packet->data, sizeof(packet->data), MDNS_CLASS_IN, answers, 6, 0, 0, additional,
+		    additional_count);
+	}
+
+	// Browse response with many instances of one service type, all names heavily compressed
+	{
+		static char instance[40][64];
+		mdns_record_t answers[40];
+		mdns_string_t type = {MDNS_STRING_CONST("_googlecast._tcp.local.")};
+		for (size_t iinst = 0; iinst < 40; ++iinst) {
+			snprintf(instance[iinst], sizeof(instance[iinst]),
+			         "Chromecast-%02u._googlecast._tcp.local.", (unsigned int)iinst);
+			answers[iinst] =
+			    (mdns_record_t){.name = type,
+			                    .type = MDNS_RECORDTYPE_PTR,
+			                    .data.ptr.name = {instance[iinst], strlen(instance[iinst])}};
+		}
+		packet = corpus_add("compressed-browse");
+		packet->size = mdns_answer_multicast_records_build(
+		    packet->data, sizeof(packet->data), MDNS_CLASS_IN, answers, 40, 0, 0, 0, 0);
+	}
+
+	// Single large TXT record with many key-value pairs
+	{
+		static char keys[48][16];
+		static char values[48][24];
+		mdns_record_t records[48];
+		for (size_t itxt = 0; itxt < 48; ++itxt) {
+			snprintf(keys[itxt], sizeof(keys[itxt]), "key%02u", (unsigned int)itxt);
+			snprintf(values[itxt], sizeof(values[itxt]), "value-%08x",
+			         (unsigned int)(itxt * 2654435761U));
+			records[itxt] =
+			    (mdns_record_t){.name = {MDNS_STRING_CONST("Printer._ipp._tcp.local.")},
+			                    .type = MDNS_RECORDTYPE_TXT,
+			                    .data.txt.key = {keys[itxt], strlen(keys[itxt])},
+			                    .data.txt.value = {values[itxt], strlen(values[itxt])}};
+		}
+		packet = corpus_add("large-txt");
+		packet->size = mdns_answer_multicast_records_build(
+		    packet->data, sizeof(packet->data), MDNS_CLASS_IN, records, 48, 0, 0, 0, 0);
+	}
+
+	// Query with questions and known answers, as sent by a browsing client
+	{
+		packet = corpus_add("query-known-answers");
+		static const uint8_t query[] = {
+		    0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+		    // _airplay._tcp.local. PTR QM
+		    0x08, '_', 'a', 'i', 'r', 'p', 'l', 'a', 'y', 0x04, '_', 't', 'c', 'p', 0x05, 'l', 'o',
+		    'c', 'a', 'l', 0x00, 0x00, 0x0C, 0x00, 0x01,
+		    // _raop._tcp.local. PTR QM
+		    0x05, '_', 'r', 'a', 'o', 'p', 0xC0, 0x15, 0x00, 0x0C, 0x00, 0x01,
+		    // Known answer _airplay._tcp.local. PTR Kitchen._airplay._tcp.local.
+		    0xC0, 0x0C, 0x00, 0x0C, 0x00, 0x01, 0x00, 0x00, 0x11, 0x94, 0x00, 0x0A, 0x07, 'K', 'i',
+		    't', 'c', 'h', 'e', 'n', 0xC0, 0x0C,
+		    // Known answer _raop._tcp.local. PTR 1234@Kitchen._raop._tcp.local.
+		    0xC0, 0x25, 0x00, 0x0C, 0x00, 0x01, 0x00, 0x00, 0x11, 0x94, 0x00, 0x0F, 0x0C, '1', '2',
+		    '3', '4', '@', 'K', 'i', 't', 'c', 'h', 'e', 'n', 0xC0, 0x25};
+		memcpy(packet->data, query, sizeof(query));
+		packet->size = sizeof(query);
+	}
+
+	// Malicious response with self referencing and looping name pointers, and a long chain of
+	// pointers. Parsers must reject these without spinning
+	{
+		packet = corpus_add("malicious-pointers");
+		uint8_t* data = packet->data;
+		size_t size = 0;
+		static const uint8_t header[] = {0x00, 0x00, 0x84, 0x00, 0x00, 0x00,
+		                                 0x00, 0x30, 0x00, 0x00, 0x00, 0x00};
+		memcpy(data, header, sizeof(header));
+		size = sizeof(header);
+		// Chain of pointers where each pointer refers to the previous one
+		size_t chain_start = size;
+		data[size++] = 0x01;
+		data[size++] = 'a';
+		data[size++] = 0x00;
+		for (size_t ichain = 0; ichain < 64; ++ichain) {
+			size_t target = (ichain == 0) ? chain_start : (size - 2);
+			data[size++] = 0x01;
+			data[size++] = 'b';
+			data[size++] = (uint8_t)(0xC0 | (target >> 8));
+			data[size++] = (uint8_t)(target & 0xFF);
+		}
+		for (size_t irec = 0; irec < 48; ++irec) {
+			if (irec % 3 == 0) {
+				// Pointer to itself
+				data[size] = (uint8_t)(0xC0 | (size >> 8));
+				data[size + 1] = (uint8_t)(size & 0xFF);
+				size += 2;
+			} else if (irec % 3 == 1) {
+				// Two pointers referring to each other
+				size_t loop = size;
+				data[size++] = (uint8_t)(0xC0 | ((loop + 2) >> 8));
+				data[size++] = (uint8_t)((loop + 2) & 0xFF);
+				data[size++] = (uint8_t)(0xC0 | (loop >> 8));
+				data[size++] = (uint8_t)(loop & 0xFF);
+			} else {
+				// End of the long pointer chain
+				size_t target = size - 6;
+				data[size++] = (uint8_t)(0xC0 | (target >> 8));
+				data[size++] = (uint8_t)(target & 0xFF);
+			}
+			static const uint8_t rr[] = {0x00, 0x0C, 0x00, 0x01, 0x00, 0x00,
+			                             0x00, 0x78, 0x00, 0x02, 0xC0, 0x0C};
+			memcpy(data + size, rr, sizeof(rr));
+			size += sizeof(rr);
+		}
+		packet->size = size;
+	}
+}
+
+static void
+bench_parse(const bench_packet_t* packet) {
+	mdns_message_t message;
+	mdns_message_record_t records[MDNS_MAX_MESSAGE_RECORDS];
+	size_t iterations = bench_iterations;
+	size_t sink = 0;
+
+	uint64_t start = bench_time_ns();
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		mdns_message_parse(packet->data, packet->size, &message, records,
+		                   MDNS_MAX_MESSAGE_RECORDS);
+		sink += message.end;
+	}
+	bench_report("mdns_message_parse", packet->name, iterations, packet->size,
+	             bench_time_ns() - start);
+
+	start = bench_time_ns();
+	for (size_t iter = 0; iter < iterations; ++iter)
+		sink += mdns_query_parse(0, 0, 0, packet->data, packet->size, bench_callback, &sink, 0);
+	bench_report("mdns_query_parse", packet->name, iterations, packet->size,
+	             bench_time_ns() - start);
+
+	start = bench_time_ns();
+	for (size_t iter = 0; iter < iterations; ++iter)
+		sink += mdns_listen_parse(0, 0, 0, packet->data, packet->size, bench_callback, &sink);
+	bench_report("mdns_listen_parse", packet->name, iterations, packet->size,
+	             bench_time_ns() - start);
+
+	// Extract all names, and parse all TXT records, in the indexed message
+	mdns_message_parse(packet->data, packet->size, &message, records, MDNS_MAX_MESSAGE_RECORDS);
+	size_t record_count = 0;
+	size_t txt_count = 0;
+	for (int section = 0; section < 4; ++section)
+		record_count += mdns_message_record_count(&message, (mdns_entry_type_t)section);
+	for (size_t irec = 0; irec < record_count; ++irec)
+		txt_count += (records[irec].rtype == MDNS_RECORDTYPE_TXT) ? 1 : 0;
+
+	if (record_count) {
+		start = bench_time_ns();
+		for (size_t iter = 0; iter < iterations; ++iter) {
+			for (size_t irec = 0; irec < record_count; ++irec) {
+				size_t offset = records[irec].name_offset;
+				mdns_string_t str = mdns_string_extract(packet->data, packet->size, &offset,
+				                                        strbuffer, sizeof(strbuffer));
+				sink += str.length;
+			}
+		}
+		bench_report("mdns_string_extract (all names)", packet->name, iterations, packet->size,
+		             bench_time_ns() - start);
+
+		start = bench_time_ns();
+		for (size_t iter = 0; iter < iterations; ++iter) {
+			for (size_t irec = 0; irec < record_count; ++irec)
+				sink += (size_t)mdns_name_hash(packet->data, packet->size,
+				                               records[irec].name_offset);
+		}
+		bench_report("mdns_name_hash (all names)", packet->name, iterations, packet->size,
+		             bench_time_ns() - start);
+	}
+
+	if (txt_count) {
+		start = bench_time_ns();
+		for (size_t iter = 0; iter < iterations; ++iter) {
+			for (size_t irec = 0; irec < record_count; ++irec) {
+				if (records[irec].rtype != MDNS_RECORDTYPE_TXT)
+					continue;
+				sink += mdns_record_parse_txt(packet->data, packet->size, records[irec].data_offset,
+				                              records[irec].data_length, txtbuffer,
+				                              sizeof(txtbuffer) / sizeof(txtbuffer[0]));
+			}
+		}
+		bench_report("mdns_record_parse_txt", packet->name, iterations, packet->size,
+		             bench_time_ns() - start);
+
+		start = bench_time_ns();
+		for (size_t iter = 0; iter < iterations; ++iter) {
+			for (size_t irec = 0; irec < record_count; ++irec) {
+				if (records[irec].rtype != MDNS_RECORDTYPE_TXT)
+					continue;
+				sink += mdns_record_parse_txt_count(packet->data, packet->size,
+				                                    records[irec].data_offset,
+				                                    records[irec].data_length);
+			}
+		}
+		bench_report("mdns_record_parse_txt_count", packet->name, iterations, packet->size,
+		             bench_time_ns() - start);
+
+		// Look up a key missing from every record, scanning all strings
+		start = bench_time_ns();
+		for (size_t iter = 0; iter < iterations; ++iter) {
+			for (size_t irec = 0; irec < record_count; ++irec) {
+				if (records[irec].rtype != MDNS_RECORDTYPE_TXT)
+					continue;
+				mdns_record_txt_t txt;
+				sink += (size_t)mdns_record_parse_txt_find(
+				    packet->data, packet->size, records[irec].data_offset,
+				    records[irec].data_length, MDNS_STRING_CONST("features"), &txt);
+			}
+		}
+		bench_report("mdns_record_parse_txt_find", packet->name, iterations, packet->size,
+		             bench_time_ns() - start);
+	}
+
+	bench_sink += sink;
+}
+
+// Build the announcement record by record with the packet builder, checking the exact size of each
+// record before adding it, as done when packing records densely
+static size_t
+bench_build_sized(uint8_t* buffer, size_t capacity) {
+	mdns_packet_builder_t builder;
+	mdns_packet_builder_begin(&builder, buffer, capacity, 0, 0x8400);
+	for (size_t irec = 0; irec < airplay_record_count; ++irec) {
+		mdns_entry_type_t section = irec ? MDNS_ENTRYTYPE_ADDITIONAL : MDNS_ENTRYTYPE_ANSWER;
+		size_t size = mdns_packet_builder_record_size(&builder, airplay_records + irec);
+		if (size && (size <= mdns_packet_builder_remain(&builder)))
+			mdns_packet_builder_add_record(&builder, section, airplay_records + irec,
+			                               MDNS_CLASS_IN, 60);
+	}
+	return mdns_packet_builder_finish(&builder);
+}
+
+// Build the announcement record by record with the packet builder without checking sizes, the
+// baseline of the sized build
+static size_t
+bench_build_plain(uint8_t* buffer, size_t capacity) {
+	mdns_packet_builder_t builder;
+	mdns_packet_builder_begin(&builder, buffer, capacity, 0, 0x8400);
+	for (size_t irec = 0; irec < airplay_record_count; ++irec) {
+		mdns_entry_type_t section = irec ? MDNS_ENTRYTYPE_ADDITIONAL : MDNS_ENTRYTYPE_ANSWER;
+		mdns_packet_builder_add_record(&builder, section, airplay_records + irec, MDNS_CLASS_IN,
+		                               60);
+	}
+	return mdns_packet_builder_finish(&builder);
+}
+
+static void
+bench_build(void) {
+	uint8_t buffer[2048];
+	size_t iterations = bench_iterations;
+	size_t sink = 0;
+	size_t size = 0;
+	uint64_t start;
+
+	// Encode the names of the announcement records with a fresh string table per packet, as done
+	// by the answer functions
+	setup_airplay_records(0);
+	start = bench_time_ns();
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		mdns_string_table_item_t string_table_item[MDNS_STRING_TABLE_SIZE];
+		mdns_string_table_t string_table;
+		mdns_string_table_initialize(&string_table, string_table_item, MDNS_STRING_TABLE_SIZE);
+		void* data = buffer;
+		for (size_t irec = 0; data && (irec < airplay_record_count); ++irec)
+			data = mdns_string_make(buffer, sizeof(buffer), data, airplay_records[irec].name.str,
+			                        airplay_records[irec].name.length, &string_table);
+		size = data ? (size_t)MDNS_POINTER_DIFF(data, buffer) : 0;
+		sink += size;
+	}
+	bench_report("mdns_string_make", "apple-announce", iterations, size, bench_time_ns() - start);
+
+	start = bench_time_ns();
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		size = mdns_query_answer_unicast_build(
+		    buffer, sizeof(buffer), (uint16_t)iter, MDNS_RECORDTYPE_PTR,
+		    MDNS_STRING_ARGS(airplay_records[0].name), airplay_records[0], 0, 0,
+		    airplay_records + 1, airplay_record_count - 1);
+		sink += size;
+	}
+	bench_report("mdns_query_answer_unicast_build", "apple-announce", iterations, size,
+	             bench_time_ns() - start);
+
+	start = bench_time_ns();
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		size = mdns_query_answer_multicast_build(buffer, sizeof(buffer), airplay_records[0], 0, 0,
+		                                         airplay_records + 1, airplay_record_count - 1);
+		sink += size;
+	}
+	bench_report("mdns_query_answer_multicast_build", "apple-announce", iterations, size,
+	             bench_time_ns() - start);
+
+	start = bench_time_ns();
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		size = bench_build_plain(buffer, sizeof(buffer));
+		sink += size;
+	}
+	bench_report("mdns_packet_builder", "apple-announce", iterations, size,
+	             bench_time_ns() - start);
+
+	start = bench_time_ns();
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		size = bench_build_sized(buffer, sizeof(buffer));
+		sink += size;
+	}
+	bench_report("mdns_packet_builder (sized)", "apple-announce", iterations, size,
+	             bench_time_ns() - start);
+
+	setup_airplay_records(1);
+	start = bench_time_ns();
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		size = mdns_query_answer_multicast_build(buffer, sizeof(buffer), airplay_records[0], 0, 0,
+		                                         airplay_records + 1, airplay_record_count - 1);
+		sink += size;
+	}
+	bench_report("mdns_query_answer_multicast_build", "apple-announce-compiled", iterations, size,
+	             bench_time_ns() - start);
+
+	start = bench_time_ns();
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		size = bench_build_plain(buffer, sizeof(buffer));
+		sink += size;
+	}
+	bench_report("mdns_packet_builder", "apple-announce-compiled", iterations, size,
+	             bench_time_ns() - start);
+
+	start = bench_time_ns();
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		size = bench_build_sized(buffer, sizeof(buffer));
+		sink += size;
+	}
+	bench_report("mdns_packet_builder (sized)", "apple-announce-compiled", iterations, size,
+	             bench_time_ns() - start);
+
+	start = bench_time_ns();
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		mdns_name_t name;
+		sink += (size_t)mdns_name_compile(&name,
+		                                  MDNS_STRING_CONST("Living Room._airplay._tcp.local."));
+		sink += name.length;
+	}
+	bench_report("mdns_name_compile", "apple-announce", iterations,
+	             sizeof("Living Room._airplay._tcp.local.") - 1, bench_time_ns() - start);
+
+	bench_sink += sink;
+}
+
+typedef int (*bench_label_equal_fn)(const void* lhs, const void* rhs, size_t length);
+
+// Label compare of the library, strncasecmp in the C locale
+static int
+bench_label_equal_strncasecmp(const void* lhs, const void* rhs, size_t length) {
+	return !strncasecmp((const char*)lhs, (const char*)rhs, length);
+}
+
+#ifdef MDNS_HAVE_SSE2
+// Candidate label compare folding ASCII letters 16 bytes at a time, loading the last block
+// overlapped with the previous one. Shorter labels are compared one byte at a time
+static int
+bench_label_equal_sse2(const void* lhs, const void* rhs, size_t length) {
+	const uint8_t* lhs_data = (const uint8_t*)lhs;
+	const uint8_t* rhs_data = (const uint8_t*)rhs;
+	if (length >= 16) {
+		const __m128i case_bit = _mm_set1_epi8(0x20);
+		const __m128i letter_base = _mm_set1_epi8((char)(0x80 - 'a'));
+		const __m128i letter_end = _mm_set1_epi8((char)(0x80 + 26));
+		for (size_t ichar = 0; ichar < length; ichar += 16) {
+			size_t pos = ((ichar + 16) <= length) ? ichar : (length - 16);
+			__m128i lhs_block = _mm_loadu_si128((const __m128i*)(const void*)(lhs_data + pos));
+			__m128i rhs_block = _mm_loadu_si128((const __m128i*)(const void*)(rhs_data + pos));
+			__m128i diff = _mm_xor_si128(lhs_block, rhs_block);
+			__m128i letter = _mm_add_epi8(_mm_or_si128(lhs_block, case_bit), letter_base);
+			__m128i folded = _mm_and_si128(_mm_cmpeq_epi8(diff, case_bit),
+			                               _mm_cmplt_epi8(letter, letter_end));
+			__m128i equal = _mm_or_si128(_mm_cmpeq_epi8(diff, _mm_setzero_si128()), folded);
+			if (_mm_movemask_epi8(equal) != 0xFFFF)
+				return 0;
+		}
+		return 1;
+	}
+	for (size_t ichar = 0; ichar < length; ++ichar) {
+		uint8_t lhs_char = lhs_data[ichar];
+		uint8_t rhs_char = rhs_data[ichar];
+		if ((lhs_char >= 'A') && (lhs_char <= 'Z'))
+			lhs_char |= 0x20;
+		if ((rhs_char >= 'A') && (rhs_char <= 'Z'))
+			rhs_char |= 0x20;
+		if (lhs_char != rhs_char)
+			return 0;
+	}
+	return 1;
+}
+#endif
+
+// Name compare walking the labels like mdns_string_equal, with the given label compare, so label
+// compares are measured on the same walk
+static int
+bench_name_equal(const void* buffer_lhs, size_t size_lhs, const void* buffer_rhs, size_t size_rhs,
+                 bench_label_equal_fn label_equal) {
+	size_t lhs_cur = 0;
+	size_t rhs_cur = 0;
+	mdns_string_pair_t lhs_substr;
+	mdns_string_pair_t rhs_substr;
+	unsigned int counter = 0;
+	do {
+		lhs_substr = mdns_get_next_substring(buffer_lhs, size_lhs, lhs_cur);
+		rhs_substr = mdns_get_next_substring(buffer_rhs, size_rhs, rhs_cur);
+		if ((lhs_substr.offset == MDNS_INVALID_POS) || (rhs_substr.offset == MDNS_INVALID_POS) ||
+		    (counter++ > MDNS_MAX_SUBSTRINGS))
+			return 0;
+		if ((lhs_substr.length != rhs_substr.length) ||
+		    !label_equal(MDNS_POINTER_OFFSET_CONST(buffer_rhs, rhs_substr.offset),
+		                 MDNS_POINTER_OFFSET_CONST(buffer_lhs, lhs_substr.offset),
+		                 rhs_substr.length))
+			return 0;
+		lhs_cur = lhs_substr.offset + lhs_substr.length;
+		rhs_cur = rhs_substr.offset + rhs_substr.length;
+	} while (lhs_substr.length);
+	return 1;
+}
+
+static void
+bench_compare(void) {
+	size_t iterations = bench_iterations;
+	size_t sink = 0;
+	uint64_t start;
+
+	// Compare a question name against a service instance name with labels of up to 63 bytes, in
+	// different case as the names differ in case on the wire
+	static const char* names[] = {
+	    "Living-Room-Speaker-With-A-Very-Long-Service-Instance-Name-0063._airplay._tcp.local.",
+	    "Office Printer (2nd floor, east wing) - Model X._ipp._tcp.local.",
+	    "Kitchen._airplay._tcp.local."};
+	static const char* packets[] = {"label-63-bytes", "label-47-bytes", "label-7-bytes"};
+	for (size_t iname = 0; iname < sizeof(names) / sizeof(names[0]); ++iname) {
+		mdns_name_t lhs;
+		mdns_name_t rhs;
+		mdns_name_compile(&lhs, names[iname], strlen(names[iname]));
+		mdns_name_compile(&rhs, names[iname], strlen(names[iname]));
+		for (size_t ichar = 0; ichar < rhs.length; ++ichar) {
+			uint8_t c = rhs.data[ichar];
+			if ((c >= 'a') && (c <= 'z'))
+				rhs.data[ichar] = (uint8_t)(c & ~0x20);
+		}
+
+		start = bench_time_ns();
+		for (size_t iter = 0; iter < iterations; ++iter) {
+			size_t lhs_ofs = 0;
+			size_t rhs_ofs = 0;
+			sink += (size_t)mdns_string_equal(lhs.data, lhs.length, &lhs_ofs, rhs.data, rhs.length,
+			                                  &rhs_ofs);
+		}
+		bench_report("mdns_string_equal", packets[iname], iterations, lhs.length,
+		             bench_time_ns() - start);
+
+		start = bench_time_ns();
+		for (size_t iter = 0; iter < iterations; ++iter)
+			sink += (size_t)bench_name_equal(lhs.data, lhs.length, rhs.data, rhs.length,
+			                                 bench_label_equal_strncasecmp);
+		bench_report("name walk, strncasecmp per label", packets[iname], iterations, lhs.length,
+		             bench_time_ns() - start);
+
+#ifdef MDNS_HAVE_SSE2
+		start = bench_time_ns();
+		for (size_t iter = 0; iter < iterations; ++iter)
+			sink += (size_t)bench_name_equal(lhs.data, lhs.length, rhs.data, rhs.length,
+			                                 bench_label_equal_sse2);
+		bench_report("name walk, SSE2 label compare", packets[iname], iterations, lhs.length,
+		             bench_time_ns() - start);
+#endif
+	}
+
+	bench_sink += sink;
+}
+
+int
+main(int argc, const char* const* argv) {
+	const char* filter = 0;
+	for (int iarg = 1; iarg < argc; ++iarg) {
+		if ((strcmp(argv[iarg], "--iterations") == 0) && ((iarg + 1) < argc)) {
+			long value = strtol(argv[++iarg], 0, 10);
+			if (value > 0)
+				bench_iterations = (size_t)value;
+		} else if ((strcmp(argv[iarg], "--packet") == 0) && ((iarg + 1) < argc)) {
+			filter = argv[++iarg];
+		} else {
+			printf("Usage: %s [--iterations <count>] [--packet <name>]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	setup_corpus();
+
+	printf("%zu iterations\n", bench_iterations);
+	for (size_t ipacket = 0; ipacket < corpus_count; ++ipacket) {
+		if (filter && strcmp(filter, corpus[ipacket].name))
+			continue;
+		printf("\n%s: %zu bytes\n", corpus[ipacket].name, corpus[ipacket].size);
+		bench_parse(corpus + ipacket);
+	}
+
+	if (!filter) {
+		printf("\nbuild\n");
+		bench_build();
+		printf("\ncompare\n");
+		bench_compare();
+	}
+
+	return 0;
+}